@@ -41,4 +41,38 @@ struct BlockCoordinate {
 };
 static_assert(sizeof(BlockCoordinate) == 8);
 
+// Position of (x,y) along a Z-order (Morton) curve: the bits of x and y interleaved (x in the even bits).
+inline uint64_t mortonIndex(uint32_t y, uint32_t x) {
+	auto spread = [](uint64_t v) {
+		v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+		v = (v | (v <<  8)) & 0x00FF00FF00FF00FFull;
+		v = (v | (v <<  4)) & 0x0F0F0F0F0F0F0F0Full;
+		v = (v | (v <<  2)) & 0x3333333333333333ull;
+		v = (v | (v <<  1)) & 0x5555555555555555ull;
+		return v;
+	};
+	return spread(x) | (spread(y) << 1);
+}
+
+// Position of (x,y) along a Hilbert curve filling a (2^order)² grid.
+inline uint64_t hilbertIndex(int order, uint32_t y, uint32_t x) {
+	uint64_t d = 0;
+	uint32_t n = 1u << order;
+	for (uint32_t s = n/2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = n-1 - x;
+				y = n-1 - y;
+			}
+			uint32_t t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return d;
+}
+
 }
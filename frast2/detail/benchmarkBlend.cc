@@ -0,0 +1,121 @@
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "frast2/flat/blend.h"
+#include "frast2/detail/argparse.hpp"
+
+//
+// Times blending the tiles of overlapping sources into one output tile (see WriterMasterGdalMany::process), with each
+// BlendMode, against the per-pixel loop blend_imgs_avg() used to run (8UC1 and 8UC3 only).
+//
+// Each source has random pixels on one side of a random diagonal edge and nodata on the other, like the tiles at the
+// border of a GeoTIFF.
+//
+// Example:
+//     ./benchmarkBlend -n 2000 --sources 3
+//
+
+using namespace frast;
+
+namespace {
+
+	using Clock = std::chrono::steady_clock;
+
+	cv::Mat sourceTile(std::mt19937_64& rng, int size, int type) {
+		cv::Mat img(size, size, type);
+		int C = img.channels();
+		// Keep x + y*slope < edge.
+		std::uniform_real_distribution<double> slope(-1, 1), edge(size * .25, size * 1.25);
+		double s = slope(rng), e = edge(rng);
+		for (int y=0; y<size; y++) {
+			uint8_t* p = img.ptr<uint8_t>(y);
+			for (int x=0; x<size; x++)
+				for (int c=0; c<C; c++) p[x*C+c] = x + y*s < e ? static_cast<uint8_t>(1 + rng() % 255) : 0;
+		}
+		return img;
+	}
+
+	// The old blend_imgs_avg(), minus its 1/3 channel mixing.
+	cv::Mat oldAverage(const std::vector<cv::Mat>& imgs) {
+		int h = imgs[0].rows, w = imgs[0].cols, c = imgs[0].channels();
+		int tmp_c = c + 1;
+		cv::Mat out(h, w, imgs[0].type(), cv::Scalar{0});
+		std::vector<int32_t> tmp(static_cast<size_t>(h) * w * tmp_c, 0);
+		for (auto& img : imgs) {
+			for (int y=0; y<h; y++) {
+				for (int x=0; x<w; x++) {
+					int32_t v = 0;
+					if (c == 1) v = ((int32_t)img.data[y*w+x])*3;
+					else        v = ((int32_t)img.data[y*w*3+x*3+0]) + ((int32_t)img.data[y*w*3+x*3+1]) + ((int32_t)img.data[y*w*3+x*3+2]);
+					int32_t weight = std::min(v*10,255);
+					for (int i=0; i<c; i++) tmp[y*w*tmp_c+x*tmp_c+i] += ((int32_t)img.data[y*w*c+x*c+i])*weight;
+					tmp[y*w*tmp_c+x*tmp_c+c] += weight;
+				}
+			}
+		}
+		for (int y=0; y<h; y++)
+			for (int x=0; x<w; x++) {
+				int32_t weight = tmp[y*w*tmp_c+x*tmp_c+c];
+				if (weight == 0) continue;
+				for (int i=0; i<c; i++) out.data[y*w*c+x*c+i] = tmp[y*w*tmp_c+x*tmp_c+i] / weight;
+			}
+		return out;
+	}
+
+}
+
+int main(int argc, char** argv) {
+
+	ArgParser parser(argc, argv);
+
+	int n = parser.get2<int>("-n", "--num", 2000).value();
+	int size = parser.get<int>("--size", 256).value();
+	int nsources = parser.get<int>("--sources", 2).value();
+	uint64_t seed = parser.get<uint64_t>("--seed", 0).value();
+	if (nsources < 2) throw std::runtime_error("--sources should be >=2 (a single source is not blended)");
+
+	struct Type { const char* name; int type; };
+	const Type types[] = { { "8UC1", CV_8UC1 }, { "8UC3", CV_8UC3 }, { "8UC4", CV_8UC4 } };
+	struct Mode { const char* name; BlendMode mode; };
+	const Mode modes[] = { { "first", BlendMode::eFirst }, { "last", BlendMode::eLast },
+		{ "average", BlendMode::eAverage }, { "feather", BlendMode::eFeather } };
+
+	fmt::print(" - {} tiles of {}², {} sources each\n", n, size, nsources);
+	fmt::print(" {:>6s} {:>10s} | {:>10s} {:>9s}\n", "type", "mode", "tiles/s", "vs oldAvg");
+
+	uint64_t checksum = 0;
+	for (auto& t : types) {
+		std::mt19937_64 rng(seed);
+		std::vector<cv::Mat> imgs;
+		for (int i=0; i<nsources; i++) imgs.push_back(sourceTile(rng, size, t.type));
+
+		double oldRate = 0;
+		if (t.type != CV_8UC4) {
+			auto t0 = Clock::now();
+			for (int i=0; i<n; i++) checksum += oldAverage(imgs).data[i % (size * size)];
+			oldRate = n / std::chrono::duration<double>(Clock::now() - t0).count();
+			fmt::print(" {:>6s} {:>10s} | {:>10.1f} {:>8.2f}x\n", t.name, "oldAvg", oldRate, 1.);
+		}
+
+		for (auto& m : modes) {
+			Blender blender(m.mode);
+			auto t0 = Clock::now();
+			for (int i=0; i<n; i++) checksum += blender.blend(imgs).data[i % (size * size)];
+			double rate = n / std::chrono::duration<double>(Clock::now() - t0).count();
+			if (oldRate > 0) fmt::print(" {:>6s} {:>10s} | {:>10.1f} {:>8.2f}x\n", t.name, m.name, rate, rate / oldRate);
+			else             fmt::print(" {:>6s} {:>10s} | {:>10.1f} {:>9s}\n", t.name, m.name, rate, "-");
+		}
+	}
+
+	// Keep the checksum live.
+	if (checksum == 1) fmt::print("\n");
+
+	return 0;
+}
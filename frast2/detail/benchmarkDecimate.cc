@@ -0,0 +1,141 @@
+#include <fmt/core.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "frast2/flat/decimate.h"
+#include "frast2/detail/argparse.hpp"
+
+//
+// Compares ways of making one overview tile from its four children (see WriterMasterAddo::process):
+//
+//     resize   : join the children into a 2x mosaic, then cv::resize() it with INTER_AREA (what addo used to do)
+//     box      : decimate2x() with DecimateKernel::eBox, reading the children in place (same pixels as resize)
+//     sinc     : decimate2x() with DecimateKernel::eSinc
+//     oldSinc  : the radial 6x6 float convolution the "custom" interpolation used to run (8UC3 only)
+//
+// For each tile type the children are random, one of them empty (as at the edge of a level).
+//
+// Example:
+//     ./benchmarkDecimate -n 2000 --size 256
+//
+
+using namespace frast;
+
+namespace {
+
+	using Clock = std::chrono::steady_clock;
+
+	cv::Mat randomTile(std::mt19937_64& rng, int size, int type) {
+		cv::Mat img(size, size, type);
+		for (int y=0; y<size; y++) {
+			uint8_t* p = img.ptr<uint8_t>(y);
+			for (size_t i=0; i<size * img.elemSize(); i++) p[i] = rng();
+		}
+		return img;
+	}
+
+	const cv::Mat& firstNonEmpty(const cv::Mat children[4]) {
+		for (int i=0; i<3; i++)
+			if (not children[i].empty()) return children[i];
+		return children[3];
+	}
+
+	void joinAndResize(cv::Mat& out, const cv::Mat children[4]) {
+		const cv::Mat& t = firstNonEmpty(children);
+		int tw = t.cols, th = t.rows;
+		cv::Mat img(th*2, tw*2, t.type());
+		cv::Mat zero = cv::Mat::zeros(th, tw, t.type());
+		(children[0].empty() ? zero : children[0]).copyTo(img(cv::Rect{0,th,tw,th}));
+		(children[1].empty() ? zero : children[1]).copyTo(img(cv::Rect{0,0,tw,th}));
+		(children[2].empty() ? zero : children[2]).copyTo(img(cv::Rect{tw,th,tw,th}));
+		(children[3].empty() ? zero : children[3]).copyTo(img(cv::Rect{tw,0,tw,th}));
+		cv::resize(img, out, cv::Size{tw, th}, 0, 0, cv::INTER_AREA);
+	}
+
+	void oldSinc(cv::Mat& oimg, const cv::Mat children[4]) {
+		const cv::Mat& t = firstNonEmpty(children);
+		int tw = t.cols, th = t.rows;
+		cv::Mat img(th*2, tw*2, t.type());
+		cv::Mat zero = cv::Mat::zeros(th, tw, t.type());
+		(children[0].empty() ? zero : children[0]).copyTo(img(cv::Rect{0,th,tw,th}));
+		(children[1].empty() ? zero : children[1]).copyTo(img(cv::Rect{0,0,tw,th}));
+		(children[2].empty() ? zero : children[2]).copyTo(img(cv::Rect{tw,th,tw,th}));
+		(children[3].empty() ? zero : children[3]).copyTo(img(cv::Rect{tw,0,tw,th}));
+		oimg.create(th, tw, t.type());
+
+		float K[] = { -0.02685111,-0.00632553,0.00166139,0.00166139,-0.00632553,-0.02685111,-0.00632553,-0.03568254,-0.0542254,-0.0542254,-0.03568254,-0.00632553,0.00166139,-0.0542254,0.54590778,0.54590778,-0.0542254,0.00166139,0.00166139,-0.0542254,0.54590778,0.54590778,-0.0542254,0.00166139,-0.00632553,-0.03568254,-0.0542254,-0.0542254,-0.03568254,-0.00632553,-0.02685111,-0.00632553,0.00166139,0.00166139,-0.00632553,-0.02685111};
+		int IW = 2*tw, IH = 2*th, OW = tw, OH = th;
+		for (int oy=0; oy<OH; oy++)
+		for (int ox=0; ox<OW; ox++) {
+			float rgba[4] = {0};
+			for (int dy=0; dy<6; dy++)
+			for (int dx=0; dx<6; dx++) {
+				int iy = oy*2 + dy - 2;
+				int ix = ox*2 + dx - 2;
+				if (iy >= 0 and ix >= 0 and iy < IH and ix < IW) {
+					rgba[0] += ((float)img.data[iy*IW*3+ix*3+0]) * K[dy*6+dx];
+					rgba[1] += ((float)img.data[iy*IW*3+ix*3+1]) * K[dy*6+dx];
+					rgba[2] += ((float)img.data[iy*IW*3+ix*3+2]) * K[dy*6+dx];
+					rgba[3] += K[dy*6+dx];
+				}
+			}
+			oimg.data[oy*OW*3+ox*3+0] = (uint8_t) std::min(std::max(0.f, (rgba[0] / rgba[3])), 255.f);
+			oimg.data[oy*OW*3+ox*3+1] = (uint8_t) std::min(std::max(0.f, (rgba[1] / rgba[3])), 255.f);
+			oimg.data[oy*OW*3+ox*3+2] = (uint8_t) std::min(std::max(0.f, (rgba[2] / rgba[3])), 255.f);
+		}
+	}
+
+}
+
+int main(int argc, char** argv) {
+
+	ArgParser parser(argc, argv);
+
+	int n = parser.get2<int>("-n", "--num", 2000).value();
+	int size = parser.get<int>("--size", 256).value();
+	uint64_t seed = parser.get<uint64_t>("--seed", 0).value();
+
+	struct Type { const char* name; int type; };
+	const Type types[] = { { "8UC1", CV_8UC1 }, { "8UC3", CV_8UC3 }, { "8UC4", CV_8UC4 }, { "16UC1", CV_16UC1 } };
+
+	fmt::print(" - {} tiles of {}², one child empty\n", n, size);
+	fmt::print(" {:>6s} {:>8s} | {:>10s} {:>9s}\n", "type", "method", "tiles/s", "vs resize");
+
+	uint64_t checksum = 0;
+	for (auto& t : types) {
+		std::mt19937_64 rng(seed);
+		cv::Mat children[4];
+		for (int i=1; i<4; i++) children[i] = randomTile(rng, size, t.type);
+
+		std::vector<std::string> methods = { "resize", "box", "sinc" };
+		if (t.type == CV_8UC3) methods.push_back("oldSinc");
+
+		double resizeRate = 0;
+		for (auto& m : methods) {
+			cv::Mat out;
+			auto t0 = Clock::now();
+			for (int i=0; i<n; i++) {
+				if (m == "resize") joinAndResize(out, children);
+				else if (m == "box") decimate2x(out, children, DecimateKernel::eBox);
+				else if (m == "sinc") decimate2x(out, children, DecimateKernel::eSinc);
+				else oldSinc(out, children);
+				checksum += out.data[i % (out.rows * out.cols)];
+			}
+			double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+			double rate = n / secs;
+			if (m == "resize") resizeRate = rate;
+			fmt::print(" {:>6s} {:>8s} | {:>10.1f} {:>8.2f}x\n", t.name, m, rate, rate / resizeRate);
+		}
+	}
+
+	// Keep the checksum live.
+	if (checksum == 1) fmt::print("\n");
+
+	return 0;
+}
@@ -223,7 +223,7 @@ struct FrastRunner {
 			// cv::Mat img = decodeValue(v, 3, false);
 
 			// Version sharing allocations
-			decodeValue(img, v, 3, false);
+			decodeValue(img, v, 3, false, reader->env.codec());
 			
 			int C = img.channels();
 
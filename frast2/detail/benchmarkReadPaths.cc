@@ -0,0 +1,413 @@
+#include <fmt/core.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef FRAST_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "frast2/flat/reader.h"
+#include "frast2/detail/argparse.hpp"
+
+//
+// Compares ways of reading the values (compressed tiles) of an existing .ft file:
+//
+//     pread   : one pread() per tile into a private buffer, one after the other
+//     mmap    : memcpy out of a fresh read-only mapping
+//     madvise : like mmap, but each batch of `qd` tiles is first madvise(WILLNEED)'ed
+//     uring   : batches of `qd` reads submitted through io_uring (only if built with liburing)
+//
+// Each is run over a few access patterns:
+//
+//     uniform    : uniformly random tiles of the level
+//     clustered  : random `window`² windows of tiles (e.g. a rasterIo call)
+//     sequential : the level in key order
+//     trajectory : replay of a camera path: a `window`² view moves along the path and only newly visible
+//                  tiles are read. The path is read from --trajectory (lines of "wmx wmy" web mercator coords),
+//                  or is a synthetic pan across the level.
+//
+// For the cold case the page cache is dropped with posix_fadvise(DONTNEED) before each run. The keys/k2vs are
+// mapped by the FlatEnvironment and touched while building the request lists, so those stay resident: only
+// the value reads are measured.
+// For the warm case the same request list is run once before the measured run.
+//
+// Every backend goes through the requests in batches of `qd`, and a request's latency runs from the start of its
+// batch until its bytes have been read (as for a caller that asked for the whole batch at once, e.g. a rasterIo
+// call), so that the latencies of the backends can be compared.
+//
+// Example:
+//     ./benchmarkReadPaths -i /data/naip/mocoNaip/moco2.ft --pattern all --backend all --cache both -n 20000
+//
+
+using namespace frast;
+
+namespace {
+
+	using Clock = std::chrono::steady_clock;
+
+	struct Request {
+		uint64_t offset;
+		uint64_t len;
+	};
+
+	struct RunResult {
+		int64_t n = 0;
+		uint64_t bytes = 0;
+		double seconds = 0;
+		double p50us = 0, p99us = 0;
+	};
+
+	struct ReadPathBenchmark {
+
+		FlatReader reader;
+		std::string path;
+		int lvl;
+		int fd = -1;
+		size_t fileSize = 0;
+
+		int qd = 32;
+		int window = 8;
+
+		std::vector<uint8_t> buffer;
+
+		// Folded from the bytes read, so the compiler cannot drop the copies.
+		uint64_t checksum = 0;
+
+		ReadPathBenchmark(const std::string& path_, int lvl_)
+			: reader(path_, EnvOptions::getReadonly()), path(path_), lvl(lvl_) {
+			fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw std::runtime_error(fmt::format("failed to open '{}': {}", path, strerror(errno)));
+
+			struct stat st;
+			fstat(fd, &st);
+			fileSize = st.st_size;
+
+			if (lvl < 0) {
+				lvl = 25;
+				while (lvl > 0 and not reader.env.haveLevel(lvl)) lvl--;
+			}
+			if (lvl < 0 or not reader.env.haveLevel(lvl))
+				throw std::runtime_error(fmt::format("level {} is not present in '{}'", lvl, path));
+		}
+
+		~ReadPathBenchmark() {
+			if (fd >= 0) close(fd);
+		}
+
+		Request requestForIdx(uint64_t idx) {
+			auto& spec = reader.env.getLevelSpec(lvl);
+			return Request { spec.valsOffset + reader.env.getValueOffset(spec, idx), reader.env.getValueLen(lvl, idx) };
+		}
+
+		// ---------------------------------------------------------------------------------------------
+		// Access patterns
+
+		std::vector<Request> makeUniform(int64_t n, std::mt19937_64& rng) {
+			int64_t nitems = reader.env.getLevelSpec(lvl).nitemsUsed();
+			std::uniform_int_distribution<int64_t> dist(0, nitems-1);
+
+			std::vector<Request> out;
+			for (int64_t i=0; i<n; i++) out.push_back(requestForIdx(dist(rng)));
+			return out;
+		}
+
+		std::vector<Request> makeClustered(size_t n, std::mt19937_64& rng) {
+			int64_t nitems = reader.env.getLevelSpec(lvl).nitemsUsed();
+			uint64_t* keys = reader.env.getKeys(lvl);
+			std::uniform_int_distribution<int64_t> dist(0, nitems-1);
+
+			std::vector<Request> out;
+			while (out.size() < n) {
+				// Center the window on an existing tile, so that the windows are not mostly empty.
+				BlockCoordinate c(keys[dist(rng)]);
+				uint64_t half = window / 2;
+				uint64_t x0 = c.x() > half ? c.x() - half : 0;
+				uint64_t y0 = c.y() > half ? c.y() - half : 0;
+
+				for (uint64_t y=y0; y<y0+window; y++) {
+					for (uint64_t x=x0; x<x0+window; x++) {
+						int64_t idx = reader.env.findKeyIdx(lvl, BlockCoordinate{(uint64_t)lvl,y,x}.c);
+						if (idx >= 0 and out.size() < n) out.push_back(requestForIdx(idx));
+					}
+				}
+			}
+			return out;
+		}
+
+		std::vector<Request> makeSequential(int64_t n) {
+			int64_t nitems = reader.env.getLevelSpec(lvl).nitemsUsed();
+
+			std::vector<Request> out;
+			for (int64_t i=0; i<n; i++) out.push_back(requestForIdx(i % nitems));
+			return out;
+		}
+
+		std::vector<Request> makeTrajectory(size_t n, const std::string& trajectoryPath) {
+			std::vector<std::array<double,2>> path;
+
+			if (trajectoryPath.length()) {
+				std::ifstream ifs(trajectoryPath);
+				if (not ifs.good()) throw std::runtime_error(fmt::format("failed to open trajectory '{}'", trajectoryPath));
+				double wx, wy;
+				while (ifs >> wx >> wy) {
+					path.push_back({
+							(wx / (2*WebMercatorMapScale) + .5) * (1<<lvl),
+							(wy / (2*WebMercatorMapScale) + .5) * (1<<lvl) });
+				}
+			} else {
+				// Synthetic: pan diagonally across the level's tlbr, one tenth of a tile per frame, with some wobble.
+				uint32_t tlbr[4];
+				reader.determineTlbrOnLevel(tlbr, lvl);
+				double dx = tlbr[2] - tlbr[0], dy = tlbr[3] - tlbr[1];
+				int64_t nframes = std::max(1., 10 * std::sqrt(dx*dx + dy*dy));
+				for (int64_t i=0; i<nframes; i++) {
+					double t = static_cast<double>(i) / nframes;
+					path.push_back({
+							tlbr[0] + dx * t,
+							tlbr[1] + dy * t + window * .25 * std::sin(t * 40) });
+				}
+			}
+
+			std::vector<Request> out;
+			std::vector<uint64_t> visible, lastVisible;
+
+			// Loop the path until we have enough requests (or it yields nothing at all).
+			for (int loop=0; out.size() < n; loop++) {
+				size_t nBefore = out.size();
+				lastVisible.clear();
+
+				for (auto& pt : path) {
+					visible.clear();
+					int64_t x0 = static_cast<int64_t>(pt[0]) - window/2;
+					int64_t y0 = static_cast<int64_t>(pt[1]) - window/2;
+					for (int64_t y=std::max<int64_t>(y0,0); y<y0+window; y++)
+						for (int64_t x=std::max<int64_t>(x0,0); x<x0+window; x++)
+							visible.push_back(BlockCoordinate{(uint64_t)lvl,(uint64_t)y,(uint64_t)x}.c);
+
+					// Both are sorted, because the loops above go in key order.
+					for (auto key : visible) {
+						if (std::binary_search(lastVisible.begin(), lastVisible.end(), key)) continue;
+						int64_t idx = reader.env.findKeyIdx(lvl, key);
+						if (idx >= 0 and out.size() < n) out.push_back(requestForIdx(idx));
+					}
+					std::swap(visible, lastVisible);
+				}
+
+				if (out.size() == nBefore) break;
+			}
+			return out;
+		}
+
+		// ---------------------------------------------------------------------------------------------
+		// Backends. Each fills @lats (per-request latency in seconds) and returns the number of bytes read.
+
+		void prepareBuffer(const std::vector<Request>& reqs) {
+			uint64_t maxLen = 0;
+			for (auto& r : reqs) maxLen = std::max(maxLen, r.len);
+			buffer.resize(maxLen * qd);
+		}
+
+		inline void fold(const uint8_t* p, uint64_t len) {
+			// Touch one byte per cache line.
+			for (uint64_t i=0; i<len; i+=64) checksum += p[i];
+		}
+
+		uint64_t runPread(const std::vector<Request>& reqs, std::vector<double>& lats) {
+			uint64_t maxLen = buffer.size() / qd;
+			uint64_t bytes = 0;
+
+			for (size_t b=0; b<reqs.size(); b+=qd) {
+				size_t e = std::min(b+qd, reqs.size());
+				auto st = Clock::now();
+
+				for (size_t i=b; i<e; i++) {
+					uint8_t* dst = buffer.data() + (i-b) * maxLen;
+					ssize_t got = pread(fd, dst, reqs[i].len, reqs[i].offset);
+					if (got != (ssize_t)reqs[i].len) throw std::runtime_error(fmt::format("pread failed: {}", strerror(errno)));
+					fold(dst, reqs[i].len);
+					lats.push_back(std::chrono::duration<double>(Clock::now() - st).count());
+					bytes += reqs[i].len;
+				}
+			}
+			return bytes;
+		}
+
+		uint64_t runMmap(const std::vector<Request>& reqs, std::vector<double>& lats, bool useMadvise) {
+			// A fresh mapping per run, so that no pages from an earlier run are mapped.
+			void* base = mmap(0, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+			if (base == MAP_FAILED) throw std::runtime_error(fmt::format("mmap failed: {}", strerror(errno)));
+			const uint8_t* basep = static_cast<const uint8_t*>(base);
+
+			uint64_t bytes = 0;
+			for (size_t b=0; b<reqs.size(); b+=qd) {
+				size_t e = std::min(b+qd, reqs.size());
+				auto st = Clock::now();
+
+				if (useMadvise) {
+					for (size_t i=b; i<e; i++) {
+						uint64_t pageStart = (reqs[i].offset >> 12) << 12;
+						madvise((void*)(basep + pageStart), reqs[i].offset + reqs[i].len - pageStart, MADV_WILLNEED);
+					}
+				}
+
+				for (size_t i=b; i<e; i++) {
+					memcpy(buffer.data(), basep + reqs[i].offset, reqs[i].len);
+					fold(buffer.data(), reqs[i].len);
+					lats.push_back(std::chrono::duration<double>(Clock::now() - st).count());
+					bytes += reqs[i].len;
+				}
+			}
+
+			munmap(base, fileSize);
+			return bytes;
+		}
+
+#ifdef FRAST_HAVE_LIBURING
+		uint64_t runUring(const std::vector<Request>& reqs, std::vector<double>& lats) {
+			struct io_uring ring;
+			int err = io_uring_queue_init(qd, &ring, 0);
+			if (err < 0) throw std::runtime_error(fmt::format("io_uring_queue_init failed: {}", strerror(-err)));
+
+			uint64_t maxLen = buffer.size() / qd;
+			uint64_t bytes = 0;
+
+			for (size_t b=0; b<reqs.size(); b+=qd) {
+				size_t e = std::min(b+qd, reqs.size());
+				auto st = Clock::now();
+
+				for (size_t i=b; i<e; i++) {
+					struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+					io_uring_prep_read(sqe, fd, buffer.data() + (i-b) * maxLen, reqs[i].len, reqs[i].offset);
+					io_uring_sqe_set_data64(sqe, i-b);
+				}
+				io_uring_submit(&ring);
+
+				for (size_t i=b; i<e; i++) {
+					struct io_uring_cqe* cqe;
+					err = io_uring_wait_cqe(&ring, &cqe);
+					if (err < 0 or cqe->res < 0) throw std::runtime_error(fmt::format("io_uring read failed: {}", strerror(err < 0 ? -err : -cqe->res)));
+					uint64_t slot = io_uring_cqe_get_data64(cqe);
+					fold(buffer.data() + slot * maxLen, cqe->res);
+					bytes += cqe->res;
+					io_uring_cqe_seen(&ring, cqe);
+					lats.push_back(std::chrono::duration<double>(Clock::now() - st).count());
+				}
+			}
+
+			io_uring_queue_exit(&ring);
+			return bytes;
+		}
+#endif
+
+		uint64_t runBackend(const std::string& backend, const std::vector<Request>& reqs, std::vector<double>& lats) {
+			if (backend == "pread") return runPread(reqs, lats);
+			if (backend == "mmap") return runMmap(reqs, lats, false);
+			if (backend == "madvise") return runMmap(reqs, lats, true);
+#ifdef FRAST_HAVE_LIBURING
+			if (backend == "uring") return runUring(reqs, lats);
+#endif
+			throw std::runtime_error(fmt::format("backend '{}' not available", backend));
+		}
+
+		void dropCache() {
+			int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			if (err != 0) fmt::print(" - posix_fadvise failed: {}\n", strerror(err));
+		}
+
+		RunResult run(const std::string& backend, const std::vector<Request>& reqs, bool cold) {
+			prepareBuffer(reqs);
+			std::vector<double> lats;
+			lats.reserve(reqs.size());
+
+			if (cold) dropCache();
+			else runBackend(backend, reqs, lats);
+			lats.clear();
+
+			auto st = Clock::now();
+			RunResult res;
+			res.bytes = runBackend(backend, reqs, lats);
+			res.seconds = std::chrono::duration<double>(Clock::now() - st).count();
+			res.n = lats.size();
+
+			if (lats.size()) {
+				std::sort(lats.begin(), lats.end());
+				res.p50us = lats[lats.size() / 2] * 1e6;
+				res.p99us = lats[std::min(lats.size()-1, lats.size() * 99 / 100)] * 1e6;
+			}
+			return res;
+		}
+	};
+
+}
+
+int main(int argc, char** argv) {
+
+	ArgParser parser(argc, argv);
+
+	std::string path = parser.get2OrDie<std::string>("-i", "--input");
+	int lvl = parser.get<int>("--level", -1).value();
+	int64_t n = parser.get2<int64_t>("-n", "--num", 20000).value();
+	std::string pattern = parser.getChoice("--pattern", "uniform", "clustered", "sequential", "trajectory", "all").value_or("all");
+	std::string backend = parser.getChoice("--backend", "pread", "mmap", "madvise", "uring", "all").value_or("all");
+	std::string cache = parser.getChoice("--cache", "cold", "warm", "both").value_or("both");
+	std::string trajectory = parser.get<std::string>("--trajectory", "").value();
+	uint64_t seed = parser.get<uint64_t>("--seed", 0).value();
+
+	ReadPathBenchmark bench(path, lvl);
+	bench.qd = parser.get<int>("--qd", 32).value();
+	bench.window = parser.get<int>("--window", 8).value();
+
+	std::vector<std::string> patterns, backends;
+	std::vector<bool> colds;
+	if (pattern == "all") patterns = { "uniform", "clustered", "sequential", "trajectory" };
+	else patterns = { pattern };
+	if (backend == "all") {
+		backends = { "pread", "mmap", "madvise" };
+#ifdef FRAST_HAVE_LIBURING
+		backends.push_back("uring");
+#endif
+	} else backends = { backend };
+	if (cache == "both") colds = { true, false };
+	else colds = { cache == "cold" };
+
+	fmt::print(" - file '{}', level {} ({} tiles), qd {}, window {}\n",
+			path, bench.lvl, bench.reader.env.getLevelSpec(bench.lvl).nitemsUsed(), bench.qd, bench.window);
+	fmt::print(" {:>11s} {:>8s} {:>5s} | {:>8s} {:>10s} {:>9s} {:>10s} {:>10s}\n",
+			"pattern", "backend", "cache", "n", "MB", "MB/s", "p50 (us)", "p99 (us)");
+
+	for (auto& pat : patterns) {
+		std::mt19937_64 rng(seed);
+		std::vector<Request> reqs;
+		if (pat == "uniform") reqs = bench.makeUniform(n, rng);
+		else if (pat == "clustered") reqs = bench.makeClustered(n, rng);
+		else if (pat == "sequential") reqs = bench.makeSequential(n);
+		else reqs = bench.makeTrajectory(n, trajectory);
+
+		for (auto& be : backends) {
+			for (bool cold : colds) {
+				RunResult r = bench.run(be, reqs, cold);
+				double mb = r.bytes / (1024. * 1024.);
+				fmt::print(" {:>11s} {:>8s} {:>5s} | {:>8d} {:>10.2f} {:>9.1f} {:>10.1f} {:>10.1f}\n",
+						pat, be, cold ? "cold" : "warm", r.n, mb, mb / r.seconds, r.p50us, r.p99us);
+			}
+		}
+	}
+
+	// Keep the checksum live.
+	if (bench.checksum == 1) fmt::print("\n");
+
+	return 0;
+}
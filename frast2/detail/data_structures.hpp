@@ -2,6 +2,7 @@
 
 // #include <deque>
 #include <list>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 // #include <fmt/core.h>
@@ -120,6 +121,61 @@ class LruCache {
 			return true;
 		}
 	}
+
+	// Return true if key not in cache (failure)
+	inline bool erase(const K& k) {
+		auto it = map.find(k);
+		if (it == map.end()) return true;
+		lst.erase(it->second.i);
+		map.erase(it);
+		return false;
+	}
+};
+
+// An LruCache split into independently locked stripes (by key hash), so many threads can use it at once.
+// The capacity is split evenly, so each stripe evicts on its own.
+template <class K, class V, int Stripes=16>
+class StripedLruCache {
+	public:
+		inline StripedLruCache(int cap) {
+			for (auto& s : stripes) s.cache = LruCache<K,V>((cap + Stripes - 1) / Stripes);
+		}
+
+		// Return true if key not in cache (failure)
+		inline bool get(V& out, const K& k) {
+			auto& s = stripe(k);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			return s.cache.get(out, k);
+		}
+
+		// Like get(), but also removes the entry.
+		inline bool take(V& out, const K& k) {
+			auto& s = stripe(k);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			if (s.cache.get(out, k)) return true;
+			s.cache.erase(k);
+			return false;
+		}
+
+		// Return true if key was in cache.
+		inline bool set(const K& k, const V& v) {
+			auto& s = stripe(k);
+			std::lock_guard<std::mutex> lck(s.mtx);
+			return s.cache.set(k, v);
+		}
+
+	private:
+		struct Stripe {
+			std::mutex mtx;
+			LruCache<K,V> cache;
+		};
+		Stripe stripes[Stripes];
+
+		inline Stripe& stripe(const K& k) {
+			// Mix, because neighbouring keys (e.g. tiles) should not share a stripe.
+			uint64_t h = std::hash<K>{}(k) * 0x9E3779B97F4A7C15ull;
+			return stripes[(h >> 32) % Stripes];
+		}
 };
 
 template <class T>
@@ -35,6 +35,16 @@ namespace frast {
 	// tree structure nodes and a seperate region for the data.
 	//
 
+	// How FlatEnvironment tile values are read. Keys and k2vs are always mmaped.
+	//     eMmap  : values are pointers into the mmaped file (page faults on first touch)
+	//     ePread : values are pread() into caller buffers, the value pages are never mapped in
+	//     eUring : like ePread, but async reads are batched through io_uring (requires FRAST_HAVE_LIBURING)
+	enum class ValueReadMode : uint8_t {
+		eMmap = 0,
+		ePread = 1,
+		eUring = 2,
+	};
+
 	struct EnvOptions {
 		size_t mapOffset = 0;
 		size_t mapSize = 64lu * (1lu<<30lu);
@@ -43,6 +53,16 @@ namespace frast {
 		bool readonly = false;
 		bool isTerrain = false;
 		bool cache = true;
+		// FlatEnvironment: build an in-memory search index over each large level's keys on first access.
+		bool keyIndex = true;
+		ValueReadMode valueReadMode = ValueReadMode::eMmap;
+		// Max reads in flight for ValueIo (only used if valueReadMode != eMmap).
+		int ioQueueDepth = 64;
+		// FlatEnvironment: store a value that is byte-identical to a recent one in the same level only once.
+		// New files are then created with explicit value lengths (see FlatEnvironment::FileMeta::ValueLengths).
+		bool dedupValues = false;
+		// FlatEnvironment: the FileMeta::CodecOverride that new files are created with. Existing files keep theirs.
+		uint8_t codec = 0;
 
 		static EnvOptions getReadonly(bool terrain=false) {
 			EnvOptions o;
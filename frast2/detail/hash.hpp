@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef FRAST_HAVE_XXHASH
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#endif
+
+namespace frast {
+
+	//
+	// 64-bit hash of a byte string, used for finding duplicate tile values.
+	// Only used in memory (never stored), so the fallback need not match xxh3.
+	//
+#ifdef FRAST_HAVE_XXHASH
+	inline uint64_t hashBytes(const void* data, size_t len) {
+		return XXH3_64bits(data, len);
+	}
+#else
+	inline uint64_t hashBytes(const void* data, size_t len) {
+		constexpr uint64_t k0 = 0x9E3779B97F4A7C15ull, k1 = 0xBF58476D1CE4E5B9ull, k2 = 0x94D049BB133111EBull;
+		auto mix = [](uint64_t x) {
+			x ^= x >> 30; x *= k1;
+			x ^= x >> 27; x *= k2;
+			return x ^ (x >> 31);
+		};
+
+		const uint8_t* p = static_cast<const uint8_t*>(data);
+		uint64_t h = k0 ^ (len * k1);
+		size_t i = 0;
+		for (; i+8 <= len; i += 8) {
+			uint64_t w;
+			memcpy(&w, p+i, 8);
+			h = mix(h ^ (w * k0)) + k2;
+		}
+		uint64_t w = 0;
+		memcpy(&w, p+i, len-i);
+		return mix(h ^ (w * k0) ^ len);
+	}
+#endif
+
+}
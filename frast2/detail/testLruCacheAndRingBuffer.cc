@@ -2,6 +2,8 @@
 // #include <gtest/gtest.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 #include "data_structures.hpp"
 
@@ -165,3 +167,52 @@ TEST_CASE( "MoveToFront", "[LruCache]" ) {
 		REQUIRE(lru.get(val, x));
 	}
 }
+
+TEST_CASE( "Erase", "[LruCache]" ) {
+	constexpr int			   cap = 4;
+	LruCache<int32_t, int32_t> lru(cap);
+
+	for (int i = 0; i < cap; i++) lru.set(i, i * 10);
+	REQUIRE(not lru.erase(1));
+	REQUIRE(lru.erase(1));
+
+	// The erased slot is free again, so nothing else is evicted.
+	lru.set(100, 100);
+	for (int i : { 0, 2, 3, 100 }) {
+		int32_t val = 0;
+		REQUIRE(not lru.get(val, i));
+		REQUIRE(val == (i == 100 ? 100 : i * 10));
+	}
+}
+
+/* ===================================================
+ *
+ *
+ *                  StripedLruCache
+ *
+ *
+ * =================================================== */
+
+TEST_CASE( "TakeAndThreads", "[StripedLruCache]" ) {
+	StripedLruCache<uint64_t, uint64_t> lru(1 << 12);
+
+	lru.set(7, 70);
+	uint64_t val = 0;
+	REQUIRE(not lru.take(val, 7));
+	REQUIRE(val == 70);
+	REQUIRE(lru.take(val, 7));
+
+	// Every thread sets and takes back its own keys.
+	std::vector<std::thread> threads;
+	std::atomic<int> nmissing = 0;
+	for (int t = 0; t < 4; t++)
+		threads.emplace_back([&lru, &nmissing, t] {
+			for (uint64_t i = 0; i < 512; i++) lru.set(t * 1000 + i, i);
+			for (uint64_t i = 0; i < 512; i++) {
+				uint64_t v = 0;
+				if (lru.take(v, t * 1000 + i) or v != i) nmissing++;
+			}
+		});
+	for (auto& th : threads) th.join();
+	REQUIRE(nmissing == 0);
+}
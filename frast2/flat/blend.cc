@@ -0,0 +1,341 @@
+#include "blend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <fmt/core.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRAST_BLEND_AVX2
+#include <immintrin.h>
+#endif
+
+namespace frast {
+
+namespace {
+
+	// -------------------------------------------------------------------------------------------
+	// Row kernels. Masks, weights, accumulators and outputs hold one entry per channel of each pixel, so apart from
+	// making masks and weights, they work on @n plain elements.
+	// -------------------------------------------------------------------------------------------
+
+	// mask = 0xff for all channels of the pixels (of @w) that are not black. Returns how many are not.
+	template <int C>
+	size_t maskRowScalar(uint8_t* __restrict mask, const uint8_t* __restrict src, int w) {
+		size_t n = 0;
+		for (int j=0; j<w; j++) {
+			uint8_t any = 0;
+			for (int c=0; c<C; c++) any |= src[j*C+c];
+			uint8_t m = any ? 0xff : 0;
+			for (int c=0; c<C; c++) mask[j*C+c] = m;
+			n += any != 0;
+		}
+		return n;
+	}
+
+	// Take src where it has data and out was not filled yet.
+	void selectRowScalar(uint8_t* __restrict out, uint8_t* __restrict filled, const uint8_t* __restrict src,
+			const uint8_t* __restrict mask, size_t n) {
+		for (size_t i=0; i<n; i++) {
+			uint8_t take = mask[i] & ~filled[i];
+			out[i] = (src[i] & take) | (out[i] & ~take);
+			filled[i] |= mask[i];
+		}
+	}
+
+	void accumulateRowScalar(uint32_t* __restrict acc, uint32_t* __restrict wsum, const uint8_t* __restrict src,
+			const uint16_t* __restrict weight, size_t n) {
+		for (size_t i=0; i<n; i++) {
+			acc[i] += static_cast<uint32_t>(src[i]) * weight[i];
+			wsum[i] += weight[i];
+		}
+	}
+
+	// The AVX2 version divides the same way (single precision, round to nearest even), so both give the same bytes.
+	void resolveRowScalar(uint8_t* __restrict out, const uint32_t* __restrict acc, const uint32_t* __restrict wsum, size_t n) {
+		for (size_t i=0; i<n; i++) {
+			float q = static_cast<float>(acc[i]) / static_cast<float>(std::max(wsum[i], 1u));
+			out[i] = static_cast<uint8_t>(std::min(255l, std::lrint(q)));
+		}
+	}
+
+#ifdef FRAST_BLEND_AVX2
+
+	template <int C>
+	__attribute__((target("avx2,popcnt")))
+	size_t maskRowAvx2(uint8_t* mask, const uint8_t* src, int w) {
+		static_assert(C == 1 or C == 4);
+		const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi8(-1);
+		size_t n = 0, j = 0, len = static_cast<size_t>(w) * C;
+		for (; j+32<=len; j+=32) {
+			__m256i x = _mm256_loadu_si256((const __m256i*)(src + j));
+			__m256i black = C == 1 ? _mm256_cmpeq_epi8(x, zero) : _mm256_cmpeq_epi32(x, zero);
+			__m256i m = _mm256_xor_si256(black, ones);
+			_mm256_storeu_si256((__m256i*)(mask + j), m);
+			n += __builtin_popcount(static_cast<uint32_t>(_mm256_movemask_epi8(m)));
+		}
+		n /= C;
+		if (j < len) n += maskRowScalar<C>(mask + j, src + j, static_cast<int>((len - j) / C));
+		return n;
+	}
+
+	__attribute__((target("avx2")))
+	void selectRowAvx2(uint8_t* out, uint8_t* filled, const uint8_t* src, const uint8_t* mask, size_t n) {
+		size_t i = 0;
+		for (; i+32<=n; i+=32) {
+			__m256i m = _mm256_loadu_si256((const __m256i*)(mask + i));
+			__m256i f = _mm256_loadu_si256((const __m256i*)(filled + i));
+			__m256i o = _mm256_loadu_si256((const __m256i*)(out + i));
+			__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+			_mm256_storeu_si256((__m256i*)(out + i), _mm256_blendv_epi8(o, s, _mm256_andnot_si256(f, m)));
+			_mm256_storeu_si256((__m256i*)(filled + i), _mm256_or_si256(f, m));
+		}
+		if (i < n) selectRowScalar(out + i, filled + i, src + i, mask + i, n - i);
+	}
+
+	// dst[0..16) += the sixteen 16 bit lanes of @v.
+	__attribute__((target("avx2"), always_inline))
+	inline void addWidened(uint32_t* dst, __m256i v) {
+		__m256i lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+		__m256i hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+		_mm256_storeu_si256((__m256i*)dst, _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)dst), lo));
+		_mm256_storeu_si256((__m256i*)(dst + 8), _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(dst + 8)), hi));
+	}
+
+	// Weights are at most 255, so the products fit 16 bit lanes.
+	__attribute__((target("avx2")))
+	void accumulateRowAvx2(uint32_t* acc, uint32_t* wsum, const uint8_t* src, const uint16_t* weight, size_t n) {
+		size_t i = 0;
+		for (; i+16<=n; i+=16) {
+			__m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i)));
+			__m256i wt = _mm256_loadu_si256((const __m256i*)(weight + i));
+			addWidened(acc + i, _mm256_mullo_epi16(s, wt));
+			addWidened(wsum + i, wt);
+		}
+		if (i < n) accumulateRowScalar(acc + i, wsum + i, src + i, weight + i, n - i);
+	}
+
+	__attribute__((target("avx2"), always_inline))
+	inline __m256i divide8(const uint32_t* acc, const uint32_t* wsum, __m256i one) {
+		__m256 a = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)acc));
+		__m256 w = _mm256_cvtepi32_ps(_mm256_max_epi32(_mm256_loadu_si256((const __m256i*)wsum), one));
+		return _mm256_cvtps_epi32(_mm256_div_ps(a, w));
+	}
+
+	__attribute__((target("avx2")))
+	void resolveRowAvx2(uint8_t* out, const uint32_t* acc, const uint32_t* wsum, size_t n) {
+		const __m256i one = _mm256_set1_epi32(1);
+		size_t i = 0;
+		for (; i+16<=n; i+=16) {
+			__m256i x = _mm256_packus_epi32(divide8(acc + i, wsum + i, one), divide8(acc + i + 8, wsum + i + 8, one));
+			x = _mm256_permute4x64_epi64(x, 0xD8);
+			x = _mm256_permute4x64_epi64(_mm256_packus_epi16(x, x), 0xD8);
+			_mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(x));
+		}
+		if (i < n) resolveRowScalar(out + i, acc + i, wsum + i, n - i);
+	}
+
+	bool haveAvx2() {
+		static const bool have = __builtin_cpu_supports("avx2");
+		return have;
+	}
+
+#endif
+
+	// Three channels do not line up with vector lanes: their masks are made with plain loops.
+	size_t maskRow(uint8_t* mask, const uint8_t* src, int w, int C) {
+#ifdef FRAST_BLEND_AVX2
+		if (haveAvx2()) {
+			if (C == 1) return maskRowAvx2<1>(mask, src, w);
+			if (C == 4) return maskRowAvx2<4>(mask, src, w);
+		}
+#endif
+		if (C == 1) return maskRowScalar<1>(mask, src, w);
+		if (C == 3) return maskRowScalar<3>(mask, src, w);
+		return maskRowScalar<4>(mask, src, w);
+	}
+
+	void selectRow(uint8_t* out, uint8_t* filled, const uint8_t* src, const uint8_t* mask, size_t n) {
+#ifdef FRAST_BLEND_AVX2
+		if (haveAvx2()) return selectRowAvx2(out, filled, src, mask, n);
+#endif
+		selectRowScalar(out, filled, src, mask, n);
+	}
+
+	void accumulateRow(uint32_t* acc, uint32_t* wsum, const uint8_t* src, const uint16_t* weight, size_t n) {
+#ifdef FRAST_BLEND_AVX2
+		if (haveAvx2()) return accumulateRowAvx2(acc, wsum, src, weight, n);
+#endif
+		accumulateRowScalar(acc, wsum, src, weight, n);
+	}
+
+	void resolveRow(uint8_t* out, const uint32_t* acc, const uint32_t* wsum, size_t n) {
+#ifdef FRAST_BLEND_AVX2
+		if (haveAvx2()) return resolveRowAvx2(out, acc, wsum, n);
+#endif
+		resolveRowScalar(out, acc, wsum, n);
+	}
+
+	// Brightness ramp of BlendMode::eAverage: min(10 * channel sum, 255), with gray counted three times.
+	// Returns the number of pixels with a non-zero weight.
+	template <int C>
+	size_t rampRow(uint16_t* __restrict weight, const uint8_t* __restrict src, int w) {
+		size_t n = 0;
+		for (int j=0; j<w; j++) {
+			int s = C == 1 ? 3 * src[j] : src[j*C] + src[j*C+1] + src[j*C+2];
+			uint16_t wt = static_cast<uint16_t>(std::min(s * 10, 255));
+			for (int c=0; c<C; c++) weight[j*C+c] = wt;
+			n += wt != 0;
+		}
+		return n;
+	}
+
+	// Two pass 3-4 chamfer distance (three per pixel step) from the pixels without data, capped at @cap.
+	// Pixels outside the tile are unknown, so they count as having data.
+	// Each pass takes a whole row from the finished neighbouring row first (which vectorizes), then sweeps along it.
+	void chamferDistance(uint16_t* d, const uint8_t* mask, int C, int w, int h, uint16_t cap) {
+		for (int y=0; y<h; y++) {
+			uint16_t* row = d + static_cast<size_t>(y) * w;
+			const uint8_t* m = mask + static_cast<size_t>(y) * w * C;
+			for (int x=0; x<w; x++) row[x] = m[x*C] ? cap : 0;
+			if (y > 0) {
+				const uint16_t* up = row - w;
+				for (int x=1; x<w-1; x++)
+					row[x] = std::min<uint16_t>(row[x], std::min<uint16_t>(up[x] + 3, std::min<uint16_t>(up[x-1] + 4, up[x+1] + 4)));
+				row[0] = std::min<uint16_t>(row[0], up[0] + 3);
+				if (w > 1) {
+					row[0] = std::min<uint16_t>(row[0], up[1] + 4);
+					row[w-1] = std::min<uint16_t>(row[w-1], std::min<uint16_t>(up[w-1] + 3, up[w-2] + 4));
+				}
+			}
+			for (int x=1; x<w; x++) row[x] = std::min<uint16_t>(row[x], row[x-1] + 3);
+		}
+		for (int y=h-1; y>=0; y--) {
+			uint16_t* row = d + static_cast<size_t>(y) * w;
+			if (y < h-1) {
+				const uint16_t* down = row + w;
+				for (int x=1; x<w-1; x++)
+					row[x] = std::min<uint16_t>(row[x], std::min<uint16_t>(down[x] + 3, std::min<uint16_t>(down[x-1] + 4, down[x+1] + 4)));
+				row[0] = std::min<uint16_t>(row[0], down[0] + 3);
+				if (w > 1) {
+					row[0] = std::min<uint16_t>(row[0], down[1] + 4);
+					row[w-1] = std::min<uint16_t>(row[w-1], std::min<uint16_t>(down[w-1] + 3, down[w-2] + 4));
+				}
+			}
+			for (int x=w-2; x>=0; x--) row[x] = std::min<uint16_t>(row[x], row[x+1] + 3);
+		}
+	}
+
+}
+
+BlendMode parseBlendMode(const std::string& name) {
+	if (name == "first") return BlendMode::eFirst;
+	if (name == "last") return BlendMode::eLast;
+	if (name == "average") return BlendMode::eAverage;
+	if (name == "feather") return BlendMode::eFeather;
+	throw std::runtime_error(fmt::format("unknown blend mode '{}' (should be first, last, average or feather)", name));
+}
+
+Blender::Blender(BlendMode mode, int featherRadius_) : mode_(mode), featherRadius(featherRadius_) {
+	// Distances are kept in 16 bits, in thirds of a pixel.
+	if (featherRadius < 1 or featherRadius > 4096)
+		throw std::runtime_error(fmt::format("feather radius {} should be in [1, 4096]", featherRadius));
+
+	// Pixels with data are at least one step (3) from nodata, so get a weight of at least 1.
+	int cap = 3 * featherRadius;
+	featherLut.resize(cap + 1);
+	for (int d=0; d<=cap; d++) featherLut[d] = static_cast<uint16_t>((255 * d + cap - 1) / cap);
+}
+
+cv::Mat Blender::blend(const std::vector<cv::Mat>& imgs) {
+	if (imgs.size() == 0) return {};
+	if (imgs.size() == 1) return imgs[0];
+
+	const cv::Mat& first = imgs[0];
+	int type = first.type();
+	if (type != CV_8UC1 and type != CV_8UC3 and type != CV_8UC4)
+		throw std::runtime_error(fmt::format("Blender: unsupported tile type {}", type));
+	for (auto& img : imgs)
+		if (img.type() != type or img.rows != first.rows or img.cols != first.cols)
+			throw std::runtime_error("Blender: tiles must share size and type");
+
+	size_t len = static_cast<size_t>(first.rows) * first.cols * first.channels();
+	mask.resize(len);
+
+	cv::Mat out(first.rows, first.cols, type, cv::Scalar{0});
+	if (mode_ == BlendMode::eFirst or mode_ == BlendMode::eLast)
+		blendFirst(out, imgs, mode_ == BlendMode::eLast);
+	else
+		blendWeighted(out, imgs);
+	return out;
+}
+
+size_t Blender::makeMask(const cv::Mat& img) {
+	size_t rowLen = static_cast<size_t>(img.cols) * img.channels();
+	size_t n = 0;
+	for (int y=0; y<img.rows; y++) n += maskRow(mask.data() + y * rowLen, img.ptr<uint8_t>(y), img.cols, img.channels());
+	return n;
+}
+
+// Last-valid is first-valid over the reversed list.
+void Blender::blendFirst(cv::Mat& out, const std::vector<cv::Mat>& imgs, bool reverse) {
+	size_t rowLen = static_cast<size_t>(out.cols) * out.channels();
+	size_t pixels = static_cast<size_t>(out.rows) * out.cols;
+	filled.assign(rowLen * out.rows, 0);
+
+	for (size_t k=0; k<imgs.size(); k++) {
+		const cv::Mat& img = imgs[reverse ? imgs.size() - 1 - k : k];
+		size_t n = makeMask(img);
+		if (n == 0) continue;
+		for (int y=0; y<out.rows; y++)
+			selectRow(out.ptr<uint8_t>(y), filled.data() + y * rowLen, img.ptr<uint8_t>(y), mask.data() + y * rowLen, rowLen);
+		// Everything is filled now.
+		if (n == pixels) break;
+	}
+}
+
+void Blender::featherWeights(int w, int h, int C, bool noNodata) {
+	if (noNodata) {
+		std::fill(weight.begin(), weight.end(), 255);
+		return;
+	}
+
+	dist.resize(static_cast<size_t>(w) * h);
+	chamferDistance(dist.data(), mask.data(), C, w, h, static_cast<uint16_t>(3 * featherRadius));
+	for (size_t i=0; i<dist.size(); i++) {
+		uint16_t wt = featherLut[dist[i]];
+		for (int c=0; c<C; c++) weight[i*C+c] = wt;
+	}
+}
+
+void Blender::blendWeighted(cv::Mat& out, const std::vector<cv::Mat>& imgs) {
+	int w = out.cols, h = out.rows, C = out.channels();
+	size_t rowLen = static_cast<size_t>(w) * C;
+	size_t pixels = static_cast<size_t>(w) * h;
+	acc.assign(rowLen * h, 0);
+	wsum.assign(rowLen * h, 0);
+	weight.resize(rowLen * h);
+
+	for (auto& img : imgs) {
+		size_t n = 0;
+		if (mode_ == BlendMode::eFeather) {
+			n = makeMask(img);
+			if (n) featherWeights(w, h, C, n == pixels);
+		} else {
+			for (int y=0; y<h; y++) {
+				uint16_t* wrow = weight.data() + y * rowLen;
+				const uint8_t* src = img.ptr<uint8_t>(y);
+				n += C == 1 ? rampRow<1>(wrow, src, w) : C == 3 ? rampRow<3>(wrow, src, w) : rampRow<4>(wrow, src, w);
+			}
+		}
+		if (n == 0) continue;
+
+		for (int y=0; y<h; y++)
+			accumulateRow(acc.data() + y * rowLen, wsum.data() + y * rowLen, img.ptr<uint8_t>(y), weight.data() + y * rowLen, rowLen);
+	}
+
+	for (int y=0; y<h; y++) resolveRow(out.ptr<uint8_t>(y), acc.data() + y * rowLen, wsum.data() + y * rowLen, rowLen);
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace frast {
+
+	//
+	// Blends the tiles that several overlapping sources give for one output tile (see WriterMasterGdalMany::process).
+	//
+	// Black pixels (all channels zero) are nodata. Supported types: CV_8UC1, CV_8UC3 and CV_8UC4, all of one size.
+	// The nodata masks and weights are expanded to one entry per channel, so the select, accumulate and divide loops
+	// run over plain rows of bytes whatever the channel count. They use AVX2 (picked at runtime) where available.
+	//
+
+	enum class BlendMode {
+		// Each pixel from the first source that has data there (sources come in srcPaths order).
+		eFirst,
+		// Each pixel from the last source that has data there.
+		eLast,
+		// Mean of the sources, weighted by brightness ramped up to full at a channel sum of 25 (so dark fringes of
+		// resampled borders count less). This was blend_imgs_avg().
+		eAverage,
+		// Mean of the sources, weighted by each pixel's distance to the nodata of its source (up to the feather
+		// radius), so seams fade in over that many pixels. Distances are measured within the tile only.
+		eFeather,
+	};
+
+	// "first", "last", "average" or "feather". Throws on anything else.
+	BlendMode parseBlendMode(const std::string& name);
+
+	class Blender {
+		public:
+			explicit Blender(BlendMode mode = BlendMode::eFirst, int featherRadius = 16);
+
+			// Blend @imgs, in priority order. No images give an empty Mat, and one image is returned as is.
+			// Otherwise the result is a new Mat.
+			cv::Mat blend(const std::vector<cv::Mat>& imgs);
+
+			inline BlendMode mode() const { return mode_; }
+
+		private:
+			BlendMode mode_;
+			int featherRadius;
+
+			// Scratch, one entry per channel of each pixel (kept between calls: use one Blender per thread).
+			std::vector<uint8_t> mask, filled;
+			std::vector<uint16_t> weight;
+			std::vector<uint32_t> acc, wsum;
+			// One entry per pixel.
+			std::vector<uint16_t> dist;
+			// Weight by chamfer distance (in thirds of a pixel, up to three times the radius).
+			std::vector<uint16_t> featherLut;
+
+			// Fill @mask for @img, returning its number of pixels with data.
+			size_t makeMask(const cv::Mat& img);
+			void blendFirst(cv::Mat& out, const std::vector<cv::Mat>& imgs, bool reverse);
+			void blendWeighted(cv::Mat& out, const std::vector<cv::Mat>& imgs);
+			void featherWeights(int w, int h, int C, bool noNodata);
+	};
+
+}
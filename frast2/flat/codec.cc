@@ -1,131 +1,739 @@
 #include "codec.h"
 
+#include <zlib.h>
+
 #include "codec_terrain.hpp"
-// #include "codec_stb.hpp"
 
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include <algorithm>
+#include <limits>
+
+#include "codec_stb.hpp"
+
+#ifdef FRAST_HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+// The BGR and BGRA output color spaces are libjpeg-turbo extensions.
+#ifdef JCS_EXTENSIONS
+#define FRAST_TURBO_JPEG
+#endif
+#endif
+
+#ifdef FRAST_HAVE_WEBP
+#include <webp/decode.h>
+#include <webp/encode.h>
+#endif
+
+#ifdef FRAST_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 namespace {
-	// constexpr bool USE_STB = true;
 
-	inline bool use_stb(uint8_t option) {
-		// WARNING: Right now stb is disabled!
-		assert(option == 0);
+#ifdef FRAST_TURBO_JPEG
+	// libjpeg reports errors by calling error_exit(), which must not return: jump back to decodeJpegTurbo().
+	struct JpegErrorMgr {
+		jpeg_error_mgr pub;
+		jmp_buf jump;
+	};
+	void jpegErrorExit(j_common_ptr cinfo) { longjmp(reinterpret_cast<JpegErrorMgr*>(cinfo->err)->jump, 1); }
+	void jpegOutputMessage(j_common_ptr) {}
+
+	// Compress into a vector that keeps its capacity from tile to tile (jpeg_mem_dest() mallocs a new buffer each time).
+	struct JpegVectorDest {
+		jpeg_destination_mgr pub;
+		std::vector<uint8_t>* buf;
+	};
+	void jpegInitDestination(j_compress_ptr cinfo) {
+		auto dest = reinterpret_cast<JpegVectorDest*>(cinfo->dest);
+		if (dest->buf->size() < 65536) dest->buf->resize(65536);
+		dest->pub.next_output_byte = dest->buf->data();
+		dest->pub.free_in_buffer = dest->buf->size();
+	}
+	boolean jpegEmptyOutputBuffer(j_compress_ptr cinfo) {
+		// Called when the whole buffer is full.
+		auto dest = reinterpret_cast<JpegVectorDest*>(cinfo->dest);
+		size_t used = dest->buf->size();
+		dest->buf->resize(used * 2);
+		dest->pub.next_output_byte = dest->buf->data() + used;
+		dest->pub.free_in_buffer = dest->buf->size() - used;
+		return TRUE;
+	}
+	void jpegTermDestination(j_compress_ptr) {}
+#endif
+
+	//
+	// The codecs' state, one per thread (see codecContext()). Each part is created by the first tile that needs it,
+	// then reset and reused by the next ones, so that a thread that has warmed up encodes and decodes without heap
+	// allocations of its own (libjpeg still takes its per-image memory pools from malloc(), and stb and libwebp
+	// allocate inside).
+	//
+	struct CodecContext {
+		// Byte planes and residuals of the terrain codecs.
+		std::vector<uint8_t> planes;
+		std::vector<uint16_t> residuals;
+		// The full tile of decodeValueScaled(), the temporary of decodeValueInto(), and WebP's grayscale decode.
+		cv::Mat full, tmp, bgr;
+		// What encodeValue() encodes into (the returned value is a copy of just its bytes).
+		std::vector<uint8_t> out;
+
+		CodecContext() = default;
+		CodecContext(const CodecContext&) = delete;
+		CodecContext& operator=(const CodecContext&) = delete;
+
+		~CodecContext() {
+			for (int i=0; i<2; i++)
+				if (haveDeflater[i]) deflateEnd(&deflaters[i]);
+			if (haveInflater) inflateEnd(&inflater_);
+#ifdef FRAST_TURBO_JPEG
+			if (haveJpegEncoder) jpeg_destroy_compress(&jpegEncoder_);
+			if (haveJpegDecoder) jpeg_destroy_decompress(&jpegDecoder_);
+#endif
+#ifdef FRAST_HAVE_ZSTD
+			ZSTD_freeCCtx(zstdEncoder_);
+			ZSTD_freeDCtx(zstdDecoder_);
+#endif
+		}
+
+		// Only Z_DEFAULT_COMPRESSION (the zlib codec) and Z_BEST_SPEED (terrainDelta) are used.
+		z_stream& deflater(int level) {
+			assert(level == Z_DEFAULT_COMPRESSION or level == Z_BEST_SPEED);
+			int i = level == Z_BEST_SPEED;
+			if (not haveDeflater[i]) {
+				deflaters[i] = z_stream{};
+				if (deflateInit(&deflaters[i], level) != Z_OK) throw std::runtime_error("encodeValue: deflateInit failed");
+				haveDeflater[i] = true;
+			}
+			return deflaters[i];
+		}
+
+		// Nullptr if zlib can not allocate it.
+		z_stream* inflater() {
+			if (not haveInflater) {
+				inflater_ = z_stream{};
+				if (inflateInit(&inflater_) != Z_OK) return nullptr;
+				haveInflater = true;
+			}
+			return &inflater_;
+		}
+
+#ifdef FRAST_TURBO_JPEG
+		// Both give error_exit() as a longjmp() to their JpegErrorMgr's jump: setjmp() it before each use, and
+		// jpeg_abort() the handle after a jump.
+		jpeg_compress_struct& jpegEncoder() {
+			if (not haveJpegEncoder) {
+				jpegEncoder_.err = jpegStdError(jpegEncoderErr);
+				jpeg_create_compress(&jpegEncoder_);
+				jpegDest.pub.init_destination = jpegInitDestination;
+				jpegDest.pub.empty_output_buffer = jpegEmptyOutputBuffer;
+				jpegDest.pub.term_destination = jpegTermDestination;
+				jpegEncoder_.dest = &jpegDest.pub;
+				haveJpegEncoder = true;
+			}
+			return jpegEncoder_;
+		}
+		jpeg_decompress_struct& jpegDecoder() {
+			if (not haveJpegDecoder) {
+				jpegDecoder_.err = jpegStdError(jpegDecoderErr);
+				jpeg_create_decompress(&jpegDecoder_);
+				haveJpegDecoder = true;
+			}
+			return jpegDecoder_;
+		}
+		JpegErrorMgr jpegEncoderErr, jpegDecoderErr;
+		JpegVectorDest jpegDest;
+#endif
+
+#ifdef FRAST_HAVE_ZSTD
+		ZSTD_CCtx* zstdEncoder() {
+			if (zstdEncoder_ == nullptr and (zstdEncoder_ = ZSTD_createCCtx()) == nullptr)
+				throw std::runtime_error("encodeValue: ZSTD_createCCtx failed");
+			return zstdEncoder_;
+		}
+		// Nullptr if zstd can not allocate it.
+		ZSTD_DCtx* zstdDecoder() {
+			if (zstdDecoder_ == nullptr) zstdDecoder_ = ZSTD_createDCtx();
+			return zstdDecoder_;
+		}
+#endif
+
+	private:
+		z_stream deflaters[2], inflater_;
+		bool haveDeflater[2] = {}, haveInflater = false;
+#ifdef FRAST_TURBO_JPEG
+		jpeg_compress_struct jpegEncoder_;
+		jpeg_decompress_struct jpegDecoder_;
+		bool haveJpegEncoder = false, haveJpegDecoder = false;
+
+		static jpeg_error_mgr* jpegStdError(JpegErrorMgr& err) {
+			jpeg_std_error(&err.pub);
+			err.pub.error_exit = jpegErrorExit;
+			err.pub.output_message = jpegOutputMessage;
+			return &err.pub;
+		}
+#endif
+#ifdef FRAST_HAVE_ZSTD
+		ZSTD_CCtx* zstdEncoder_ = nullptr;
+		ZSTD_DCtx* zstdDecoder_ = nullptr;
+#endif
+	};
+
+	// Destroyed when the thread exits, e.g. when a writer's workers are joined.
+	CodecContext& codecContext() {
+		thread_local CodecContext ctx;
+		return ctx;
+	}
+
+#ifdef FRAST_TURBO_JPEG
+	// Decode at 1/@scaleDenom, row by row into @out. With @into, @out is a caller's region (maybe strided) that must
+	// have the decoded size and type already, otherwise it is (re)allocated as needed.
+	// Returns true on failure (corrupt or non-JPEG data, or a size mismatch with @into).
+	bool decodeJpegTurbo(cv::Mat& out, const frast::Value& val, int channels, int scaleDenom, bool into) {
+		CodecContext& ctx = codecContext();
+		jpeg_decompress_struct& cinfo = ctx.jpegDecoder();
+		if (setjmp(ctx.jpegDecoderErr.jump)) {
+			jpeg_abort_decompress(&cinfo);
+			return true;
+		}
+
+		jpeg_mem_src(&cinfo, static_cast<const unsigned char*>(val.value), val.len);
+		jpeg_read_header(&cinfo, TRUE);
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = scaleDenom;
+		// Straight to the layout that imdecode() and cvtColor() give (with BGRA, the decoder fills the alpha).
+		cinfo.out_color_space = channels == 1 ? JCS_GRAYSCALE : channels == 3 ? JCS_EXT_BGR : JCS_EXT_BGRA;
+		jpeg_start_decompress(&cinfo);
+
+		int rows = cinfo.output_height, cols = cinfo.output_width;
+		if (into and (out.rows != rows or out.cols != cols or out.type() != CV_8UC(channels))) {
+			jpeg_abort_decompress(&cinfo);
+			return true;
+		}
+		out.create(rows, cols, CV_8UC(channels));
+		while (cinfo.output_scanline < cinfo.output_height) {
+			JSAMPROW row = out.ptr<uint8_t>(cinfo.output_scanline);
+			jpeg_read_scanlines(&cinfo, &row, 1);
+		}
+
+		// Leaves the handle ready for the next tile.
+		jpeg_finish_decompress(&cinfo);
 		return false;
 	}
+
+	// Same quality as cv::imencode()'s default, so that eJpegTurbo only differs from eDefault by its smaller headers
+	// and Huffman tables.
+	constexpr int kJpegQuality = 95;
+
+	size_t encodeJpegTurbo(std::vector<uint8_t>& buf, const cv::Mat& img) {
+		CodecContext& ctx = codecContext();
+		jpeg_compress_struct& cinfo = ctx.jpegEncoder();
+		ctx.jpegDest.buf = &buf;
+		if (setjmp(ctx.jpegEncoderErr.jump)) {
+			jpeg_abort_compress(&cinfo);
+			throw std::runtime_error("encodeValue: libjpeg failed to encode a tile");
+		}
+
+		int channels = img.channels();
+		cinfo.image_width = img.cols;
+		cinfo.image_height = img.rows;
+		cinfo.input_components = channels;
+		cinfo.in_color_space = channels == 1 ? JCS_GRAYSCALE : channels == 3 ? JCS_EXT_BGR : JCS_EXT_BGRA;
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, kJpegQuality, TRUE);
+		cinfo.optimize_coding = TRUE;
+		cinfo.write_JFIF_header = FALSE;
+		jpeg_start_compress(&cinfo, TRUE);
+		while (cinfo.next_scanline < cinfo.image_height) {
+			JSAMPROW row = const_cast<uint8_t*>(img.ptr<uint8_t>(cinfo.next_scanline));
+			jpeg_write_scanlines(&cinfo, &row, 1);
+		}
+		jpeg_finish_compress(&cinfo);
+
+		return buf.size() - ctx.jpegDest.pub.free_in_buffer;
+	}
+#endif
 }
 
+
 namespace frast {
 
-	// WARNING: This calls malloc(), and the user must then free memory with free()
-	//         [This is because this function is typically used with ThreadPool]
-	Value encodeValue(const cv::Mat& img, bool isTerrain, uint8_t option) {
-		assert (not img.empty());
+	namespace {
+
+		// malloc()ed copy of @len bytes, as encodeValue() returns.
+		Value mallocValue(const void* data, size_t len) {
+			Value v;
+			v.value = malloc(len);
+			if (v.value == nullptr) throw std::runtime_error("encodeValue: malloc failed");
+			v.len = len;
+			memcpy(v.value, data, len);
+			return v;
+		}
+
+		//
+		// JPEG: eDefault (color) and eJpegTurbo. Both are plain JPEG, so either decodes with libjpeg-turbo, or with
+		// OpenCV when built without it.
+		//
+
+		size_t encodeJpegOpenCV(std::vector<uint8_t>& buf, const cv::Mat& img) {
+			if (not cv::imencode(".jpg", img, buf)) throw std::runtime_error("encodeValue: cv::imencode failed");
+			return buf.size();
+		}
+
+		bool decodeJpeg(cv::Mat& out, const Value& val, int channels) {
+#ifdef FRAST_TURBO_JPEG
+			if (not decodeJpegTurbo(out, val, channels, 1, false)) return false;
+#endif
+			bool grayscale = channels == 1;
+			auto flags = grayscale ? 0 : cv::IMREAD_COLOR;
+
+			cv::_InputArray buf((uint8_t*)val.value, val.len);
+			cv::imdecode(buf, flags, &out);
+			if (out.empty()) return true;
+
+			if (channels == 4 and out.channels() == 1) cv::cvtColor(out,out, cv::COLOR_GRAY2BGRA);
+			if (channels == 4 and out.channels() == 3) cv::cvtColor(out,out, cv::COLOR_BGR2BGRA);
+			return false;
+		}
+
+#ifdef FRAST_TURBO_JPEG
+		bool decodeJpegScaled(cv::Mat& out, const Value& val, int channels, int scaleDenom) {
+			return decodeJpegTurbo(out, val, channels, scaleDenom, false);
+		}
+		bool decodeJpegInto(cv::Mat& dst, const Value& val, int channels, int scaleDenom) {
+			return decodeJpegTurbo(dst, val, channels, scaleDenom, true);
+		}
+		constexpr auto jpegScaledFn = decodeJpegScaled;
+		constexpr auto jpegIntoFn = decodeJpegInto;
+		constexpr auto jpegTurboEncodeFn = encodeJpegTurbo;
+#else
+		constexpr bool (*jpegScaledFn)(cv::Mat&, const Value&, int, int) = nullptr;
+		constexpr bool (*jpegIntoFn)(cv::Mat&, const Value&, int, int) = nullptr;
+		constexpr size_t (*jpegTurboEncodeFn)(std::vector<uint8_t>&, const cv::Mat&) = nullptr;
+#endif
+
+		//
+		// eStbJpeg (see codec_stb.hpp). Only 256x256 tiles.
+		//
+
+		size_t encodeStbJpeg(std::vector<uint8_t>& buf, const cv::Mat& img) {
+			if (img.rows != 256 or img.cols != 256) throw std::runtime_error("encodeValue: the stbJpeg codec only supports 256x256 tiles");
+			cv::Mat in = img.isContinuous() ? img : img.clone();
+			// It appends.
+			buf.clear();
+			if (my_write_jpg_stb(buf, in)) throw std::runtime_error("encodeValue: stb failed to encode a tile");
+			return buf.size();
+		}
+
+		bool decodeStbJpeg(cv::Mat& out, const Value& val, int channels) {
+			int w, h, c;
+			uint8_t* mem = my_load_from_memory((uint8_t*)val.value, val.len, &w, &h, &c, channels);
+			if (mem == nullptr) return true;
+			out.create(h, w, CV_8UC(channels));
+			for (int y=0; y<h; y++) memcpy(out.ptr<uint8_t>(y), mem + y * w * channels, w * channels);
+			free(mem);
+			// stb gives RGB(A).
+			if (channels >= 3)
+				for (int y=0; y<h; y++) {
+					uint8_t* row = out.ptr<uint8_t>(y);
+					for (int x=0; x<w; x++) std::swap(row[x*channels], row[x*channels+2]);
+				}
+			return false;
+		}
+
+		//
+		// eWebp and eWebpLossless. WebP has no grayscale, and the alpha channel is not kept (as with JPEG).
+		//
+
+#ifdef FRAST_HAVE_WEBP
+		constexpr float kWebpQuality = 90;
+
+		size_t encodeWebpWith(std::vector<uint8_t>& buf, const cv::Mat& img, bool lossless) {
+			cv::Mat bgr = img;
+			if (img.channels() == 1) cv::cvtColor(img, bgr, cv::COLOR_GRAY2BGR);
+			if (img.channels() == 4) cv::cvtColor(img, bgr, cv::COLOR_BGRA2BGR);
+			uint8_t* out = nullptr;
+			size_t len = lossless ? WebPEncodeLosslessBGR(bgr.data, bgr.cols, bgr.rows, bgr.step, &out)
+			                      : WebPEncodeBGR(bgr.data, bgr.cols, bgr.rows, bgr.step, kWebpQuality, &out);
+			if (len == 0) throw std::runtime_error("encodeValue: libwebp failed to encode a tile");
+			if (buf.size() < len) buf.resize(len);
+			memcpy(buf.data(), out, len);
+			WebPFree(out);
+			return len;
+		}
+		size_t encodeWebp(std::vector<uint8_t>& buf, const cv::Mat& img) { return encodeWebpWith(buf, img, false); }
+		size_t encodeWebpLossless(std::vector<uint8_t>& buf, const cv::Mat& img) { return encodeWebpWith(buf, img, true); }
 
+		bool decodeWebpInto(cv::Mat& dst, const Value& val, int channels, int scaleDenom) {
+			int w, h;
+			auto data = static_cast<const uint8_t*>(val.value);
+			if (scaleDenom != 1 or not WebPGetInfo(data, val.len, &w, &h)) return true;
+			if (dst.rows != h or dst.cols != w or dst.type() != CV_8UC(channels)) return true;
 
-		if (isTerrain) {
-			assert(img.channels() == 1);
-			assert(img.type() == CV_16UC1);
-			return encode_terrain_2x8(img);
-		} else {
-
-			if (use_stb(option)) {
-				assert(false);
-				throw std::runtime_error("bad");
-				/*
-				std::vector<uint8_t> buf;
-				my_write_jpg_stb(buf, img);
-				Value v;
-				// fmt::print(" - Writing {} bytes:", buf.size()); for (int i=0; i<20; i++) fmt::print(" {:0x}", buf[i]); fmt::print("\n");
-				v.value = malloc(buf.size());
-				v.len = buf.size();
-				memcpy(v.value, buf.data(), buf.size());
-				return v;
-				*/
-			} else {
-				std::vector<uint8_t> buf;
-				bool stat = cv::imencode(".jpg", img, buf);
-				assert(stat);
-				Value v;
-				v.value = malloc(buf.size());
-				v.len = buf.size();
-				memcpy(v.value, buf.data(), buf.size());
-				return v;
+			if (channels == 1) {
+				cv::Mat& bgr = codecContext().bgr;
+				bgr.create(h, w, CV_8UC3);
+				if (WebPDecodeBGRInto(data, val.len, bgr.data, bgr.step * h, bgr.step) == nullptr) return true;
+				cv::cvtColor(bgr, dst, cv::COLOR_BGR2GRAY);
+				return false;
 			}
+			size_t size = dst.step * (h - 1) + w * channels;
+			auto decode = channels == 3 ? WebPDecodeBGRInto : WebPDecodeBGRAInto;
+			return decode(data, val.len, dst.data, size, dst.step) == nullptr;
 		}
-	}
 
-	cv::Mat decodeValue(const Value& val, int channels, bool isTerrain, uint8_t option) {
-		if (val.value == nullptr) return cv::Mat{};
+		bool decodeWebp(cv::Mat& out, const Value& val, int channels) {
+			int w, h;
+			if (not WebPGetInfo(static_cast<const uint8_t*>(val.value), val.len, &w, &h)) return true;
+			out.create(h, w, CV_8UC(channels));
+			return decodeWebpInto(out, val, channels, 1);
+		}
+		constexpr auto webpEncodeFn = encodeWebp;
+		constexpr auto webpLosslessEncodeFn = encodeWebpLossless;
+		constexpr auto webpDecodeFn = decodeWebp;
+		constexpr auto webpIntoFn = decodeWebpInto;
+#else
+		constexpr size_t (*webpEncodeFn)(std::vector<uint8_t>&, const cv::Mat&) = nullptr;
+		constexpr size_t (*webpLosslessEncodeFn)(std::vector<uint8_t>&, const cv::Mat&) = nullptr;
+		constexpr bool (*webpDecodeFn)(cv::Mat&, const Value&, int) = nullptr;
+		constexpr bool (*webpIntoFn)(cv::Mat&, const Value&, int, int) = nullptr;
+#endif
 
-		if (isTerrain) {
-			assert (channels == 1);
-			return decode_terrain_2x8(val);
-		} else {
-			assert(channels == 1 or channels == 3 or channels == 4);
+		//
+		// Terrain. Tiles are 256x256 CV_16UC1.
+		//
 
-			if (use_stb(option)) {
-				assert(false);
-				throw std::runtime_error("bad");
-				/*
-				int w,h,c;
-				uint8_t* mem = my_load_from_memory((uint8_t*)val.value, val.len, &w,&h,&c, channels);
-				cv::Mat out (w,h, CV_8UC3); // FIXME: correct type
-				memcpy(out.data, mem, out.total() * out.elemSize());
-				free(mem);
-				return out;
-				*/
+		constexpr int kTerrainSize = 256;
 
-			} else {
-				bool grayscale = channels == 1;
-				auto flags = grayscale ? 0 : cv::IMREAD_COLOR;
+		inline bool isTerrainTile(const cv::Mat& m) {
+			return m.rows == kTerrainSize and m.cols == kTerrainSize and m.type() == CV_16UC1;
+		}
 
-				cv::_InputArray buf((uint8_t*)val.value, val.len);
-				cv::Mat img = cv::imdecode(buf, flags);
+		// Decode with @decode, which needs a continuous output, into a caller's region.
+		bool decodeTerrainInto(cv::Mat& dst, const Value& val, bool (*decode)(cv::Mat&, const Value&, int)) {
+			if (not isTerrainTile(dst)) return true;
+			if (dst.isContinuous()) return decode(dst, val, 1);
+			cv::Mat& tmp = codecContext().tmp;
+			if (decode(tmp, val, 1)) return true;
+			tmp.copyTo(dst);
+			return false;
+		}
+
+		size_t encodeZlib(std::vector<uint8_t>& buf, const cv::Mat& img) {
+			z_stream& strm = codecContext().deflater(Z_DEFAULT_COMPRESSION);
+			return encode_terrain_2x8(buf, img.isContinuous() ? img : img.clone(), strm);
+		}
+		bool decodeZlib(cv::Mat& out, const Value& val, int) {
+			z_stream* strm = codecContext().inflater();
+			return strm == nullptr or decode_terrain_2x8(out, val, *strm);
+		}
+		bool decodeZlibInto(cv::Mat& dst, const Value& val, int, int) {
+			return decodeTerrainInto(dst, val, decodeZlib);
+		}
 
-				if (channels == 4 and img.channels() == 1) cv::cvtColor(img,img, cv::COLOR_GRAY2BGRA);
-				if (channels == 4 and img.channels() == 3) cv::cvtColor(img,img, cv::COLOR_BGR2BGRA);
-				return img;
+		// eTerrainDelta. Elevation changes slowly, so the difference to the left neighbour (to the one above, for the
+		// first of a row) is small: its high bytes are mostly 0 or 255 and its low bytes repeat. Putting each byte
+		// plane in a run of its own lets deflate's fastest level find that, where it could not in raw uint16.
+		size_t encodeTerrainDelta(std::vector<uint8_t>& buf, const cv::Mat& img) {
+			if (not isTerrainTile(img)) throw std::runtime_error("encodeValue: the terrainDelta codec only supports 256x256 CV_16UC1 tiles");
+			constexpr int n = kTerrainSize * kTerrainSize;
+			CodecContext& ctx = codecContext();
+			std::vector<uint8_t>& planes = ctx.planes;
+			planes.resize(2 * n);
+			uint16_t above = 0;
+			for (int y=0, i=0; y<kTerrainSize; y++) {
+				const uint16_t* row = img.ptr<uint16_t>(y);
+				uint16_t prev = above;
+				above = row[0];
+				for (int x=0; x<kTerrainSize; x++, i++) {
+					uint16_t d = row[x] - prev;
+					prev = row[x];
+					planes[i] = d & 0xff;
+					planes[n + i] = d >> 8;
+				}
 			}
+
+			// As compress2(), but with this thread's stream.
+			z_stream& strm = ctx.deflater(Z_BEST_SPEED);
+			if (deflateReset(&strm) != Z_OK) throw std::runtime_error("encodeValue: deflateReset failed");
+			size_t bound = deflateBound(&strm, planes.size());
+			if (buf.size() < bound) buf.resize(bound);
+			strm.next_in = planes.data();
+			strm.avail_in = planes.size();
+			strm.next_out = buf.data();
+			strm.avail_out = buf.size();
+			if (deflate(&strm, Z_FINISH) != Z_STREAM_END) throw std::runtime_error("encodeValue: deflate failed");
+			return strm.total_out;
 		}
-	}
 
-	bool decodeValue(cv::Mat& out, const Value& val, int channels, bool isTerrain, uint8_t option) {
-		if (val.value == nullptr) return true;
+		bool decodeTerrainDelta(cv::Mat& out, const Value& val, int) {
+			constexpr int n = kTerrainSize * kTerrainSize;
+			CodecContext& ctx = codecContext();
+			std::vector<uint8_t>& planes = ctx.planes;
+			planes.resize(2 * n);
 
-		if (isTerrain) {
-			assert (channels == 1);
-			return decode_terrain_2x8(out,val);
-		} else {
-			assert(channels == 1 or channels == 3 or channels == 4);
-
-			if (use_stb(option)) {
-				assert(false);
-				throw std::runtime_error("bad");
-				/*
-				int w,h,c;
-				uint8_t* mem = my_load_from_memory((uint8_t*)val.value, val.len, &w,&h,&c, channels);
-				out.create(w,h, CV_8UC3); // FIXME: correct type
-				memcpy(out.data, mem, out.total() * out.elemSize());
-				free(mem);
-				return false;
-				*/
+			// As uncompress(), but with this thread's stream.
+			z_stream* strm = ctx.inflater();
+			if (strm == nullptr or inflateReset(strm) != Z_OK) return true;
+			strm->next_in = static_cast<Bytef*>(val.value);
+			strm->avail_in = val.len;
+			strm->next_out = planes.data();
+			strm->avail_out = planes.size();
+			if (inflate(strm, Z_FINISH) != Z_STREAM_END or strm->avail_out != 0) return true;
 
-			} else {
-				bool grayscale = channels == 1;
-				auto flags = grayscale ? 0 : cv::IMREAD_COLOR;
+			out.create(kTerrainSize, kTerrainSize, CV_16UC1);
+			uint16_t above = 0;
+			for (int y=0, i=0; y<kTerrainSize; y++) {
+				uint16_t* row = out.ptr<uint16_t>(y);
+				uint16_t prev = above;
+				for (int x=0; x<kTerrainSize; x++, i++) {
+					prev += static_cast<uint16_t>(planes[i] | planes[n + i] << 8);
+					row[x] = prev;
+				}
+				above = row[0];
+			}
+			return false;
+		}
+		bool decodeTerrainDeltaInto(cv::Mat& dst, const Value& val, int, int) {
+			// Writes rows one by one, so strided regions need no temporary.
+			if (not isTerrainTile(dst)) return true;
+			return decodeTerrainDelta(dst, val, 1);
+		}
 
-				cv::_InputArray buf((uint8_t*)val.value, val.len);
-				cv::imdecode(buf, flags, &out);
+		// eTerrainPredict. Each pixel is predicted from its left (a), upper (b) and upper left (c) neighbours, with the
+		// predictor that leaves the smallest residuals over the tile. The residuals are zigzagged, so that small negative
+		// ones have zero high bytes too, split into byte planes and compressed with zstd, whose decoder is several times
+		// faster than inflate. The first byte is the predictor.
+		// The first row is always predicted from the left, and the first column from above.
+#ifdef FRAST_HAVE_ZSTD
+		enum TerrainPredictor : uint8_t {
+			eLeft = 0,
+			eUp = 1,
+			ePaeth = 2,
+			// a + b - c: exact on planar slopes.
+			eGradient = 3,
+			eNumPredictors
+		};
 
-				if (channels == 4 and out.channels() == 1) cv::cvtColor(out,out, cv::COLOR_GRAY2BGRA);
-				if (channels == 4 and out.channels() == 3) cv::cvtColor(out,out, cv::COLOR_BGR2BGRA);
+		template <int P>
+		inline uint16_t predictTerrain(uint16_t a, uint16_t b, uint16_t c) {
+			if constexpr (P == eLeft) return a;
+			if constexpr (P == eUp) return b;
+			if constexpr (P == ePaeth) {
+				int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+				return pa <= pb and pa <= pc ? a : pb <= pc ? b : c;
+			}
+			return a + b - c;
+		}
 
-				return false;
+		inline uint16_t zigzag(uint16_t r) { return static_cast<uint16_t>(r << 1) ^ static_cast<uint16_t>(-(r >> 15)); }
+		inline uint16_t unzigzag(uint16_t z) { return (z >> 1) ^ static_cast<uint16_t>(-(z & 1)); }
+
+		// Zigzagged residuals of row @y (> 0) of @img, into @out.
+		template <int P>
+		inline void terrainResiduals(uint16_t* out, const cv::Mat& img, int y) {
+			const uint16_t* row = img.ptr<uint16_t>(y);
+			const uint16_t* up = img.ptr<uint16_t>(y - 1);
+			out[0] = zigzag(row[0] - up[0]);
+			for (int x=1; x<kTerrainSize; x++)
+				out[x] = zigzag(row[x] - predictTerrain<P>(row[x-1], up[x], up[x-1]));
+		}
+
+		template <int P>
+		void terrainResidualsRows(uint16_t* out, const cv::Mat& img, int y0, int step) {
+			for (int y=y0; y<kTerrainSize; y+=step) terrainResiduals<P>(out + y * kTerrainSize, img, y);
+		}
+		constexpr void (*terrainResidualsFns[eNumPredictors])(uint16_t*, const cv::Mat&, int, int) = {
+			terrainResidualsRows<eLeft>, terrainResidualsRows<eUp>, terrainResidualsRows<ePaeth>, terrainResidualsRows<eGradient> };
+
+		template <int P>
+		void terrainReconstructRow(uint16_t* row, const uint16_t* up, const uint8_t* lo, const uint8_t* hi) {
+			row[0] = up[0] + unzigzag(lo[0] | hi[0] << 8);
+			for (int x=1; x<kTerrainSize; x++)
+				row[x] = predictTerrain<P>(row[x-1], up[x], up[x-1]) + unzigzag(lo[x] | hi[x] << 8);
+		}
+		constexpr void (*terrainReconstructFns[eNumPredictors])(uint16_t*, const uint16_t*, const uint8_t*, const uint8_t*) = {
+			terrainReconstructRow<eLeft>, terrainReconstructRow<eUp>, terrainReconstructRow<ePaeth>, terrainReconstructRow<eGradient> };
+
+		// Decoding speed barely depends on the level.
+		constexpr int kZstdLevel = 6;
+
+		size_t encodeTerrainPredict(std::vector<uint8_t>& buf, const cv::Mat& img) {
+			if (not isTerrainTile(img)) throw std::runtime_error("encodeValue: the terrainPredict codec only supports 256x256 CV_16UC1 tiles");
+			constexpr int n = kTerrainSize * kTerrainSize;
+			CodecContext& ctx = codecContext();
+			std::vector<uint16_t>& residuals = ctx.residuals;
+			residuals.resize(n);
+
+			// Pick the predictor on every 8th row. Residuals are capped in the cost, so that the jumps at nodata edges
+			// (which no predictor gets) do not outweigh the rest of the tile.
+			int best = eLeft;
+			uint64_t bestCost = std::numeric_limits<uint64_t>::max();
+			for (int p=0; p<eNumPredictors; p++) {
+				terrainResidualsFns[p](residuals.data(), img, 1, 8);
+				uint64_t cost = 0;
+				for (int y=1; y<kTerrainSize; y+=8)
+					for (int x=0; x<kTerrainSize; x++) cost += std::min<uint16_t>(residuals[y * kTerrainSize + x], 1024);
+				if (cost < bestCost) best = p, bestCost = cost;
+			}
+
+			terrainResidualsFns[best](residuals.data(), img, 1, 1);
+			const uint16_t* row0 = img.ptr<uint16_t>(0);
+			residuals[0] = zigzag(row0[0]);
+			for (int x=1; x<kTerrainSize; x++) residuals[x] = zigzag(row0[x] - row0[x-1]);
+
+			std::vector<uint8_t>& planes = ctx.planes;
+			planes.resize(2 * n);
+			for (int i=0; i<n; i++) {
+				planes[i] = residuals[i] & 0xff;
+				planes[n + i] = residuals[i] >> 8;
 			}
+
+			size_t bound = ZSTD_compressBound(planes.size());
+			if (buf.size() < 1 + bound) buf.resize(1 + bound);
+			buf[0] = best;
+			size_t len = ZSTD_compressCCtx(ctx.zstdEncoder(), buf.data() + 1, bound, planes.data(), planes.size(), kZstdLevel);
+			if (ZSTD_isError(len)) throw std::runtime_error("encodeValue: zstd failed");
+			return 1 + len;
+		}
+
+		bool decodeTerrainPredict(cv::Mat& out, const Value& val, int) {
+			constexpr int n = kTerrainSize * kTerrainSize;
+			auto data = static_cast<const uint8_t*>(val.value);
+			if (val.len < 2 or data[0] >= eNumPredictors) return true;
+			CodecContext& ctx = codecContext();
+			std::vector<uint8_t>& planes = ctx.planes;
+			planes.resize(2 * n);
+			ZSTD_DCtx* dctx = ctx.zstdDecoder();
+			if (dctx == nullptr) return true;
+			size_t len = ZSTD_decompressDCtx(dctx, planes.data(), planes.size(), data + 1, val.len - 1);
+			if (ZSTD_isError(len) or len != planes.size()) return true;
+
+			out.create(kTerrainSize, kTerrainSize, CV_16UC1);
+			const uint8_t *lo = planes.data(), *hi = planes.data() + n;
+			uint16_t* row0 = out.ptr<uint16_t>(0);
+			row0[0] = unzigzag(lo[0] | hi[0] << 8);
+			for (int x=1; x<kTerrainSize; x++) row0[x] = row0[x-1] + unzigzag(lo[x] | hi[x] << 8);
+			auto reconstruct = terrainReconstructFns[data[0]];
+			for (int y=1; y<kTerrainSize; y++)
+				reconstruct(out.ptr<uint16_t>(y), out.ptr<uint16_t>(y-1), lo + y * kTerrainSize, hi + y * kTerrainSize);
+			return false;
 		}
+		bool decodeTerrainPredictInto(cv::Mat& dst, const Value& val, int, int) {
+			// Rows are written one by one, and only read back from @dst itself: strided regions need no temporary.
+			if (not isTerrainTile(dst)) return true;
+			return decodeTerrainPredict(dst, val, 1);
+		}
+		constexpr auto terrainPredictEncodeFn = encodeTerrainPredict;
+		constexpr auto terrainPredictDecodeFn = decodeTerrainPredict;
+		constexpr auto terrainPredictIntoFn = decodeTerrainPredictInto;
+#else
+		constexpr size_t (*terrainPredictEncodeFn)(std::vector<uint8_t>&, const cv::Mat&) = nullptr;
+		constexpr bool (*terrainPredictDecodeFn)(cv::Mat&, const Value&, int) = nullptr;
+		constexpr bool (*terrainPredictIntoFn)(cv::Mat&, const Value&, int, int) = nullptr;
+#endif
+
+		const Codec& codecFor(CodecId id, bool isTerrain, bool encode) {
+			const Codec& c = getCodec(id, isTerrain);
+			if (encode ? not c.canEncode() : not c.canDecode())
+				throw std::runtime_error(fmt::format("frast was built without {} support for the '{}' codec", encode ? "encoding" : "decoding", c.name));
+			return c;
+		}
+	}
+
+	const std::vector<Codec>& allCodecs() {
+		static const std::vector<Codec> codecs {
+			{ "jpeg", CodecId::eDefault, false, false, encodeJpegOpenCV, decodeJpeg, jpegScaledFn, jpegIntoFn },
+			{ "zlib", CodecId::eDefault, true, true, encodeZlib, decodeZlib, nullptr, decodeZlibInto },
+			{ "jpegTurbo", CodecId::eJpegTurbo, false, false, jpegTurboEncodeFn, decodeJpeg, jpegScaledFn, jpegIntoFn },
+			{ "stbJpeg", CodecId::eStbJpeg, false, false, encodeStbJpeg, decodeStbJpeg, nullptr, nullptr },
+			{ "webp", CodecId::eWebp, false, false, webpEncodeFn, webpDecodeFn, nullptr, webpIntoFn },
+			{ "webpLossless", CodecId::eWebpLossless, false, true, webpLosslessEncodeFn, webpDecodeFn, nullptr, webpIntoFn },
+			{ "terrainDelta", CodecId::eTerrainDelta, true, true, encodeTerrainDelta, decodeTerrainDelta, nullptr, decodeTerrainDeltaInto },
+			{ "terrainPredict", CodecId::eTerrainPredict, true, true, terrainPredictEncodeFn, terrainPredictDecodeFn, nullptr, terrainPredictIntoFn },
+		};
+		return codecs;
+	}
+
+	const Codec& getCodec(CodecId id, bool isTerrain) {
+		for (auto& c : allCodecs())
+			if (c.id == id and c.terrain == isTerrain) return c;
+		for (auto& c : allCodecs())
+			if (c.id == id) throw std::runtime_error(fmt::format("codec '{}' is not for {} files", c.name, isTerrain ? "terrain" : "color"));
+		throw std::runtime_error(fmt::format("unknown codec id {} (a file from a newer frast?)", static_cast<int>(id)));
+	}
+
+	CodecId parseCodec(const std::string& name, bool isTerrain) {
+		if (name == "default") return CodecId::eDefault;
+		for (auto& c : allCodecs())
+			if (name == c.name) return getCodec(c.id, isTerrain).id;
+		throw std::runtime_error(fmt::format("unknown codec '{}'", name));
+	}
+
+	// WARNING: This calls malloc(), and the user must then free memory with free()
+	//         [This is because this function is typically used with ThreadPool]
+	Value encodeValue(const cv::Mat& img, bool isTerrain, CodecId codec) {
+		Value scratch = encodeValueScratch(img, isTerrain, codec);
+		return mallocValue(scratch.value, scratch.len);
+	}
+
+	Value encodeValueScratch(const cv::Mat& img, bool isTerrain, CodecId codec) {
+		assert (not img.empty());
+		assert(isTerrain ? img.type() == CV_16UC1 : img.depth() == CV_8U);
+		std::vector<uint8_t>& buf = codecContext().out;
+		size_t len = codecFor(codec, isTerrain, true).encode(buf, img);
+		return Value { buf.data(), len };
+	}
+
+	cv::Mat decodeValue(const Value& val, int channels, bool isTerrain, CodecId codec) {
+		cv::Mat out;
+		if (decodeValue(out, val, channels, isTerrain, codec)) return cv::Mat{};
+		return out;
 	}
 
+	bool decodeValue(cv::Mat& out, const Value& val, int channels, bool isTerrain, CodecId codec) {
+		if (val.value == nullptr) return true;
+		assert(isTerrain ? channels == 1 : (channels == 1 or channels == 3 or channels == 4));
+		return codecFor(codec, isTerrain, false).decode(out, val, channels);
+	}
+
+
+	cv::Mat decodeValueScaled(const Value& val, int channels, bool isTerrain, int scaleDenom, CodecId codec) {
+		cv::Mat out;
+		if (decodeValueScaled(out, val, channels, isTerrain, scaleDenom, codec)) return cv::Mat{};
+		return out;
+	}
+
+	bool decodeValueScaled(cv::Mat& out, const Value& val, int channels, bool isTerrain, int scaleDenom, CodecId codec) {
+		assert(scaleDenom == 1 or scaleDenom == 2 or scaleDenom == 4 or scaleDenom == 8);
+		if (scaleDenom == 1) return decodeValue(out, val, channels, isTerrain, codec);
+		if (val.value == nullptr) return true;
+
+		const Codec& c = codecFor(codec, isTerrain, false);
+		if (c.decodeScaled) return c.decodeScaled(out, val, channels, scaleDenom);
+
+		cv::Mat& full = codecContext().full;
+		if (c.decode(full, val, channels)) return true;
+		cv::Size size { (full.cols + scaleDenom - 1) / scaleDenom, (full.rows + scaleDenom - 1) / scaleDenom };
+		// Averaging terrain would mix in its nodata zeros.
+		cv::resize(full, out, size, 0, 0, isTerrain ? cv::INTER_NEAREST : cv::INTER_AREA);
+		return false;
+	}
+
+	bool decodeValueInto(cv::Mat& dst, const Value& val, int channels, bool isTerrain, int scaleDenom, CodecId codec) {
+		if (val.value == nullptr) return true;
+
+		const Codec& c = codecFor(codec, isTerrain, false);
+		if (c.decodeInto and (scaleDenom == 1 or c.decodeScaled)) return c.decodeInto(dst, val, channels, scaleDenom);
+
+		// Through a temporary.
+		cv::Mat& tmp = codecContext().tmp;
+		if (decodeValueScaled(tmp, val, channels, isTerrain, scaleDenom, codec)) return true;
+		if (tmp.rows != dst.rows or tmp.cols != dst.cols or tmp.type() != dst.type()) return true;
+		tmp.copyTo(dst);
+		return false;
+	}
 
 }
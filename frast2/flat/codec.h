@@ -2,12 +2,83 @@
 
 #include "frast2/flat/flat_env.h"
 
+#include <string>
+#include <vector>
+
 namespace cv { class Mat; };
 
 
 namespace frast {
-	Value encodeValue(const cv::Mat& img, bool isTerrain, uint8_t option=0);
 
-	cv::Mat decodeValue(const Value& val, int outChannels, bool isTerrain, uint8_t option=0);
-	bool decodeValue(cv::Mat& out, const Value& val, int outChannels, bool isTerrain, uint8_t option=0);
+	// Which codec a file's values are in (stored in its FileMeta, see FlatEnvironment::codec()).
+	using CodecId = FlatEnvironment::FileMeta::CodecOverride;
+
+	//
+	// The codecs, keyed by CodecId and raster kind. eDefault means JPEG (OpenCV) for color and deflate for terrain,
+	// which is what every file from before the registry has.
+	//
+	// Color codecs take and give CV_8UC1, CV_8UC3 or CV_8UC4 (without alpha: it decodes as 255). Terrain codecs take
+	// and give CV_16UC1. Some codecs can not be built into every binary (WebP needs FRAST_HAVE_WEBP, terrainPredict
+	// FRAST_HAVE_ZSTD, direct libjpeg-turbo encoding FRAST_HAVE_LIBJPEG): their entries are still listed, with null
+	// functions.
+	//
+	// Each thread keeps its own codec state (zlib streams, libjpeg handles, zstd contexts and scratch buffers) from
+	// tile to tile, so that once warm, encoding and decoding a tile allocate nothing but the returned value or a
+	// grown output Mat. Encoders and decoders may be called from any number of threads at once.
+	//
+	struct Codec {
+		const char* name;
+		CodecId id;
+		bool terrain;
+		bool lossless;
+
+		// Encode into @buf, resized as needed (its capacity is kept from call to call), and return the value's length.
+		// Throws if @img can not be encoded.
+		size_t (*encode)(std::vector<uint8_t>& buf, const cv::Mat& img);
+		// Decode into @out, reallocated as needed. Returns true if @val is corrupt.
+		bool (*decode)(cv::Mat& out, const Value& val, int channels);
+		// Optional: decode at 1/@scaleDenom of the size without making the full tile first (see decodeValueScaled).
+		bool (*decodeScaled)(cv::Mat& out, const Value& val, int channels, int scaleDenom);
+		// Optional: decode in place into @dst, which must have the decoded size and type (see decodeValueInto).
+		bool (*decodeInto)(cv::Mat& dst, const Value& val, int channels, int scaleDenom);
+
+		inline bool canEncode() const { return encode != nullptr; }
+		inline bool canDecode() const { return decode != nullptr; }
+	};
+
+	// Every codec, including the ones this build can not use.
+	const std::vector<Codec>& allCodecs();
+
+	// Throws if @id is unknown, or is not for this raster kind.
+	const Codec& getCodec(CodecId id, bool isTerrain);
+
+	// A codec by name (see allCodecs(), or "default"), for this raster kind. Throws if there is none.
+	CodecId parseCodec(const std::string& name, bool isTerrain);
+
+	// Returns a malloc()ed value: free() it.
+	Value encodeValue(const cv::Mat& img, bool isTerrain, CodecId codec=CodecId::eDefault);
+
+	// Same, but the value is in a buffer of this thread's, valid until its next encode: no allocation at all once the
+	// buffer fits the largest value. For callers that copy the value right away (e.g. to a TileSpill). Do not free() it.
+	Value encodeValueScratch(const cv::Mat& img, bool isTerrain, CodecId codec=CodecId::eDefault);
+
+	cv::Mat decodeValue(const Value& val, int outChannels, bool isTerrain, CodecId codec=CodecId::eDefault);
+	bool decodeValue(cv::Mat& out, const Value& val, int outChannels, bool isTerrain, CodecId codec=CodecId::eDefault);
+
+	// Decode at 1/@scaleDenom of the tile's size (1, 2, 4 or 8; odd sizes round up), for outputs coarser than the
+	// tile's level. When built with libjpeg-turbo (FRAST_HAVE_LIBJPEG), color tiles use its scaled IDCT, which never
+	// computes the full resolution pixels: a 1/8 decode only reads each 8x8 block's DC coefficient. Otherwise, and
+	// for terrain, the tile is decoded whole and downsampled (area average for color, nearest for terrain).
+	cv::Mat decodeValueScaled(const Value& val, int outChannels, bool isTerrain, int scaleDenom,
+			CodecId codec=CodecId::eDefault);
+	bool decodeValueScaled(cv::Mat& out, const Value& val, int outChannels, bool isTerrain, int scaleDenom,
+			CodecId codec=CodecId::eDefault);
+
+	// Decode into @dst, a caller's region that already has the decoded size and type: a tile of a mosaic, a texture
+	// staging buffer wrapped in a cv::Mat header, or a numpy array. It is written in place and never reallocated, and
+	// may be strided. With libjpeg-turbo, JPEG rows are written straight from the decoder (including the alpha of
+	// 4-channel outputs). Otherwise the tile goes through a temporary.
+	// Returns true if @val is empty, corrupt (@dst may be partly written then), or not of @dst's size and type.
+	bool decodeValueInto(cv::Mat& dst, const Value& val, int outChannels, bool isTerrain, int scaleDenom = 1,
+			CodecId codec=CodecId::eDefault);
 }
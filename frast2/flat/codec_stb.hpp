@@ -173,10 +173,11 @@ static int MODIFIED_stbi_write_jpg_core(stbi__write_context *s, int width, int h
       int DCY=0, DCU=0, DCV=0;
       int bitBuf=0, bitCnt=0;
       // comp == 2 is grey+alpha (alpha is ignored)
-      int ofsG = comp > 2 ? 1 : 0, ofsB = comp > 2 ? 2 : 0;
-      const unsigned char *dataR = (const unsigned char *)data;
-      const unsigned char *dataG = dataR + ofsG;
-      const unsigned char *dataB = dataR + ofsB;
+      // MODIFIED: 3 and 4 channels are cv::Mat's BGR(A), not RGB(A).
+      int ofsR = comp > 2 ? 2 : 0, ofsG = comp > 2 ? 1 : 0;
+      const unsigned char *dataB = (const unsigned char *)data;
+      const unsigned char *dataG = dataB + ofsG;
+      const unsigned char *dataR = dataB + ofsR;
       int x, y, pos;
       if(subsample) {
          for(y = 0; y < height; y += 16) {
@@ -274,7 +275,7 @@ void my_write_func(void* ctx, void* data, int size) {
 static int MODIFIED_stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
-   int Lf,p,i,q, h_max=1,v_max=1,c;
+   int i, h_max=1,v_max=1,c;
 
 
    /*
@@ -293,8 +294,7 @@ static int MODIFIED_stbi__process_frame_header(stbi__jpeg *z, int scan)
    }
    */
 
-   Lf = 0x11;
-   p = 0x8;
+   // The implied SOF: length 0x11, 8-bit precision.
    s->img_y = 256;
    s->img_x = 256;
    c = 3;
@@ -305,7 +305,7 @@ static int MODIFIED_stbi__process_frame_header(stbi__jpeg *z, int scan)
    }
 
    if (scan != STBI__SCAN_load) return 1;
-   if (!stbi__mad3sizes_valid(s->img_x, s->img_y, s->img_n, 0)) assert(false);
+   if (!stbi__mad3sizes_valid(s->img_x, s->img_y, s->img_n, 0)) return 0;
 
    /*
    z->rgb = 0;
@@ -330,9 +330,9 @@ static int MODIFIED_stbi__process_frame_header(stbi__jpeg *z, int scan)
    for (i=0; i < s->img_n; ++i) {
 		z->img_comp[i].id = id[i];
 		uint8_t q = qq[i];
-		z->img_comp[i].h = (q >> 4);  if (!z->img_comp[i].h || z->img_comp[i].h > 4) assert(false);
-		z->img_comp[i].v = q & 15;    if (!z->img_comp[i].v || z->img_comp[i].v > 4) assert(false);
-		z->img_comp[i].tq = tq[i];  if (z->img_comp[i].tq > 3) assert(false);
+		z->img_comp[i].h = (q >> 4);  if (!z->img_comp[i].h || z->img_comp[i].h > 4) return 0;
+		z->img_comp[i].v = q & 15;    if (!z->img_comp[i].v || z->img_comp[i].v > 4) return 0;
+		z->img_comp[i].tq = tq[i];  if (z->img_comp[i].tq > 3) return 0;
 	  // fmt::print(" rgb {} img_comp {} {} {}\n", z->rgb, z->img_comp[i].id, q, z->img_comp[i].tq);
    }
 
@@ -394,7 +394,8 @@ static int MODIFIED_stbi__process_frame_header(stbi__jpeg *z, int scan)
 
 static int MODIFIED_stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 {
-   int m;
+   // There is no SOF marker: the frame is always baseline.
+   int m = 0xC0;
    z->jfif = 0;
    z->app14_color_transform = -1; // valid values are 0,1,2
    z->marker = STBI__MARKER_none; // initialize cached marker to empty
@@ -419,15 +420,13 @@ static int MODIFIED_stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 
    // fmt::print(" - [Warning] decoding with hard-coded quantization/huffman tables.\n");
 
-   int row, col, i, k, subsample;
+   int i;
    // int quality = DEFAULT_QUALITY;
    // quality = quality ? quality : DEFAULT_QUALITY;
    int quality = DEFAULT_QUALITY;
-   subsample = quality <= 90 ? 1 : 0;
    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
 
-   float fdtbl_Y[64], fdtbl_UV[64];
    unsigned char YTable[64], UVTable[64];
    for(i = 0; i < 64; ++i) {
       int uvti, yti = (YQT[i]*quality+50)/100;
@@ -452,8 +451,8 @@ static int MODIFIED_stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
             int p = q >> 4, sixteen = (p != 0);
             int t = q & 15,i;
 			// fmt::print(" j {} t {}\n",j,t);
-            if (p != 0 && p != 1) assert(false);;
-            if (t > 3) assert(false);
+            if (p != 0 && p != 1) return 0;
+            if (t > 3) return 0;
 
             for (i=0; i < 64; ++i) {
                // z->dequant[t][stbi__jpeg_dezigzag[i]] = (stbi__uint16)(sixteen ? stbi__get16be(z->s) : stbi__get8(z->s));
@@ -467,17 +466,17 @@ static int MODIFIED_stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 	uint8_t htable[512];
 	jj = 0;
 	htable[jj++] = 0;
-	for (int ii=1; ii<sizeof(std_dc_luminance_nrcodes); ii++) htable[jj++] = std_dc_luminance_nrcodes[ii];
-	for (int ii=0; ii<sizeof(std_dc_luminance_values); ii++) htable[jj++] = std_dc_luminance_values[ii];
+	for (size_t ii=1; ii<sizeof(std_dc_luminance_nrcodes); ii++) htable[jj++] = std_dc_luminance_nrcodes[ii];
+	for (size_t ii=0; ii<sizeof(std_dc_luminance_values); ii++) htable[jj++] = std_dc_luminance_values[ii];
 	htable[jj++] = 0x10;
-	for (int ii=1; ii<sizeof(std_ac_luminance_nrcodes); ii++) htable[jj++] = std_ac_luminance_nrcodes[ii];
-	for (int ii=0; ii<sizeof(std_ac_luminance_values); ii++) htable[jj++] = std_ac_luminance_values[ii];
+	for (size_t ii=1; ii<sizeof(std_ac_luminance_nrcodes); ii++) htable[jj++] = std_ac_luminance_nrcodes[ii];
+	for (size_t ii=0; ii<sizeof(std_ac_luminance_values); ii++) htable[jj++] = std_ac_luminance_values[ii];
 	htable[jj++] = 0x1;
-	for (int ii=1; ii<sizeof(std_dc_chrominance_nrcodes); ii++) htable[jj++] = std_dc_chrominance_nrcodes[ii];
-	for (int ii=0; ii<sizeof(std_dc_chrominance_values); ii++) htable[jj++] = std_dc_chrominance_values[ii];
+	for (size_t ii=1; ii<sizeof(std_dc_chrominance_nrcodes); ii++) htable[jj++] = std_dc_chrominance_nrcodes[ii];
+	for (size_t ii=0; ii<sizeof(std_dc_chrominance_values); ii++) htable[jj++] = std_dc_chrominance_values[ii];
 	htable[jj++] = 0x11;
-	for (int ii=1; ii<sizeof(std_ac_chrominance_nrcodes); ii++) htable[jj++] = std_ac_chrominance_nrcodes[ii];
-	for (int ii=0; ii<sizeof(std_ac_chrominance_values); ii++) htable[jj++] = std_ac_chrominance_values[ii];
+	for (size_t ii=1; ii<sizeof(std_ac_chrominance_nrcodes); ii++) htable[jj++] = std_ac_chrominance_nrcodes[ii];
+	for (size_t ii=0; ii<sizeof(std_ac_chrominance_values); ii++) htable[jj++] = std_ac_chrominance_values[ii];
 	L = 0x01a2-2;
 	// L = 0xa201;
 	jj = 0;
@@ -490,7 +489,7 @@ static int MODIFIED_stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
             int th = q & 15;
 			// fmt::print( " - dht {} : {} {}, L={}\n", q, tc, th, L);
             // if (tc > 1 || th > 3) return stbi__err("bad DHT header","Corrupt JPEG");
-            if (tc > 1 || th > 3) assert(false);
+            if (tc > 1 || th > 3) return 0;
             for (i=0; i < 16; ++i) {
                // sizes[i] = stbi__get8(z->s);
                sizes[i] = htable[jj++];
@@ -498,10 +497,10 @@ static int MODIFIED_stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
             }
             L -= 17;
             if (tc == 0) {
-               if (!stbi__build_huffman(z->huff_dc+th, sizes)) assert(false);
+               if (!stbi__build_huffman(z->huff_dc+th, sizes)) return 0;
                v = z->huff_dc[th].values;
             } else {
-               if (!stbi__build_huffman(z->huff_ac+th, sizes)) assert(false);
+               if (!stbi__build_huffman(z->huff_ac+th, sizes)) return 0;
                v = z->huff_ac[th].values;
             }
             for (i=0; i < n; ++i)
@@ -516,7 +515,7 @@ static int MODIFIED_stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 
    z->progressive = stbi__SOF_progressive(m);
    // if (!MODIFIED_stbi__process_frame_header(z, scan)) return 0;
-   if (!MODIFIED_stbi__process_frame_header(z, scan)) assert(false);
+   if (!MODIFIED_stbi__process_frame_header(z, scan)) return 0;
    return 1;
 }
 
@@ -530,15 +529,15 @@ static int MODIFIED_stbi__decode_jpeg_image(stbi__jpeg *j)
    }
    j->restart_interval = 0;
    // if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
-   if (!MODIFIED_stbi__decode_jpeg_header(j, STBI__SCAN_load)) assert(false);
+   if (!MODIFIED_stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
    // if (!MODIFIED_stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
    m = stbi__get_marker(j);
 	// fmt::print(" - marker: 0x{:0x}\n", m);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
 	// fmt::print(" - sos: 0x{:0x}\n", m);
-         if (!stbi__process_scan_header(j)) assert(false);
-         if (!stbi__parse_entropy_coded_data(j)) assert(false);
+         if (!stbi__process_scan_header(j)) return 0;
+         if (!stbi__parse_entropy_coded_data(j)) return 0;
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -788,16 +787,17 @@ static unsigned char *my_load_and_postprocess_8bit(stbi__context *s, int *x, int
 
 
 
-void my_write_jpg_stb(std::vector<uint8_t> &buf, const cv::Mat& in) {
+// @in must be continuous. Returns true on failure.
+bool my_write_jpg_stb(std::vector<uint8_t> &buf, const cv::Mat& in) {
 	buf.reserve(1024);
 
 	stbi__write_context s = { 0 };
 	stbi__start_write_callbacks(&s, &my_write_func, &buf);
 
 	buf.push_back(in.channels());
-	int stat = MODIFIED_stbi_write_jpg_core(&s, in.rows, in.cols, in.channels(), in.data);
+	int stat = MODIFIED_stbi_write_jpg_core(&s, in.cols, in.rows, in.channels(), in.data);
 	// int stat = stbi_write_jpg_core(&s, in.rows, in.cols, in.channels(), in.data, 0);
-	assert(stat == 1);
+	return stat != 1;
 }
 
 static stbi_uc *my_load_from_memory(stbi_uc *buffer, int len, int *x, int *y, int *comp, int req_comp)
@@ -2,10 +2,15 @@
 #include <opencv2/core.hpp>
 #include <fmt/core.h>
 
+#include <zlib.h>
+
 #define FRAST_COMPRESS_TERRAIN
 
 namespace frast {
 
+// Both take the thread's z_stream (see CodecContext in codec.cc) and reset it, rather than initializing one per tile.
+// The encoders write to @buf, which keeps its capacity from tile to tile, and return the value's length.
+
 #ifndef FRAST_COMPRESS_TERRAIN
 
 
@@ -13,31 +18,17 @@ namespace frast {
 // Identity codec: store raw data with no compression.
 //
 
-Value encode_terrain_2x8(const cv::Mat& img) {
+size_t encode_terrain_2x8(std::vector<uint8_t>& buf, const cv::Mat& img, z_stream&) {
 	assert(img.type() == CV_16UC1);
 
-	
-	Value v;
-	v.value = malloc(img.elemSize() * img.total());
-	v.len = img.elemSize() * img.total();
-
-	memcpy(v.value, img.data, v.len);
+	size_t len = img.elemSize() * img.total();
+	if (buf.size() < len) buf.resize(len);
+	memcpy(buf.data(), img.data, len);
 
-	return v;
+	return len;
 }
 
-cv::Mat decode_terrain_2x8(const Value& eimg) {
-	cv::Mat out(256,256, CV_16UC1);
-
-	fmt::print(" - decode raw\n");
-
-	assert(eimg.len == 256*256*2);
-	memcpy(out.data, eimg.value, eimg.len);
-
-	return out;
-}
-
-bool decode_terrain_2x8(cv::Mat& out, const Value& eimg) {
+bool decode_terrain_2x8(cv::Mat& out, const Value& eimg, z_stream&) {
 	// cv::Mat out(256,256, CV_16UC1);
 	out.create(256,256,CV_16UC1);
 
@@ -53,24 +44,13 @@ bool decode_terrain_2x8(cv::Mat& out, const Value& eimg) {
 // Deflate codec: store data using deflate algorithm
 //
 
-#include <zlib.h>
-
 namespace {
-bool inflate_img(cv::Mat& out, uint8_t* data, int len) {
-	z_stream strm;
-	strm.zalloc	  = Z_NULL;
-	strm.zfree	  = Z_NULL;
-	strm.opaque	  = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in  = Z_NULL;
-	int ret		  = inflateInit(&strm);
-	if (ret != Z_OK) {
-		inflateEnd(&strm);
-		return true;
-	}
+// Inflate @len bytes from @data into @out, which must be continuous.
+// Returns true if the data is corrupt, or does not fill @out exactly.
+bool inflate_img(z_stream& strm, cv::Mat& out, uint8_t* data, int len) {
+	int ret = inflateReset(&strm);
+	if (ret != Z_OK) return true;
 
-	// strm.avail_in = in.size();
-	// strm.next_in = (in.data());
 	strm.avail_in = len;
 	strm.next_in  = data;
 
@@ -84,120 +64,60 @@ bool inflate_img(cv::Mat& out, uint8_t* data, int len) {
 
 	do {
 		ret = inflate(&strm, Z_NO_FLUSH);
-		// ret = inflate(&strm, Z_FINISH);
 
 		// printf(" - inflate ret: %d, avail_out %d, ptr %p\n", ret, strm.avail_out, ptr);
 		assert(ret != Z_STREAM_ERROR); /* state not clobbered */
 		switch (ret) {
 			case Z_NEED_DICT:
-				ret = Z_DATA_ERROR; /* and fall through */
 			case Z_DATA_ERROR:
 			case Z_MEM_ERROR:
 			case Z_BUF_ERROR:
-				// TODO XXX hitting here
-				printf(" - zlib error %d, %s avail_out %d avail_in %d\n", ret, strm.msg, strm.avail_out, strm.avail_in);
-				(void)inflateEnd(&strm);
-				assert(false);
-				// return true;
+				// The stream is reset by the next call.
+				return true;
 		}
 
 	} while (ret != Z_STREAM_END);
 
-	// out.resize(out.size() - strm.avail_out);
-
 	// printf(" - -> inflate -- done: %zu %p, %zu %p\n", strm.avail_in, strm.next_in, strm.avail_out, strm.next_out);
 
-	inflateEnd(&strm);
-	return false;
+	return strm.avail_out != 0;
 }
 
-Value deflate_img(const cv::Mat& img) {
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree	= Z_NULL;
-	strm.opaque = Z_NULL;
-
-	// For some reason directly using @out was broken, because resize() cleared the buffer to zero, when
-	// I thought it was supposed to copy.
-	// This was a quickfix: TODO: avoid the copy.
-	std::vector<uint8_t> out0;
-	out0.reserve(img.elemSize() * img.total());
-	strm.avail_in  = 0;
-	strm.next_in   = 0;
-	strm.avail_out = 0;
-	strm.next_out  = 0;
-	int ret		   = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
+size_t deflate_img(z_stream& strm, std::vector<uint8_t>& buf, const cv::Mat& img) {
+	int ret = deflateReset(&strm);
+	if (ret != Z_OK) throw std::runtime_error("encodeValue: deflateReset failed");
+
+	// Enough for a single deflate(Z_FINISH) call, whatever the data.
+	size_t bound = deflateBound(&strm, img.elemSize() * img.total());
+	if (buf.size() < bound) buf.resize(bound);
+
 	strm.avail_in  = img.elemSize() * img.total();
 	strm.next_in   = img.data;
-	strm.avail_out = out0.capacity();
-	strm.next_out  = out0.data();
+	strm.avail_out = buf.size();
+	strm.next_out  = buf.data();
 
 	// printf(" - deflate: %zu %p, %zu %p\n", strm.avail_in, strm.next_in, strm.avail_out, strm.next_out);
 
-	// int ret       = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_RLE, 15, 8);
-	if (ret != Z_OK) {
-		deflateEnd(&strm);
-		return Value{};
+	ret = deflate(&strm, Z_FINISH);
+	if (ret != Z_STREAM_END) {
+		printf(" - deflate err %d, %s\n", ret, strm.msg);
+		throw std::runtime_error("encodeValue: deflate failed");
 	}
 
-	do {
-		ret = deflate(&strm, Z_FINISH);
-		// printf(" - deflate ret: %d, avail_in %d\n", ret, strm.avail_in);
-
-		if (ret == Z_DATA_ERROR or ret == Z_MEM_ERROR or ret == Z_BUF_ERROR) {
-			printf(" - deflate err %d, %s\n", ret, strm.msg);
-			throw std::runtime_error("bad");
-			deflateEnd(&strm);
-			return Value{};
-		}
-
-		// NOTE: Below shouldn't be needed, as output shouldn't be larger than input ever.
-		// I think:
-		// When avail_out is zero, that means zlib needs more space.
-		// So increase+copy (using reserve()), then reset pointer.
-		/*
-		if (strm.avail_out == 0) {
-			size_t off = strm.next_out - out.data();
-			out.reserve(out.capacity() * 2);
-			strm.avail_out = out.capacity() - off;
-			strm.next_out = out.data() + off;
-			// Should be rare.
-			printf(" - avail_out 0, increasing to %zu, off %zu\n", out.capacity(), off);
-		}
-		*/
-	} while (ret != Z_STREAM_END);
-
-	Value v;
-	v.value = malloc(strm.total_out);
-	v.len = strm.total_out;
-	memcpy(v.value, out0.data(), v.len);
-
 	// fmt::print(" - deflated {} -> {} ({:.1f}%)\n", img.elemSize() * img.total(), strm.total_out, strm.total_out * 100.f / static_cast<float>(img.elemSize() * img.total()));
 
-
-	if (ret != Z_STREAM_END) return Value{};
-	ret = deflateEnd(&strm);
-
-	// printf(" - deflate header: %hhu %hhu %hhu %hhu\n", out0[0], out0[1], out0[2], out0[3]);
-	return v;
+	return strm.total_out;
 }
 
 }  // namespace
 
-Value encode_terrain_2x8(const cv::Mat& img) {
-	return deflate_img(img);
+size_t encode_terrain_2x8(std::vector<uint8_t>& buf, const cv::Mat& img, z_stream& strm) {
+	return deflate_img(strm, buf, img);
 }
 
-cv::Mat decode_terrain_2x8(const Value& eimg) {
-	cv::Mat out(256,256,CV_16UC1);
-	bool stat = inflate_img(out, (uint8_t*)eimg.value, eimg.len);
-	return out;
-}
-
-bool decode_terrain_2x8(cv::Mat& out, const Value& eimg) {
+bool decode_terrain_2x8(cv::Mat& out, const Value& eimg, z_stream& strm) {
 	out.create(256,256,CV_16UC1);
-	bool stat = inflate_img(out, (uint8_t*)eimg.value, eimg.len);
-	return false;
+	return inflate_img(strm, out, (uint8_t*)eimg.value, eimg.len);
 }
 
 #endif
@@ -0,0 +1,251 @@
+#include "compact.h"
+#include "flat_env.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+namespace frast {
+
+	namespace {
+		constexpr uint64_t kBlock = 4096;
+		constexpr uint64_t kChunk = 16lu << 20;
+
+		inline uint64_t roundUp(uint64_t x) {
+			return (x + kBlock - 1) / kBlock * kBlock;
+		}
+
+		inline std::runtime_error sysError(const char* what) {
+			return std::runtime_error(fmt::format("compactFile: {} failed: {}", what, strerror(errno)));
+		}
+
+		struct FreeDeleter {
+			void operator()(void* p) const { free(p); }
+		};
+
+		// A region of the input copied to (block aligned) @dst in the output.
+		// The output region is @len rounded up to a block, with the tail zero filled.
+		struct Segment {
+			uint64_t src, dst, len;
+		};
+
+		class Copier {
+			public:
+				Copier(int in, int out) : in(in), out(out) {
+					void* p = nullptr;
+					if (posix_memalign(&p, kBlock, kChunk) != 0) throw std::runtime_error("compactFile: posix_memalign failed");
+					buf.reset(static_cast<uint8_t*>(p));
+				}
+
+				void copy(const Segment& seg) {
+					for (uint64_t done = 0; done < seg.len; done += kChunk) {
+						uint64_t n = std::min(kChunk, seg.len - done);
+						readFully(buf.get(), n, seg.src + done);
+						uint64_t nn = roundUp(n);
+						if (nn != n) memset(buf.get() + n, 0, nn - n);
+						writeFully(buf.get(), nn, seg.dst + done);
+					}
+				}
+
+				void writeFully(const uint8_t* src, uint64_t len, uint64_t off) {
+					uint64_t done = 0;
+					while (done < len) {
+						ssize_t r = pwrite(out, src + done, len - done, off + done);
+						if (r < 0 and errno == EINTR) continue;
+						if (r < 0 and errno == EINVAL and not directFallback) {
+							// The filesystem accepted O_DIRECT on open, but not for this write (e.g. a larger logical block size).
+							fmt::print(" - [compactFile] O_DIRECT write refused, continuing with buffered writes\n");
+							fcntl(out, F_SETFL, fcntl(out, F_GETFL) & ~O_DIRECT);
+							directFallback = true;
+							continue;
+						}
+						if (r < 0) throw sysError("pwrite");
+						done += r;
+					}
+				}
+
+			private:
+				int in, out;
+				bool directFallback = false;
+				std::unique_ptr<uint8_t, FreeDeleter> buf;
+
+				void readFully(uint8_t* dst, uint64_t len, uint64_t off) {
+					uint64_t done = 0;
+					while (done < len) {
+						ssize_t r = pread(in, dst + done, len - done, off + done);
+						if (r < 0 and errno == EINTR) continue;
+						if (r < 0) throw sysError("pread");
+						if (r == 0) throw std::runtime_error("compactFile: input file is shorter than its FileMeta says");
+						done += r;
+					}
+				}
+		};
+
+		// So that the rename() itself is durable.
+		void syncParentDir(const std::string& path) {
+			std::vector<char> tmp(path.begin(), path.end());
+			tmp.push_back(0);
+			int fd = open(dirname(tmp.data()), O_RDONLY | O_DIRECTORY);
+			if (fd < 0) return;
+			fsync(fd);
+			close(fd);
+		}
+	}
+
+	int64_t countFileExtents(int fd) {
+		struct fiemap fm;
+		memset(&fm, 0, sizeof(fm));
+		fm.fm_start = 0;
+		fm.fm_length = FIEMAP_MAX_OFFSET;
+		fm.fm_flags = FIEMAP_FLAG_SYNC;
+		// With no room for extents, the kernel only counts them.
+		fm.fm_extent_count = 0;
+		if (ioctl(fd, FS_IOC_FIEMAP, &fm) < 0) return -1;
+		return fm.fm_mapped_extents;
+	}
+
+	CompactStats compactFile(const std::string& inPath, const std::string& outPath) {
+		using FileMeta = FlatEnvironment::FileMeta;
+		static_assert(sizeof(FileMeta) <= FlatEnvironment::fileMetaCapacity);
+
+		CompactStats stats;
+
+		// The whole first block, so that anything after FileMeta is kept too.
+		void* metaBuf_ = nullptr;
+		if (posix_memalign(&metaBuf_, kBlock, kBlock) != 0) throw std::runtime_error("compactFile: posix_memalign failed");
+		std::unique_ptr<uint8_t, FreeDeleter> metaBuf(static_cast<uint8_t*>(metaBuf_));
+
+		int in = open(inPath.c_str(), O_RDONLY);
+		if (in < 0) throw sysError("open input");
+		posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		struct stat st;
+		if (fstat(in, &st) != 0) {
+			close(in);
+			throw sysError("fstat");
+		}
+		stats.bytesIn = st.st_size;
+		stats.extentsIn = countFileExtents(in);
+
+		if (pread(in, metaBuf.get(), kBlock, 0) != static_cast<ssize_t>(kBlock)) {
+			close(in);
+			throw std::runtime_error("compactFile: could not read FileMeta of '" + inPath + "'");
+		}
+		FileMeta* meta = reinterpret_cast<FileMeta*>(metaBuf.get());
+
+		// Lay the levels out back-to-back, in the order they were in the input.
+		std::vector<int> levels;
+		for (int lvl=0; lvl<26; lvl++) {
+			if (meta->levelSpecs[lvl].keysLength > 0) levels.push_back(lvl);
+			else meta->levelSpecs[lvl] = FlatEnvironment::LevelSpec{};
+			if (meta->levelSpecs[lvl].keysLength == 0) meta->occupancy[lvl] = FileMeta::SegmentSpec{};
+		}
+		std::sort(levels.begin(), levels.end(), [meta](int a, int b) {
+			return meta->levelSpecs[a].keysOffset < meta->levelSpecs[b].keysOffset;
+		});
+
+		std::vector<Segment> segments;
+		uint64_t end = kBlock;
+
+		if (meta->metaLength > 0) {
+			segments.push_back(Segment { meta->metaOffset, end, meta->metaLength });
+			meta->metaOffset = end;
+			end += roundUp(meta->metaLength);
+		}
+
+		auto place = [&segments, &end](FlatEnvironment::LevelSpec& spec) {
+			uint64_t keysCap = roundUp(spec.keysLength);
+			uint64_t valsCap = roundUp(spec.valsLength);
+
+			segments.push_back(Segment { spec.keysOffset, end, spec.keysLength });
+			segments.push_back(Segment { spec.k2vsOffset, end + keysCap, spec.keysLength });
+			segments.push_back(Segment { spec.valsOffset, end + 2*keysCap, spec.valsLength });
+
+			spec.keysOffset = end;
+			spec.keysCapacity = keysCap;
+			spec.k2vsOffset = end + keysCap;
+			spec.valsOffset = end + 2*keysCap;
+			spec.valsCapacity = valsCap;
+			end += 2*keysCap + valsCap;
+		};
+
+		for (int lvl : levels) {
+			place(meta->levelSpecs[lvl]);
+			// The occupancy segment is position independent, so it just moves along with its level.
+			auto& occ = meta->occupancy[lvl];
+			if (occ.length > 0) {
+				segments.push_back(Segment { occ.offset, end, occ.length });
+				occ.offset = end;
+				end += roundUp(occ.length);
+			}
+		}
+		// Delta runs are kept as they are (only moved), after all the levels. See FlatEnvironment::mergeLevel to fold them in.
+		for (int d=0; d<meta->nDeltas; d++) place(meta->deltas[d].spec);
+
+		for (auto& seg : segments)
+			if (seg.src + seg.len > stats.bytesIn) {
+				close(in);
+				throw std::runtime_error("compactFile: '" + inPath + "' has a level past the end of the file");
+			}
+
+		std::string tmpPath = outPath + ".tmp";
+		auto mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+		int out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, mode);
+		if (out < 0 and errno == EINVAL) {
+			fmt::print(" - [compactFile] filesystem does not support O_DIRECT, using buffered writes\n");
+			out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+		}
+		if (out < 0) {
+			close(in);
+			throw sysError("open output");
+		}
+
+		try {
+			// One allocation for the whole file, so the filesystem can give us as few extents as it is able to.
+			int r = posix_fallocate(out, 0, end);
+			if (r != 0) {
+				errno = r;
+				throw sysError("posix_fallocate");
+			}
+
+			Copier copier(in, out);
+			for (auto& seg : segments) copier.copy(seg);
+
+			// Data first, then the FileMeta that points at it.
+			if (fdatasync(out) != 0) throw sysError("fdatasync");
+			copier.writeFully(metaBuf.get(), kBlock, 0);
+			if (fsync(out) != 0) throw sysError("fsync");
+
+			stats.bytesOut = end;
+			stats.extentsOut = countFileExtents(out);
+		} catch (...) {
+			close(in);
+			close(out);
+			unlink(tmpPath.c_str());
+			throw;
+		}
+
+		close(in);
+		close(out);
+
+		if (rename(tmpPath.c_str(), outPath.c_str()) != 0) {
+			unlink(tmpPath.c_str());
+			throw sysError("rename");
+		}
+		syncParentDir(outPath);
+
+		return stats;
+	}
+
+}
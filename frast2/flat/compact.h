@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace frast {
+
+	//
+	// Rewrites a .ft file so that each level's keys, k2vs and values are contiguous and the whole file is one
+	// preallocated range.
+	//
+	// Files made by FlatEnvironment grow their levels with fallocate(FALLOC_FL_INSERT_RANGE), which leaves them
+	// in many extents. This is the replacement for running `e4defrag` on them.
+	//
+	// The input is streamed with large sequential reads and the output is written with O_DIRECT (if the
+	// filesystem supports it) into `outPath + ".tmp"`. The FileMeta block is written only after all the data
+	// is synced, and the temporary file is then renamed over @outPath, so @outPath is either the old file or
+	// the complete new one. @outPath may equal @inPath.
+	//
+
+	struct CompactStats {
+		uint64_t bytesIn = 0, bytesOut = 0;
+		// Number of extents according to FIEMAP (-1 if the filesystem does not support it).
+		int64_t extentsIn = -1, extentsOut = -1;
+	};
+
+	CompactStats compactFile(const std::string& inPath, const std::string& outPath);
+
+	// FIEMAP extent count of the open file @fd, or -1 if it could not be queried.
+	int64_t countFileExtents(int fd);
+
+}
@@ -1,4 +1,5 @@
 #include "writer.h"
+#include "codec.h"
 #include "frast2/detail/argparse.hpp"
 
 #include <opencv2/imgproc.hpp>
@@ -31,9 +32,12 @@ int main(int argc, char** argv) {
 
 	ArgParser parser(argc, argv);
 	auto color = parser.getChoice2("-c", "--color", "rgb", "gray", "terrain");
-	auto        inpPaths = parser.get2OrDie<std::vector<std::string>>("-i", "--input");
 	std::string outPath  = parser.get2OrDie<std::string>("-o", "--output");
 	int level = parser.get2OrDie<int>("-l", "--level");
+	// Only build the overviews of an existing output, from its level `-l` (e.g. after merging shards, see below).
+	bool addoOnly = parser.get<bool>("--addoOnly", false).value();
+	std::vector<std::string> inpPaths;
+	if (not addoOnly) inpPaths = parser.get2OrDie<std::vector<std::string>>("-i", "--input");
 
 	// Value for addo decimation interpolation (see cv::resize())
 	std::string interp   = parser.get<std::string>("--interpolation", "bilinear").value();
@@ -54,15 +58,22 @@ int main(int argc, char** argv) {
 		if (threads > FRAST_WRITER_THREADS) throw std::runtime_error(fmt::format("given threads ({}) should be >0 and <=FRAST_WRITER_THREADS ({})", threads, FRAST_WRITER_THREADS));
 	}
 
+	// Add the tiles of the input (optionally only within --tlbr) to the existing output's base level as a delta run.
+	bool append = parser.get<bool>("--append", false).value();
+
 	struct stat statbuf;
 	int res = ::stat(outPath.c_str(), &statbuf);
-	if (res == 0) {
+	if ((append or addoOnly) and res != 0) {
+		throw std::runtime_error("--append and --addoOnly need an existing output file");
+	} else if (res == 0 and not append and not addoOnly) {
 		// unlink(outPath.c_str());
 		fmt::print(" - Not running: the output file '{}' already exists\n", outPath);
 		throw std::runtime_error("output file already exists");
 	}
 
 	EnvOptions envOpts;
+	// Store identical tiles (nodata, ocean, ...) once per level.
+	envOpts.dedupValues = parser.get<bool>("--dedup", false).value();
 	ConvertConfig ccfg;
 	ccfg.addoInterp = interpValue;
 
@@ -77,9 +88,49 @@ int main(int argc, char** argv) {
 		throw std::runtime_error("unsupported 'color' option");
 	}
 
+	// How new files encode their tiles (see allCodecs()): "default" is JPEG for color and deflate for terrain, whatever
+	// the build. A codec this build lacks the library for (e.g. terrainPredict without zstd) is an error, not a fallback.
+	// --append and --addoOnly keep the existing file's codec.
+	auto codecName = parser.get<std::string>("--codec", "default").value();
+	auto codec = parseCodec(codecName, envOpts.isTerrain);
+	if (not getCodec(codec, envOpts.isTerrain).canEncode())
+		throw std::runtime_error(fmt::format("this build cannot encode with codec '{}' (built without its library)", getCodec(codec, envOpts.isTerrain).name));
+	envOpts.codec = static_cast<uint8_t>(codec);
+
 	ccfg.srcPaths = inpPaths;
+	// With many inputs, each thread opens them as needed and keeps this many open.
+	ccfg.sourceHandlesPerWorker = parser.get<int>("--sourceHandles", ccfg.sourceHandlesPerWorker).value();
+	if (ccfg.sourceHandlesPerWorker <= 0) throw std::runtime_error("--sourceHandles should be >0");
+	// Convert in groups of tiles that share a source file (and its rows), instead of row by row.
+	ccfg.localitySchedule = parser.get<bool>("--locality", false).value();
+	// How overlapping inputs are combined: first or last (in --input order) with data, or a weighted mean.
+	ccfg.blendMode = parseBlendMode(parser.getChoice("--blend", "first", "last", "average", "feather").value_or("first"));
 	ccfg.baseLevel = level;
-	ccfg.addo = true;
+	ccfg.addo = not append;
+	ccfg.delta = append;
+	if (append) fmt::print(" - appending a delta run to level {} (overviews are not updated)\n", level);
+
+	// Convert only one of --shards bands of the base level's rows, without overviews. Once every shard is done, merge
+	// them with `frastTool -a merge -i <shards...> -o <output>`, then build the overviews with --addoOnly.
+	ccfg.shardCount = parser.get<int>("--shards", 1).value();
+	ccfg.shardIndex = parser.get<int>("--shard", 0).value();
+	if (ccfg.shardCount < 1 or ccfg.shardIndex < 0 or ccfg.shardIndex >= ccfg.shardCount)
+		throw std::runtime_error("--shard should be in [0, --shards)");
+	if (ccfg.shardCount > 1) {
+		if (append) throw std::runtime_error("--shards cannot be used with --append");
+		ccfg.addo = false;
+	}
+
+	// Build the overviews during the base level conversion, instead of re-decoding the base level afterwards.
+	bool fused = parser.get<bool>("--fused", false).value();
+	if (fused and append) throw std::runtime_error("--fused cannot be used with --append");
+	if (fused and ccfg.shardCount > 1) throw std::runtime_error("--fused cannot be used with --shards (overview tiles would straddle shards)");
+	if (fused and interpValue != cv::INTER_LINEAR and interpValue != cv::INTER_AREA)
+		throw std::runtime_error("--fused only supports bilinear or area interpolation");
+	if (fused) {
+		ccfg.fusedAddo = true;
+		ccfg.addo = false;
+	}
 
 	auto optTlbr = parser.get2<std::vector<double>>("-t", "--tlbr");
 	if (optTlbr.has_value()) {
@@ -93,8 +144,13 @@ int main(int argc, char** argv) {
 	}
 
 
+	if (addoOnly) {
+		if (append or fused or ccfg.shardCount > 1) throw std::runtime_error("--addoOnly cannot be used with --append, --fused or --shards");
+		ccfg.addo = true;
+	}
+
 	// Run initial job: convert gdal -> frast2
-	{
+	if (not addoOnly) {
 
 		if (ccfg.srcPaths.size() == 1) {
 			WriterMasterGdal wm(outPath, envOpts, threads);
@@ -126,7 +182,7 @@ int main(int argc, char** argv) {
 	}
 
 
-	fmt::print(" - you may want to run 'e4defrag' on the output file.\n");
+	fmt::print(" - you may want to run 'frastTool -a compact -i <output>' to defragment the output file.\n");
 
 	return 0;
 }
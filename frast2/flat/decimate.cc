@@ -0,0 +1,489 @@
+#include "decimate.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <fmt/core.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRAST_DECIMATE_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace frast {
+
+namespace {
+
+	// -------------------------------------------------------------------------------------------
+	// Box: dst[j] = (r0[2j] + r0[2j+1] + r1[2j] + r1[2j+1] + 2) >> 2, per channel.
+	// Each function does @w output pixels, from two input rows of 2*@w pixels.
+	// -------------------------------------------------------------------------------------------
+
+	template <class T, class Acc, int C>
+	void halveRowsScalar(T* __restrict dst, const T* __restrict r0, const T* __restrict r1, int w) {
+		for (int j=0; j<w; j++)
+			for (int c=0; c<C; c++) {
+				Acc s = (Acc)r0[2*j*C+c] + r0[(2*j+1)*C+c] + r1[2*j*C+c] + r1[(2*j+1)*C+c];
+				dst[j*C+c] = (T)((s + 2) >> 2);
+			}
+	}
+
+#ifdef FRAST_DECIMATE_AVX2
+
+	// Widen and add 8 (or 16) pixels of two rows.
+	__attribute__((target("avx2"), always_inline))
+	inline __m128i vsum128(const uint8_t* a, const uint8_t* b) {
+		return _mm_add_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)a)), _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)b)));
+	}
+	__attribute__((target("avx2"), always_inline))
+	inline __m256i vsum256(const uint8_t* a, const uint8_t* b) {
+		return _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)a)), _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)b)));
+	}
+
+	// The two rows are summed vertically into 16 bit lanes, then each lane is added to the lane C over (the next pixel),
+	// and the even pixels' sums are compacted, all in registers.
+	template <int C>
+	__attribute__((target("avx2")))
+	void halveRowsAvx2_u8(uint8_t* dst, const uint8_t* r0, const uint8_t* r1, int w) {
+		int j = 0;
+		if constexpr (C == 1) {
+			// Sixteen output pixels per iteration.
+			const __m256i two = _mm256_set1_epi16(2);
+			for (; j+16<=w; j+=16) {
+				__m256i x = _mm256_hadd_epi16(vsum256(r0 + 2*j, r1 + 2*j), vsum256(r0 + 2*j + 16, r1 + 2*j + 16));
+				x = _mm256_permute4x64_epi64(x, 0xD8);
+				x = _mm256_srli_epi16(_mm256_add_epi16(x, two), 2);
+				x = _mm256_permute4x64_epi64(_mm256_packus_epi16(x, x), 0xD8);
+				_mm_storeu_si128((__m128i*)(dst + j), _mm256_castsi256_si128(x));
+			}
+		} else if constexpr (C == 4) {
+			// Four output pixels per iteration. Each 128 bit lane holds two pixels, so adding its high half to its low
+			// half leaves one output pixel in the low 64 bits.
+			const __m256i two = _mm256_set1_epi16(2);
+			for (; j+4<=w; j+=4) {
+				__m256i x0 = vsum256(r0 + 8*j, r1 + 8*j);
+				__m256i x1 = vsum256(r0 + 8*j + 16, r1 + 8*j + 16);
+				x0 = _mm256_add_epi16(x0, _mm256_srli_si256(x0, 8));
+				x1 = _mm256_add_epi16(x1, _mm256_srli_si256(x1, 8));
+				x0 = _mm256_permute4x64_epi64(_mm256_srli_epi16(_mm256_add_epi16(x0, two), 2), 0x08);
+				x1 = _mm256_permute4x64_epi64(_mm256_srli_epi16(_mm256_add_epi16(x1, two), 2), 0x08);
+				_mm_storeu_si128((__m128i*)(dst + 4*j), _mm_packus_epi16(_mm256_castsi256_si128(x0), _mm256_castsi256_si128(x1)));
+			}
+		} else if constexpr (C == 3) {
+			// Four output pixels per iteration, from 24 lanes: the sums are in lanes 0-2, 6-8, 12-14 and 18-20.
+			const __m128i k0a = _mm_setr_epi8(0,1, 2,3, 4,5, 12,13, 14,15, -1,-1, -1,-1, -1,-1);
+			const __m128i k0b = _mm_setr_epi8(-1,-1, -1,-1, -1,-1, -1,-1, -1,-1, 0,1, 8,9, 10,11);
+			const __m128i k1b = _mm_setr_epi8(12,13, -1,-1, -1,-1, -1,-1, -1,-1, -1,-1, -1,-1, -1,-1);
+			const __m128i k1c = _mm_setr_epi8(-1,-1, 4,5, 6,7, 8,9, -1,-1, -1,-1, -1,-1, -1,-1);
+			const __m128i two = _mm_set1_epi16(2);
+			for (; j+4<=w; j+=4) {
+				const uint8_t* a = r0 + 6*j;
+				const uint8_t* b = r1 + 6*j;
+				__m128i v0 = vsum128(a, b), v1 = vsum128(a+8, b+8), v2 = vsum128(a+16, b+16);
+				__m128i s0 = _mm_add_epi16(v0, _mm_alignr_epi8(v1, v0, 6));
+				__m128i s1 = _mm_add_epi16(v1, _mm_alignr_epi8(v2, v1, 6));
+				__m128i s2 = _mm_add_epi16(v2, _mm_srli_si128(v2, 6));
+				__m128i x0 = _mm_or_si128(_mm_shuffle_epi8(s0, k0a), _mm_shuffle_epi8(s1, k0b));
+				__m128i x1 = _mm_or_si128(_mm_shuffle_epi8(s1, k1b), _mm_shuffle_epi8(s2, k1c));
+				x0 = _mm_srli_epi16(_mm_add_epi16(x0, two), 2);
+				x1 = _mm_srli_epi16(_mm_add_epi16(x1, two), 2);
+				__m128i p = _mm_packus_epi16(x0, x1);
+				uint8_t* o = dst + 3*j;
+				_mm_storel_epi64((__m128i*)o, p);
+				uint32_t last = _mm_extract_epi32(p, 2);
+				memcpy(o + 8, &last, 4);
+			}
+		}
+
+		if (j < w) halveRowsScalar<uint8_t,uint32_t,C>(dst + j*C, r0 + 2*j*C, r1 + 2*j*C, w - j);
+	}
+
+	// Eight output pixels per iteration, summed in 32 bit lanes.
+	__attribute__((target("avx2")))
+	void halveRowsAvx2_u16c1(uint16_t* dst, const uint16_t* r0, const uint16_t* r1, int w) {
+		const __m256i two = _mm256_set1_epi32(2);
+		int j = 0;
+		for (; j+8<=w; j+=8) {
+			const uint16_t* a = r0 + 2*j;
+			const uint16_t* b = r1 + 2*j;
+			__m256i s0 = _mm256_add_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(a+0))),
+			                              _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(b+0))));
+			__m256i s1 = _mm256_add_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(a+8))),
+			                              _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(b+8))));
+			__m256i x = _mm256_permute4x64_epi64(_mm256_hadd_epi32(s0, s1), 0xD8);
+			x = _mm256_srli_epi32(_mm256_add_epi32(x, two), 2);
+			x = _mm256_permute4x64_epi64(_mm256_packus_epi32(x, x), 0xD8);
+			_mm_storeu_si128((__m128i*)(dst + j), _mm256_castsi256_si128(x));
+		}
+		if (j < w) halveRowsScalar<uint16_t,uint32_t,1>(dst + j, r0 + 2*j, r1 + 2*j, w - j);
+	}
+
+	bool haveAvx2() {
+		static const bool have = __builtin_cpu_supports("avx2");
+		return have;
+	}
+
+#endif
+
+#if defined(__ARM_NEON)
+
+	// The structured loads split the channels, so pairwise adds handle any C.
+	template <int C>
+	void halveRowsNeon_u8(uint8_t* dst, const uint8_t* r0, const uint8_t* r1, int w) {
+		int j = 0;
+		for (; j+8<=w; j+=8) {
+			const uint8_t* a = r0 + 2*j*C;
+			const uint8_t* b = r1 + 2*j*C;
+			uint8_t* o = dst + j*C;
+			if constexpr (C == 1) {
+				uint16x8_t s = vaddq_u16(vpaddlq_u8(vld1q_u8(a)), vpaddlq_u8(vld1q_u8(b)));
+				vst1_u8(o, vrshrn_n_u16(s, 2));
+			} else if constexpr (C == 3) {
+				uint8x16x3_t va = vld3q_u8(a), vb = vld3q_u8(b);
+				uint8x8x3_t vo;
+				for (int c=0; c<3; c++) vo.val[c] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(va.val[c]), vpaddlq_u8(vb.val[c])), 2);
+				vst3_u8(o, vo);
+			} else if constexpr (C == 4) {
+				uint8x16x4_t va = vld4q_u8(a), vb = vld4q_u8(b);
+				uint8x8x4_t vo;
+				for (int c=0; c<4; c++) vo.val[c] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(va.val[c]), vpaddlq_u8(vb.val[c])), 2);
+				vst4_u8(o, vo);
+			}
+		}
+		if (j < w) halveRowsScalar<uint8_t,uint32_t,C>(dst + j*C, r0 + 2*j*C, r1 + 2*j*C, w - j);
+	}
+
+	void halveRowsNeon_u16c1(uint16_t* dst, const uint16_t* r0, const uint16_t* r1, int w) {
+		int j = 0;
+		for (; j+4<=w; j+=4) {
+			uint32x4_t s = vaddq_u32(vpaddlq_u16(vld1q_u16(r0 + 2*j)), vpaddlq_u16(vld1q_u16(r1 + 2*j)));
+			vst1_u16(dst + j, vrshrn_n_u32(s, 2));
+		}
+		if (j < w) halveRowsScalar<uint16_t,uint32_t,1>(dst + j, r0 + 2*j, r1 + 2*j, w - j);
+	}
+
+#endif
+
+	template <int C>
+	void halveRows_u8(uint8_t* dst, const uint8_t* r0, const uint8_t* r1, int w) {
+#ifdef FRAST_DECIMATE_AVX2
+		if (haveAvx2()) return halveRowsAvx2_u8<C>(dst, r0, r1, w);
+#endif
+#if defined(__ARM_NEON)
+		return halveRowsNeon_u8<C>(dst, r0, r1, w);
+#endif
+		halveRowsScalar<uint8_t,uint32_t,C>(dst, r0, r1, w);
+	}
+
+	void halveRows_u16c1(uint16_t* dst, const uint16_t* r0, const uint16_t* r1, int w) {
+#ifdef FRAST_DECIMATE_AVX2
+		if (haveAvx2()) return halveRowsAvx2_u16c1(dst, r0, r1, w);
+#endif
+#if defined(__ARM_NEON)
+		return halveRowsNeon_u16c1(dst, r0, r1, w);
+#endif
+		halveRowsScalar<uint16_t,uint32_t,1>(dst, r0, r1, w);
+	}
+
+	void checkType(int type) {
+		if (type != CV_8UC1 and type != CV_8UC3 and type != CV_8UC4 and type != CV_16UC1)
+			throw std::runtime_error(fmt::format("decimate: unsupported cv type {}", type));
+	}
+
+	// -------------------------------------------------------------------------------------------
+	// Windowed sinc.
+	// -------------------------------------------------------------------------------------------
+
+	// Taps at offsets -2..3 around 2*o, i.e. at +-0.5, +-1.5 and +-2.5 around the output pixel's center.
+	// The window is the 1D version of the radial one it replaced:
+	//    p = np.linspace(-1,1,6); d = abs(p) * 1.8; w = np.sinc(d) * np.sinc(d/1.8)
+	// Balanced: sharper than bilinear/area, and better for a while, but noisy after too many levels.
+	struct SincTaps {
+		float w[6];
+		SincTaps() {
+			auto sinc = [](double x) { return x == 0 ? 1. : std::sin(M_PI * x) / (M_PI * x); };
+			for (int i=0; i<6; i++) {
+				double d = std::abs(-1. + i * .4) * 1.8;
+				w[i] = sinc(d) * sinc(d / 1.8);
+			}
+		}
+	};
+
+	template <class T>
+	inline T saturateRound(float x) {
+		constexpr float hi = (float)std::numeric_limits<T>::max();
+		return (T)std::min(std::max(0.f, x + .5f), hi);
+	}
+
+	// The two passes are written over flat arrays of floats, so the same loops run for any number of channels.
+	// A mosaic row is split into its even (E) and odd (O) pixels, so that the horizontal taps of output pixel ox are
+	// E and O at pixels ox-1, ox and ox+1: every tap is a contiguous, unit stride load.
+
+	// Horizontal, for @n floats from @j0 (away from the edges): h = k0·E[-C] + k1·O[-C] + k2·E + k3·O + k4·E[+C] + k5·O[+C].
+	template <int C>
+	void sincRowScalar(float* __restrict h, const float* __restrict E, const float* __restrict O, int j0, int n, const float k[6]) {
+		for (int j=j0; j<j0+n; j++)
+			h[j] = k[0]*E[j-C] + k[1]*O[j-C] + k[2]*E[j] + k[3]*O[j] + k[4]*E[j+C] + k[5]*O[j+C];
+	}
+
+	// Vertical, for @n values: the weighted sum of the six filtered rows, rounded and saturated.
+	template <class T>
+	void sincColsScalar(T* __restrict dst, const float* const rows[6], const float w[6], int i0, int n) {
+		for (int i=i0; i<i0+n; i++)
+			dst[i] = saturateRound<T>(w[0]*rows[0][i] + w[1]*rows[1][i] + w[2]*rows[2][i] + w[3]*rows[3][i] + w[4]*rows[4][i] + w[5]*rows[5][i]);
+	}
+
+#ifdef FRAST_DECIMATE_AVX2
+
+	template <int C>
+	__attribute__((target("avx2")))
+	void sincRowAvx2(float* h, const float* E, const float* O, int j0, int n, const float k[6]) {
+		__m256 kv[6];
+		for (int d=0; d<6; d++) kv[d] = _mm256_set1_ps(k[d]);
+		int j = j0;
+		for (; j+8<=j0+n; j+=8) {
+			__m256 acc = _mm256_mul_ps(kv[0], _mm256_loadu_ps(E + j - C));
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(kv[1], _mm256_loadu_ps(O + j - C)));
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(kv[2], _mm256_loadu_ps(E + j)));
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(kv[3], _mm256_loadu_ps(O + j)));
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(kv[4], _mm256_loadu_ps(E + j + C)));
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(kv[5], _mm256_loadu_ps(O + j + C)));
+			_mm256_storeu_ps(h + j, acc);
+		}
+		sincRowScalar<C>(h, E, O, j, j0 + n - j, k);
+	}
+
+	// Eight values per iteration: clamped and truncated like saturateRound(), then narrowed to T.
+	template <class T>
+	__attribute__((target("avx2")))
+	void sincColsAvx2(T* dst, const float* const rows[6], const float w[6], int n) {
+		__m256 wv[6];
+		for (int d=0; d<6; d++) wv[d] = _mm256_set1_ps(w[d]);
+		const __m256 half = _mm256_set1_ps(.5f), zero = _mm256_setzero_ps();
+		const __m256 hi = _mm256_set1_ps((float)std::numeric_limits<T>::max());
+		int i = 0;
+		for (; i+8<=n; i+=8) {
+			__m256 acc = _mm256_add_ps(half, _mm256_mul_ps(wv[0], _mm256_loadu_ps(rows[0] + i)));
+			for (int d=1; d<6; d++) acc = _mm256_add_ps(acc, _mm256_mul_ps(wv[d], _mm256_loadu_ps(rows[d] + i)));
+			__m256i x = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(acc, zero), hi));
+			__m128i x16 = _mm_packus_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+			if constexpr (sizeof(T) == 1) _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(x16, x16));
+			else _mm_storeu_si128((__m128i*)(dst + i), x16);
+		}
+		sincColsScalar<T>(dst, rows, w, i, n - i);
+	}
+
+#endif
+
+#if defined(__ARM_NEON)
+
+	template <int C>
+	void sincRowNeon(float* h, const float* E, const float* O, int j0, int n, const float k[6]) {
+		int j = j0;
+		for (; j+4<=j0+n; j+=4) {
+			float32x4_t acc = vmulq_n_f32(vld1q_f32(E + j - C), k[0]);
+			acc = vmlaq_n_f32(acc, vld1q_f32(O + j - C), k[1]);
+			acc = vmlaq_n_f32(acc, vld1q_f32(E + j), k[2]);
+			acc = vmlaq_n_f32(acc, vld1q_f32(O + j), k[3]);
+			acc = vmlaq_n_f32(acc, vld1q_f32(E + j + C), k[4]);
+			acc = vmlaq_n_f32(acc, vld1q_f32(O + j + C), k[5]);
+			vst1q_f32(h + j, acc);
+		}
+		sincRowScalar<C>(h, E, O, j, j0 + n - j, k);
+	}
+
+	template <class T>
+	void sincColsNeon(T* dst, const float* const rows[6], const float w[6], int n) {
+		const float32x4_t hi = vdupq_n_f32((float)std::numeric_limits<T>::max());
+		auto sum4 = [&](int i) {
+			float32x4_t acc = vdupq_n_f32(.5f);
+			for (int d=0; d<6; d++) acc = vmlaq_n_f32(acc, vld1q_f32(rows[d] + i), w[d]);
+			// Negative values convert to 0.
+			return vmovn_u32(vcvtq_u32_f32(vminq_f32(acc, hi)));
+		};
+		int i = 0;
+		for (; i+8<=n; i+=8) {
+			uint16x8_t x = vcombine_u16(sum4(i), sum4(i+4));
+			if constexpr (sizeof(T) == 1) vst1_u8((uint8_t*)(dst + i), vmovn_u16(x));
+			else vst1q_u16((uint16_t*)(dst + i), x);
+		}
+		sincColsScalar<T>(dst, rows, w, i, n - i);
+	}
+
+#endif
+
+	template <int C>
+	void sincRow(float* h, const float* E, const float* O, int j0, int n, const float k[6]) {
+#ifdef FRAST_DECIMATE_AVX2
+		if (haveAvx2()) return sincRowAvx2<C>(h, E, O, j0, n, k);
+#endif
+#if defined(__ARM_NEON)
+		return sincRowNeon<C>(h, E, O, j0, n, k);
+#endif
+		sincRowScalar<C>(h, E, O, j0, n, k);
+	}
+
+	template <class T>
+	void sincCols(T* dst, const float* const rows[6], const float w[6], int n) {
+#ifdef FRAST_DECIMATE_AVX2
+		if (haveAvx2()) return sincColsAvx2<T>(dst, rows, w, n);
+#endif
+#if defined(__ARM_NEON)
+		return sincColsNeon<T>(dst, rows, w, n);
+#endif
+		sincColsScalar<T>(dst, rows, w, 0, n);
+	}
+
+	template <class T, int C>
+	void decimateSinc(cv::Mat& out, const cv::Mat children[4]) {
+		static const SincTaps taps;
+		const float* k = taps.w;
+
+		const int tw = out.cols, th = out.rows;
+		const int IW = 2*tw, IH = 2*th;
+
+		// Away from the left and right edges all six taps are on the mosaic, so the weights are normalized once.
+		float kn[6], ksum = 0;
+		for (int d=0; d<6; d++) ksum += k[d];
+		for (int d=0; d<6; d++) kn[d] = k[d] / ksum;
+
+		// The even and odd pixels of one mosaic row, and a ring of horizontally filtered rows (input row iy in slot iy % 8).
+		std::vector<float> even(tw*C), odd(tw*C);
+		std::vector<float> ring(8 * tw*C);
+
+		auto filterRow = [&](int iy) {
+			// Mosaic row @iy: the top half of the mosaic is children 1 (left) and 3 (right), the bottom half 0 and 2.
+			int top = iy < th;
+			int cy = top ? iy : iy - th;
+			for (int half=0; half<2; half++) {
+				const cv::Mat& child = children[(top ? 1 : 0) + 2*half];
+				float* e = even.data() + half*(tw/2)*C;
+				float* o = odd.data() + half*(tw/2)*C;
+				if (child.empty()) {
+					std::fill(e, e + (tw/2)*C, 0.f);
+					std::fill(o, o + (tw/2)*C, 0.f);
+					continue;
+				}
+				const T* src = child.ptr<T>(cy);
+				for (int q=0; q<tw/2; q++)
+					for (int c=0; c<C; c++) {
+						e[q*C+c] = src[(2*q)*C+c];
+						o[q*C+c] = src[(2*q+1)*C+c];
+					}
+			}
+
+			float* h = ring.data() + (iy & 7) * tw*C;
+			if (tw > 2) sincRow<C>(h, even.data(), odd.data(), C, (tw-2)*C, kn);
+
+			// The first and last output pixels, with the taps that fall off the mosaic left out.
+			for (int ox : { 0, tw-1 }) {
+				float acc[C] = {0}, s = 0;
+				for (int d=0; d<6; d++) {
+					int ix = 2*ox + d - 2;
+					if (ix < 0 or ix >= IW) continue;
+					const float* p = (ix & 1 ? odd : even).data() + (ix >> 1)*C;
+					for (int c=0; c<C; c++) acc[c] += k[d] * p[c];
+					s += k[d];
+				}
+				for (int c=0; c<C; c++) h[ox*C+c] = acc[c] / s;
+			}
+		};
+
+		int nextRow = 0;
+		for (int oy=0; oy<th; oy++) {
+			int y0 = std::max(0, 2*oy - 2), y1 = std::min(IH, 2*oy + 4);
+			while (nextRow < y1) filterRow(nextRow++);
+
+			// The rows that are on the mosaic, with their renormalized weights.
+			const float* rows[6];
+			float wv[6], s = 0;
+			int n = 0;
+			for (int iy=y0; iy<y1; iy++) {
+				rows[n] = ring.data() + (iy & 7) * tw*C;
+				wv[n] = k[iy - (2*oy - 2)];
+				s += wv[n++];
+			}
+			for (int d=0; d<n; d++) wv[d] /= s;
+
+			T* dst = out.ptr<T>(oy);
+			if (n == 6) sincCols<T>(dst, rows, wv, tw*C);
+			else {
+				for (int i=0; i<tw*C; i++) {
+					float acc = 0;
+					for (int d=0; d<n; d++) acc += wv[d] * rows[d][i];
+					dst[i] = saturateRound<T>(acc);
+				}
+			}
+		}
+	}
+
+}
+
+bool canDecimate(const cv::Mat& tile) {
+	int type = tile.type();
+	return (type == CV_8UC1 or type == CV_8UC3 or type == CV_8UC4 or type == CV_16UC1) and tile.cols % 2 == 0 and tile.rows % 2 == 0;
+}
+
+void halveBox(const cv::Mat& src, cv::Mat dst) {
+	checkType(src.type());
+	assert(src.type() == dst.type());
+	assert(src.cols == 2*dst.cols and src.rows == 2*dst.rows);
+
+	const int w = dst.cols;
+	for (int y=0; y<dst.rows; y++) {
+		const uint8_t* r0 = src.ptr<uint8_t>(2*y);
+		const uint8_t* r1 = src.ptr<uint8_t>(2*y+1);
+		uint8_t* o = dst.ptr<uint8_t>(y);
+		switch (src.type()) {
+			case CV_8UC1: halveRows_u8<1>(o, r0, r1, w); break;
+			case CV_8UC3: halveRows_u8<3>(o, r0, r1, w); break;
+			case CV_8UC4: halveRows_u8<4>(o, r0, r1, w); break;
+			case CV_16UC1: halveRows_u16c1((uint16_t*)o, (const uint16_t*)r0, (const uint16_t*)r1, w); break;
+		}
+	}
+}
+
+void decimate2x(cv::Mat& out, const cv::Mat children[4], DecimateKernel kernel) {
+	const cv::Mat* tmpl = nullptr;
+	for (int i=0; i<4 and tmpl == nullptr; i++)
+		if (not children[i].empty()) tmpl = &children[i];
+	if (tmpl == nullptr) throw std::runtime_error("decimate2x: all children are empty");
+	checkType(tmpl->type());
+	for (int i=0; i<4; i++)
+		if (not children[i].empty() and (children[i].rows != tmpl->rows or children[i].cols != tmpl->cols or children[i].type() != tmpl->type()))
+			throw std::runtime_error("decimate2x: children differ in size or type");
+	if (tmpl->cols % 2 or tmpl->rows % 2) throw std::runtime_error("decimate2x: odd tile size");
+
+	const int tw = tmpl->cols, th = tmpl->rows;
+	out.create(th, tw, tmpl->type());
+
+	if (kernel == DecimateKernel::eBox) {
+		const int hw = tw / 2, hh = th / 2;
+		for (int i=0; i<4; i++) {
+			cv::Mat q = out(cv::Rect{(i >> 1) * hw, (1 - (i & 1)) * hh, hw, hh});
+			if (children[i].empty()) {
+				for (int y=0; y<hh; y++) memset(q.ptr<uint8_t>(y), 0, hw * q.elemSize());
+			} else halveBox(children[i], q);
+		}
+		return;
+	}
+
+	switch (tmpl->type()) {
+		case CV_8UC1: decimateSinc<uint8_t,1>(out, children); break;
+		case CV_8UC3: decimateSinc<uint8_t,3>(out, children); break;
+		case CV_8UC4: decimateSinc<uint8_t,4>(out, children); break;
+		case CV_16UC1: decimateSinc<uint16_t,1>(out, children); break;
+	}
+}
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+
+namespace frast {
+
+	//
+	// 2:1 decimation kernels for building overview tiles (see WriterMasterAddo::process and PyramidBuilder).
+	//
+	// Supported types: CV_8UC1, CV_8UC3, CV_8UC4 and CV_16UC1 (terrain). Widths and heights must be even.
+	// Both kernels use AVX2 (picked at runtime) or NEON where available, and plain loops otherwise.
+	//
+
+	enum class DecimateKernel {
+		// Rounded mean of each 2x2 block. For an exact 2:1 downscale, this is what cv::resize() gives with
+		// cv::INTER_AREA, and also with cv::INTER_LINEAR (which it switches to area for this case).
+		eBox,
+		// Separable 6-tap windowed sinc (the "custom" addo interpolation). Sharper than box, but rings and aliases
+		// after many levels.
+		eSinc,
+	};
+
+	// Whether decimate2x() handles tiles like @tile (supported type, even size).
+	bool canDecimate(const cv::Mat& tile);
+
+	// Halve the 2x2 mosaic of @children into @out, reading them in place instead of joining them first.
+	// @children are in the order of WriterMasterAddo::process(): (2x,2y), (2x,2y+1), (2x+1,2y), (2x+1,2y+1).
+	// Rows of a tile go from high to low y, so children[1] is the top left quadrant.
+	// Empty children count as zeros, but at least one must be non-empty, and those must share size and type.
+	// @out is (re)allocated to that size and type.
+	void decimate2x(cv::Mat& out, const cv::Mat children[4], DecimateKernel kernel);
+
+	// Box-halve @src into @dst, which must already have half the size and the same type (it may be a view).
+	void halveBox(const cv::Mat& src, cv::Mat dst);
+
+}
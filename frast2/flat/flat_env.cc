@@ -1,13 +1,31 @@
 #include "flat_env.h"
+#include "frast2/detail/hash.hpp"
+
+#include <algorithm>
+#include <numeric>
 
 namespace frast {
 
 static constexpr uint64_t BLOCK_SIZE = 4096;
 
+static std::string byteSizeToString(uint64_t x);
+
 FlatEnvironment::FlatEnvironment(const std::string& path, const EnvOptions& opts)
 		: BaseEnvironment<FlatEnvironment>(path, opts), path_(path)
 {
 
+		if (opts.keyIndex) keyIndices_ = std::make_shared<KeyIndexSet>();
+
+		valueReadMode_ = opts.valueReadMode;
+		ioQueueDepth_  = opts.ioQueueDepth;
+		mapOffset_     = opts.mapOffset;
+#ifndef FRAST_HAVE_LIBURING
+		if (valueReadMode_ == ValueReadMode::eUring)
+			throw std::runtime_error("ValueReadMode::eUring requested, but frast was built without liburing");
+#endif
+		if (valueReadMode_ != ValueReadMode::eMmap and opts.anon)
+			throw std::runtime_error("ValueReadMode other than eMmap requires a file (not opts.anon)");
+
 		// basePointer = static_cast<void*>(static_cast<char*>(basePointer) + BLOCK_SIZE);
 		// fmt::print(" - sizeof(FileMeta) = {}\n", sizeof(FileMeta));
 
@@ -18,6 +36,8 @@ FlatEnvironment::FlatEnvironment(const std::string& path, const EnvOptions& opts
 			new (meta()) FileMeta;
 			currentEnd = fileMetaCapacity;
 			meta()->rasterType = opts.isTerrain ? FileMeta::RasterType::eTerrain : FileMeta::RasterType::eColor;
+			if (opts.dedupValues) meta()->valueLengths = FileMeta::ValueLengths::eExplicit;
+			meta()->codecOverride = static_cast<FileMeta::CodecOverride>(opts.codec);
 			// fmt::print(" - [FlatEnv] using new file, currentEnd {}\n", currentEnd);
 		} else {
 
@@ -27,6 +47,16 @@ FlatEnvironment::FlatEnvironment(const std::string& path, const EnvOptions& opts
 				while (off_ % BLOCK_SIZE != 0) off_++;
 				off = std::max(off,off_);
 			}
+			for (int d=0; d<meta()->nDeltas; d++) {
+				uint64_t off_ = meta()->deltas[d].spec.valsOffset + meta()->deltas[d].spec.valsLength;
+				while (off_ % BLOCK_SIZE != 0) off_++;
+				off = std::max(off,off_);
+			}
+			for (int i=0; i<26; i++) {
+				uint64_t off_ = meta()->occupancy[i].offset + meta()->occupancy[i].length;
+				while (off_ % BLOCK_SIZE != 0) off_++;
+				off = std::max(off,off_);
+			}
 			currentEnd = off;
 			// fmt::print(" - [FlatEnv] using old file, found currentEnd {}\n", currentEnd);
 
@@ -37,23 +67,61 @@ FlatEnvironment::FlatEnvironment(const std::string& path, const EnvOptions& opts
 
 			for (int i=0; i<16; i++)
 				haveLevel(i);
+
+			if (opts.dedupValues and not hasExplicitValueLengths()) {
+				if (opts.readonly) throw std::runtime_error("opts.dedupValues is set, but the file is readonly");
+				// Throws if the file already has levels with implicit lengths.
+				setValueLengths(FileMeta::ValueLengths::eExplicit);
+			}
 		}
 
+		dedupValues_ = opts.dedupValues;
+
 }
 
 FlatEnvironment::~FlatEnvironment() {
 	assert(currentLvl == INVALID_LVL && "you called startLevel without endLevel later");
 }
 
+void FlatEnvironment::setKeyOrder(FileMeta::KeyOrder order) {
+	for (int i=0; i<26; i++)
+		if (meta()->levelSpecs[i].keysCapacity != 0) throw std::runtime_error("setKeyOrder() must be called before any level is written");
+	meta()->keyOrder = order;
+}
+
+void FlatEnvironment::setValueLengths(FileMeta::ValueLengths v) {
+	for (int i=0; i<26; i++)
+		if (meta()->levelSpecs[i].keysCapacity != 0) throw std::runtime_error("setValueLengths() must be called before any level is written");
+	meta()->valueLengths = v;
+}
+
+FlatEnvironment::LevelSpec& FlatEnvironment::writeSpec() {
+	assert(currentLvl != INVALID_LVL);
+	if (currentDelta >= 0) return meta()->deltas[currentDelta].spec;
+	return meta()->levelSpecs[currentLvl];
+}
+
+bool FlatEnvironment::beginDelta(int lvl) {
+	assert(currentLvl == INVALID_LVL && "finish the current level first");
+	if (meta()->nDeltas >= FileMeta::maxDeltas)
+		throw std::runtime_error(fmt::format("beginDelta: file already has {} delta runs, merge them first", (int)FileMeta::maxDeltas));
+
+	currentDelta = meta()->nDeltas;
+	meta()->deltas[currentDelta] = FileMeta::DeltaSpec{};
+	meta()->deltas[currentDelta].lvl = lvl;
+	return beginLevel(lvl);
+}
+
 bool FlatEnvironment::beginLevel(int lvl) {
-	assert(meta()->levelSpecs[lvl].keysCapacity == 0 && "this level should be empty");
+	assert((currentDelta >= 0 or meta()->levelSpecs[lvl].keysCapacity == 0) && "this level should be empty");
 
 	if (currentEnd % BLOCK_SIZE != 0) {
 		fmt::print(" - Warning: currentEnd was not at a multiple of block size, adding needed padding.\n");
 		while (currentEnd % BLOCK_SIZE != 0) currentEnd++;
 	}
 
-	auto& spec = meta()->levelSpecs[lvl];
+	currentLvl = lvl;
+	auto& spec = writeSpec();
 
 	static constexpr uint64_t iniNumKeys = 2048;
 	static constexpr uint64_t iniValBlobSize = 2048*BLOCK_SIZE;
@@ -71,26 +139,47 @@ bool FlatEnvironment::beginLevel(int lvl) {
 	spec.valsCapacity = iniValBlobSize;
 	currentEnd += spec.valsCapacity;
 
+	if (dedupValues_) {
+		// Values can only be shared within one values blob.
+		dedupSlots_.assign(1 << dedupSlotsLog2, DedupSlot{});
+		dedupHits_ = dedupSavedBytes_ = 0;
+	}
+
 	fmt::print(" - [beginLevel] lvl={} ko={}, k2vo={}, vo={}\n", lvl, (uint64_t)spec.keysOffset, (uint64_t)spec.k2vsOffset, (uint64_t)spec.valsOffset);
 	int r = fallocate(fd_, 0, 0, currentEnd);
 	if (r != 0) {
+		currentLvl = INVALID_LVL;
+		currentDelta = -1;
 		throw std::runtime_error("fallocate() failed: " + std::string{strerror(errno)});
 	}
 
-	currentLvl = lvl;
-
 	return false;
 }
 
 bool FlatEnvironment::endLevel(bool finalLevel) {
 
 	assert(currentLvl >= 0 and currentLvl < 30);
-	auto& spec = meta()->levelSpecs[currentLvl];
+	auto& spec = writeSpec();
+
+	// A delta run is always the last thing in the file.
+	if (currentDelta >= 0) finalLevel = true;
+
+	if (dedupValues_) {
+		fmt::print(" - [FlatEnv::endLevel] lvl {}: {} of {} values were duplicates ({} saved)\n",
+				currentLvl, dedupHits_, spec.nitemsUsed(), byteSizeToString(dedupSavedBytes_));
+		std::vector<DedupSlot>().swap(dedupSlots_);
+	}
 
 	spec.valsCapacity = spec.valsLength;
 	while (spec.valsCapacity % BLOCK_SIZE != 0) spec.valsCapacity++;
 	currentEnd = spec.valsOffset + spec.valsCapacity;
 
+	// Delta runs get none: they are small, and are searched directly.
+	uint64_t occEnd = 0;
+	if (currentDelta < 0) occEnd = writeOccupancy(currentLvl, currentEnd);
+	if (occEnd > currentEnd) currentEnd = occEnd;
+	else occEnd = 0;
+
 	if (finalLevel) {
 		fmt::print(" - [FlatEnv::endLevel] setting level {}'s vals capacity to {} then truncating to {}\n", currentLvl, (uint64_t)spec.valsCapacity, currentEnd);
 		int r = ftruncate(fd_, currentEnd);
@@ -100,9 +189,14 @@ bool FlatEnvironment::endLevel(bool finalLevel) {
 	} else {
 		fmt::print(" - [FlatEnv::endLevel] setting level {}'s vals capacity to {} and rewinding currentEnd to {}\n", currentLvl, (uint64_t)spec.valsCapacity, currentEnd);
     // FIXME: TEST THIS.
-    currentEnd = spec.valsOffset + spec.valsLength;
+    if (occEnd == 0) currentEnd = spec.valsOffset + spec.valsLength;
 	}
 
+	// Publish the run only now that it is complete.
+	if (currentDelta >= 0) {
+		meta()->nDeltas = currentDelta + 1;
+		currentDelta = -1;
+	}
 
 	currentLvl = INVALID_LVL;
 	return false;
@@ -152,6 +246,7 @@ bool FlatEnvironment::copyLevelFrom(uint64_t lvl,
   spec.valsCapacity = len;
 	while (spec.valsCapacity % BLOCK_SIZE != 0) spec.valsCapacity++;
 
+	currentEnd = writeOccupancy(lvl, currentEnd);
 
 	if (finalLevel) {
 		fmt::print(" - [FlatEnv::endLevel] setting level {}'s vals capacity to {} then truncating to {}\n", currentLvl, (uint64_t)spec.valsCapacity, currentEnd);
@@ -161,13 +256,131 @@ bool FlatEnvironment::copyLevelFrom(uint64_t lvl,
 		}
 	} else {
 		fmt::print(" - [FlatEnv::endLevel] setting level {}'s vals capacity to {} and rewinding currentEnd to {}\n", currentLvl, (uint64_t)spec.valsCapacity, currentEnd);
-    currentEnd = spec.valsOffset + spec.valsLength;
+    if (meta()->occupancy[lvl].length == 0) currentEnd = spec.valsOffset + spec.valsLength;
 	}
   currentLvl = INVALID_LVL;
 
   return false;
 }
 
+// Copy @len bytes from @inFd at @inOff to @outFd at @outOff. Uses copy_file_range() and falls back to pread/pwrite
+// where the kernel or filesystem cannot (e.g. across filesystems before Linux 5.3).
+static void copyFileBytes(int inFd, uint64_t inOff, int outFd, uint64_t outOff, uint64_t len) {
+	bool fallback = false;
+	while (len > 0 and not fallback) {
+		loff_t i = inOff, o = outOff;
+		ssize_t r = copy_file_range(inFd, &i, outFd, &o, len, 0);
+		if (r > 0) {
+			inOff += r, outOff += r, len -= r;
+		} else if (r == 0) {
+			throw std::runtime_error("copy_file_range(): unexpected end of input file");
+		} else if (errno == EXDEV or errno == EINVAL or errno == ENOSYS or errno == EOPNOTSUPP) {
+			fallback = true;
+		} else if (errno != EINTR) {
+			throw std::runtime_error("copy_file_range() failed: " + std::string{strerror(errno)});
+		}
+	}
+
+	std::vector<uint8_t> buf(len > 0 ? std::min<uint64_t>(len, 8 << 20) : 0);
+	while (len > 0) {
+		ssize_t r = pread(inFd, buf.data(), std::min<uint64_t>(len, buf.size()), inOff);
+		if (r <= 0) throw std::runtime_error("pread() failed: " + std::string{r == 0 ? "unexpected end of file" : strerror(errno)});
+		for (ssize_t w = 0; w < r; ) {
+			ssize_t r2 = pwrite(outFd, buf.data() + w, r - w, outOff + w);
+			if (r2 < 0) throw std::runtime_error("pwrite() failed: " + std::string{strerror(errno)});
+			w += r2;
+		}
+		inOff += r, outOff += r, len -= r;
+	}
+}
+
+uint64_t FlatEnvironment::writeLevelFromFiles(uint64_t lvl, const uint64_t* keys, const uint64_t* k2vs, uint64_t n,
+		const std::vector<FileRange>& ranges, bool finalLevel) {
+	assert(currentLvl == INVALID_LVL && "finish the current level before writing another");
+	assert(meta()->levelSpecs[lvl].keysCapacity == 0 && "this level should be empty");
+	assert(n > 0);
+	auto& spec = meta()->levelSpecs[lvl];
+	currentLvl = lvl;
+
+	uint64_t valsLength = 0;
+	for (auto& r : ranges) valsLength += r.len;
+	auto roundUp = [](uint64_t x) { return (x + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE; };
+
+	// Same layout as copyLevelFrom: keys, k2vs and values, each starting on a block (so that block aligned source
+	// ranges, like whole levels, stay aligned and can be reflinked).
+	spec.keysOffset = roundUp(currentEnd);
+	spec.keysLength = n * sizeof(uint64_t);
+	spec.keysCapacity = spec.keysLength;
+	spec.k2vsOffset = roundUp(spec.keysOffset + spec.keysLength);
+	spec.valsOffset = roundUp(spec.k2vsOffset + spec.keysLength);
+	spec.valsLength = valsLength;
+	spec.valsCapacity = roundUp(valsLength);
+	currentEnd = spec.valsOffset + spec.valsCapacity;
+
+	int r = fallocate(fd_, 0, 0, currentEnd);
+	if (r != 0) throw std::runtime_error("fallocate() failed: " + std::string{strerror(errno)});
+
+	memcpy(static_cast<uint8_t*>(basePointer) + spec.keysOffset, keys, spec.keysLength);
+	memcpy(static_cast<uint8_t*>(basePointer) + spec.k2vsOffset, k2vs, spec.keysLength);
+
+	uint64_t dst = spec.valsOffset;
+	for (auto& range : ranges) {
+		copyFileBytes(range.fd, range.offset, fd_, dst, range.len);
+		dst += range.len;
+	}
+
+	currentEnd = writeOccupancy(lvl, currentEnd);
+
+	if (finalLevel) {
+		r = ftruncate(fd_, currentEnd);
+		if (r != 0) throw std::runtime_error("ftruncate() failed: " + std::string{strerror(errno)});
+	}
+	currentLvl = INVALID_LVL;
+
+	return valsLength;
+}
+
+uint64_t FlatEnvironment::writeOccupancy(int lvl, uint64_t offset) {
+	assert(offset % BLOCK_SIZE == 0);
+	auto& spec = meta()->levelSpecs[lvl];
+	meta()->occupancy[lvl] = FileMeta::SegmentSpec{};
+
+	std::vector<uint8_t> seg = buildOccupancy(lvl, getKeys(spec), spec.nitemsUsed());
+	if (seg.empty()) return offset;
+
+	uint64_t end = offset + seg.size();
+	while (end % BLOCK_SIZE != 0) end++;
+	int r = fallocate(fd_, 0, offset, end - offset);
+	if (r != 0) throw std::runtime_error("fallocate() failed: " + std::string{strerror(errno)});
+
+	memcpy(static_cast<char*>(basePointer) + offset, seg.data(), seg.size());
+	meta()->occupancy[lvl] = FileMeta::SegmentSpec { offset, seg.size() };
+	return end;
+}
+
+OccupancyView FlatEnvironment::occupancy(int lvl) const {
+	const auto& seg = meta()->occupancy[lvl];
+	if (seg.length == 0) return {};
+
+	OccupancyView view(static_cast<const char*>(basePointer) + seg.offset, seg.length);
+	if (view.valid() and view.nitems() != meta()->levelSpecs[lvl].nitemsUsed()) return {};
+	return view;
+}
+
+int FlatEnvironment::addMissingOccupancy() {
+	assert(currentLvl == INVALID_LVL && "finish the current level first");
+
+	int n = 0;
+	for (int lvl=0; lvl<26; lvl++) {
+		if (not haveLevel(lvl) or occupancy(lvl).valid()) continue;
+		uint64_t end = writeOccupancy(lvl, currentEnd);
+		if (end == currentEnd) continue;
+		currentEnd = end;
+		n++;
+	}
+	return n;
+}
+
 
 static std::string byteSizeToString(uint64_t x) {
 	if (x < 1<<10)
@@ -241,7 +454,7 @@ void FlatEnvironment::printFirstLastEightCurLvl() {
 
 uint64_t FlatEnvironment::growLevelKeys() {
 	assert(currentLvl != INVALID_LVL);
-	auto& spec = meta()->levelSpecs[currentLvl];
+	auto& spec = writeSpec();
 
 	fmt::print(" - [growLevelKeys] lvl={}, from ko={}, k2vo={}, vo={}, kcap={}, vcap={}\n",
 				currentLvl, (uint64_t)spec.keysOffset, (uint64_t)spec.k2vsOffset, (uint64_t)spec.valsOffset, (uint64_t)spec.keysCapacity, (uint64_t)spec.valsCapacity);
@@ -286,7 +499,7 @@ uint64_t FlatEnvironment::growLevelKeys() {
 }
 uint64_t FlatEnvironment::growLevelValues() {
 	assert(currentLvl != INVALID_LVL);
-	auto& spec = meta()->levelSpecs[currentLvl];
+	auto& spec = writeSpec();
 
 	// Here, we need not do any updating of any offsets
 	uint64_t oldValsOffset = spec.valsOffset;
@@ -315,22 +528,51 @@ uint64_t FlatEnvironment::growLevelValues() {
 
 	bool FlatEnvironment::writeKeyValue(uint64_t key, void* value, uint64_t valLen) {
 		assert(currentLvl != INVALID_LVL);
-		auto& spec = meta()->levelSpecs[currentLvl];
+		auto& spec = writeSpec();
 
 		assert(spec.nitemsUsed() <= spec.nitemsCap());
+		assert((spec.nitemsUsed() == 0 or orderedKey(getKeys(spec)[spec.nitemsUsed()-1]) < orderedKey(key))
+				&& "keys must be written in the file's KeyOrder");
 		if (spec.nitemsUsed() == spec.nitemsCap()) {
 			growLevelKeys();
 		}
+		if (hasExplicitValueLengths()) {
+			if (valLen > maxExplicitValueLen)
+				throw std::runtime_error(fmt::format("writeKeyValue: value of {} bytes is too large for explicit value lengths", valLen));
+			if (spec.valsLength + valLen > k2vOffsetMask)
+				throw std::runtime_error("writeKeyValue: values blob is too large for explicit value lengths");
+		}
+
 		// Note: this is a uint64_t* so the pointer arithmetic needs nitemsUsed (not keyLength)
 		// memcpy(getKeys(currentLvl) + spec.nitemsUsed(), &key, sizeof(key));
-		getKeys(currentLvl)[spec.nitemsUsed()] = key;
-		getK2vs(currentLvl)[spec.nitemsUsed()] = spec.valsLength;
+		getKeys(spec)[spec.nitemsUsed()] = key;
+
+		if (dedupValues_) {
+			assert(hasExplicitValueLengths());
+			uint64_t h = hashBytes(value, valLen);
+			DedupSlot& slot = dedupSlots_[h >> (64 - dedupSlotsLog2)];
+			if (slot.hash == h and slot.len == valLen and valLen > 0
+					and memcmp(static_cast<char*>(getValues(spec)) + slot.offset, value, valLen) == 0) {
+				// Point at the earlier copy and store nothing.
+				getK2vs(spec)[spec.nitemsUsed()] = slot.offset | (valLen << k2vOffsetBits);
+				spec.keysLength += sizeof(key);
+				dedupHits_++;
+				dedupSavedBytes_ += valLen;
+				return false;
+			}
+			slot = DedupSlot { h, spec.valsLength, valLen };
+		}
+
+		if (hasExplicitValueLengths())
+			getK2vs(spec)[spec.nitemsUsed()] = spec.valsLength | (valLen << k2vOffsetBits);
+		else
+			getK2vs(spec)[spec.nitemsUsed()] = spec.valsLength;
 
 		assert(spec.valsLength <= spec.valsCapacity);
 		while (spec.valsLength + valLen >= spec.valsCapacity) {
 			growLevelValues();
 		}
-		memcpy(static_cast<char*>(getValues(currentLvl)) + spec.valsLength, value, valLen);
+		memcpy(static_cast<char*>(getValues(spec)) + spec.valsLength, value, valLen);
 
 		spec.keysLength += sizeof(key);
 		spec.valsLength += valLen;
@@ -339,65 +581,272 @@ uint64_t FlatEnvironment::growLevelValues() {
 		return false;
 	}
 
-	Value FlatEnvironment::lookup(uint64_t lvl, uint64_t key) {
+	std::shared_ptr<const KeyIndex> FlatEnvironment::getKeyIndex(uint64_t lvl) {
+		if (not keyIndices_) return nullptr;
+
+		// The level being written changes on every write, so never index it.
+		if (lvl == currentLvl and currentDelta < 0) return nullptr;
+
+		auto& spec = meta()->levelSpecs[lvl];
+		int64_t n = spec.nitemsUsed();
+		if (n < minKeysForIndex) return nullptr;
+
+		std::shared_ptr<const KeyIndex> idx = std::atomic_load(&keyIndices_->levels[lvl]);
+		if (idx != nullptr and idx->size() == n) return idx;
+
+		// Either not built yet, or the level grew (e.g. written by another env on the same file). (Re-)build it.
+		std::lock_guard<std::mutex> lck(keyIndices_->mtx);
+		idx = std::atomic_load(&keyIndices_->levels[lvl]);
+		if (idx != nullptr and idx->size() == n) return idx;
+
+		auto newIdx = std::make_shared<KeyIndex>();
+		newIdx->build(getKeys(lvl), n, [this](uint64_t k) { return orderedKey(k); });
+		idx = std::move(newIdx);
+		// The old index (if any) lives on in the lookups that already loaded it.
+		std::atomic_store(&keyIndices_->levels[lvl], idx);
+		return idx;
+	}
+
+	int64_t FlatEnvironment::findKeyIdx(uint64_t lvl, uint64_t key) {
 		auto& spec = meta()->levelSpecs[lvl];
 
-		if (spec.keysLength == 0) return {};
+		if (spec.keysLength == 0) return -1;
 
-		// Binary search for the key
 		int64_t n = spec.nitemsUsed();
 		uint64_t* keys = getKeys(lvl);
+
+		uint64_t okey = orderedKey(key);
+		if (auto idx = getKeyIndex(lvl)) return idx->find(keys, n, key, okey);
+
+		// Binary search for the key
 		int64_t lo = 0;
 		int64_t hi = n-1;
 		while (lo < hi) {
 			int64_t mid = (lo+hi+1)/2;
-			if (key < keys[mid]) {
+			uint64_t omid = orderedKey(keys[mid]);
+			if (okey < omid) {
 				hi = mid-1;
-			} else if (key > keys[mid]) {
+			} else if (okey > omid) {
 				lo = mid + 1;
 			} else {
 				lo = mid;
 				break;
 			}
 		}
-		
+
 		// fmt::print(" - bin searched for key {}, final lo was at idx {}, key {}\n", key, lo, keys[lo]);
-		if (keys[lo] != key) return {};
+		if (keys[lo] != key) return -1;
+		return lo;
+	}
 
-		// fmt::print(" - bin searched for key {}, found at idx {}, k2v {}\n", key, lo, getK2vs(lvl)[lo]);
-		// return getValueFromIdx(lvl,lo);
-		Value val;
-		val.value = static_cast<char*>(getValues(lvl)) + getK2vs(lvl)[lo];
-		val.len = getValueLen(lvl, lo);
-		return val;
+	int64_t FlatEnvironment::lowerBoundIdx(uint64_t lvl, uint64_t key) {
+		auto& spec = meta()->levelSpecs[lvl];
+
+		int64_t n = spec.nitemsUsed();
+		uint64_t* keys = getKeys(lvl);
+		if (n == 0) return 0;
+
+		auto order = [this](uint64_t k) { return orderedKey(k); };
+		if (auto idx = getKeyIndex(lvl)) return idx->lowerBound(keys, n, key, order);
+
+		uint64_t okey = order(key);
+		return std::lower_bound(keys, keys+n, okey, [&order](uint64_t a, uint64_t ob) { return order(a) < ob; }) - keys;
 	}
 
-	bool FlatEnvironment::keyExists(uint64_t lvl, uint64_t key) {
+	int64_t FlatEnvironment::lookupMany(uint64_t lvl, const uint64_t* reqKeys, Value* out, int64_t nreq) {
+		auto& spec = meta()->levelSpecs[lvl];
+		for (int64_t i=0; i<nreq; i++) out[i] = Value{};
+		if (nreq == 0) return 0;
+		if (spec.keysLength == 0) {
+			int64_t nfound = 0;
+			for (int64_t i=0; i<nreq; i++) {
+				int64_t idx;
+				int d = findDelta(lvl, reqKeys[i], idx);
+				if (d >= 0) out[i] = getValueFromIdx(getDeltaSpec(d), idx), nfound++;
+			}
+			return nfound;
+		}
+
+		int64_t n = spec.nitemsUsed();
+		uint64_t* keys = getKeys(lvl);
+
+		// Visit requests in key order.
+		std::vector<uint64_t> oreq(nreq);
+		for (int64_t i=0; i<nreq; i++) oreq[i] = orderedKey(reqKeys[i]);
+		std::vector<int64_t> order(nreq);
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&oreq](int64_t a, int64_t b) { return oreq[a] < oreq[b]; });
+
+		int64_t nfound = 0;
+		int64_t pos = lowerBoundIdx(lvl, reqKeys[order[0]]);
+
+		for (int64_t j=0; j<nreq; j++) {
+			uint64_t key = reqKeys[order[j]];
+			uint64_t okey = oreq[order[j]];
+
+			// Gallop forward from the last position, then binary search the bracketed range.
+			if (pos < n and orderedKey(keys[pos]) < okey) {
+				int64_t lo = pos, step = 1;
+				while (lo + step < n and orderedKey(keys[lo + step]) < okey) {
+					lo += step;
+					step *= 2;
+				}
+				int64_t hi = std::min(lo + step, n);
+				pos = std::lower_bound(keys+lo+1, keys+hi, okey, [this](uint64_t a, uint64_t ob) { return orderedKey(a) < ob; }) - keys;
+			}
+
+			if (pos >= n) break;
+
+			if (keys[pos] == key) {
+				out[order[j]] = getValueFromIdx(lvl, pos);
+				nfound++;
+			}
+		}
+
+		if (haveDeltas(lvl)) {
+			for (int64_t i=0; i<nreq; i++) {
+				int64_t idx;
+				int d = findDelta(lvl, reqKeys[i], idx);
+				if (d < 0) continue;
+				if (out[i].value == nullptr) nfound++;
+				out[i] = getValueFromIdx(getDeltaSpec(d), idx);
+			}
+		}
+
+		return nfound;
+	}
+
+	int64_t FlatEnvironment::lookupRow(uint64_t lvl, uint64_t y, uint64_t x0, uint64_t x1, Value* out) {
 		auto& spec = meta()->levelSpecs[lvl];
+		for (uint64_t x=x0; x<x1; x++) out[x-x0] = Value{};
+		if (x1 <= x0) return 0;
 
-		if (spec.keysLength == 0) return false;
+		if (keyOrder() != FileMeta::KeyOrder::eRowMajor or haveDeltas(lvl)) {
+			std::vector<uint64_t> rowKeys;
+			for (uint64_t x=x0; x<x1; x++) rowKeys.push_back(BlockCoordinate{lvl,y,x}.c);
+			return lookupMany(lvl, rowKeys.data(), out, rowKeys.size());
+		}
 
-		// Binary search for the key
 		int64_t n = spec.nitemsUsed();
 		uint64_t* keys = getKeys(lvl);
-		int64_t lo = 0;
-		int64_t hi = n-1;
-		while (lo < hi) {
-			int64_t mid = (lo+hi+1)/2;
-			if (key < keys[mid]) {
-				hi = mid-1;
-			} else if (key > keys[mid]) {
-				lo = mid + 1;
-			} else {
-				lo = mid;
-				break;
+		uint64_t endKey = BlockCoordinate{lvl,y,x1}.c;
+
+		int64_t nfound = 0;
+		for (int64_t i = lowerBoundIdx(lvl, BlockCoordinate{lvl,y,x0}.c); i < n and keys[i] < endKey; i++) {
+			BlockCoordinate bc(keys[i]);
+			out[bc.x()-x0] = getValueFromIdx(lvl, i);
+			nfound++;
+		}
+
+		return nfound;
+	}
+
+	FlatEnvironment::ValueLocation FlatEnvironment::locateValue(uint64_t lvl, uint64_t key) {
+		int64_t idx;
+		int d = findDelta(lvl, key, idx);
+		if (d >= 0) {
+			auto& spec = getDeltaSpec(d);
+			return ValueLocation { mapOffset_ + spec.valsOffset + getValueOffset(spec, idx), getValueLen(spec, idx) };
+		}
+
+		idx = findKeyIdx(lvl, key);
+		if (idx < 0) return {};
+
+		auto& spec = meta()->levelSpecs[lvl];
+		return ValueLocation { mapOffset_ + spec.valsOffset + getValueOffset(spec, idx), getValueLen(spec, idx) };
+	}
+
+	int64_t FlatEnvironment::readValue(uint64_t lvl, uint64_t key, void* buf, uint64_t bufLen) {
+		ValueLocation loc = locateValue(lvl, key);
+		if (loc.len == 0) return -1;
+		if (loc.len > bufLen) return loc.len;
+
+		readLocation(loc, buf);
+		return loc.len;
+	}
+
+	void FlatEnvironment::readLocation(const ValueLocation& loc, void* buf) {
+		uint64_t got = 0;
+		while (got < loc.len) {
+			ssize_t r = pread(fd_, static_cast<char*>(buf) + got, loc.len - got, loc.offset + got);
+			if (r < 0 and errno == EINTR) continue;
+			if (r <= 0) throw std::runtime_error(fmt::format("readValue: pread failed ({})", r < 0 ? strerror(errno) : "eof"));
+			got += r;
+		}
+	}
+
+	Value FlatEnvironment::lookup(uint64_t lvl, uint64_t key) {
+		int64_t idx;
+		int d = findDelta(lvl, key, idx);
+		if (d >= 0) return getValueFromIdx(getDeltaSpec(d), idx);
+
+		idx = findKeyIdx(lvl, key);
+		if (idx < 0) return {};
+
+		// fmt::print(" - searched for key {}, found at idx {}, k2v {}\n", key, idx, getK2vs(lvl)[idx]);
+		return getValueFromIdx(lvl, idx);
+	}
+
+	bool FlatEnvironment::keyExists(uint64_t lvl, uint64_t key) {
+		int64_t idx;
+		return findDelta(lvl, key, idx) >= 0 or findKeyIdx(lvl, key) >= 0;
+	}
+
+	int64_t FlatEnvironment::findInDelta(int d, uint64_t key) {
+		auto& spec = getDeltaSpec(d);
+		uint64_t* keys = getKeys(spec);
+		int64_t n = spec.nitemsUsed();
+
+		uint64_t okey = orderedKey(key);
+		int64_t i = std::lower_bound(keys, keys+n, okey, [this](uint64_t a, uint64_t ob) { return orderedKey(a) < ob; }) - keys;
+		if (i < n and keys[i] == key) return i;
+		return -1;
+	}
+
+	int FlatEnvironment::findDelta(uint64_t lvl, uint64_t key, int64_t& idx) {
+		for (int d=meta()->nDeltas-1; d>=0; d--) {
+			if (meta()->deltas[d].lvl != lvl) continue;
+			idx = findInDelta(d, key);
+			if (idx >= 0) return d;
+		}
+		return -1;
+	}
+
+	void FlatEnvironment::mergeLevel(int lvl, FlatEnvironment& dst, bool finalLevel) {
+		if (dst.keyOrder() != keyOrder()) throw std::runtime_error("mergeLevel: dst must have the same KeyOrder");
+
+		// The runs to merge, oldest first: the base arrays, then each delta run of this level.
+		std::vector<LevelSpec*> runs;
+		if (haveLevel(lvl)) runs.push_back(&meta()->levelSpecs[lvl]);
+		for (int d=0; d<meta()->nDeltas; d++)
+			if (meta()->deltas[d].lvl == lvl) runs.push_back(&meta()->deltas[d].spec);
+
+		std::vector<uint64_t> pos(runs.size(), 0);
+
+		dst.beginLevel(lvl);
+		while (true) {
+			// Smallest next key among the runs. On ties the newest run wins and the older entries are skipped.
+			int64_t best = -1;
+			uint64_t bestKey = 0, bestOrdered = 0;
+			for (size_t r=0; r<runs.size(); r++) {
+				if (pos[r] >= runs[r]->nitemsUsed()) continue;
+				uint64_t key = getKeys(*runs[r])[pos[r]];
+				uint64_t okey = orderedKey(key);
+				if (best < 0 or okey <= bestOrdered) {
+					best = r;
+					bestKey = key;
+					bestOrdered = okey;
+				}
 			}
+			if (best < 0) break;
+
+			Value val = getValueFromIdx(*runs[best], pos[best]);
+			dst.writeKeyValue(bestKey, val.value, val.len);
+
+			for (size_t r=0; r<runs.size(); r++)
+				if (pos[r] < runs[r]->nitemsUsed() and getKeys(*runs[r])[pos[r]] == bestKey) pos[r]++;
 		}
-		
-		// fmt::print(" - bin searched for key {}, final lo was at idx {}, key {}\n", key, lo, keys[lo]);
-		if (keys[lo] != key) return false;
-		return true;
+		dst.endLevel(finalLevel);
 	}
 
 }
-
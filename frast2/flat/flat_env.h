@@ -1,9 +1,13 @@
 #pragma once
 
 #include "frast2/detail/env.h"
+#include "frast2/detail/key_index.hpp"
 #include "frast2/coordinates.h"
+#include "occupancy.h"
 
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <cassert>
 #include <vector>
 
@@ -86,14 +90,73 @@ class FlatEnvironment : public BaseEnvironment<FlatEnvironment> {
 			eGrayscale = 1,
 			eTerrain = 2,
 		} rasterType = RasterType::eColor;
+		// How the values are encoded (see codec.h). The ids are stored in files: never renumber them.
+		// Set for new files with EnvOptions::codec.
 		enum class CodecOverride : uint8_t {
+			// JPEG through OpenCV for color, deflate (zlib) for terrain.
 			eDefault = 0,
+			// JPEG encoded directly with libjpeg-turbo (no JFIF header, optimized Huffman tables).
+			eJpegTurbo = 1,
+			// stb's JPEG without any headers: the tables are implied (256x256, 3 channels).
+			eStbJpeg = 2,
+			eWebp = 3,
+			eWebpLossless = 4,
+			// Terrain: per row deltas, split into low and high byte planes, deflated at the fastest level.
+			eTerrainDelta = 5,
+			// Terrain: the residuals of a 2D predictor (picked per tile), in byte planes, compressed with zstd.
+			eTerrainPredict = 6,
 		} codecOverride = CodecOverride::eDefault;
+
+		// The order of the keys (and so the values) within every level.
+		// The keys are always BlockCoordinates, but are sorted by orderedKey() which keeps the level in the top bits
+		// and replaces y/x by the tile's index along a space filling curve. With eMorton/eHilbert, tiles that are
+		// close spatially are close in the values blob too.
+		// Set with setKeyOrder() before writing any level (see `frastTool --action reorder`).
+		enum class KeyOrder : uint8_t {
+			eRowMajor = 0,
+			eMorton = 1,
+			eHilbert = 2,
+		} keyOrder = KeyOrder::eRowMajor;
+
+		// Delta runs, oldest first. Each is a sorted run of tiles added to (or replacing tiles of) an existing level
+		// after it was written, appended at the end of the file (see beginDelta()).
+		// Only the first nDeltas are valid: a run is counted once endLevel() finishes it.
+		struct __attribute__((packed)) DeltaSpec {
+			uint8_t lvl=0;
+			LevelSpec spec;
+		};
+		static constexpr int maxDeltas = 32;
+		uint8_t nDeltas = 0;
+		DeltaSpec deltas[maxDeltas];
+
+		// How a k2vs entry gives a value's location.
+		//     eImplicit: the entry is the offset into the level's values blob, and the length is the distance to the
+		//                next entry's offset (or to valsLength).
+		//     eExplicit: the entry is offset | (length << k2vOffsetBits). Several keys may then share one stored
+		//                value (see EnvOptions::dedupValues).
+		enum class ValueLengths : uint8_t {
+			eImplicit = 0,
+			eExplicit = 1,
+		} valueLengths = ValueLengths::eImplicit;
+
+		// Per level occupancy segments (see occupancy.h), written by endLevel() in the blocks after the level's values.
+		// A zero length means the level has none (files from before these existed): queries then scan the keys.
+		struct __attribute__((packed)) SegmentSpec {
+			uint64_t offset=0, length=0;
+		};
+		SegmentSpec occupancy[26];
 	};
 
+	// With ValueLengths::eExplicit: up to 16 TiB of values per level, and values must be smaller than 1 MiB.
+	static constexpr int k2vOffsetBits = 44;
+	static constexpr uint64_t k2vOffsetMask = (1ull << k2vOffsetBits) - 1;
+	static constexpr uint64_t maxExplicitValueLen = (1ull << (64 - k2vOffsetBits)) - 1;
+
 	static constexpr uint64_t fileMetaLength   = sizeof(uint64_t) * 2 + sizeof(LevelSpec) * 26;
 	static constexpr uint64_t fileMetaCapacity = 4096;
 
+	static_assert(sizeof(FileMeta) <= fileMetaCapacity);
+
 	inline FileMeta* meta() { return reinterpret_cast<FileMeta*>(basePointer); }
 	inline const FileMeta* meta() const { return reinterpret_cast<FileMeta*>(basePointer); }
   inline void* getBasePointer() { return basePointer; }
@@ -105,34 +168,87 @@ class FlatEnvironment : public BaseEnvironment<FlatEnvironment> {
 		// fmt::print(" - have lvl {} -> {}\n", lvl, meta()->levelSpecs[lvl].keysLength);
 		return meta()->levelSpecs[lvl].keysLength > 0;
 	}
-	inline uint64_t* getKeys(int lvl) {
-		return reinterpret_cast<uint64_t*>(static_cast<char*>(basePointer) + meta()->levelSpecs[lvl].keysOffset);
+	// These address the level's base arrays only (not its delta runs).
+	inline uint64_t* getKeys(int lvl) { return getKeys(meta()->levelSpecs[lvl]); }
+	inline uint64_t* getK2vs(int lvl) { return getK2vs(meta()->levelSpecs[lvl]); }
+	inline void* getValues(int lvl) { return getValues(meta()->levelSpecs[lvl]); }
+	inline Value getValueFromIdx(int lvl, uint64_t idx) { return getValueFromIdx(meta()->levelSpecs[lvl], idx); }
+	inline uint64_t getValueLen(uint64_t lvl, uint64_t idx) { return getValueLen(meta()->levelSpecs[lvl], idx); }
+
+	inline uint64_t* getKeys(const LevelSpec& spec) {
+		return reinterpret_cast<uint64_t*>(static_cast<char*>(basePointer) + spec.keysOffset);
+	}
+	inline uint64_t* getK2vs(const LevelSpec& spec) {
+		return reinterpret_cast<uint64_t*>(static_cast<char*>(basePointer) + spec.k2vsOffset);
 	}
-	inline uint64_t* getK2vs(int lvl) {
-		return reinterpret_cast<uint64_t*>(static_cast<char*>(basePointer) + meta()->levelSpecs[lvl].k2vsOffset);
+	inline void* getValues(const LevelSpec& spec) {
+		return reinterpret_cast<void*>(static_cast<char*>(basePointer) + spec.valsOffset);
 	}
-	inline void* getValues(int lvl) {
-		return reinterpret_cast<void*>(static_cast<char*>(basePointer) + meta()->levelSpecs[lvl].valsOffset);
+	inline Value getValueFromIdx(const LevelSpec& spec, uint64_t idx) {
+		void* ptr = static_cast<char*>(getValues(spec)) + getValueOffset(spec, idx);
+		return Value { ptr, getValueLen(spec, idx) };
 	}
-	inline Value getValueFromIdx(int lvl, uint64_t idx) {
-		const auto& spec = meta()->levelSpecs[lvl];
-		uint64_t local_v_offset = reinterpret_cast<uint64_t*>(static_cast<char*>(basePointer) + spec.k2vsOffset)[idx];
-		void* ptr = static_cast<char*>(basePointer) + spec.valsOffset + local_v_offset;
-		// return static_cast<char*>(basePointer) + spec.valsOffset + local_v_offset;
-		return Value { ptr, getValueLen(lvl, idx) };
+	// Offset of the idx'th value within the spec's values blob.
+	inline uint64_t getValueOffset(const LevelSpec& spec, uint64_t idx) {
+		uint64_t k2v = getK2vs(spec)[idx];
+		return hasExplicitValueLengths() ? (k2v & k2vOffsetMask) : k2v;
 	}
-	inline uint64_t getValueLen(uint64_t lvl, uint64_t idx) {
-		const auto& spec = meta()->levelSpecs[lvl];
-		uint64_t local_v_offset = reinterpret_cast<uint64_t*>(static_cast<char*>(basePointer) + spec.k2vsOffset)[idx];
+	inline uint64_t getValueLen(const LevelSpec& spec, uint64_t idx) {
+		if (hasExplicitValueLengths()) return getK2vs(spec)[idx] >> k2vOffsetBits;
+
+		uint64_t local_v_offset = getK2vs(spec)[idx];
 		if (idx == spec.nitemsUsed() - 1) {
 			// fmt::print(" - len from {} - {} = {}\n", spec.valsLength , local_v_offset,spec.valsLength - local_v_offset);
 			return spec.valsLength - local_v_offset;
 		} else {
-			uint64_t local_v_offset_next = reinterpret_cast<uint64_t*>(static_cast<char*>(basePointer) + spec.k2vsOffset)[idx+1];
-			return local_v_offset_next - local_v_offset;
+			return getK2vs(spec)[idx+1] - local_v_offset;
 		}
 	}
+
+	// Finished delta runs, oldest first.
+	inline int numDeltas() const { return meta()->nDeltas; }
+	inline int deltaLevel(int d) const { return meta()->deltas[d].lvl; }
+	inline LevelSpec& getDeltaSpec(int d) { return meta()->deltas[d].spec; }
+	inline bool haveDeltas(int lvl) const {
+		for (int d=0; d<meta()->nDeltas; d++) if (meta()->deltas[d].lvl == lvl) return true;
+		return false;
+	}
+
+	// Which tiles of level @lvl exist, without touching its keys. An invalid view if the level has no (up to date)
+	// occupancy segment. Covers the base arrays only: check delta runs separately.
+	OccupancyView occupancy(int lvl) const;
+	// Write the occupancy segments that levels are missing (files from before they existed), at the end of the file.
+	// Returns the number written.
+	int addMissingOccupancy();
+
 	inline bool isTerrain() const { return meta()->rasterType == FileMeta::RasterType::eTerrain; }
+	// The codec of every value in the file (pass it to encodeValue()/decodeValue()).
+	inline FileMeta::CodecOverride codec() const { return meta()->codecOverride; }
+
+	inline bool hasExplicitValueLengths() const { return meta()->valueLengths == FileMeta::ValueLengths::eExplicit; }
+	// Whether writeKeyValue() stores repeated values once (EnvOptions::dedupValues).
+	inline bool dedupValues() const { return dedupValues_; }
+	// Throws if any level was already written.
+	void setValueLengths(FileMeta::ValueLengths v);
+
+	inline FileMeta::KeyOrder keyOrder() const { return meta()->keyOrder; }
+	// Throws if any level was already written.
+	void setKeyOrder(FileMeta::KeyOrder order);
+
+	// The value that keys are sorted by under this file's KeyOrder.
+	inline uint64_t orderedKey(uint64_t key) const {
+		switch (meta()->keyOrder) {
+			case FileMeta::KeyOrder::eMorton: {
+				BlockCoordinate bc(key);
+				return (key & (0b111111ull << 58)) | mortonIndex(bc.y(), bc.x());
+			}
+			case FileMeta::KeyOrder::eHilbert: {
+				BlockCoordinate bc(key);
+				return (key & (0b111111ull << 58)) | hilbertIndex(bc.z(), bc.y(), bc.x());
+			}
+			default: return key;
+		}
+	}
 
   bool copyLevelFrom(uint64_t lvl,
     const uint8_t* start,
@@ -141,15 +257,82 @@ class FlatEnvironment : public BaseEnvironment<FlatEnvironment> {
     uint64_t valOff, uint64_t valLen,
     bool finalLevel);
 
+	// A byte range of another open file (see writeLevelFromFiles).
+	struct FileRange {
+		int fd;
+		uint64_t offset, len;
+	};
+	// Write level @lvl in one go: the @n @keys (sorted by orderedKey) and @k2vs (in this file's value lengths format,
+	// relative to the start of the level's values), then the values, which are @ranges one after the other.
+	// Unlike copyLevelFrom, the values do not pass through memory: each range is copied file to file with
+	// copy_file_range(), which the filesystem may turn into a reflink (btrfs, XFS) or a server side copy (NFS).
+	// Returns the number of value bytes written.
+	uint64_t writeLevelFromFiles(uint64_t lvl, const uint64_t* keys, const uint64_t* k2vs, uint64_t n,
+			const std::vector<FileRange>& ranges, bool finalLevel);
+
+	// These (and lookupMany, lookupRow, locateValue, readValue) see delta runs: the newest run with the key wins
+	// over older runs and the base arrays.
 	bool keyExists(uint64_t lvl, uint64_t key);
 	Value lookup(uint64_t lvl, uint64_t idx);
 
+	// Returns the index of @key within level @lvl's (base) keys array, or -1.
+	// Uses the in-memory KeyIndex if one is enabled for the level, otherwise binary searches the mmaped keys.
+	int64_t findKeyIdx(uint64_t lvl, uint64_t key);
+	// Returns the index of the first key >= @key within level @lvl's keys array (nitemsUsed() if there is none).
+	int64_t lowerBoundIdx(uint64_t lvl, uint64_t key);
+
+	// Batched lookup of @n keys on one level. @keys need not be sorted: out[i] is the value for keys[i]
+	// (or an empty Value). Requests are visited in sorted order, galloping through the keys array from the
+	// previous hit, so a cluster of nearby keys costs one search plus a few local probes.
+	// Returns the number of keys found.
+	int64_t lookupMany(uint64_t lvl, const uint64_t* keys, Value* out, int64_t n);
+
+	// Lookup every tile on row @y with x in [x0, x1) using one search followed by a linear scan
+	// (the row is contiguous in the keys array if the file is eRowMajor, otherwise this uses lookupMany). out[x-x0] is set for each x (empty Value if not present).
+	// Returns the number of keys found.
+	int64_t lookupRow(uint64_t lvl, uint64_t y, uint64_t x0, uint64_t x1, Value* out);
+
+	// Where the value for @key lies in the file (len is 0 if the key is not present).
+	struct ValueLocation {
+		uint64_t offset=0, len=0;
+	};
+	ValueLocation locateValue(uint64_t lvl, uint64_t key);
+	// The mmaped bytes at @loc (which must come from locateValue()).
+	inline Value mappedValue(const ValueLocation& loc) {
+		if (loc.len == 0) return {};
+		return Value { static_cast<char*>(basePointer) + (loc.offset - mapOffset_), loc.len };
+	}
+	// pread() the @loc.len bytes at @loc into @buf.
+	void readLocation(const ValueLocation& loc, void* buf);
+
+	// pread() the value for @key into @buf. Unlike lookup(), this never touches the mmaped value pages.
+	// Returns the value length, or -1 if the key is not present.
+	// If the length is larger than @bufLen nothing is read: retry with a larger buffer.
+	int64_t readValue(uint64_t lvl, uint64_t key, void* buf, uint64_t bufLen);
+
+	inline ValueReadMode valueReadMode() const { return valueReadMode_; }
+	inline int ioQueueDepth() const { return ioQueueDepth_; }
+
+	// Levels with fewer keys than this are just binary searched.
+	static constexpr int64_t minKeysForIndex = 4096;
+
 	static uint64_t constexpr INVALID_LVL = 99999;
 	uint64_t currentLvl = INVALID_LVL;
 	uint64_t currentEnd = 0;
 
+	// Set while writing a delta run (between beginDelta() and endLevel()).
+	int currentDelta = -1;
+
 	bool writeKeyValue(uint64_t key, void* val, uint64_t valLen);
 
+	// Start a delta run for level @lvl, written with writeKeyValue() and finished with endLevel() like a level.
+	// The run is appended at the end of the file, so writing it costs time proportional to the tiles written.
+	// Throws if there are already FileMeta::maxDeltas runs (use mergeLevel() into a new file).
+	bool beginDelta(int lvl);
+	// Write level @lvl of this file into @dst (as its level @lvl) with all of its delta runs folded in.
+	// @dst must have the same KeyOrder.
+	void mergeLevel(int lvl, FlatEnvironment& dst, bool finalLevel);
+
 	bool beginLevel(int lvl);
 	bool endLevel(bool finalLevel); // trims the value buffer to set capacity closer to length (but still block aligned). If finalLevel is true, trim file as well
 	uint64_t growLevelKeys();
@@ -158,6 +341,47 @@ class FlatEnvironment : public BaseEnvironment<FlatEnvironment> {
 	void printFirstLastEightCurLvl();
 	void printSomeInfo();
 
+	private:
+
+	// Lazily built in-memory key indices, one per level.
+	// Held through a shared_ptr so that FlatEnvironment stays copy-assignable (see FlatReader::refreshMemMap).
+	// Each level's index is a shared_ptr snapshot, swapped with std::atomic_store() when the level grows: readers
+	// take no lock, and an index that was replaced is freed once the last lookup still holding it is done.
+	struct KeyIndexSet {
+		std::mutex mtx;
+		std::shared_ptr<const KeyIndex> levels[26];
+	};
+	std::shared_ptr<KeyIndexSet> keyIndices_;
+
+	// Returns nullptr if the level should not (or cannot yet) use an index. Keep the pointer for the whole lookup.
+	std::shared_ptr<const KeyIndex> getKeyIndex(uint64_t lvl);
+
+	// The spec that writeKeyValue() and the grow functions work on: the current level's or the current delta's.
+	LevelSpec& writeSpec();
+
+	// Index of @key in finished delta run @d (binary searched), or -1.
+	int64_t findInDelta(int d, uint64_t key);
+	// Newest finished delta run of @lvl that has @key (with its index in @idx), or -1.
+	int findDelta(uint64_t lvl, uint64_t key, int64_t& idx);
+
+	// Build the occupancy segment of finished level @lvl and write it at @offset (block aligned), growing the file
+	// if needed. Returns the block aligned end of the segment, or @offset if the level gets none.
+	uint64_t writeOccupancy(int lvl, uint64_t offset);
+
+	ValueReadMode valueReadMode_ = ValueReadMode::eMmap;
+	int ioQueueDepth_ = 64;
+	uint64_t mapOffset_ = 0;
+
+	// Recently written values of the current level/run, by hash. Direct mapped: a slot is overwritten by the next
+	// value hashing to it, so memory is bounded while frequent values (nodata, ocean) stay found.
+	struct DedupSlot {
+		uint64_t hash=0, offset=0, len=0;
+	};
+	static constexpr int dedupSlotsLog2 = 20;
+	bool dedupValues_ = false;
+	std::vector<DedupSlot> dedupSlots_;
+	uint64_t dedupHits_ = 0, dedupSavedBytes_ = 0;
+
 };
 
 
@@ -0,0 +1,296 @@
+#include "merge.h"
+#include "flat_env.h"
+#include "reader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace frast {
+
+	MergeResolve parseMergeResolve(const std::string& name) {
+		if (name == "last") return MergeResolve::eLast;
+		if (name == "first") return MergeResolve::eFirst;
+		if (name == "largest") return MergeResolve::eLargest;
+		if (name == "error") return MergeResolve::eError;
+		throw std::runtime_error(fmt::format("unknown merge resolve rule '{}' (expected last, first, largest or error)", name));
+	}
+
+	namespace {
+
+		// Peek at a file's FileMeta, to open it with the right EnvOptions::isTerrain.
+		bool fileIsTerrain(const std::string& path, const char* who) {
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw std::runtime_error(fmt::format("{}: cannot open '{}': {}", who, path, strerror(errno)));
+			FlatEnvironment::FileMeta meta;
+			ssize_t r = pread(fd, &meta, sizeof(meta), 0);
+			close(fd);
+			if (r != sizeof(meta)) throw std::runtime_error(fmt::format("{}: '{}' is not a .ft file", who, path));
+			return meta.rasterType == FlatEnvironment::FileMeta::RasterType::eTerrain;
+		}
+
+		std::vector<std::unique_ptr<FlatEnvironment>> openInputs(const std::vector<std::string>& paths, const char* who) {
+			bool terrain = fileIsTerrain(paths[0], who);
+			std::vector<std::unique_ptr<FlatEnvironment>> ins;
+			for (auto& path : paths) {
+				if (fileIsTerrain(path, who) != terrain) throw std::runtime_error(fmt::format("{}: inputs mix terrain and color files", who));
+				ins.push_back(std::make_unique<FlatEnvironment>(path, EnvOptions::getReadonly(terrain)));
+				auto& in = *ins.back();
+				if (in.numDeltas() > 0)
+					throw std::runtime_error(fmt::format("{}: '{}' has delta runs, run `frastTool --action mergeDeltas` on it first", who, path));
+				if (in.keyOrder() != ins[0]->keyOrder())
+					throw std::runtime_error(fmt::format("{}: '{}' has a different KeyOrder than '{}'", who, path, paths[0]));
+				if (in.hasExplicitValueLengths() != ins[0]->hasExplicitValueLengths())
+					throw std::runtime_error(fmt::format("{}: '{}' has a different value lengths format than '{}'", who, path, paths[0]));
+				if (in.codec() != ins[0]->codec())
+					throw std::runtime_error(fmt::format("{}: '{}' has a different codec than '{}'", who, path, paths[0]));
+			}
+			return ins;
+		}
+
+		std::unique_ptr<FlatEnvironment> createOutput(const std::string& path, FlatEnvironment& like) {
+			EnvOptions opts;
+			opts.isTerrain = like.isTerrain();
+			opts.codec = static_cast<uint8_t>(like.codec());
+			auto out = std::make_unique<FlatEnvironment>(path, opts);
+			out->setKeyOrder(like.keyOrder());
+			out->setValueLengths(like.meta()->valueLengths);
+			return out;
+		}
+
+		// The keys, k2vs and value ranges of the output level being put together.
+		class LevelParts {
+			public:
+				explicit LevelParts(bool explicitLengths) : explicitLengths(explicitLengths) {}
+
+				// Append @key, whose value is the @len bytes at (absolute) offset @srcOffset of input @input.
+				inline void add(uint64_t key, uint32_t input, int fd, uint64_t srcOffset, uint64_t len) {
+					keys.push_back(key);
+
+					// With explicit lengths, a value shared by several keys of an input (dedupValues) stays shared.
+					uint64_t sharedId = static_cast<uint64_t>(input) << 48 | srcOffset;
+					if (explicitLengths) {
+						auto it = shared.find(sharedId);
+						if (it != shared.end()) {
+							k2vs.push_back(it->second | len << FlatEnvironment::k2vOffsetBits);
+							return;
+						}
+					}
+
+					uint64_t dst = valsLength;
+					if (not ranges.empty() and ranges.back().fd == fd and ranges.back().offset + ranges.back().len == srcOffset)
+						ranges.back().len += len;
+					else
+						ranges.push_back(FlatEnvironment::FileRange { fd, srcOffset, len });
+					valsLength += len;
+
+					if (explicitLengths) {
+						if (valsLength > FlatEnvironment::k2vOffsetMask)
+							throw std::runtime_error("a merged level's values exceed what explicit value lengths can address");
+						k2vs.push_back(dst | len << FlatEnvironment::k2vOffsetBits);
+						shared[sharedId] = dst;
+					} else {
+						k2vs.push_back(dst);
+					}
+				}
+
+				inline uint64_t size() const { return keys.size(); }
+
+				// Write level @lvl of @out and start over.
+				void write(FlatEnvironment& out, int lvl, bool finalLevel, MergeStats& stats) {
+					stats.valueBytes += out.writeLevelFromFiles(lvl, keys.data(), k2vs.data(), keys.size(), ranges, finalLevel);
+					stats.tiles += keys.size();
+					stats.copies += ranges.size();
+					keys.clear();
+					k2vs.clear();
+					ranges.clear();
+					shared.clear();
+					valsLength = 0;
+				}
+
+			private:
+				bool explicitLengths;
+				std::vector<uint64_t> keys, k2vs;
+				std::vector<FlatEnvironment::FileRange> ranges;
+				uint64_t valsLength = 0;
+				std::unordered_map<uint64_t, uint64_t> shared;
+		};
+
+		// Add the @idx'th key of level @lvl of @in (input number @input) to @parts.
+		inline void addFrom(LevelParts& parts, FlatEnvironment& in, uint32_t input, int lvl, uint64_t idx) {
+			auto& spec = in.getLevelSpec(lvl);
+			parts.add(in.getKeys(spec)[idx], input, in.getFd(),
+					spec.valsOffset + in.getValueOffset(spec, idx), in.getValueLen(spec, idx));
+		}
+
+		// The next key of one input, in the heap of the k-way merge (smallest ordered key on top, then lowest input).
+		struct Head {
+			uint64_t okey;
+			uint32_t input;
+			uint64_t idx;
+			inline bool operator>(const Head& o) const { return okey != o.okey ? okey > o.okey : input > o.input; }
+		};
+
+	}
+
+	MergeStats mergeFiles(const std::vector<std::string>& inPaths, const std::string& outPath, MergeResolve resolve) {
+		if (inPaths.empty()) throw std::runtime_error("mergeFiles: no inputs");
+		if (access(outPath.c_str(), F_OK) == 0) throw std::runtime_error(fmt::format("mergeFiles: '{}' already exists", outPath));
+
+		auto ins = openInputs(inPaths, "mergeFiles");
+		auto out = createOutput(outPath, *ins[0]);
+
+		std::vector<int> levels;
+		for (int lvl=0; lvl<MAX_LVLS; lvl++)
+			for (auto& in : ins)
+				if (in->haveLevel(lvl)) {
+					levels.push_back(lvl);
+					break;
+				}
+
+		MergeStats stats;
+		LevelParts parts(ins[0]->hasExplicitValueLengths());
+		try {
+			for (size_t j=0; j<levels.size(); j++) {
+				int lvl = levels[j];
+				bool finalLevel = j == levels.size() - 1;
+
+				std::vector<uint32_t> have;
+				for (uint32_t i=0; i<ins.size(); i++)
+					if (ins[i]->haveLevel(lvl)) have.push_back(i);
+
+				if (have.size() == 1) {
+					// Implicit lengths make this one run from the level's first value to its last.
+					auto& in = *ins[have[0]];
+					uint64_t n = in.getLevelSpec(lvl).nitemsUsed();
+					for (uint64_t i=0; i<n; i++) addFrom(parts, in, have[0], lvl, i);
+					fmt::print(" - [mergeFiles] lvl {}: copying {} tiles from '{}'\n", lvl, n, inPaths[have[0]]);
+					parts.write(*out, lvl, finalLevel, stats);
+					stats.levelsCopied++;
+					continue;
+				}
+
+				std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heap;
+				for (uint32_t i : have) heap.push(Head { ins[i]->orderedKey(ins[i]->getKeys(lvl)[0]), i, 0 });
+
+				uint64_t ndups = 0;
+				while (not heap.empty()) {
+					// Pop every input's copy of the smallest key. They come by ascending input.
+					uint64_t okey = heap.top().okey;
+					Head win = heap.top();
+					uint64_t winLen = 0;
+					int copies = 0;
+					while (not heap.empty() and heap.top().okey == okey) {
+						Head h = heap.top();
+						heap.pop();
+						auto& in = *ins[h.input];
+						auto& spec = in.getLevelSpec(lvl);
+						uint64_t len = in.getValueLen(spec, h.idx);
+						if (copies == 0 or resolve == MergeResolve::eLast or (resolve == MergeResolve::eLargest and len >= winLen))
+							win = h, winLen = len;
+						copies++;
+						if (h.idx + 1 < spec.nitemsUsed())
+							heap.push(Head { in.orderedKey(in.getKeys(spec)[h.idx+1]), h.input, h.idx + 1 });
+					}
+
+					if (copies > 1 and resolve == MergeResolve::eError) {
+						BlockCoordinate bc(ins[win.input]->getKeys(lvl)[win.idx]);
+						throw std::runtime_error(fmt::format("mergeFiles: tile {} {} {} is in several inputs", bc.z(), bc.y(), bc.x()));
+					}
+
+					addFrom(parts, *ins[win.input], win.input, lvl, win.idx);
+					ndups += copies - 1;
+				}
+
+				fmt::print(" - [mergeFiles] lvl {}: merged {} tiles from {} inputs ({} duplicate keys)\n", lvl, parts.size(), have.size(), ndups);
+				parts.write(*out, lvl, finalLevel, stats);
+				stats.duplicates += ndups;
+				stats.levelsMerged++;
+			}
+		} catch (...) {
+			// Don't leave a file that looks complete.
+			out.reset();
+			unlink(outPath.c_str());
+			throw;
+		}
+
+		return stats;
+	}
+
+	MergeStats extractFile(const std::string& inPath, const std::string& outPath, const double wmTlbr[4]) {
+		if (access(outPath.c_str(), F_OK) == 0) throw std::runtime_error(fmt::format("extractFile: '{}' already exists", outPath));
+		if (not (wmTlbr[0] < wmTlbr[2] and wmTlbr[1] < wmTlbr[3]))
+			throw std::runtime_error("extractFile: the tlbr should be x0 y0 x1 y1 with x0 < x1 and y0 < y1");
+		for (int i=0; i<4; i++)
+			if (std::abs(wmTlbr[i]) > WebMercatorMapScale) throw std::runtime_error("extractFile: the tlbr is outside of the map");
+
+		auto ins = openInputs({ inPath }, "extractFile");
+		auto& in = *ins[0];
+		bool rowMajor = in.keyOrder() == FlatEnvironment::FileMeta::KeyOrder::eRowMajor;
+
+		// Select every level's tiles first: the output's last level has to be known to be truncated.
+		struct Selected {
+			int lvl;
+			std::vector<uint64_t> idxs;
+		};
+		std::vector<Selected> selected;
+		for (int lvl=0; lvl<MAX_LVLS; lvl++) {
+			if (not in.haveLevel(lvl)) continue;
+			auto& spec = in.getLevelSpec(lvl);
+			const uint64_t* keys = in.getKeys(spec);
+			uint64_t n = spec.nitemsUsed();
+
+			uint32_t tlbr[4];
+			dwm_to_iwm(tlbr, wmTlbr, lvl);
+			for (int i=2; i<4; i++) tlbr[i] = std::min(tlbr[i], 1u << lvl);
+
+			Selected sel { lvl, {} };
+			if (rowMajor) {
+				// One search per row, then a scan of the row's run of keys.
+				for (uint32_t y=tlbr[1]; y<tlbr[3]; y++) {
+					uint64_t end = BlockCoordinate(lvl, y, tlbr[2]).c;
+					for (uint64_t i = in.lowerBoundIdx(lvl, BlockCoordinate(lvl, y, tlbr[0]).c); i < n and keys[i] < end; i++)
+						sel.idxs.push_back(i);
+				}
+			} else {
+				// Morton and Hilbert orders keep the area in a few runs, but finding them is not worth it: the scan
+				// only reads keys.
+				for (uint64_t i=0; i<n; i++) {
+					BlockCoordinate bc(keys[i]);
+					if (bc.x() >= tlbr[0] and bc.x() < tlbr[2] and bc.y() >= tlbr[1] and bc.y() < tlbr[3]) sel.idxs.push_back(i);
+				}
+			}
+			if (not sel.idxs.empty()) selected.push_back(std::move(sel));
+		}
+		if (selected.empty()) throw std::runtime_error(fmt::format("extractFile: '{}' has no tile in the tlbr", inPath));
+
+		auto out = createOutput(outPath, in);
+		MergeStats stats;
+		LevelParts parts(in.hasExplicitValueLengths());
+		try {
+			for (size_t j=0; j<selected.size(); j++) {
+				auto& sel = selected[j];
+				for (uint64_t i : sel.idxs) addFrom(parts, in, 0, sel.lvl, i);
+				uint64_t copies0 = stats.copies;
+				parts.write(*out, sel.lvl, j == selected.size() - 1, stats);
+				fmt::print(" - [extractFile] lvl {}: {} of {} tiles in {} runs\n", sel.lvl, sel.idxs.size(),
+						in.getLevelSpec(sel.lvl).nitemsUsed(), stats.copies - copies0);
+				stats.levelsCopied++;
+			}
+		} catch (...) {
+			out.reset();
+			unlink(outPath.c_str());
+			throw;
+		}
+
+		return stats;
+	}
+
+}
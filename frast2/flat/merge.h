@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace frast {
+
+	//
+	// Builds new .ft files out of existing ones without decoding any tile: mergeFiles() joins several files (e.g. the
+	// partial files of a sharded conversion, `frastFlatWriter --shard i --shards n`), extractFile() cuts an area of
+	// interest out of one.
+	//
+	// Both stream level by level: the keys and k2vs of a level are put together in memory, then its values are copied
+	// file to file (FlatEnvironment::writeLevelFromFiles). Runs of values that sit back to back in an input stay one
+	// copy, so a level only one input has, or a row of an extract, is one large sequential copy_file_range().
+	//
+	// The inputs must share their raster type, KeyOrder, value lengths format and codec, and must not have delta runs
+	// (see `frastTool --action mergeDeltas`). The output has the same formats. @outPath must not exist.
+	//
+
+	// Which copy of a key that several inputs have goes to the output.
+	enum class MergeResolve {
+		// The one of the last input that has it (in inPaths order), like with delta runs.
+		eLast,
+		// The one of the first input that has it.
+		eFirst,
+		// The largest encoded value (ties go to the last input): with nodata compressing well, usually the most
+		// complete tile, e.g. where two shards of a conversion both cover the seam.
+		eLargest,
+		// Throw: the inputs are expected to be disjoint.
+		eError,
+	};
+
+	// "last", "first", "largest" or "error". Throws on anything else.
+	MergeResolve parseMergeResolve(const std::string& name);
+
+	struct MergeStats {
+		uint64_t tiles = 0, valueBytes = 0;
+		// Keys that more than one input had (only one copy is kept).
+		uint64_t duplicates = 0;
+		// Number of copy_file_range() runs the values took.
+		uint64_t copies = 0;
+		int levelsCopied = 0, levelsMerged = 0;
+	};
+
+	MergeStats mergeFiles(const std::vector<std::string>& inPaths, const std::string& outPath,
+			MergeResolve resolve = MergeResolve::eLast);
+
+	// Copy the tiles of @inPath that intersect @wmTlbr (Web Mercator meters: x0 y0 x1 y1) to @outPath, on every level.
+	// Levels without any such tile are left out. Throws if there is none at all.
+	MergeStats extractFile(const std::string& inPath, const std::string& outPath, const double wmTlbr[4]);
+
+}
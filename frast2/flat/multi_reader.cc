@@ -0,0 +1,201 @@
+#include "multi_reader.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+
+#include "frast2/errors.h"
+
+namespace frast {
+
+	FlatMultiReader::FlatMultiReader(const std::vector<std::string>& paths, const EnvOptions& opts, const std::vector<int>& priorities) {
+		if (paths.size() == 0) throw std::runtime_error("FlatMultiReader needs at least one file");
+		if (paths.size() > std::numeric_limits<uint16_t>::max()) throw std::runtime_error("FlatMultiReader: too many files");
+		if (priorities.size() and priorities.size() != paths.size())
+			throw std::runtime_error("FlatMultiReader: need one priority per file (or none)");
+
+		for (auto& path : paths) readers.push_back(std::make_unique<FlatReaderCached>(path, opts));
+
+		byPriority.resize(paths.size());
+		std::iota(byPriority.begin(), byPriority.end(), 0);
+		if (priorities.size())
+			std::stable_sort(byPriority.begin(), byPriority.end(), [&](int a, int b) { return priorities[a] > priorities[b]; });
+
+		for (auto& reader : readers) {
+			uint32_t iwmTlbr[4];
+			std::array<double,4> dwmTlbr { 0, 0, 0, 0 };
+			int64_t lvl = reader->determineTlbr(iwmTlbr);
+			if (lvl >= 0) iwm_to_dwm(dwmTlbr.data(), iwmTlbr, lvl);
+			fileBounds.push_back(dwmTlbr);
+		}
+
+		// Collect (cell, rank) for every cell any file touches, sort, then store the ranks as reader indices.
+		std::vector<std::pair<uint64_t,uint16_t>> cellRanks;
+		int nscanned = 0;
+		for (size_t rank=0; rank<byPriority.size(); rank++) {
+			FlatEnvironment& env = readers[byPriority[rank]]->env;
+
+			// From the occupancy segment: every cell of every non-empty 64² block that has a tile.
+			auto addOccupancy = [&](int lvl, const OccupancyView& occ) {
+				constexpr uint32_t B = OccupancyView::blockSize;
+				occ.forEachBlock([&](uint32_t bx0, uint32_t by0) {
+					for (uint32_t cy = by0 >> cellShift; cy <= (by0 + B - 1) >> cellShift; cy++)
+						for (uint32_t cx = bx0 >> cellShift; cx <= (bx0 + B - 1) >> cellShift; cx++)
+							if (occ.anyIn(cx << cellShift, cy << cellShift, (cx+1) << cellShift, (cy+1) << cellShift))
+								cellRanks.push_back({BlockCoordinate{(uint64_t)lvl, cy, cx}.c, static_cast<uint16_t>(rank)});
+				});
+			};
+
+			// From the keys, for runs without an occupancy segment.
+			auto addRun = [&](const FlatEnvironment::LevelSpec& spec) {
+				nscanned++;
+				uint64_t* keys = env.getKeys(spec);
+				uint64_t n = spec.nitemsUsed();
+				uint64_t last = 0;
+				for (uint64_t i=0; i<n; i++) {
+					uint64_t c = cellKey(keys[i]);
+					// Consecutive keys mostly share a cell, so this removes most duplicates early.
+					if (i > 0 and c == last) continue;
+					cellRanks.push_back({c, static_cast<uint16_t>(rank)});
+					last = c;
+				}
+			};
+
+			for (int lvl=0; lvl<MAX_LVLS; lvl++) {
+				if (not env.haveLevel(lvl)) continue;
+				OccupancyView occ = env.occupancy(lvl);
+				if (occ.valid()) addOccupancy(lvl, occ);
+				else addRun(env.getLevelSpec(lvl));
+			}
+			for (int d=0; d<env.numDeltas(); d++) addRun(env.getDeltaSpec(d));
+		}
+
+		std::sort(cellRanks.begin(), cellRanks.end());
+		cellRanks.erase(std::unique(cellRanks.begin(), cellRanks.end()), cellRanks.end());
+
+		for (size_t i=0; i<cellRanks.size(); ) {
+			size_t j = i;
+			CellSources cs { static_cast<uint32_t>(cellSourceList.size()), 0 };
+			for (; j<cellRanks.size() and cellRanks[j].first == cellRanks[i].first; j++) {
+				cellSourceList.push_back(byPriority[cellRanks[j].second]);
+				cs.count++;
+			}
+			cells[cellRanks[i].first] = cs;
+			i = j;
+		}
+
+		fmt::print(" - [FlatMultiReader] opened {} files, {} coverage cells ({} key runs scanned)\n", readers.size(), cells.size(), nscanned);
+	}
+
+	int FlatMultiReader::findSource(uint64_t tile) {
+		uint32_t n;
+		const uint16_t* srcs = cellSources(tile, n);
+		for (uint32_t j=0; j<n; j++)
+			if (readers[srcs[j]]->tileExists(tile)) return srcs[j];
+		return -1;
+	}
+
+	bool FlatMultiReader::tileExists(uint64_t tile) {
+		return findSource(tile) >= 0;
+	}
+
+	cv::Mat FlatMultiReader::getTile(uint64_t tile, int channels) {
+		cv::Mat out;
+		if (getTile(out, tile, channels)) return cv::Mat{};
+		return out;
+	}
+
+	bool FlatMultiReader::getTile(cv::Mat& out, uint64_t tile, int channels) {
+		uint32_t n;
+		const uint16_t* srcs = cellSources(tile, n);
+		for (uint32_t j=0; j<n; j++)
+			if (not readers[srcs[j]]->getTile(out, tile, channels)) return false;
+		return true;
+	}
+
+	bool FlatMultiReader::getTileInto(cv::Mat& dst, uint64_t tile, int channels) {
+		uint32_t n;
+		const uint16_t* srcs = cellSources(tile, n);
+		for (uint32_t j=0; j<n; j++)
+			if (not readers[srcs[j]]->getTileInto(dst, tile, channels)) return false;
+		return true;
+	}
+
+	cv::Mat FlatMultiReader::getTlbr(uint64_t lvl, uint32_t tlbr[4], int channels) {
+		constexpr int tileSize = FlatReader::tileSize;
+		uint64_t h = tlbr[3] - tlbr[1];
+		uint64_t w = tlbr[2] - tlbr[0];
+		int cvType = isTerrain() ? CV_16UC1 : CV_MAKETYPE(CV_8U, channels);
+
+		cv::Mat out(tileSize*h, tileSize*w, cvType);
+		for (uint64_t y=0; y<h; y++) {
+			for (uint64_t x=0; x<w; x++) {
+				int yy = h-1-y;
+				cv::Mat dst = out(cv::Rect{(int)x*tileSize, yy*tileSize, tileSize, tileSize});
+
+				if (getTileInto(dst, BlockCoordinate{lvl, tlbr[1]+y, tlbr[0]+x}.c, channels)) dst = cv::Scalar{0};
+			}
+		}
+
+		return out;
+	}
+
+	namespace {
+		// Fill pixels of @out that are not yet @filled from @img, where @img is not all-zero.
+		template <class T>
+		void composite_(cv::Mat& out, cv::Mat& filled, const cv::Mat& img) {
+			int C = out.channels();
+			for (int y=0; y<out.rows; y++) {
+				T* o = out.ptr<T>(y);
+				const T* s = img.ptr<T>(y);
+				uint8_t* f = filled.ptr<uint8_t>(y);
+				for (int x=0; x<out.cols; x++) {
+					if (f[x]) continue;
+					bool any = false;
+					for (int c=0; c<C; c++) any |= s[x*C+c] != 0;
+					if (any) {
+						for (int c=0; c<C; c++) o[x*C+c] = s[x*C+c];
+						f[x] = 1;
+					}
+				}
+			}
+		}
+	}
+
+	cv::Mat FlatMultiReader::rasterIo(const double tlbr[4], int w, int h, int c) {
+		std::vector<int> candidates;
+		for (int i : byPriority) {
+			auto& b = fileBounds[i];
+			if (b[0] < tlbr[2] and tlbr[0] < b[2] and b[1] < tlbr[3] and tlbr[1] < b[3]) candidates.push_back(i);
+		}
+
+		if (candidates.size() == 0) throw NoValidLevelError((tlbr[2] - tlbr[0]) / w, 0);
+		if (candidates.size() == 1) return readers[candidates[0]]->rasterIo(tlbr, w, h, c);
+
+		cv::Mat out, filled;
+		for (int i : candidates) {
+			cv::Mat img;
+			try {
+				img = readers[i]->rasterIo(tlbr, w, h, c);
+			} catch (NoValidLevelError& e) {
+				continue;
+			}
+			if (img.empty()) continue;
+
+			if (out.empty()) {
+				out.create(img.rows, img.cols, img.type());
+				out = cv::Scalar{0};
+				filled = cv::Mat(img.rows, img.cols, CV_8UC1, cv::Scalar{0});
+			}
+
+			if (out.depth() == CV_16U) composite_<uint16_t>(out, filled, img);
+			else composite_<uint8_t>(out, filled, img);
+
+			if (static_cast<size_t>(cv::countNonZero(filled)) == filled.total()) break;
+		}
+
+		return out;
+	}
+
+}
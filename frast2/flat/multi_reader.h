@@ -0,0 +1,78 @@
+#pragma once
+
+#include "reader.h"
+
+#include <unordered_map>
+
+namespace frast {
+
+	//
+	// Reads many .ft files (e.g. one per state) as if they were one dataset.
+	//
+	// On open, the tiles of every level of every file are grouped into cells of 2^cellShift x 2^cellShift tiles,
+	// and each cell lists the files that have at least one tile in it, highest priority first. The cells come from
+	// the levels' occupancy segments (see occupancy.h), so opening costs about one check per occupied 16² cell and
+	// never touches the keys. Only delta runs, and levels of files from before occupancy segments (see
+	// `frastTool --action addOccupancy`), are read key by key.
+	// A request for a tile then only probes the files listed for its cell (normally one, a few along borders),
+	// instead of searching each of the N files.
+	//
+	// Where files overlap, the highest priority file that has the tile wins.
+	// If no priorities are given, files given earlier have higher priority.
+	//
+	class FlatMultiReader {
+		public:
+			FlatMultiReader(const std::vector<std::string>& paths, const EnvOptions& opts, const std::vector<int>& priorities = {});
+
+			static constexpr int cellShift = 4;
+
+			// Index (into the given paths) of the highest priority file that has @tile, or -1.
+			int findSource(uint64_t tile);
+
+			bool tileExists(uint64_t tile);
+			// These look the tile up once per file probed (do not check tileExists() first): the first of the cell's
+			// files that decodes it wins.
+			cv::Mat getTile(uint64_t tile, int channels);
+			bool getTile(cv::Mat& out, uint64_t tile, int channels); // true if the tile does not exist
+			// In place into @dst, see FlatReader::getTileInto.
+			bool getTileInto(cv::Mat& dst, uint64_t tile, int channels);
+
+			// Like FlatReaderCached::getTlbr, but each tile comes from its own source.
+			cv::Mat getTlbr(uint64_t lvl, uint32_t tlbr[4], int channels);
+
+			// Calls rasterIo on only the files whose extent overlaps @tlbr. Where more than one does, the output is
+			// composited in priority order (pixels that are zero in a higher priority file are taken from the next).
+			cv::Mat rasterIo(const double tlbr[4], int w, int h, int c);
+
+			inline int size() const { return readers.size(); }
+			inline FlatReaderCached& getReader(int i) { return *readers[i]; }
+			inline bool isTerrain() const { return readers.size() and readers[0]->isTerrain(); }
+
+		private:
+			// In the order of the given paths.
+			std::vector<std::unique_ptr<FlatReaderCached>> readers;
+			// Web mercator extent of each file's deepest level.
+			std::vector<std::array<double,4>> fileBounds;
+			// Reader indices, highest priority first.
+			std::vector<int> byPriority;
+
+			struct CellSources {
+				uint32_t begin, count;
+			};
+			// Keyed by cellKey(). Each entry is a range of cellSourceList.
+			std::unordered_map<uint64_t, CellSources> cells;
+			std::vector<uint16_t> cellSourceList;
+
+			static inline uint64_t cellKey(uint64_t tile) {
+				BlockCoordinate bc(tile);
+				return BlockCoordinate{bc.z(), bc.y() >> cellShift, bc.x() >> cellShift}.c;
+			}
+			// The readers of @tile's cell, highest priority first (nullptr and 0 if none).
+			inline const uint16_t* cellSources(uint64_t tile, uint32_t& count) const {
+				auto it = cells.find(cellKey(tile));
+				count = it == cells.end() ? 0 : it->second.count;
+				return count ? cellSourceList.data() + it->second.begin : nullptr;
+			}
+	};
+
+}
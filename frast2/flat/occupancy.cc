@@ -0,0 +1,109 @@
+#include "occupancy.h"
+#include "frast2/coordinates.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace frast {
+
+	std::vector<uint8_t> buildOccupancy(int lvl, const uint64_t* keys, uint64_t n) {
+		constexpr int B = OccupancyView::blockLog2;
+		constexpr uint32_t S = OccupancyView::blockSize;
+		if (n == 0) return {};
+
+		OccupancyHeader hdr;
+		hdr.lvl = lvl;
+		hdr.nitems = n;
+		hdr.tlbr[0] = hdr.tlbr[1] = std::numeric_limits<uint32_t>::max();
+		for (uint64_t i=0; i<n; i++) {
+			BlockCoordinate bc(keys[i]);
+			hdr.tlbr[0] = std::min(hdr.tlbr[0], (uint32_t)bc.x());
+			hdr.tlbr[1] = std::min(hdr.tlbr[1], (uint32_t)bc.y());
+			hdr.tlbr[2] = std::max(hdr.tlbr[2], 1u+(uint32_t)bc.x());
+			hdr.tlbr[3] = std::max(hdr.tlbr[3], 1u+(uint32_t)bc.y());
+		}
+		hdr.gridW = (hdr.tlbr[2] - hdr.tlbr[0] + S - 1) >> B;
+		hdr.gridH = (hdr.tlbr[3] - hdr.tlbr[1] + S - 1) >> B;
+		uint64_t ncells = static_cast<uint64_t>(hdr.gridW) * hdr.gridH;
+		if (ncells > maxOccupancyGridCells) return {};
+
+		// Number the non-empty blocks in grid order, so that the bitmaps of a row of blocks are adjacent.
+		std::vector<uint32_t> grid(ncells, 0);
+		for (uint64_t i=0; i<n; i++) {
+			BlockCoordinate bc(keys[i]);
+			grid[((bc.y() - hdr.tlbr[1]) >> B) * hdr.gridW + ((bc.x() - hdr.tlbr[0]) >> B)] = 1;
+		}
+		for (auto& g : grid)
+			if (g) g = ++hdr.nblocks;
+
+		uint64_t gridBytes = (ncells * sizeof(uint32_t) + 7) & ~7ull;
+		uint64_t blocksOffset = sizeof(OccupancyHeader) + gridBytes;
+		std::vector<uint8_t> out(blocksOffset + static_cast<uint64_t>(hdr.nblocks) * S * sizeof(uint64_t), 0);
+		memcpy(out.data(), &hdr, sizeof(hdr));
+		memcpy(out.data() + sizeof(hdr), grid.data(), ncells * sizeof(uint32_t));
+
+		uint64_t* blocks = reinterpret_cast<uint64_t*>(out.data() + blocksOffset);
+		for (uint64_t i=0; i<n; i++) {
+			BlockCoordinate bc(keys[i]);
+			uint32_t x = bc.x() - hdr.tlbr[0], y = bc.y() - hdr.tlbr[1];
+			uint32_t blk = grid[(y >> B) * hdr.gridW + (x >> B)] - 1;
+			blocks[blk * S + (y & (S-1))] |= 1ull << (x & (S-1));
+		}
+
+		return out;
+	}
+
+	OccupancyView::OccupancyView(const void* segment, uint64_t length) {
+		if (segment == nullptr or length < sizeof(OccupancyHeader)) return;
+		auto h = static_cast<const OccupancyHeader*>(segment);
+		if (h->magic != OccupancyHeader::kMagic) return;
+
+		uint64_t ncells = static_cast<uint64_t>(h->gridW) * h->gridH;
+		uint64_t gridBytes = (ncells * sizeof(uint32_t) + 7) & ~7ull;
+		if (sizeof(OccupancyHeader) + gridBytes + static_cast<uint64_t>(h->nblocks) * blockSize * sizeof(uint64_t) > length) return;
+
+		hdr = h;
+		grid = reinterpret_cast<const uint32_t*>(h + 1);
+		blocks = reinterpret_cast<const uint64_t*>(reinterpret_cast<const uint8_t*>(grid) + gridBytes);
+	}
+
+	bool OccupancyView::has(uint32_t x, uint32_t y) const {
+		if (x < hdr->tlbr[0] or x >= hdr->tlbr[2] or y < hdr->tlbr[1] or y >= hdr->tlbr[3]) return false;
+		x -= hdr->tlbr[0];
+		y -= hdr->tlbr[1];
+		const uint64_t* b = block(x >> blockLog2, y >> blockLog2);
+		return b and ((b[y & (blockSize-1)] >> (x & (blockSize-1))) & 1);
+	}
+
+	bool OccupancyView::anyIn(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) const {
+		x0 = std::max(x0, hdr->tlbr[0]);
+		y0 = std::max(y0, hdr->tlbr[1]);
+		x1 = std::min(x1, hdr->tlbr[2]);
+		y1 = std::min(y1, hdr->tlbr[3]);
+		if (x0 >= x1 or y0 >= y1) return false;
+
+		// Relative to the grid from here on, and inclusive.
+		x0 -= hdr->tlbr[0]; x1 -= hdr->tlbr[0] + 1;
+		y0 -= hdr->tlbr[1]; y1 -= hdr->tlbr[1] + 1;
+
+		for (uint32_t by = y0 >> blockLog2; by <= (y1 >> blockLog2); by++) {
+			uint32_t ya = std::max(y0, by << blockLog2) & (blockSize-1);
+			uint32_t yb = std::min(y1, (by << blockLog2) + blockSize-1) & (blockSize-1);
+
+			for (uint32_t bx = x0 >> blockLog2; bx <= (x1 >> blockLog2); bx++) {
+				const uint64_t* b = block(bx, by);
+				if (b == nullptr) continue;
+
+				uint32_t xa = std::max(x0, bx << blockLog2) & (blockSize-1);
+				uint32_t xb = std::min(x1, (bx << blockLog2) + blockSize-1) & (blockSize-1);
+				uint64_t mask = (~0ull >> (blockSize-1 - xb)) & (~0ull << xa);
+
+				for (uint32_t y=ya; y<=yb; y++)
+					if (b[y] & mask) return true;
+			}
+		}
+		return false;
+	}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace frast {
+
+	//
+	// Which tiles of a level exist, as a small segment stored in the file next to the level (see
+	// FlatEnvironment::FileMeta::occupancy). Answers existence and extent queries without touching the keys.
+	//
+	// The level's tlbr is cut into blocks of 64x64 tiles. The segment is:
+	//       [1] OccupancyHeader
+	//       [2] uint32_t grid[gridH][gridW]: 0 for a block without tiles, otherwise 1 + the block's index in [3]
+	//       [3] nblocks bitmaps of 64 uint64_t, one per row of the block (bit i is tile x0+i)
+	//
+	// This is a one level quadtree: empty blocks cost 4 bytes, so sparse levels (strips, several AOIs) stay small.
+	//
+
+	struct OccupancyHeader {
+		static constexpr uint32_t kMagic = 0x6f636331; // "occ1"
+		uint32_t magic = kMagic;
+		uint32_t lvl = 0;
+		// Number of keys the segment was built from, so that a stale segment can be detected.
+		uint64_t nitems = 0;
+		// [x0, y0, x1, y1) in tiles, exact.
+		uint32_t tlbr[4] = {0,0,0,0};
+		uint32_t gridW = 0, gridH = 0;
+		uint32_t nblocks = 0, pad = 0;
+	};
+	static_assert(sizeof(OccupancyHeader) % 8 == 0);
+
+	// Grids larger than this (a level spread over most of the world at a high zoom) get no segment.
+	static constexpr uint64_t maxOccupancyGridCells = 1ull << 24;
+
+	// Build the segment for the @n keys (BlockCoordinates on level @lvl, in any order).
+	// Returns an empty vector if there are no keys or the grid would be too large.
+	std::vector<uint8_t> buildOccupancy(int lvl, const uint64_t* keys, uint64_t n);
+
+	class OccupancyView {
+		public:
+			static constexpr int blockLog2 = 6;
+			static constexpr uint32_t blockSize = 1u << blockLog2;
+
+			OccupancyView() = default;
+			// @segment must stay valid (it points into the mmaped file). Invalid if it is not a well formed segment.
+			OccupancyView(const void* segment, uint64_t length);
+
+			inline bool valid() const { return hdr != nullptr; }
+			inline const uint32_t* tlbr() const { return hdr->tlbr; }
+			inline uint64_t nitems() const { return hdr->nitems; }
+
+			bool has(uint32_t x, uint32_t y) const;
+			// Whether any tile in [x0,x1) x [y0,y1) exists.
+			bool anyIn(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) const;
+
+			// Call @f(x0, y0) with the first tile of every blockSize² block that has any tile (in grid order).
+			template <class F>
+			void forEachBlock(F&& f) const {
+				for (uint32_t by=0; by<hdr->gridH; by++)
+					for (uint32_t bx=0; bx<hdr->gridW; bx++)
+						if (grid[by * hdr->gridW + bx]) f(hdr->tlbr[0] + (bx << blockLog2), hdr->tlbr[1] + (by << blockLog2));
+			}
+
+		private:
+			const OccupancyHeader* hdr = nullptr;
+			const uint32_t* grid = nullptr;
+			const uint64_t* blocks = nullptr;
+
+			inline const uint64_t* block(uint32_t bx, uint32_t by) const {
+				uint32_t i = grid[by * hdr->gridW + bx];
+				return i == 0 ? nullptr : blocks + (i-1) * blockSize;
+			}
+	};
+
+}
@@ -0,0 +1,141 @@
+#include "pyramid.h"
+#include "codec.h"
+#include "decimate.h"
+
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace frast {
+
+	PyramidBuilder::PyramidBuilder(const std::string& spillPath, int baseLevel, const uint64_t baseTlbr[4], bool isTerrain, int interp, int minLevel,
+			CodecId codec)
+		: baseLevel(baseLevel), minLevel(minLevel), isTerrain(isTerrain), interp(interp), codec(codec), spill(spillPath)
+	{
+		if (interp != cv::INTER_LINEAR and interp != cv::INTER_AREA)
+			throw std::runtime_error("PyramidBuilder only supports bilinear or area interpolation");
+		if (minLevel < 0 or minLevel >= baseLevel)
+			throw std::runtime_error(fmt::format("PyramidBuilder: bad levels (base {}, min {})", baseLevel, minLevel));
+
+		// Like WriterMasterAddo, stop at the first level where the (floored) range is a single tile.
+		auto fitsOneTile = [baseTlbr](int zoom) {
+			return (baseTlbr[2] >> zoom) == (baseTlbr[0] >> zoom) and (baseTlbr[3] >> zoom) == (baseTlbr[1] >> zoom);
+		};
+		int lastLevel = baseLevel;
+		while (lastLevel > minLevel and not fitsOneTile(baseLevel - (lastLevel - 1))) lastLevel--;
+		this->minLevel = minLevel = lastLevel;
+
+		levels.resize(baseLevel+1);
+		for (int lvl=baseLevel; lvl>=minLevel; lvl--) {
+			levels[lvl] = std::make_unique<Level>();
+			uint64_t* t = levels[lvl]->tlbr;
+			if (lvl == baseLevel) {
+				for (int i=0; i<4; i++) t[i] = baseTlbr[i];
+			} else {
+				const uint64_t* c = levels[lvl+1]->tlbr;
+				t[0] = c[0] >> 1;
+				t[1] = c[1] >> 1;
+				t[2] = (c[2] + 1) >> 1;
+				t[3] = (c[3] + 1) >> 1;
+			}
+		}
+	}
+
+	int PyramidBuilder::expectedChildren(uint64_t lvl, uint64_t x, uint64_t y) const {
+		const uint64_t* c = levels[lvl+1]->tlbr;
+		int nx = (2*x >= c[0] and 2*x < c[2]) + (2*x+1 >= c[0] and 2*x+1 < c[2]);
+		int ny = (2*y >= c[1] and 2*y < c[3]) + (2*y+1 >= c[1] and 2*y+1 < c[3]);
+		return nx * ny;
+	}
+
+	void PyramidBuilder::addTile(uint64_t key, const cv::Mat& img) {
+		BlockCoordinate bc(key);
+		assert(bc.z() == static_cast<uint64_t>(baseLevel));
+		report(bc.z(), bc.y(), bc.x(), img);
+	}
+
+	void PyramidBuilder::report(uint64_t z, uint64_t y, uint64_t x, cv::Mat img) {
+		if (z <= static_cast<uint64_t>(minLevel)) return;
+
+		Level& parent = *levels[z-1];
+		uint64_t pkey = BlockCoordinate{z-1, y>>1, x>>1}.c;
+
+		// Downsample before taking the lock. An exact 2:1 linear or area resize only averages 2x2 blocks (halveBox),
+		// so each quadrant gives the same pixels as resizing the joined 2x2 image would.
+		cv::Mat half;
+		if (img.empty()) {
+			// Nothing to downsample.
+		} else if (canDecimate(img)) {
+			half.create(img.rows/2, img.cols/2, img.type());
+			halveBox(img, half);
+		} else cv::resize(img, half, cv::Size{img.cols/2, img.rows/2}, 0, 0, interp);
+
+		cv::Mat done;
+		{
+			std::lock_guard<std::mutex> lck(parent.mtx);
+			Pending& p = parent.pending[pkey];
+			if (p.nexpected == 0) p.nexpected = expectedChildren(z-1, x>>1, y>>1);
+
+			if (not half.empty()) {
+				if (p.canvas.empty()) p.canvas = cv::Mat::zeros(img.rows, img.cols, img.type());
+				// Rows of a tile go from high to low y (see WriterMasterAddo::process).
+				half.copyTo(p.canvas(cv::Rect{(int)(x&1) * half.cols, (int)(1-(y&1)) * half.rows, half.cols, half.rows}));
+			}
+
+			if (++p.nreported < p.nexpected) return;
+			done = p.canvas;
+			parent.pending.erase(pkey);
+		}
+
+		emit(pkey, done);
+	}
+
+	void PyramidBuilder::emit(uint64_t key, cv::Mat img) {
+		BlockCoordinate bc(key);
+
+		if (not img.empty()) {
+			// Copied by add(), so the worker's scratch buffer will do.
+			Value v = encodeValueScratch(img, isTerrain, codec);
+			spill.add(key, v.value, v.len);
+		}
+
+		report(bc.z(), bc.y(), bc.x(), img);
+	}
+
+	void PyramidBuilder::finish() {
+		// Finer levels first, so that their leftovers reach the coarser levels before those are flushed.
+		for (int lvl=baseLevel-1; lvl>=minLevel; lvl--) {
+			std::unordered_map<uint64_t, Pending> left;
+			{
+				std::lock_guard<std::mutex> lck(levels[lvl]->mtx);
+				left.swap(levels[lvl]->pending);
+			}
+			if (left.size()) fmt::print(" - [PyramidBuilder] lvl {}: {} incomplete tiles\n", lvl, left.size());
+			for (auto& kv : left) emit(kv.first, kv.second.canvas);
+		}
+	}
+
+	uint64_t PyramidBuilder::numTiles() const {
+		uint64_t n = 0;
+		for (int lvl=minLevel; lvl<baseLevel; lvl++) n += spill.count(lvl);
+		return n;
+	}
+
+	void PyramidBuilder::writeLevels(FlatEnvironment& env) {
+		int lastLevel = -1;
+		for (int lvl=minLevel; lvl<baseLevel and lastLevel < 0; lvl++)
+			if (spill.count(lvl)) lastLevel = lvl;
+
+		for (int lvl=baseLevel-1; lvl>=minLevel; lvl--) {
+			uint64_t n = spill.count(lvl);
+			if (n == 0) continue;
+			fmt::print(" - [PyramidBuilder] writing lvl {} ({} tiles)\n", lvl, n);
+
+			env.beginLevel(lvl);
+			spill.writeLevel(env, lvl);
+			env.endLevel(lvl == lastLevel);
+		}
+	}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "codec.h"
+#include "flat_env.h"
+#include "tile_spill.h"
+
+#include <opencv2/core.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace frast {
+
+	//
+	// Builds the overview levels from base level tiles as they are converted, instead of re-reading and re-decoding
+	// the finished base level with WriterMasterAddo (see ConvertConfig::fusedAddo).
+	//
+	// Writer workers addTile() every base tile they produce (empty or not). A parent gets each child downsampled
+	// into its quadrant as it arrives, and is encoded as soon as all of its children inside the level's range
+	// have been reported, then reported to its own parent, and so on up the pyramid.
+	// Encoded parents are appended to a TileSpill next to the output, and written out as sorted levels by
+	// writeLevels() once the base level is done.
+	//
+	// Memory: the pending parents are a band about one base row wide, so roughly one tile (256²·channels bytes) per
+	// base level column of the converted area.
+	//
+	// Only 2:1 decimations that never cross quadrants can be done this way: cv::INTER_LINEAR and cv::INTER_AREA.
+	//
+	class PyramidBuilder {
+		public:
+			// @baseTlbr is the range [x0, y0, x1, y1) of base level tiles that will be added, each exactly once.
+			// Levels baseLevel-1 down to @minLevel are built, and encoded with @codec (the output file's). As with
+			// WriterMasterAddo, no level is built below the first one where the range fits in one tile.
+			PyramidBuilder(const std::string& spillPath, int baseLevel, const uint64_t baseTlbr[4], bool isTerrain, int interp, int minLevel=0,
+					CodecId codec=CodecId::eDefault);
+
+			// Thread safe. @img may be empty (no tile at @key).
+			void addTile(uint64_t key, const cv::Mat& img);
+
+			// Encode parents that are still waiting for children (only left over if conversion stopped early).
+			// Call after the last addTile().
+			void finish();
+
+			// Number of overview tiles produced.
+			uint64_t numTiles() const;
+
+			// Write the overview levels into @env (which must have no level open), coarsest last.
+			// The last one written is the final level of the file.
+			void writeLevels(FlatEnvironment& env);
+
+		private:
+			struct Pending {
+				cv::Mat canvas;
+				uint8_t nreported = 0, nexpected = 0;
+			};
+			struct Level {
+				// Range of this level's tiles that are reported to the level above, [x0 y0 x1 y1).
+				uint64_t tlbr[4];
+				std::mutex mtx;
+				std::unordered_map<uint64_t, Pending> pending;
+			};
+
+			int baseLevel, minLevel;
+			bool isTerrain;
+			int interp;
+			CodecId codec;
+			// Indexed by level (only minLevel..baseLevel are set).
+			std::vector<std::unique_ptr<Level>> levels;
+
+			TileSpill spill;
+
+			// The child (z, y, x) is done, with tile @img (possibly empty). Emits every ancestor this completes.
+			void report(uint64_t z, uint64_t y, uint64_t x, cv::Mat img);
+			// Encode and spill the finished tile @img of @key, and report it upwards.
+			void emit(uint64_t key, cv::Mat img);
+			int expectedChildren(uint64_t lvl, uint64_t x, uint64_t y) const;
+	};
+
+}
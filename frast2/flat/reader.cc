@@ -63,10 +63,17 @@ namespace frast {
 	void FlatReader::refreshMemMap() {
 		// env = std::move(FlatEnvironment{openPath,openOpts});
 		env = (FlatEnvironment(openPath,openOpts));
+		// It used the old fd.
+		valueIo.reset();
+		lastDecoded.release();
+		lastSeenOffset = 0;
 	}
 
 	bool FlatReader::tileExists(uint64_t tile) {
 		BlockCoordinate bc{tile};
+		OccupancyView occ = env.occupancy(bc.z());
+		if (occ.valid() and not env.haveDeltas(bc.z())) return occ.has(bc.x(), bc.y());
+		if (occ.valid() and occ.has(bc.x(), bc.y())) return true;
 		return env.keyExists(bc.z(), tile);
 	}
 
@@ -94,17 +101,26 @@ namespace frast {
 		tlbr[2] = std::numeric_limits<uint32_t>::min();
 		tlbr[3] = std::numeric_limits<uint32_t>::min();
 
-		uint64_t* keys = env.getKeys(lvl);
-		uint64_t n = env.meta()->levelSpecs[lvl].nitemsUsed();
+		auto extend = [tlbr](const uint64_t* keys, uint64_t n) {
+			for (uint64_t i=0; i<n; i++) {
+				BlockCoordinate bc(keys[i]);
+				tlbr[0] = std::min(tlbr[0], (uint32_t)bc.x());
+				tlbr[1] = std::min(tlbr[1], (uint32_t)bc.y());
+				tlbr[2] = std::max(tlbr[2], 1u+(uint32_t)bc.x());
+				tlbr[3] = std::max(tlbr[3], 1u+(uint32_t)bc.y());
+			}
+		};
 
-		for (uint64_t i=0; i<n; i++) {
-			BlockCoordinate bc(keys[i]);
-			tlbr[0] = std::min(tlbr[0], (uint32_t)bc.x());
-			tlbr[1] = std::min(tlbr[1], (uint32_t)bc.y());
-			tlbr[2] = std::max(tlbr[2], 1u+(uint32_t)bc.x());
-			tlbr[3] = std::max(tlbr[3], 1u+(uint32_t)bc.y());
+		OccupancyView occ = env.occupancy(lvl);
+		if (occ.valid()) {
+			for (int i=0; i<4; i++) tlbr[i] = occ.tlbr()[i];
+		} else {
+			extend(env.getKeys(lvl), env.meta()->levelSpecs[lvl].nitemsUsed());
 		}
 
+		for (int d=0; d<env.numDeltas(); d++)
+			if (env.deltaLevel(d) == lvl) extend(env.getKeys(env.getDeltaSpec(d)), env.getDeltaSpec(d).nitemsUsed());
+
 		return lvl;
 	}
 
@@ -113,22 +129,8 @@ namespace frast {
 		// This should never happen. File must be corrupted.
 		if (lvl < 0 or lvl > 30) throw std::runtime_error("invalid level from determineDeepeseLevel()");
 
-		uint64_t* keys = env.getKeys(lvl);
-		auto nitems = env.getLevelSpec(lvl).nitemsUsed();
-
-		uint32_t tlbr[4] = {
-			std::numeric_limits<uint32_t>::max(),
-			std::numeric_limits<uint32_t>::max(),
-			std::numeric_limits<uint32_t>::min(),
-			std::numeric_limits<uint32_t>::min() };
-
-		for (int i=0; i<nitems; i++) {
-			BlockCoordinate c(keys[i]);
-			tlbr[0] = std::min(tlbr[0], (uint32_t)c.x());
-			tlbr[1] = std::min(tlbr[1], (uint32_t)c.y());
-			tlbr[2] = std::max(tlbr[2], 1u+(uint32_t)c.x());
-			tlbr[3] = std::max(tlbr[3], 1u+(uint32_t)c.y());
-		}
+		uint32_t tlbr[4];
+		determineTlbrOnLevel(tlbr, lvl);
 
 		std::array<double,4> dwmTlbr;
 		iwm_to_dwm(dwmTlbr.begin(), tlbr, lvl);
@@ -138,18 +140,138 @@ namespace frast {
 		return out;
 	}
 
+	Value FlatReader::fetchValue(const FlatEnvironment::ValueLocation& loc) {
+		if (loc.len == 0) return {};
+		if (env.valueReadMode() == ValueReadMode::eMmap) return env.mappedValue(loc);
+
+		if (readBuf.size() < loc.len) readBuf.resize(loc.len);
+		env.readLocation(loc, readBuf.data());
+		return Value { readBuf.data(), loc.len };
+	}
+
+	bool FlatReader::reuseDecoded(cv::Mat& out, const FlatEnvironment::ValueLocation& loc, int channels, int scaleDenom) {
+		if (lastDecoded.empty() or loc.len == 0) return false;
+		if (loc.offset != lastDecodedOffset or channels != lastDecodedChannels or scaleDenom != lastDecodedScale) return false;
+		lastDecoded.copyTo(out);
+		return true;
+	}
+
+	void FlatReader::keepDecoded(const cv::Mat& img, const FlatEnvironment::ValueLocation& loc, int channels, int scaleDenom) {
+		if (not env.hasExplicitValueLengths() or img.empty()) return;
+		if (loc.offset != lastSeenOffset) {
+			lastSeenOffset = loc.offset;
+			return;
+		}
+		img.copyTo(lastDecoded);
+		lastDecodedOffset = loc.offset;
+		lastDecodedChannels = channels;
+		lastDecodedScale = scaleDenom;
+	}
+
 	cv::Mat FlatReader::getTile(uint64_t tile, int channels) {
-		BlockCoordinate bc(tile);
-		auto val = env.lookup(bc.z(), tile);
+		auto loc = env.locateValue(BlockCoordinate{tile}.z(), tile);
+		cv::Mat out;
+		if (reuseDecoded(out, loc, channels)) return out;
+
+		auto val = fetchValue(loc);
 		// fmt::print(" - found tile {} :: {} {}\n", tile, val.value, val.len);
-		return decodeValue(val, channels, isTerrain());
+		out = decodeValue(val, channels, isTerrain(), env.codec());
+		keepDecoded(out, loc, channels);
+		return out;
 	}
 
 	bool FlatReader::getTile(cv::Mat& out, uint64_t tile, int channels) {
-		BlockCoordinate bc(tile);
-		auto val = env.lookup(bc.z(), tile);
+		auto loc = env.locateValue(BlockCoordinate{tile}.z(), tile);
+		if (reuseDecoded(out, loc, channels)) return false;
+
+		auto val = fetchValue(loc);
 		// fmt::print(" - found tile {} :: {} {}\n", tile, val.value, val.len);
-		return decodeValue(out, val, channels, isTerrain());
+		bool missing = decodeValue(out, val, channels, isTerrain(), env.codec());
+		if (not missing) keepDecoded(out, loc, channels);
+		return missing;
+	}
+
+	bool FlatReader::getTileInto(cv::Mat& dst, uint64_t tile, int channels) {
+		auto loc = env.locateValue(BlockCoordinate{tile}.z(), tile);
+		if (reuseDecoded(dst, loc, channels)) return false;
+
+		bool missing = decodeValueInto(dst, fetchValue(loc), channels, isTerrain(), 1, env.codec());
+		if (not missing) keepDecoded(dst, loc, channels);
+		return missing;
+	}
+
+	int FlatReader::getTiles(const uint64_t* tiles, int n, int channels, const std::function<void(int, cv::Mat&)>& onTile,
+			int scaleDenom) {
+		int nfound = 0;
+
+		if (env.valueReadMode() == ValueReadMode::eMmap) {
+			for (int i=0; i<n; i++) {
+				cv::Mat img;
+				auto loc = env.locateValue(BlockCoordinate{tiles[i]}.z(), tiles[i]);
+				if (loc.len) {
+					if (not reuseDecoded(img, loc, channels, scaleDenom)) {
+						img = decodeValueScaled(env.mappedValue(loc), channels, isTerrain(), scaleDenom, env.codec());
+						keepDecoded(img, loc, channels, scaleDenom);
+					}
+					nfound++;
+				}
+				onTile(i, img);
+			}
+			return nfound;
+		}
+
+		if (not valueIo) valueIo = std::make_unique<ValueIo>(env.getFd(), env.valueReadMode(), env.ioQueueDepth());
+
+		// One buffer per read in flight. bufTile[b] is the index of the tile being read into ioBufs[b].
+		int qd = valueIo->queueDepth();
+		ioBufs.resize(qd);
+		std::vector<int> freeBufs(qd), bufTile(qd);
+		std::vector<FlatEnvironment::ValueLocation> bufLoc(qd);
+		for (int b=0; b<qd; b++) freeBufs[b] = qd-1-b;
+		std::vector<ValueIo::Completion> comps(qd);
+
+		int next = 0;
+		while (next < n or valueIo->inFlight() > 0) {
+			while (next < n and not freeBufs.empty()) {
+				BlockCoordinate bc(tiles[next]);
+				auto loc = env.locateValue(bc.z(), tiles[next]);
+				if (loc.len == 0) {
+					cv::Mat empty;
+					onTile(next++, empty);
+					continue;
+				}
+				cv::Mat reused;
+				if (reuseDecoded(reused, loc, channels, scaleDenom)) {
+					nfound++;
+					onTile(next++, reused);
+					continue;
+				}
+
+				int b = freeBufs.back();
+				ioBufs[b].resize(loc.len);
+				if (valueIo->submit(ioBufs[b].data(), loc.len, loc.offset, b)) break;
+				freeBufs.pop_back();
+				bufTile[b] = next++;
+				bufLoc[b] = loc;
+			}
+
+			// Tiles decode here while the rest of the batch is still being read.
+			int ndone = valueIo->reap(comps.data(), qd, true);
+			for (int j=0; j<ndone; j++) {
+				int b = static_cast<int>(comps[j].userData);
+				if (comps[j].result < 0)
+					throw std::runtime_error(fmt::format("getTiles: read failed: {}", strerror(-comps[j].result)));
+
+				Value val { ioBufs[b].data(), static_cast<uint64_t>(comps[j].result) };
+				cv::Mat img = decodeValueScaled(val, channels, isTerrain(), scaleDenom, env.codec());
+				keepDecoded(img, bufLoc[b], channels, scaleDenom);
+				nfound++;
+				onTile(bufTile[b], img);
+				freeBufs.push_back(b);
+			}
+		}
+
+		return nfound;
 	}
 
 	// FIXME: This will fail if we have differing levels in different places in one large file.
@@ -242,36 +364,74 @@ namespace frast {
 
 
 	// TODO: Return also the number of tiles hit (so we know if zero tiles were hit)
-	cv::Mat FlatReaderCached::getTlbr(uint64_t lvl, uint32_t tlbr[4], int channels) {
+	cv::Mat FlatReaderCached::getTlbr(uint64_t lvl, uint32_t tlbr[4], int channels, int scaleDenom) {
+		cv::Mat out;
+		getTlbr(out, lvl, tlbr, channels, scaleDenom);
+		return out;
+	}
+
+	void FlatReaderCached::getTlbr(cv::Mat& out, uint64_t lvl, uint32_t tlbr[4], int channels, int scaleDenom) {
 		uint64_t h = tlbr[3] - tlbr[1];
 		uint64_t w = tlbr[2] - tlbr[0];
 		auto cvType = get_cv_type_from_channels(channels, isTerrain());
+		const int tileSize = FlatReader::tileSize / scaleDenom;
+
+		out.create(tileSize*h,tileSize*w,cvType);
+
+		if (env.valueReadMode() != ValueReadMode::eMmap) {
+			// Read the whole rectangle with many reads in flight.
+			std::vector<uint64_t> tiles;
+			for (uint64_t y=0; y<h; y++)
+				for (uint64_t x=0; x<w; x++) tiles.push_back(BlockCoordinate{lvl, tlbr[1]+y, tlbr[0]+x}.c);
+
+			getTiles(tiles.data(), tiles.size(), channels, [&](int i, cv::Mat& tile) {
+				int x = i % w;
+				int yy = h-1-(i / w);
+				if (tile.empty()) out(cv::Rect{x*tileSize,yy*tileSize,tileSize,tileSize}) = cv::Scalar{0};
+				else tile.copyTo(out(cv::Rect{x*tileSize,yy*tileSize,tileSize,tileSize}));
+			}, scaleDenom);
+			return;
+		}
 
-		cv::Mat out(tileSize*h,tileSize*w,cvType);
-
-		for (int y=0; y<h; y++)
-		for (int x=0; x<w; x++) {
-			BlockCoordinate bc(lvl, tlbr[1]+y, tlbr[0]+x);
-
-			// cv::Mat tile = this->getTile(bc.c, channels);
-			cv::Mat tile = FlatReader::getTile(bc.c, channels);
-			// fmt::print(" - getTile :: {} {} {} | {} ===> {}x{}c{}\n", bc.z(), bc.y(), bc.x(), bc.c, tile.rows,tile.cols,tile.channels());
-
-			int yy = h-1-y;
+		// Each row of tiles is contiguous in the keys array, so find it with one search.
+		// Rows that the occupancy segment says are empty are not searched at all.
+		std::vector<Value> rowVals(w);
+		OccupancyView occ = env.haveDeltas(lvl) ? OccupancyView{} : env.occupancy(lvl);
 
-			if (tile.empty()) {
-				out(cv::Rect{x*tileSize,yy*tileSize,tileSize,tileSize}) = cv::Scalar{0};
-			} else {
-				// fmt::print(" - copy to {} {}, {} {} c{}\n", x*tileSize, yy*tileSize, tileSize,tileSize,out.channels());
-				// out(cv::Rect{x*tileSize,y*tileSize,tileSize,tileSize}) = tile;
-				tile.copyTo(out(cv::Rect{x*tileSize,yy*tileSize,tileSize,tileSize}));
+		for (int y=0; y<h; y++) {
+			if (occ.valid() and not occ.anyIn(tlbr[0], tlbr[1]+y, tlbr[2], tlbr[1]+y+1)) {
+				out(cv::Rect{0,(int)(h-1-y)*tileSize,(int)w*tileSize,tileSize}) = cv::Scalar{0};
+				continue;
+			}
+			env.lookupRow(lvl, tlbr[1]+y, tlbr[0], tlbr[2], rowVals.data());
+
+			for (int x=0; x<w; x++) {
+				int yy = h-1-y;
+
+				// Tiles decode straight into their place in the mosaic.
+				cv::Mat dst = out(cv::Rect{x*tileSize,yy*tileSize,tileSize,tileSize});
+				if (rowVals[x].value == nullptr)
+					dst = cv::Scalar{0};
+				else if (x > 0 and rowVals[x].value == rowVals[x-1].value)
+					// A value shared with the left neighbour (EnvOptions::dedupValues): copy it instead of decoding again.
+					out(cv::Rect{(x-1)*tileSize,yy*tileSize,tileSize,tileSize}).copyTo(dst);
+				else if (decodeValueInto(dst, rowVals[x], channels, isTerrain(), scaleDenom, env.codec()))
+					dst = cv::Scalar{0};
 			}
 		}
-
-		return out;
 	}
 
 
+	int FlatReaderCached::rasterIoScale(const double wmTlbr[4], const double sampledWmTlbr[4], int iwm_w, int iwm_h, int w, int h) const {
+		// Pixels of the whole tiles that fall within the query, per output pixel.
+		double ratioX = tileSize * iwm_w * ((wmTlbr[2] - wmTlbr[0]) / (sampledWmTlbr[2] - sampledWmTlbr[0])) / w;
+		double ratioY = tileSize * iwm_h * ((wmTlbr[3] - wmTlbr[1]) / (sampledWmTlbr[3] - sampledWmTlbr[1])) / h;
+		double ratio = std::min(ratioX, ratioY);
+		int scale = 1;
+		while (scale < maxDecodeScale and scale < 8 and scale * 2 <= ratio) scale *= 2;
+		return scale;
+	}
+
 		//WARNING: Lightly test
 		//FIXME: Test me
 	cv::Mat FlatReaderCached::rasterIo(const double wmTlbr[4], int w, int h, int c) {
@@ -306,14 +466,16 @@ namespace frast {
 			throw SampleTooLargeError{static_cast<uint32_t>(iwm_w), static_cast<uint32_t>(iwm_h)};
 		}
 
-		cv::Mat sampledImg = getTlbr(lvl, iwmTlbr, c);
+		int scale = rasterIoScale(wmTlbr, sampledWmTlbr, iwm_w, iwm_h, w, h);
+		getTlbr(mosaic, lvl, iwmTlbr, c, scale);
+		const cv::Mat& sampledImg = mosaic;
 		if (sampledImg.empty()) return cv::Mat();
 
 
 		double sampledWmW = sampledWmTlbr[2] - sampledWmTlbr[0];
 		double sampledWmH = sampledWmTlbr[3] - sampledWmTlbr[1];
-		double sampledW = tileSize * iwm_w;
-		double sampledH = tileSize * iwm_h;
+		double sampledW = sampledImg.cols;
+		double sampledH = sampledImg.rows;
 		double dw=w, dh=h;
 		// double queryW = wmTlbr[2] - wmTlbr[0];
 		// double queryH = wmTlbr[3] - wmTlbr[1];
@@ -395,14 +557,16 @@ namespace frast {
 			throw SampleTooLargeError{static_cast<uint32_t>(iwm_w), static_cast<uint32_t>(iwm_h)};
 		}
 
-		// FIXME: Cache this image allocation as well.
-		cv::Mat sampledImg = getTlbr(lvl, iwmTlbr, out.channels());
+		// The mosaic buffer is kept between calls, and the warp writes into the caller's @out.
+		int scale = rasterIoScale(wmTlbr, sampledWmTlbr, iwm_w, iwm_h, w, h);
+		getTlbr(mosaic, lvl, iwmTlbr, out.channels(), scale);
+		const cv::Mat& sampledImg = mosaic;
 		if (sampledImg.empty()) return true;
 
 		double sampledWmW = sampledWmTlbr[2] - sampledWmTlbr[0];
 		double sampledWmH = sampledWmTlbr[3] - sampledWmTlbr[1];
-		double sampledW = tileSize * iwm_w;
-		double sampledH = tileSize * iwm_h;
+		double sampledW = sampledImg.cols;
+		double sampledH = sampledImg.rows;
 		double dw=w, dh=h;
 		// double queryW = wmTlbr[2] - wmTlbr[0];
 		// double queryH = wmTlbr[3] - wmTlbr[1];
@@ -2,8 +2,11 @@
 
 #include <opencv2/core.hpp>
 #include <array>
+#include <functional>
+#include <memory>
 
 #include "flat_env.h"
+#include "value_io.h"
 #include "frast2/detail/data_structures.hpp"
 
 #include "codec.h"
@@ -32,6 +35,18 @@ namespace frast {
 
 			cv::Mat getTile(uint64_t tile, int channels);
 			bool getTile(cv::Mat& out, uint64_t tile, int channels);
+			// Decode the tile in place into @dst, which must already be tileSize² of the right type (see decodeValueInto).
+			// Returns true if the tile does not exist (or could not be decoded).
+			bool getTileInto(cv::Mat& dst, uint64_t tile, int channels);
+
+			// Get many tiles (on any levels). @onTile(i, img) is called once per tiles[i], in completion order,
+			// with an empty Mat if the tile does not exist.
+			// If the env uses a non-mmap ValueReadMode, up to EnvOptions::ioQueueDepth reads are kept in flight
+			// while the completed tiles are decoded.
+			// With @scaleDenom > 1, tiles are decoded at that fraction of their size (see decodeValueScaled).
+			// Returns the number of tiles found.
+			int getTiles(const uint64_t* tiles, int n, int channels, const std::function<void(int, cv::Mat&)>& onTile,
+					int scaleDenom = 1);
 
 			bool tileExists(uint64_t tile);
 
@@ -55,6 +70,24 @@ namespace frast {
 			int find_level_for_mpp(float res);
 
 			int maxRasterIoTiles = 256;
+
+			// The value at @loc: a pointer into the mmap, or (for non-mmap ValueReadModes) read into readBuf.
+			Value fetchValue(const FlatEnvironment::ValueLocation& loc);
+
+			std::vector<uint8_t> readBuf;
+			std::unique_ptr<ValueIo> valueIo;
+			std::vector<std::vector<uint8_t>> ioBufs;
+
+			// In files with shared values (EnvOptions::dedupValues), runs of neighbouring tiles are often one stored
+			// value (e.g. ocean), so the last decoded one is kept and copied instead of read and decoded again.
+			// Most values are still unshared, so a copy is only kept once the same offset comes twice in a row.
+			bool reuseDecoded(cv::Mat& out, const FlatEnvironment::ValueLocation& loc, int channels, int scaleDenom = 1);
+			void keepDecoded(const cv::Mat& img, const FlatEnvironment::ValueLocation& loc, int channels, int scaleDenom = 1);
+			cv::Mat lastDecoded;
+			uint64_t lastSeenOffset = 0;
+			uint64_t lastDecodedOffset = 0;
+			int lastDecodedChannels = 0;
+			int lastDecodedScale = 1;
 	};
 
 	class FlatReaderCached : public FlatReader {
@@ -64,13 +97,27 @@ namespace frast {
 			cv::Mat getTile(uint64_t tile, int channels);
 			bool getTile(cv::Mat& out, uint64_t tile, int channels);
 
-			cv::Mat getTlbr(uint64_t lvl, uint32_t tlbr[4], int channels);
+			// The mosaic of tiles @tlbr of level @lvl, each decoded at 1/@scaleDenom of its size (1, 2, 4 or 8).
+			cv::Mat getTlbr(uint64_t lvl, uint32_t tlbr[4], int channels, int scaleDenom = 1);
+			// Same, into @out: reallocated only if it does not have the mosaic's size and type yet, so a caller's buffer
+			// (or one kept between calls) is decoded into in place.
+			void getTlbr(cv::Mat& out, uint64_t lvl, uint32_t tlbr[4], int channels, int scaleDenom = 1);
 
+			// These decode tiles at a reduced scale when the output is coarser than the level they sample, up to
+			// 1/maxDecodeScale (1 to always decode whole tiles).
 			cv::Mat rasterIo(const double tlbr[4], int w, int h, int c);
 			bool rasterIo(cv::Mat out, const double tlbr[4]); // false on success
 
+			inline void setMaxDecodeScale(int s) { maxDecodeScale = s; }
+
 		private:
 
+			int maxDecodeScale = 8;
+			// Kept between rasterIo() calls.
+			cv::Mat mosaic;
+			// The largest decode scale that keeps the sampled tiles at least as fine as the w x h output.
+			int rasterIoScale(const double wmTlbr[4], const double sampledWmTlbr[4], int iwm_w, int iwm_h, int w, int h) const;
+
 			LruCache<uint64_t,cv::Mat> cache;
 
 
@@ -0,0 +1,106 @@
+#include "source_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace frast {
+
+	SourceIndex::SourceIndex(const std::vector<Box>& boxes_) : boxes(boxes_) {
+		if (boxes.empty()) return;
+
+		double lo[2] = { std::numeric_limits<double>::max(), std::numeric_limits<double>::max() };
+		double hi[2] = { std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest() };
+		std::vector<double> sizes[2];
+		for (auto& b : boxes) {
+			b = Box{ std::min(b[0],b[2]), std::min(b[1],b[3]), std::max(b[0],b[2]), std::max(b[1],b[3]) };
+			for (int i=0; i<2; i++) {
+				lo[i] = std::min(lo[i], b[i]);
+				hi[i] = std::max(hi[i], b[2+i]);
+				sizes[i].push_back(b[2+i] - b[i]);
+			}
+		}
+
+		// Cells about the size of the median footprint, but not more than maxCellsPerBox of them per footprint
+		// (a few huge or tiny outliers must not blow up the grid).
+		double n[2];
+		for (int i=0; i<2; i++) {
+			auto mid = sizes[i].begin() + sizes[i].size() / 2;
+			std::nth_element(sizes[i].begin(), mid, sizes[i].end());
+			double extent = hi[i] - lo[i];
+			n[i] = (*mid > 0 and extent > 0) ? std::ceil(extent / *mid) : 1;
+		}
+		double maxCells = static_cast<double>(maxCellsPerBox * boxes.size());
+		if (n[0] * n[1] > maxCells) {
+			double f = std::sqrt(n[0] * n[1] / maxCells);
+			n[0] = std::max(1., std::floor(n[0] / f));
+			n[1] = std::max(1., std::floor(n[1] / f));
+		}
+		gridW = static_cast<int>(n[0]);
+		gridH = static_cast<int>(n[1]);
+		for (int i=0; i<2; i++) {
+			origin[i] = lo[i];
+			double extent = hi[i] - lo[i];
+			cellSize[i] = extent > 0 ? extent / n[i] : 1;
+		}
+
+		// Count, then fill. Boxes are visited in id order, so each cell's ids are ascending.
+		cellStart.assign(static_cast<size_t>(gridW) * gridH + 1, 0);
+		for (int pass=0; pass<2; pass++) {
+			std::vector<uint32_t> fill;
+			if (pass == 1) {
+				for (size_t i=1; i<cellStart.size(); i++) cellStart[i] += cellStart[i-1];
+				ids.resize(cellStart.back());
+				fill.assign(cellStart.begin(), cellStart.end() - 1);
+			}
+			for (uint32_t id=0; id<boxes.size(); id++) {
+				const Box& b = boxes[id];
+				int cx0, cy0, cx1, cy1;
+				cellRange(cx0, cy0, cx1, cy1, b[0], b[1], b[2], b[3]);
+				for (int cy=cy0; cy<=cy1; cy++)
+					for (int cx=cx0; cx<=cx1; cx++) {
+						size_t cell = static_cast<size_t>(cy) * gridW + cx;
+						if (pass == 0) cellStart[cell+1]++;
+						else ids[fill[cell]++] = id;
+					}
+			}
+		}
+	}
+
+	void SourceIndex::cellRange(int& cx0, int& cy0, int& cx1, int& cy1, double x0, double y0, double x1, double y1) const {
+		auto cell = [](double v, double o, double s, int n) {
+			double c = std::floor((v - o) / s);
+			return static_cast<int>(std::min(std::max(c, 0.), n - 1.));
+		};
+		cx0 = cell(x0, origin[0], cellSize[0], gridW);
+		cx1 = cell(x1, origin[0], cellSize[0], gridW);
+		cy0 = cell(y0, origin[1], cellSize[1], gridH);
+		cy1 = cell(y1, origin[1], cellSize[1], gridH);
+	}
+
+	void SourceIndex::query(std::vector<uint32_t>& out, double x0, double y0, double x1, double y1) const {
+		out.clear();
+		if (boxes.empty()) return;
+
+		if (x0 > x1) std::swap(x0, x1);
+		if (y0 > y1) std::swap(y0, y1);
+		int cx0, cy0, cx1, cy1;
+		cellRange(cx0, cy0, cx1, cy1, x0, y0, x1, y1);
+
+		for (int cy=cy0; cy<=cy1; cy++)
+			for (int cx=cx0; cx<=cx1; cx++) {
+				size_t cell = static_cast<size_t>(cy) * gridW + cx;
+				for (uint32_t i=cellStart[cell]; i<cellStart[cell+1]; i++) {
+					const Box& b = boxes[ids[i]];
+					if (b[0] <= x1 and x0 <= b[2] and b[1] <= y1 and y0 <= b[3]) out.push_back(ids[i]);
+				}
+			}
+
+		// A footprint spanning several visited cells was found once per cell.
+		if (cx0 != cx1 or cy0 != cy1) {
+			std::sort(out.begin(), out.end());
+			out.erase(std::unique(out.begin(), out.end()), out.end());
+		}
+	}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace frast {
+
+	//
+	// Which of many source footprints (GeoTIFFs of a WriterMasterGdalMany conversion) intersect a box.
+	//
+	// The footprints are bucketed into a uniform grid with cells about the size of a typical footprint, stored like
+	// a CSR matrix: the ids of cell i are ids[cellStart[i] .. cellStart[i+1]). A query visits the cells under the box,
+	// so it costs about the number of overlapping footprints rather than the number of footprints.
+	// Built once, then only read (so it can be shared by all threads).
+	//
+
+	class SourceIndex {
+		public:
+			using Box = std::array<double,4>;
+
+			// Cap on the number of grid cells, per footprint.
+			static constexpr uint64_t maxCellsPerBox = 4;
+
+			SourceIndex() = default;
+			// @boxes are [x0,y0,x1,y1], with the corners in any order. Their index is their id.
+			explicit SourceIndex(const std::vector<Box>& boxes);
+
+			// Set @out to the ids of the footprints intersecting [x0,x1] x [y0,y1] (closed, like Eigen::AlignedBox),
+			// in ascending order.
+			void query(std::vector<uint32_t>& out, double x0, double y0, double x1, double y1) const;
+
+			inline size_t size() const { return boxes.size(); }
+
+		private:
+			std::vector<Box> boxes;
+			double origin[2] = {0,0};
+			double cellSize[2] = {1,1};
+			int gridW = 0, gridH = 0;
+			std::vector<uint32_t> cellStart;
+			std::vector<uint32_t> ids;
+
+			// The cells [cx0,cx1] x [cy0,cy1] covering [x0,x1] x [y0,y1], clamped to the grid.
+			void cellRange(int& cx0, int& cy0, int& cx1, int& cy1, double x0, double y0, double x1, double y1) const;
+	};
+
+}
@@ -5,9 +5,29 @@
 #include <unistd.h>
 #include <atomic>
 #include <unordered_set>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <fcntl.h>
+#include <functional>
+#include <thread>
+#include <random>
 
 #include "writer.h"
+#include "value_io.h"
+#include "compact.h"
+#include "pyramid.h"
+#include "codec.h"
+#include "blend.h"
+#include "decimate.h"
+#include "merge.h"
+#include "reader.h"
+#include "multi_reader.h"
+#include "source_index.h"
+#include "tile_schedule.h"
+#include "tile_spill.h"
+
+#include <opencv2/imgproc.hpp>
 
 using namespace frast;
 
@@ -150,3 +170,1791 @@ TEST_CASE( "WriteKeyValue", "[flatwriter]" ) {
 	REQUIRE(e.lookup(2, 1).value == nullptr);
 
 }
+
+// Enough keys that lookups go through the KeyIndex rather than the plain binary search.
+TEST_CASE( "KeyIndexLookup", "[flatwriter]" ) {
+	fmt::print(" - Running KeyIndexLookup test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	unlink(fname.c_str());
+
+	EnvOptions opts;
+	FlatEnvironment e(fname, opts);
+
+	e.beginLevel(12);
+
+	// Every third tile on a 200x200 grid, so there are both hits and misses in every block.
+	std::vector<uint64_t> keys;
+	for (uint64_t y=0; y<200; y++)
+	for (uint64_t x=0; x<200; x++) {
+		if ((y*200+x) % 3 == 0) keys.push_back(BlockCoordinate{12,y,x}.c);
+	}
+	REQUIRE(keys.size() > FlatEnvironment::minKeysForIndex);
+
+	for (auto key : keys) {
+		uint8_t val = key % 256;
+		e.writeKeyValue(key, &val, 1);
+	}
+	e.endLevel(true);
+
+	for (int64_t i=0; i<keys.size(); i++) {
+		REQUIRE(e.findKeyIdx(12, keys[i]) == i);
+		auto foundVal = e.lookup(12, keys[i]);
+		REQUIRE(foundVal.value != nullptr);
+		REQUIRE(*static_cast<uint8_t*>(foundVal.value) == keys[i] % 256);
+	}
+
+	for (uint64_t y=0; y<200; y++)
+	for (uint64_t x=0; x<200; x++) {
+		bool expected = (y*200+x) % 3 == 0;
+		REQUIRE(e.keyExists(12, BlockCoordinate{12,y,x}.c) == expected);
+	}
+
+	REQUIRE(not e.keyExists(12, 0));
+	REQUIRE(not e.keyExists(12, BlockCoordinate{12,200,0}.c));
+	REQUIRE(not e.keyExists(12, -1));
+}
+
+TEST_CASE( "LookupManyAndRow", "[flatwriter]" ) {
+	fmt::print(" - Running LookupManyAndRow test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	unlink(fname.c_str());
+
+	EnvOptions opts;
+	FlatEnvironment e(fname, opts);
+
+	e.beginLevel(12);
+	for (uint64_t y=0; y<200; y++)
+	for (uint64_t x=0; x<200; x++) {
+		if ((y*200+x) % 3 == 0) {
+			uint64_t key = BlockCoordinate{12,y,x}.c;
+			uint8_t val = key % 256;
+			e.writeKeyValue(key, &val, 1);
+		}
+	}
+	e.endLevel(true);
+
+	// Unsorted, with duplicates and misses.
+	std::vector<uint64_t> reqs;
+	for (uint64_t i=0; i<500; i++) reqs.push_back(BlockCoordinate{12, (i*37)%200, (i*91)%200}.c);
+	reqs.push_back(reqs[3]);
+	reqs.push_back(BlockCoordinate{12,250,0}.c);
+
+	std::vector<Value> vals(reqs.size());
+	int64_t nfound = e.lookupMany(12, reqs.data(), vals.data(), reqs.size());
+
+	int64_t nexpected = 0;
+	for (int64_t i=0; i<reqs.size(); i++) {
+		Value v = e.lookup(12, reqs[i]);
+		REQUIRE(vals[i].value == v.value);
+		REQUIRE(vals[i].len == v.len);
+		if (v.value) nexpected++;
+	}
+	REQUIRE(nfound == nexpected);
+
+	std::vector<Value> row(50);
+	for (uint64_t y=0; y<200; y+=7) {
+		int64_t nrow = e.lookupRow(12, y, 20, 70, row.data());
+		int64_t nrowExpected = 0;
+		for (uint64_t x=20; x<70; x++) {
+			Value v = e.lookup(12, BlockCoordinate{12,y,x}.c);
+			REQUIRE(row[x-20].value == v.value);
+			if (v.value) nrowExpected++;
+		}
+		REQUIRE(nrow == nrowExpected);
+	}
+}
+
+TEST_CASE( "ReadValuePread", "[flatwriter]" ) {
+	fmt::print(" - Running ReadValuePread test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	unlink(fname.c_str());
+
+	std::vector<uint64_t> keys;
+	{
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		e.beginLevel(10);
+		for (uint64_t y=0; y<100; y++)
+		for (uint64_t x=0; x<100; x++) {
+			if ((x+y) % 2 == 0) {
+				uint64_t key = BlockCoordinate{10,y,x}.c;
+				keys.push_back(key);
+				std::vector<uint8_t> val(1 + key % 300);
+				for (int i=0; i<val.size(); i++) val[i] = (key + i) % 251;
+				e.writeKeyValue(key, val.data(), val.size());
+			}
+		}
+		e.endLevel(true);
+	}
+
+	EnvOptions opts = EnvOptions::getReadonly();
+	opts.valueReadMode = ValueReadMode::ePread;
+	opts.ioQueueDepth = 8;
+	FlatEnvironment e(fname, opts);
+
+	// Too small a buffer only reports the length.
+	uint8_t small[1];
+	auto loc = e.locateValue(10, keys[5]);
+	REQUIRE(loc.len > 1);
+	REQUIRE(e.readValue(10, keys[5], small, 1) == loc.len);
+
+	std::vector<uint8_t> buf(1024);
+	for (auto key : keys) {
+		Value val = e.lookup(10, key);
+		REQUIRE(e.readValue(10, key, buf.data(), buf.size()) == val.len);
+		REQUIRE(memcmp(buf.data(), val.value, val.len) == 0);
+	}
+	REQUIRE(e.readValue(10, BlockCoordinate{10,0,1}.c, buf.data(), buf.size()) == -1);
+
+	// Async reads through ValueIo, more than the queue depth at once.
+	ValueIo io(e.getFd(), ValueReadMode::ePread, opts.ioQueueDepth);
+	std::vector<std::vector<uint8_t>> bufs(keys.size());
+	std::vector<ValueIo::Completion> comps(opts.ioQueueDepth);
+	size_t next = 0, ndone = 0;
+	while (ndone < keys.size()) {
+		while (next < keys.size()) {
+			auto loc = e.locateValue(10, keys[next]);
+			bufs[next].resize(loc.len);
+			if (io.submit(bufs[next].data(), loc.len, loc.offset, next)) break;
+			next++;
+		}
+		REQUIRE(io.inFlight() <= opts.ioQueueDepth);
+
+		int n = io.reap(comps.data(), comps.size(), true);
+		REQUIRE(n > 0);
+		for (int j=0; j<n; j++) {
+			Value val = e.lookup(10, keys[comps[j].userData]);
+			REQUIRE(comps[j].result == val.len);
+			REQUIRE(memcmp(bufs[comps[j].userData].data(), val.value, val.len) == 0);
+			ndone++;
+		}
+	}
+}
+
+TEST_CASE( "SpatialKeyOrder", "[flatwriter]" ) {
+	fmt::print(" - Running SpatialKeyOrder test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	// Both curves must be bijective on a level's grid.
+	for (int order=1; order<=5; order++) {
+		std::unordered_set<uint64_t> seenH, seenM;
+		for (uint32_t y=0; y<(1u<<order); y++)
+		for (uint32_t x=0; x<(1u<<order); x++) {
+			uint64_t h = hilbertIndex(order, y, x);
+			REQUIRE(h < (1u << (2*order)));
+			seenH.insert(h);
+			seenM.insert(mortonIndex(y, x));
+		}
+		REQUIRE(seenH.size() == (1u << (2*order)));
+		REQUIRE(seenM.size() == (1u << (2*order)));
+	}
+
+	using KeyOrder = FlatEnvironment::FileMeta::KeyOrder;
+	for (auto order : { KeyOrder::eMorton, KeyOrder::eHilbert }) {
+		const std::string fname = "test.it";
+		unlink(fname.c_str());
+
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		e.setKeyOrder(order);
+
+		// Level 12 is large enough to get a KeyIndex, level 4 is not.
+		for (uint64_t lvl : { 4, 12 }) {
+			uint64_t size = lvl == 4 ? 16 : 200;
+			std::vector<uint64_t> keys;
+			for (uint64_t y=0; y<size; y++)
+			for (uint64_t x=0; x<size; x++) {
+				if ((y*size+x) % 3 == 0) keys.push_back(BlockCoordinate{lvl,y,x}.c);
+			}
+			std::sort(keys.begin(), keys.end(), [&e](uint64_t a, uint64_t b) { return e.orderedKey(a) < e.orderedKey(b); });
+
+			e.beginLevel(lvl);
+			for (auto key : keys) {
+				uint8_t val = key % 256;
+				e.writeKeyValue(key, &val, 1);
+			}
+			e.endLevel(lvl == 12);
+
+			for (int64_t i=0; i<keys.size(); i++) REQUIRE(e.findKeyIdx(lvl, keys[i]) == i);
+
+			std::vector<Value> row(size);
+			for (uint64_t y=0; y<size; y++) {
+				int64_t nrow = e.lookupRow(lvl, y, 0, size, row.data());
+				int64_t nexpected = 0;
+				for (uint64_t x=0; x<size; x++) {
+					uint64_t key = BlockCoordinate{lvl,y,x}.c;
+					bool expected = (y*size+x) % 3 == 0;
+					nexpected += expected;
+					REQUIRE(e.keyExists(lvl, key) == expected);
+					REQUIRE((row[x].value != nullptr) == expected);
+					if (expected) REQUIRE(*static_cast<uint8_t*>(row[x].value) == key % 256);
+				}
+				REQUIRE(nrow == nexpected);
+			}
+		}
+
+		REQUIRE_THROWS(e.setKeyOrder(KeyOrder::eRowMajor));
+	}
+}
+
+TEST_CASE( "CompactFile", "[flatwriter]" ) {
+	fmt::print(" - Running CompactFile test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	const std::string cname = "test.compact.it";
+	unlink(fname.c_str());
+	unlink(cname.c_str());
+
+	// Enough keys and bytes that both growLevelKeys and growLevelValues run on each level.
+	{
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		for (uint64_t lvl : { 12, 11 }) {
+			e.beginLevel(lvl);
+			for (uint64_t y=0; y<100; y++)
+			for (uint64_t x=0; x<100; x++) {
+				uint64_t key = BlockCoordinate{lvl,y,x}.c;
+				std::vector<uint8_t> val(1 + key % 2000);
+				for (int i=0; i<val.size(); i++) val[i] = (key + i) % 251;
+				e.writeKeyValue(key, val.data(), val.size());
+			}
+			e.endLevel(lvl == 11);
+		}
+	}
+
+	auto stats = compactFile(fname, cname);
+	REQUIRE(stats.bytesOut > 0);
+	REQUIRE(stats.bytesOut <= stats.bytesIn);
+	if (stats.extentsIn >= 0 and stats.extentsOut >= 0) REQUIRE(stats.extentsOut <= stats.extentsIn);
+	REQUIRE(access((cname + ".tmp").c_str(), F_OK) != 0);
+
+	FlatEnvironment a(fname, EnvOptions::getReadonly());
+	FlatEnvironment b(cname, EnvOptions::getReadonly());
+	for (uint64_t lvl : { 12, 11 }) {
+		auto& sa = a.getLevelSpec(lvl);
+		auto& sb = b.getLevelSpec(lvl);
+		REQUIRE(sa.keysLength == sb.keysLength);
+		REQUIRE(sa.valsLength == sb.valsLength);
+		// Contiguous: no slack between the arrays (beyond block padding).
+		REQUIRE(sb.k2vsOffset == sb.keysOffset + sb.keysCapacity);
+		REQUIRE(sb.valsOffset == sb.k2vsOffset + sb.keysCapacity);
+		REQUIRE(sb.keysCapacity - sb.keysLength < 4096);
+
+		for (uint64_t i=0; i<sa.nitemsUsed(); i++) {
+			uint64_t key = a.getKeys(lvl)[i];
+			REQUIRE(b.getKeys(lvl)[i] == key);
+			Value va = a.lookup(lvl, key);
+			Value vb = b.lookup(lvl, key);
+			REQUIRE(va.len == vb.len);
+			REQUIRE(memcmp(va.value, vb.value, va.len) == 0);
+		}
+	}
+	// The 12 -> 11 physical order is kept.
+	REQUIRE(b.getLevelSpec(12).keysOffset < b.getLevelSpec(11).keysOffset);
+}
+
+TEST_CASE( "DeltaRuns", "[flatwriter]" ) {
+	fmt::print(" - Running DeltaRuns test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	const std::string mname = "test.merged.it";
+	unlink(fname.c_str());
+	unlink(mname.c_str());
+
+	// The expected value of each tile: base tiles on even x, a first run adds odd x on rows < 10 and replaces
+	// row 0, a second run replaces (0,0) again.
+	std::map<uint64_t, uint8_t> expected;
+	auto write = [&expected](FlatEnvironment& e, uint64_t y, uint64_t x, uint8_t v) {
+		uint64_t key = BlockCoordinate{10,y,x}.c;
+		e.writeKeyValue(key, &v, 1);
+		expected[key] = v;
+	};
+
+	{
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		e.beginLevel(10);
+		for (uint64_t y=0; y<64; y++)
+		for (uint64_t x=0; x<64; x+=2) write(e, y, x, 1);
+		e.endLevel(true);
+
+		e.beginDelta(10);
+		for (uint64_t y=0; y<10; y++)
+		for (uint64_t x=(y == 0 ? 0 : 1); x<64; x+=(y == 0 ? 1 : 2)) write(e, y, x, 2);
+		e.endLevel(true);
+	}
+	{
+		// Reopen, as a later update would.
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		REQUIRE(e.numDeltas() == 1);
+		e.beginDelta(10);
+		write(e, 0, 0, 3);
+		e.endLevel(true);
+	}
+
+	auto check = [&expected](FlatEnvironment& e) {
+		for (uint64_t y=0; y<64; y++) {
+			std::vector<Value> row(64);
+			int64_t nrow = e.lookupRow(10, y, 0, 64, row.data());
+			int64_t nexpected = 0;
+			for (uint64_t x=0; x<64; x++) {
+				uint64_t key = BlockCoordinate{10,y,x}.c;
+				auto it = expected.find(key);
+				Value val = e.lookup(10, key);
+				REQUIRE(e.keyExists(10, key) == (it != expected.end()));
+				if (it == expected.end()) {
+					REQUIRE(val.value == nullptr);
+					REQUIRE(row[x].value == nullptr);
+					continue;
+				}
+				nexpected++;
+				REQUIRE(val.len == 1);
+				REQUIRE(*static_cast<uint8_t*>(val.value) == it->second);
+				REQUIRE(*static_cast<uint8_t*>(row[x].value) == it->second);
+				REQUIRE(e.locateValue(10, key).len == 1);
+			}
+			REQUIRE(nrow == nexpected);
+		}
+	};
+
+	{
+		FlatEnvironment e(fname, EnvOptions::getReadonly());
+		REQUIRE(e.numDeltas() == 2);
+		check(e);
+
+		// Compaction moves the runs, but keeps them.
+		compactFile(fname, fname);
+	}
+
+	{
+		FlatEnvironment e(fname, EnvOptions::getReadonly());
+		REQUIRE(e.numDeltas() == 2);
+		check(e);
+
+		EnvOptions opts;
+		FlatEnvironment m(mname, opts);
+		e.mergeLevel(10, m, true);
+		REQUIRE(m.numDeltas() == 0);
+		REQUIRE(m.getLevelSpec(10).nitemsUsed() == expected.size());
+		check(m);
+	}
+}
+
+TEST_CASE( "DeltaRunsSpatialOrder", "[flatwriter]" ) {
+	fmt::print(" - Running DeltaRunsSpatialOrder test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	// What `frastFlatWriter --append` does on a reordered file: the new tiles come from a LocalitySchedule over the
+	// flight's rectangle, and go through a ScheduledLevelWriter into the delta run (see WriterMasterGdal::start()).
+	const std::string fname = "test.it";
+	constexpr uint64_t lvl = 10;
+	const uint64_t tlbr[4] = { 5, 3, 41, 30 };
+
+	using KeyOrder = FlatEnvironment::FileMeta::KeyOrder;
+	for (auto order : { KeyOrder::eMorton, KeyOrder::eHilbert }) {
+		unlink(fname.c_str());
+		std::map<uint64_t, uint8_t> expected;
+
+		{
+			EnvOptions opts;
+			FlatEnvironment e(fname, opts);
+			e.setKeyOrder(order);
+			std::vector<uint64_t> keys;
+			for (uint64_t y=0; y<64; y++)
+				for (uint64_t x=0; x<64; x+=2) keys.push_back(BlockCoordinate{lvl,y,x}.c);
+			std::sort(keys.begin(), keys.end(), [&e](uint64_t a, uint64_t b) { return e.orderedKey(a) < e.orderedKey(b); });
+			e.beginLevel(lvl);
+			for (auto key : keys) {
+				uint8_t v = 1;
+				e.writeKeyValue(key, &v, 1);
+				expected[key] = v;
+			}
+			e.endLevel(true);
+		}
+
+		{
+			// Reopen, as --append does.
+			EnvOptions opts;
+			FlatEnvironment e(fname, opts);
+			REQUIRE(e.keyOrder() == order);
+			LocalitySchedule schedule(lvl, tlbr, [](const uint64_t*) { return 0u; }, [&e](uint64_t k) { return e.orderedKey(k); });
+			e.beginDelta(lvl);
+			ScheduledLevelWriter writer(e, lvl, fname + ".spill");
+			std::vector<uint64_t> group;
+			uint64_t laterMin;
+			while (schedule.next(group, laterMin)) {
+				writer.beginGroup(group.size(), laterMin);
+				for (uint64_t key : group) {
+					// Some of the flight is nodata.
+					BlockCoordinate bc(key);
+					if ((bc.x() + bc.y()) % 7 == 0) {
+						writer.add(key, nullptr, 0);
+						continue;
+					}
+					uint8_t v = 2;
+					writer.add(key, &v, 1);
+					expected[key] = v;
+				}
+			}
+			writer.finish();
+			e.endLevel(true);
+			REQUIRE(writer.numSpilled() == 0);
+		}
+
+		FlatEnvironment e(fname, EnvOptions::getReadonly());
+		REQUIRE(e.numDeltas() == 1);
+		for (uint64_t y=0; y<64; y++) {
+			std::vector<Value> row(64);
+			int64_t nrow = e.lookupRow(lvl, y, 0, 64, row.data());
+			int64_t nexpected = 0;
+			for (uint64_t x=0; x<64; x++) {
+				uint64_t key = BlockCoordinate{lvl,y,x}.c;
+				auto it = expected.find(key);
+				Value val = e.lookup(lvl, key);
+				REQUIRE(e.keyExists(lvl, key) == (it != expected.end()));
+				if (it == expected.end()) {
+					REQUIRE(val.value == nullptr);
+					REQUIRE(row[x].value == nullptr);
+					continue;
+				}
+				nexpected++;
+				REQUIRE(val.len == 1);
+				REQUIRE(*static_cast<uint8_t*>(val.value) == it->second);
+				REQUIRE(*static_cast<uint8_t*>(row[x].value) == it->second);
+			}
+			REQUIRE(nrow == nexpected);
+		}
+	}
+}
+
+TEST_CASE( "DedupValues", "[flatwriter]" ) {
+	fmt::print(" - Running DedupValues test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	unlink(fname.c_str());
+
+	// Every third tile is "ocean" (the same bytes), the rest are unique and of differing lengths.
+	auto valueFor = [](uint64_t key) {
+		std::vector<uint8_t> val;
+		if (key % 3 == 0) val.assign(700, 7);
+		else {
+			val.resize(1 + key % 500);
+			for (int i=0; i<val.size(); i++) val[i] = (key + i) % 251;
+		}
+		return val;
+	};
+
+	uint64_t nocean = 0, oceanBytes = 0, totalBytes = 0;
+	{
+		EnvOptions opts;
+		opts.dedupValues = true;
+		FlatEnvironment e(fname, opts);
+		REQUIRE(e.hasExplicitValueLengths());
+		e.beginLevel(10);
+		for (uint64_t y=0; y<100; y++)
+		for (uint64_t x=0; x<100; x++) {
+			uint64_t key = BlockCoordinate{10,y,x}.c;
+			auto val = valueFor(key);
+			e.writeKeyValue(key, val.data(), val.size());
+			totalBytes += val.size();
+			if (key % 3 == 0) nocean++, oceanBytes += val.size();
+		}
+		e.endLevel(true);
+
+		// Only one copy of the ocean tile is stored.
+		REQUIRE(e.getLevelSpec(10).valsLength == totalBytes - oceanBytes + 700);
+	}
+
+	{
+		FlatEnvironment e(fname, EnvOptions::getReadonly());
+		REQUIRE(e.hasExplicitValueLengths());
+		std::vector<uint64_t> keys;
+		for (uint64_t y=0; y<100; y++)
+		for (uint64_t x=0; x<100; x++) {
+			uint64_t key = BlockCoordinate{10,y,x}.c;
+			keys.push_back(key);
+			auto expected = valueFor(key);
+			Value val = e.lookup(10, key);
+			REQUIRE(val.len == expected.size());
+			REQUIRE(memcmp(val.value, expected.data(), val.len) == 0);
+			REQUIRE(e.locateValue(10, key).len == expected.size());
+		}
+
+		std::vector<Value> vals(keys.size());
+		REQUIRE(e.lookupMany(10, keys.data(), vals.data(), keys.size()) == keys.size());
+		for (int i=0; i<keys.size(); i++) REQUIRE(vals[i].len == valueFor(keys[i]).size());
+	}
+
+	// Through a reader, which keeps the decoded ocean tile once it repeats: every tile must still decode as its own,
+	// also when the caller writes into what it got.
+	unlink(fname.c_str());
+	auto tileFor = [](uint64_t x) {
+		cv::Mat img(256, 256, CV_8UC3);
+		uint8_t v = x % 4 == 3 ? 40 + x * 10 : 200;
+		for (int r=0; r<256; r++) memset(img.ptr<uint8_t>(r), v, 256*3);
+		return img;
+	};
+	{
+		EnvOptions opts;
+		opts.dedupValues = true;
+		FlatEnvironment e(fname, opts);
+		e.beginLevel(8);
+		for (uint64_t x=0; x<12; x++) {
+			Value v = encodeValue(tileFor(x), false);
+			e.writeKeyValue(BlockCoordinate{8,0,x}.c, v.value, v.len);
+			free(v.value);
+		}
+		e.endLevel(true);
+	}
+	{
+		FlatReaderCached reader(fname, EnvOptions::getReadonly());
+		cv::Mat dst(256, 256, CV_8UC3);
+		for (int pass=0; pass<2; pass++)
+			for (uint64_t x=0; x<12; x++) {
+				uint8_t want = tileFor(x).ptr<uint8_t>(0)[0];
+				cv::Mat img;
+				if (pass == 0) REQUIRE(not reader.getTile(img, BlockCoordinate{8,0,x}.c, 3));
+				else {
+					REQUIRE(not reader.getTileInto(dst, BlockCoordinate{8,0,x}.c, 3));
+					img = dst;
+				}
+				REQUIRE(std::abs(img.ptr<uint8_t>(100)[300] - want) <= 2);
+				img.ptr<uint8_t>(100)[300] = 0;
+			}
+	}
+
+	// Implicit lengths cannot be switched once a level exists.
+	unlink(fname.c_str());
+	{
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		e.beginLevel(3);
+		uint8_t v = 1;
+		e.writeKeyValue(BlockCoordinate{3,0,0}.c, &v, 1);
+		e.endLevel(true);
+		REQUIRE_THROWS(e.setValueLengths(FlatEnvironment::FileMeta::ValueLengths::eExplicit));
+	}
+	{
+		EnvOptions opts;
+		opts.dedupValues = true;
+		REQUIRE_THROWS(FlatEnvironment(fname, opts));
+	}
+}
+
+TEST_CASE( "OccupancyBitmap", "[flatwriter]" ) {
+	fmt::print(" - Running OccupancyBitmap test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	const std::string cname = "test.compact.it";
+	unlink(fname.c_str());
+	unlink(cname.c_str());
+
+	// A sparse, patterned region spanning several 64x64 blocks, and a small far away cluster.
+	std::set<std::pair<uint32_t,uint32_t>> tiles;
+	for (uint32_t y=500; y<600; y++)
+		for (uint32_t x=1000; x<1200; x++)
+			if ((x*7 + y*3) % 5 != 0) tiles.insert({x,y});
+	for (uint32_t y=3000; y<3003; y++)
+		for (uint32_t x=5000; x<5010; x++) tiles.insert({x,y});
+
+	{
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		// Level 14 is not the final level, so the next one is written right after its occupancy segment.
+		std::vector<uint64_t> keys;
+		for (auto& t : tiles) keys.push_back(BlockCoordinate{14,t.second,t.first}.c);
+		std::sort(keys.begin(), keys.end());
+		e.beginLevel(14);
+		for (uint64_t key : keys) e.writeKeyValue(key, &key, sizeof(key));
+		e.endLevel(false);
+		e.beginLevel(13);
+		uint64_t key = BlockCoordinate{13,250,500}.c;
+		e.writeKeyValue(key, &key, sizeof(key));
+		e.endLevel(true);
+	}
+
+	auto check = [&tiles](FlatEnvironment& e) {
+		OccupancyView occ = e.occupancy(14);
+		REQUIRE(occ.valid());
+		REQUIRE(occ.nitems() == tiles.size());
+		REQUIRE(occ.tlbr()[0] == 1000);
+		REQUIRE(occ.tlbr()[1] == 500);
+		REQUIRE(occ.tlbr()[2] == 5010);
+		REQUIRE(occ.tlbr()[3] == 3003);
+
+		for (uint32_t y=490; y<610; y++)
+			for (uint32_t x=990; x<1210; x++) REQUIRE(occ.has(x,y) == (tiles.count({x,y}) > 0));
+		for (uint32_t y=2990; y<3010; y++)
+			for (uint32_t x=4990; x<5020; x++) REQUIRE(occ.has(x,y) == (tiles.count({x,y}) > 0));
+
+		// Rectangles of all sizes, compared against the set.
+		uint64_t seed = 1;
+		for (int i=0; i<2000; i++) {
+			seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+			uint32_t x0 = 950 + (seed >> 33) % 4100, y0 = 450 + (seed >> 13) % 2600;
+			uint32_t w = 1 + (seed >> 45) % (i % 2 ? 3 : 300), h = 1 + (seed >> 52) % (i % 2 ? 3 : 300);
+			bool expected = false;
+			for (auto it = tiles.lower_bound({x0,0}); it != tiles.end() and it->first < x0+w; ++it)
+				if (it->second >= y0 and it->second < y0+h) { expected = true; break; }
+			REQUIRE(occ.anyIn(x0, y0, x0+w, y0+h) == expected);
+		}
+		REQUIRE_FALSE(occ.anyIn(1300, 500, 4900, 3100));
+		REQUIRE(occ.anyIn(0, 0, 1u<<14, 1u<<14));
+
+		REQUIRE(e.occupancy(13).valid());
+		REQUIRE(e.occupancy(13).has(500, 250));
+		REQUIRE_FALSE(e.occupancy(12).valid());
+	};
+
+	{
+		FlatEnvironment e(fname, EnvOptions::getReadonly());
+		check(e);
+		REQUIRE(e.lookup(13, BlockCoordinate{13,250,500}.c).len == 8);
+	}
+
+	// The segments move with their levels.
+	compactFile(fname, cname);
+	{
+		FlatEnvironment e(cname, EnvOptions::getReadonly());
+		check(e);
+	}
+
+	// Files without segments (or with stale ones) get them added in place.
+	{
+		EnvOptions opts;
+		FlatEnvironment e(fname, opts);
+		e.meta()->occupancy[14] = FlatEnvironment::FileMeta::SegmentSpec{};
+		REQUIRE_FALSE(e.occupancy(14).valid());
+		REQUIRE(e.addMissingOccupancy() == 1);
+		check(e);
+	}
+	{
+		FlatEnvironment e(fname, EnvOptions::getReadonly());
+		check(e);
+	}
+}
+
+TEST_CASE( "MultiReader", "[flatwriter]" ) {
+	fmt::print(" - Running MultiReader test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::vector<std::string> names { "test.multi0.it", "test.multi1.it", "test.multi2.it" };
+	for (auto& name : names) unlink(name.c_str());
+
+	// Solid tiles, so each file's value is easy to tell apart after a lossy codec.
+	auto write = [](FlatEnvironment& e, uint64_t z, uint64_t y, uint64_t x, uint8_t v) {
+		cv::Mat img(256, 256, CV_8UC3);
+		for (int r=0; r<256; r++) memset(img.ptr<uint8_t>(r), v, 256*3);
+		Value val = encodeValue(img, false);
+		e.writeKeyValue(BlockCoordinate{z,y,x}.c, val.value, val.len);
+		free(val.value);
+	};
+	auto inA = [](uint64_t y, uint64_t x) { return y < 20 and x < 40 and (x + y) % 3 != 0; };
+	auto inB = [](uint64_t y, uint64_t x) { return y >= 10 and y < 30 and x >= 30 and x < 70; };
+	auto inDelta = [](uint64_t y, uint64_t x) { return y == 50 and x >= 100 and x < 104; };
+	auto inC = [](uint64_t y, uint64_t x) { return y == 0 and x >= 200 and x < 210; };
+
+	{
+		FlatEnvironment e(names[0], EnvOptions{});
+		e.beginLevel(10);
+		for (uint64_t y=0; y<20; y++)
+			for (uint64_t x=0; x<40; x++) if (inA(y,x)) write(e, 10, y, x, 50);
+		e.endLevel(true);
+	}
+	{
+		// Overlaps the first, and has a delta run in a cell no base level touches.
+		FlatEnvironment e(names[1], EnvOptions{});
+		e.beginLevel(10);
+		for (uint64_t y=10; y<30; y++)
+			for (uint64_t x=30; x<70; x++) write(e, 10, y, x, 100);
+		e.endLevel(false);
+		e.beginLevel(9);
+		write(e, 9, 5, 5, 120);
+		e.endLevel(true);
+		e.beginDelta(10);
+		for (uint64_t x=100; x<104; x++) write(e, 10, 50, x, 150);
+		e.endLevel(true);
+	}
+	{
+		// As a file from before occupancy segments.
+		FlatEnvironment e(names[2], EnvOptions{});
+		e.beginLevel(10);
+		for (uint64_t x=200; x<210; x++) write(e, 10, 0, x, 200);
+		e.endLevel(true);
+		e.meta()->occupancy[10] = FlatEnvironment::FileMeta::SegmentSpec{};
+	}
+
+	auto check = [&](FlatMultiReader& r, bool firstWins) {
+		cv::Mat dst(256, 256, CV_8UC3);
+		for (uint64_t y=0; y<56; y++)
+			for (uint64_t x=0; x<216; x++) {
+				uint64_t tile = BlockCoordinate{10,y,x}.c;
+				int want = -1, value = 0;
+				if (inA(y,x) and (firstWins or not inB(y,x))) want = 0, value = 50;
+				else if (inB(y,x)) want = 1, value = 100;
+				else if (inDelta(y,x)) want = 1, value = 150;
+				else if (inC(y,x)) want = 2, value = 200;
+
+				REQUIRE(r.findSource(tile) == want);
+				REQUIRE(r.tileExists(tile) == (want >= 0));
+				REQUIRE(r.getTileInto(dst, tile, 3) == (want < 0));
+				if (want >= 0) REQUIRE(std::abs(dst.ptr<uint8_t>(128)[128*3] - value) <= 2);
+			}
+		REQUIRE(r.findSource(BlockCoordinate{9,5,5}.c) == 1);
+		REQUIRE(r.findSource(BlockCoordinate{9,5,6}.c) == -1);
+		REQUIRE(r.getTile(BlockCoordinate{11,0,0}.c, 3).empty());
+	};
+
+	{
+		FlatMultiReader r(names, EnvOptions::getReadonly());
+		REQUIRE_FALSE(r.getReader(2).env.occupancy(10).valid());
+		check(r, true);
+	}
+	{
+		FlatMultiReader r(names, EnvOptions::getReadonly(), { 0, 1, 0 });
+		check(r, false);
+	}
+}
+
+// Terrain tiles, so that the (lossless) decoded overviews can be compared exactly.
+// The range is not aligned to parent tiles on any side, and some tiles are missing: scattered ones, and a 4x4 hole
+// that leaves a whole tile two levels up empty.
+static constexpr int pyramidTestBase = 6;
+static const uint64_t pyramidTestTlbr[4] = { 5, 3, 14, 12 };
+
+static cv::Mat pyramidTestTile(uint64_t x, uint64_t y) {
+	const uint64_t* tlbr = pyramidTestTlbr;
+	if (x < tlbr[0] or x >= tlbr[2] or y < tlbr[1] or y >= tlbr[3]) return {};
+	if ((x + 2*y) % 7 == 0) return {};
+	if (x >= 8 and x < 12 and y >= 4 and y < 8) return {};
+	cv::Mat img(256, 256, CV_16UC1);
+	for (int r=0; r<256; r++)
+		for (int c=0; c<256; c++) img.at<uint16_t>(r,c) = (x*977 + y*131 + r*3 + c*5) % 4000;
+	return img;
+}
+
+// What WriterMasterAddo would make: join the four children (zeros for missing ones) and halve.
+static cv::Mat pyramidTestExpected(int lvl, uint64_t x, uint64_t y) {
+	if (lvl == pyramidTestBase) return pyramidTestTile(x, y);
+	cv::Mat a = pyramidTestExpected(lvl+1, 2*x+0, 2*y+0);
+	cv::Mat b = pyramidTestExpected(lvl+1, 2*x+0, 2*y+1);
+	cv::Mat c = pyramidTestExpected(lvl+1, 2*x+1, 2*y+0);
+	cv::Mat d = pyramidTestExpected(lvl+1, 2*x+1, 2*y+1);
+	if (a.empty() and b.empty() and c.empty() and d.empty()) return {};
+	cv::Mat img = cv::Mat::zeros(512, 512, CV_16UC1);
+	if (!a.empty()) a.copyTo(img(cv::Rect{0,256,256,256}));
+	if (!b.empty()) b.copyTo(img(cv::Rect{0,0,256,256}));
+	if (!c.empty()) c.copyTo(img(cv::Rect{256,256,256,256}));
+	if (!d.empty()) d.copyTo(img(cv::Rect{256,0,256,256}));
+	cv::resize(img, img, cv::Size{256,256}, 0, 0, cv::INTER_LINEAR);
+	return img;
+}
+
+// Every overview tile from @lvl down to @minLvl in @env must match pyramidTestExpected().
+static void checkPyramidTestLevels(FlatEnvironment& env, int lvl, int minLvl) {
+	const uint64_t* tlbr = pyramidTestTlbr;
+	for (; lvl>=minLvl; lvl--) {
+		int shift = pyramidTestBase - lvl;
+		for (uint64_t y=tlbr[1]>>shift; y<=((tlbr[3]-1)>>shift); y++)
+			for (uint64_t x=tlbr[0]>>shift; x<=((tlbr[2]-1)>>shift); x++) {
+				cv::Mat want = pyramidTestExpected(lvl, x, y);
+				Value val = env.lookup(lvl, BlockCoordinate{(uint64_t)lvl,y,x}.c);
+				REQUIRE((val.value == nullptr) == want.empty());
+				if (want.empty()) continue;
+				cv::Mat got = decodeValue(val, 1, true);
+				REQUIRE(cv::norm(got, want, cv::NORM_INF) == 0);
+			}
+	}
+}
+
+TEST_CASE( "PyramidBuilder", "[flatwriter]" ) {
+	fmt::print(" - Running PyramidBuilder test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+	unlink(fname.c_str());
+
+	constexpr int base = pyramidTestBase;
+	const uint64_t* tlbr = pyramidTestTlbr;
+
+	{
+		EnvOptions opts;
+		opts.isTerrain = true;
+		FlatEnvironment env(fname, opts);
+		PyramidBuilder pyramid(fname + ".spill", base, tlbr, true, cv::INTER_LINEAR);
+
+		// Added from several threads, in no particular order.
+		std::vector<uint64_t> keys;
+		for (uint64_t y=tlbr[1]; y<tlbr[3]; y++)
+			for (uint64_t x=tlbr[0]; x<tlbr[2]; x++) keys.push_back(BlockCoordinate{base,y,x}.c);
+		std::reverse(keys.begin(), keys.end());
+		std::atomic<int> next = 0;
+		std::vector<std::thread> threads;
+		for (int t=0; t<4; t++)
+			threads.emplace_back([&] {
+				for (int i; (i = next++) < keys.size(); ) {
+					BlockCoordinate bc(keys[i]);
+					pyramid.addTile(keys[i], pyramidTestTile(bc.x(), bc.y()));
+				}
+			});
+		for (auto& t : threads) t.join();
+
+		pyramid.finish();
+		REQUIRE(pyramid.numTiles() > 0);
+		pyramid.writeLevels(env);
+	}
+
+	// Down to where the range fits in one tile, as with WriterMasterAddo (see AddoDag).
+	FlatEnvironment env(fname, EnvOptions::getReadonly(true));
+	REQUIRE(env.haveLevel(3));
+	REQUIRE_FALSE(env.haveLevel(2));
+	checkPyramidTestLevels(env, base-1, 3);
+
+	// And tile by tile the same as WriterMasterAddo on the same base level.
+	const std::string aname = "test.addo.it";
+	unlink(aname.c_str());
+	EnvOptions opts;
+	opts.isTerrain = true;
+	{
+		FlatEnvironment e(aname, opts);
+		e.beginLevel(base);
+		for (uint64_t y=tlbr[1]; y<tlbr[3]; y++)
+			for (uint64_t x=tlbr[0]; x<tlbr[2]; x++) {
+				cv::Mat img = pyramidTestTile(x, y);
+				if (img.empty()) continue;
+				Value v = encodeValue(img, true);
+				e.writeKeyValue(BlockCoordinate{base,y,x}.c, v.value, v.len);
+				free(v.value);
+			}
+		e.endLevel(false);
+	}
+	{
+		ConvertConfig cfg;
+		cfg.baseLevel = base;
+		cfg.channels = 1;
+		cfg.addoInterp = cv::INTER_LINEAR;
+		WriterMasterAddo wm(aname, opts);
+		wm.start(cfg);
+		while (not wm.didWriterLoopExit()) usleep(10'000);
+		wm.stop();
+	}
+	FlatEnvironment addo(aname, EnvOptions::getReadonly(true));
+	for (int lvl=0; lvl<base; lvl++) {
+		REQUIRE(env.haveLevel(lvl) == addo.haveLevel(lvl));
+		if (not addo.haveLevel(lvl)) continue;
+		uint64_t n = addo.getLevelSpec(lvl).nitemsUsed();
+		REQUIRE(env.getLevelSpec(lvl).nitemsUsed() == n);
+		const uint64_t* keys = addo.getKeys(lvl);
+		for (uint64_t i=0; i<n; i++) {
+			cv::Mat want = decodeValue(addo.lookup(lvl, keys[i]), 1, true);
+			cv::Mat got = decodeValue(env.lookup(lvl, keys[i]), 1, true);
+			REQUIRE(not got.empty());
+			REQUIRE(cv::norm(got, want, cv::NORM_INF) == 0);
+		}
+	}
+}
+
+TEST_CASE( "AddoDag", "[flatwriter]" ) {
+	fmt::print(" - Running AddoDag test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+
+	constexpr int base = pyramidTestBase;
+	const uint64_t* tlbr = pyramidTestTlbr;
+
+	// Without the decoded tile cache, with one too small to hold every pending child, and with one that holds everything.
+	for (int cacheTiles : { 0, 1, 2048 }) {
+		unlink(fname.c_str());
+
+		EnvOptions opts;
+		opts.isTerrain = true;
+		{
+			FlatEnvironment env(fname, opts);
+			env.beginLevel(base);
+			for (uint64_t y=tlbr[1]; y<tlbr[3]; y++)
+				for (uint64_t x=tlbr[0]; x<tlbr[2]; x++) {
+					cv::Mat img = pyramidTestTile(x, y);
+					if (img.empty()) continue;
+					Value v = encodeValue(img, true);
+					env.writeKeyValue(BlockCoordinate{base,y,x}.c, v.value, v.len);
+					free(v.value);
+				}
+			env.endLevel(false);
+		}
+
+		// Levels are built until the range fits in one tile: 5, 4 and 3 here.
+		{
+			ConvertConfig cfg;
+			cfg.baseLevel = base;
+			cfg.channels = 1;
+			cfg.addoInterp = cv::INTER_LINEAR;
+			cfg.addoCacheTiles = cacheTiles;
+			WriterMasterAddo wm(fname, opts);
+			wm.start(cfg);
+			while (not wm.didWriterLoopExit()) usleep(10'000);
+			wm.stop();
+		}
+
+		FlatEnvironment env(fname, EnvOptions::getReadonly(true));
+		REQUIRE(env.haveLevel(3));
+		REQUIRE_FALSE(env.haveLevel(2));
+		checkPyramidTestLevels(env, base-1, 3);
+	}
+}
+
+TEST_CASE( "ScaledDecode", "[flatwriter]" ) {
+	fmt::print(" - Running ScaledDecode test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	// Smooth color (so that JPEG keeps it well) with a coarse checker pattern.
+	cv::Mat img(256, 256, CV_8UC3);
+	for (int y=0; y<256; y++)
+		for (int x=0; x<256; x++) {
+			uint8_t* p = img.ptr<uint8_t>(y) + x*3;
+			p[0] = x / 2 + 40;
+			p[1] = y / 2 + 40;
+			p[2] = ((x / 32 + y / 32) % 2) ? 200 : 60;
+		}
+	Value val = encodeValue(img, false);
+
+	for (int channels : { 1, 3, 4 }) {
+		cv::Mat full = decodeValue(val, channels, false);
+		for (int scale : { 1, 2, 4, 8 }) {
+			cv::Mat scaled = decodeValueScaled(val, channels, false, scale);
+			REQUIRE(scaled.rows == 256 / scale);
+			REQUIRE(scaled.cols == 256 / scale);
+			REQUIRE(scaled.channels() == channels);
+
+			// Close to the full decode averaged down (the scaled IDCT is not exactly an area average).
+			cv::Mat want;
+			if (scale == 1) want = full;
+			else cv::resize(full, want, cv::Size{256 / scale, 256 / scale}, 0, 0, cv::INTER_AREA);
+			double err = 0;
+			for (int y=0; y<scaled.rows; y++)
+				for (int x=0; x<scaled.cols*channels; x++)
+					err += std::abs(scaled.ptr<uint8_t>(y)[x] - want.ptr<uint8_t>(y)[x]);
+			err /= scaled.rows * scaled.cols * channels;
+			REQUIRE(err < 4);
+			if (channels == 4) REQUIRE(scaled.ptr<uint8_t>(scaled.rows-1)[scaled.cols*4-1] == 255);
+		}
+	}
+	free(val.value);
+
+	// Terrain keeps exact samples.
+	cv::Mat terrain(256, 256, CV_16UC1);
+	for (int y=0; y<256; y++)
+		for (int x=0; x<256; x++) terrain.at<uint16_t>(y, x) = (y * 256 + x) * 3;
+	Value tval = encodeValue(terrain, true);
+	cv::Mat tscaled = decodeValueScaled(tval, 1, true, 4);
+	REQUIRE(tscaled.rows == 64);
+	REQUIRE(tscaled.cols == 64);
+	for (int y=0; y<64; y++)
+		for (int x=0; x<64; x++) REQUIRE(tscaled.at<uint16_t>(y, x) == terrain.at<uint16_t>(y*4, x*4));
+	free(tval.value);
+
+	REQUIRE(decodeValueScaled(Value{}, 3, false, 2).empty());
+}
+
+TEST_CASE( "DecodeInto", "[flatwriter]" ) {
+	fmt::print(" - Running DecodeInto test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	auto makeTile = [](int seed) {
+		cv::Mat img(256, 256, CV_8UC3);
+		for (int y=0; y<256; y++)
+			for (int x=0; x<256*3; x++) img.ptr<uint8_t>(y)[x] = (x / 3 + y * seed) / 4 % 200 + 20;
+		return img;
+	};
+
+	// Into a strided region of a larger buffer: the same pixels as decodeValue(), and nothing around it touched.
+	Value val = encodeValue(makeTile(1), false);
+	for (int channels : { 1, 3, 4 }) {
+		cv::Mat want = decodeValue(val, channels, false);
+		cv::Mat big(300, 600, CV_8UC(channels), cv::Scalar{0});
+		cv::Mat dst = big(cv::Rect{100, 20, 256, 256});
+		uint8_t* before = dst.data;
+		REQUIRE(not decodeValueInto(dst, val, channels, false));
+		REQUIRE(dst.data == before);
+		for (int y=0; y<256; y++) REQUIRE(memcmp(dst.ptr<uint8_t>(y), want.ptr<uint8_t>(y), 256 * channels) == 0);
+		if (channels == 4) REQUIRE(dst.ptr<uint8_t>(255)[255*4+3] == 255);
+		REQUIRE(big.ptr<uint8_t>(19)[100 * channels] == 0);
+		REQUIRE(big.ptr<uint8_t>(20)[356 * channels] == 0);
+
+		cv::Mat wrongSize = big(cv::Rect{0, 0, 128, 128});
+		REQUIRE(decodeValueInto(wrongSize, val, channels, false));
+	}
+	cv::Mat unused(256, 256, CV_8UC3);
+	REQUIRE(decodeValueInto(unused, Value{}, 3, false));
+	free(val.value);
+
+	// The mosaic of a reader, into a buffer kept between calls.
+	const std::string name = "test.decodeInto.it";
+	unlink(name.c_str());
+	{
+		FlatEnvironment e(name, EnvOptions{});
+		e.beginLevel(5);
+		for (uint64_t y=3; y<5; y++)
+			for (uint64_t x=7; x<10; x++) {
+				if (y == 4 and x == 8) continue;
+				Value v = encodeValue(makeTile(y * 16 + x), false);
+				e.writeKeyValue(BlockCoordinate{5,y,x}.c, v.value, v.len);
+				free(v.value);
+			}
+		e.endLevel(true);
+	}
+	FlatReaderCached reader(name, EnvOptions::getReadonly());
+	uint32_t tlbr[4] = { 7, 3, 10, 5 };
+	cv::Mat mosaic(512, 768, CV_8UC4);
+	uint8_t* before = mosaic.data;
+	reader.getTlbr(mosaic, 5, tlbr, 4);
+	REQUIRE(mosaic.data == before);
+	for (uint32_t y=3; y<5; y++)
+		for (uint32_t x=7; x<10; x++) {
+			cv::Mat tile = mosaic(cv::Rect{(int)(x-7)*256, (int)(4-y)*256, 256, 256});
+			cv::Mat want = reader.getTile(BlockCoordinate{5,y,x}.c, 4);
+			for (int r=0; r<256; r+=51) {
+				if (want.empty()) REQUIRE(tile.ptr<uint8_t>(r)[0] == 0);
+				else REQUIRE(memcmp(tile.ptr<uint8_t>(r), want.ptr<uint8_t>(r), 256 * 4) == 0);
+			}
+		}
+}
+
+TEST_CASE( "CodecRegistry", "[flatwriter]" ) {
+	fmt::print(" - Running CodecRegistry test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	cv::Mat color(256, 256, CV_8UC3), terrain(256, 256, CV_16UC1);
+	for (int y=0; y<256; y++)
+		for (int x=0; x<256; x++) {
+			for (int c=0; c<3; c++) color.ptr<uint8_t>(y)[x*3+c] = (x + y * (c + 1)) / 3 % 200 + 20;
+			// Rolling hills, with a corner of nodata.
+			terrain.ptr<uint16_t>(y)[x] = x < 40 and y < 30 ? 0 : 3000 + 40 * x - 25 * y + (x * y) % 97;
+		}
+
+	// Every codec of this build round trips, the lossless ones exactly.
+	for (auto& codec : allCodecs()) {
+		if (not codec.canEncode() or not codec.canDecode()) continue;
+		fmt::print(" - codec {}\n", codec.name);
+		if (codec.terrain) {
+			Value v = encodeValue(terrain, true, codec.id);
+			cv::Mat got = decodeValue(v, 1, true, codec.id);
+			REQUIRE(got.type() == CV_16UC1);
+			for (int y=0; y<256; y++) REQUIRE(memcmp(got.ptr<uint8_t>(y), terrain.ptr<uint8_t>(y), 256 * 2) == 0);
+			// In place, into a strided region.
+			cv::Mat big(300, 300, CV_16UC1, cv::Scalar{0});
+			cv::Mat dst = big(cv::Rect{20, 10, 256, 256});
+			REQUIRE(not decodeValueInto(dst, v, 1, true, 1, codec.id));
+			for (int y=0; y<256; y++) REQUIRE(memcmp(dst.ptr<uint8_t>(y), terrain.ptr<uint8_t>(y), 256 * 2) == 0);
+			REQUIRE(big.ptr<uint16_t>(9)[20] == 0);
+			free(v.value);
+		} else {
+			Value v = encodeValue(color, false, codec.id);
+			for (int channels : { 1, 3, 4 }) {
+				cv::Mat got = decodeValue(v, channels, false, codec.id);
+				REQUIRE(got.rows == 256);
+				REQUIRE(got.cols == 256);
+				REQUIRE(got.type() == CV_8UC(channels));
+				if (channels != 3) continue;
+				double absErr = 0;
+				for (int y=0; y<256; y++)
+					for (int x=0; x<256*3; x++) absErr += std::abs(got.ptr<uint8_t>(y)[x] - color.ptr<uint8_t>(y)[x]);
+				absErr /= 256 * 256 * 3;
+				if (codec.lossless) REQUIRE(absErr == 0);
+				else REQUIRE(absErr < 3);
+			}
+			REQUIRE(decodeValueScaled(v, 3, false, 4, codec.id).cols == 64);
+			free(v.value);
+		}
+	}
+
+	// Ids are per raster kind.
+	REQUIRE(parseCodec("default", true) == CodecId::eDefault);
+	REQUIRE(parseCodec("terrainDelta", true) == CodecId::eTerrainDelta);
+	REQUIRE(parseCodec("stbJpeg", false) == CodecId::eStbJpeg);
+	REQUIRE_THROWS(parseCodec("terrainDelta", false));
+	REQUIRE_THROWS(parseCodec("webp", true));
+	REQUIRE_THROWS(parseCodec("png", false));
+	REQUIRE_THROWS(getCodec(static_cast<CodecId>(200), false));
+
+	// Smooth terrain is much smaller with per row deltas.
+	Value deflated = encodeValue(terrain, true), delta = encodeValue(terrain, true, CodecId::eTerrainDelta);
+	fmt::print(" - terrain: zlib {} bytes, terrainDelta {} bytes\n", deflated.len, delta.len);
+	REQUIRE(delta.len < deflated.len);
+	free(deflated.value);
+	free(delta.value);
+
+	// The codec is stored in the file, and readers decode with it.
+	const std::string name = "test.codecRegistry.it";
+	unlink(name.c_str());
+	{
+		EnvOptions opts;
+		opts.isTerrain = true;
+		opts.codec = static_cast<uint8_t>(CodecId::eTerrainDelta);
+		FlatEnvironment e(name, opts);
+		REQUIRE(e.codec() == CodecId::eTerrainDelta);
+		e.beginLevel(5);
+		for (uint64_t x=7; x<9; x++) {
+			Value v = encodeValue(terrain, true, e.codec());
+			e.writeKeyValue(BlockCoordinate{5,3,x}.c, v.value, v.len);
+			free(v.value);
+		}
+		e.endLevel(true);
+	}
+	FlatReaderCached reader(name, EnvOptions::getReadonly(true));
+	REQUIRE(reader.env.codec() == CodecId::eTerrainDelta);
+	cv::Mat tile = reader.getTile(BlockCoordinate{5,3,8}.c, 1);
+	REQUIRE(not tile.empty());
+	for (int y=0; y<256; y++) REQUIRE(memcmp(tile.ptr<uint8_t>(y), terrain.ptr<uint8_t>(y), 256 * 2) == 0);
+}
+
+TEST_CASE( "TerrainPredict", "[flatwriter]" ) {
+	fmt::print(" - Running TerrainPredict test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+	if (not getCodec(CodecId::eTerrainPredict, true).canEncode()) {
+		fmt::print(" - skipped: built without zstd\n");
+		return;
+	}
+
+	// Tiles that favour each predictor, plus the cases with large residuals: wrap around, nodata and noise.
+	std::mt19937 rng(0);
+	std::vector<std::function<uint16_t(int,int)>> tiles {
+		[](int y, int x) { return 1000 + 7 * x; },
+		[](int y, int x) { return 1000 + 7 * y; },
+		[](int y, int x) { return 30000 + 13 * x - 11 * y; },
+		[](int y, int x) { return (x / 16 + y / 16) % 2 ? 2000 : 100; },
+		[](int y, int x) { return x < 100 and y > 50 ? 0 : 8000 + 3 * x + (x * y) % 7; },
+		[](int y, int x) { return (x + y) % 2 ? 65535 : 0; },
+		[&rng](int y, int x) { return static_cast<uint16_t>(rng()); },
+		[](int y, int x) { return 0; },
+	};
+	std::vector<size_t> sizes;
+	for (auto& f : tiles) {
+		cv::Mat img(256, 256, CV_16UC1);
+		for (int y=0; y<256; y++)
+			for (int x=0; x<256; x++) img.ptr<uint16_t>(y)[x] = f(y, x);
+		Value v = encodeValue(img, true, CodecId::eTerrainPredict);
+		sizes.push_back(v.len);
+		cv::Mat got = decodeValue(v, 1, true, CodecId::eTerrainPredict);
+		REQUIRE(got.type() == CV_16UC1);
+		for (int y=0; y<256; y++) REQUIRE(memcmp(got.ptr<uint8_t>(y), img.ptr<uint8_t>(y), 256 * 2) == 0);
+
+		// Truncated or with an unknown predictor: an error, not a crash.
+		Value bad { v.value, v.len / 2 };
+		REQUIRE(decodeValue(got, bad, 1, true, CodecId::eTerrainPredict));
+		static_cast<uint8_t*>(v.value)[0] = 200;
+		REQUIRE(decodeValue(got, v, 1, true, CodecId::eTerrainPredict));
+		free(v.value);
+	}
+	for (size_t i=0; i<sizes.size(); i++) fmt::print(" - tile {}: {} bytes\n", i, sizes[i]);
+	// The slopes leave only a few distinct residuals.
+	REQUIRE(sizes[0] < 200);
+	REQUIRE(sizes[1] < 200);
+	REQUIRE(sizes[2] < 200);
+}
+
+TEST_CASE( "CodecContext", "[flatwriter]" ) {
+	fmt::print(" - Running CodecContext test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	cv::Mat color(256, 256, CV_8UC3), terrain(256, 256, CV_16UC1);
+	for (int y=0; y<256; y++)
+		for (int x=0; x<256; x++) {
+			for (int c=0; c<3; c++) color.ptr<uint8_t>(y)[x*3+c] = (x * (c + 2) + y) / 5 % 180 + 40;
+			terrain.ptr<uint16_t>(y)[x] = 1500 + 9 * x + 4 * y + (x ^ y) % 13;
+		}
+	std::vector<uint8_t> garbage(3000, 0xab);
+
+	// Each thread reuses its codec state from tile to tile, also after a corrupt value: the results must not change.
+	for (auto& codec : allCodecs()) {
+		if (not codec.canEncode() or not codec.canDecode()) continue;
+		fmt::print(" - codec {}\n", codec.name);
+		const cv::Mat& img = codec.terrain ? terrain : color;
+		int channels = codec.terrain ? 1 : 3;
+		Value first = encodeValue(img, codec.terrain, codec.id);
+		cv::Mat expected = decodeValue(first, channels, codec.terrain, codec.id);
+		REQUIRE(not expected.empty());
+
+		std::atomic<int> failures { 0 };
+		std::vector<std::thread> threads;
+		for (int t=0; t<4; t++)
+			threads.emplace_back([&]() {
+				cv::Mat got;
+				for (int i=0; i<8; i++) {
+					Value v = encodeValueScratch(img, codec.terrain, codec.id);
+					if (v.len != first.len or memcmp(v.value, first.value, v.len) != 0) failures++;
+
+					Value bad { garbage.data(), garbage.size() };
+					decodeValue(got, bad, channels, codec.terrain, codec.id);
+					Value truncated { first.value, first.len / 2 };
+					decodeValue(got, truncated, channels, codec.terrain, codec.id);
+
+					if (decodeValue(got, v, channels, codec.terrain, codec.id)) failures++;
+					else
+						for (int y=0; y<256; y++)
+							if (memcmp(got.ptr<uint8_t>(y), expected.ptr<uint8_t>(y), expected.cols * expected.elemSize())) {
+								failures++;
+								break;
+							}
+				}
+			});
+		for (auto& th : threads) th.join();
+		REQUIRE(failures == 0);
+		free(first.value);
+	}
+}
+
+TEST_CASE( "Decimate", "[flatwriter]" ) {
+	fmt::print(" - Running Decimate test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	// Odd widths leave a tail for the non-vector loops.
+	std::mt19937_64 rng(0);
+	for (int type : { CV_8UC1, CV_8UC3, CV_8UC4, CV_16UC1 }) {
+		for (cv::Size size : { cv::Size{256,256}, cv::Size{2*37,2*5} }) {
+			cv::Mat children[4];
+			for (int i=0; i<4; i++) {
+				if (i == 2) continue;
+				children[i] = cv::Mat(size.height, size.width, type);
+				for (int y=0; y<size.height; y++) {
+					uint8_t* p = children[i].ptr<uint8_t>(y);
+					for (size_t j=0; j<size.width * children[i].elemSize(); j++) p[j] = rng();
+				}
+			}
+
+			// Joined, with zeros for the missing child.
+			const int tw = size.width, th = size.height, C = children[0].channels();
+			cv::Mat joined = cv::Mat::zeros(2*th, 2*tw, type);
+			children[0].copyTo(joined(cv::Rect{0,th,tw,th}));
+			children[1].copyTo(joined(cv::Rect{0,0,tw,th}));
+			children[3].copyTo(joined(cv::Rect{tw,0,tw,th}));
+
+			// The box kernel gives what cv::resize() does.
+			cv::Mat want, got;
+			cv::resize(joined, want, cv::Size{tw,th}, 0, 0, cv::INTER_AREA);
+			decimate2x(got, children, DecimateKernel::eBox);
+			REQUIRE(got.type() == type);
+			REQUIRE(cv::norm(got, want, cv::NORM_INF) == 0);
+
+			// The sinc kernel, straight from its definition on the joined image.
+			float k[6];
+			for (int i=0; i<6; i++) {
+				double d = std::abs(-1. + i * .4) * 1.8;
+				auto sinc = [](double x) { return x == 0 ? 1. : std::sin(M_PI * x) / (M_PI * x); };
+				k[i] = sinc(d) * sinc(d / 1.8);
+			}
+			auto at = [&](int y, int x, int c) -> double {
+				if (type == CV_16UC1) return joined.at<uint16_t>(y, x);
+				return joined.ptr<uint8_t>(y)[x*C+c];
+			};
+			decimate2x(got, children, DecimateKernel::eSinc);
+			double maxErr = 0;
+			for (int oy=0; oy<th; oy++)
+				for (int ox=0; ox<tw; ox++)
+					for (int c=0; c<C; c++) {
+						double acc = 0, wsum = 0;
+						for (int dy=0; dy<6; dy++)
+							for (int dx=0; dx<6; dx++) {
+								int iy = 2*oy + dy - 2, ix = 2*ox + dx - 2;
+								if (iy < 0 or ix < 0 or iy >= 2*th or ix >= 2*tw) continue;
+								acc += k[dy] * k[dx] * at(iy, ix, c);
+								wsum += k[dy] * k[dx];
+							}
+						double hi = type == CV_16UC1 ? 65535 : 255;
+						double want = std::min(std::max(acc / wsum, 0.), hi);
+						double have = type == CV_16UC1 ? got.at<uint16_t>(oy, ox) : got.ptr<uint8_t>(oy)[ox*C+c];
+						maxErr = std::max(maxErr, std::abs(have - want));
+					}
+			REQUIRE(maxErr <= (type == CV_16UC1 ? 1.5 : .55));
+		}
+	}
+}
+
+TEST_CASE( "Blend", "[flatwriter]" ) {
+	fmt::print(" - Running Blend test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	REQUIRE(parseBlendMode("feather") == BlendMode::eFeather);
+	REQUIRE_THROWS(parseBlendMode("median"));
+
+	// Random sources with about a third of the pixels black, and some with a single non-zero channel (which is data).
+	// The odd width leaves a tail for the non-vector loops.
+	std::mt19937_64 rng(0);
+	for (int type : { CV_8UC1, CV_8UC3, CV_8UC4 }) {
+		for (cv::Size size : { cv::Size{256,256}, cv::Size{37,5} }) {
+			std::vector<cv::Mat> imgs;
+			for (int i=0; i<3; i++) {
+				cv::Mat img(size.height, size.width, type);
+				const int C = img.channels();
+				for (int y=0; y<size.height; y++) {
+					uint8_t* p = img.ptr<uint8_t>(y);
+					for (int x=0; x<size.width; x++) {
+						int r = rng() % 8;
+						for (int c=0; c<C; c++) p[x*C+c] = r < 3 ? 0 : r == 3 ? (c == C-1) * 7 : 1 + rng() % 255;
+					}
+				}
+				imgs.push_back(img);
+			}
+			const int C = imgs[0].channels();
+
+			auto hasData = [&](const cv::Mat& img, int y, int x) {
+				for (int c=0; c<C; c++)
+					if (img.ptr<uint8_t>(y)[x*C+c]) return true;
+				return false;
+			};
+
+			Blender first(BlendMode::eFirst), last(BlendMode::eLast), average(BlendMode::eAverage);
+			cv::Mat gotFirst = first.blend(imgs), gotLast = last.blend(imgs), gotAverage = average.blend(imgs);
+			REQUIRE(gotFirst.type() == type);
+			double maxErr = 0;
+			for (int y=0; y<size.height; y++)
+				for (int x=0; x<size.width; x++) {
+					int f = -1, l = -1;
+					for (int i=0; i<3; i++)
+						if (hasData(imgs[i], y, x)) {
+							if (f < 0) f = i;
+							l = i;
+						}
+					double acc[4] = {0}, wsum = 0;
+					for (auto& img : imgs) {
+						const uint8_t* p = img.ptr<uint8_t>(y) + x*C;
+						int s = C == 1 ? 3 * p[0] : p[0] + p[1] + p[2];
+						double w = std::min(s * 10, 255);
+						for (int c=0; c<C; c++) acc[c] += w * p[c];
+						wsum += w;
+					}
+					for (int c=0; c<C; c++) {
+						REQUIRE(gotFirst.ptr<uint8_t>(y)[x*C+c] == (f < 0 ? 0 : imgs[f].ptr<uint8_t>(y)[x*C+c]));
+						REQUIRE(gotLast.ptr<uint8_t>(y)[x*C+c] == (l < 0 ? 0 : imgs[l].ptr<uint8_t>(y)[x*C+c]));
+						double want = wsum > 0 ? acc[c] / wsum : 0;
+						maxErr = std::max(maxErr, std::abs(gotAverage.ptr<uint8_t>(y)[x*C+c] - want));
+					}
+				}
+			REQUIRE(maxErr <= .501);
+		}
+	}
+
+	// Feathering: a full source under one with data left of x=128 only. The second one's weight grows from its edge,
+	// up to full (same as the first's) at the feather radius.
+	{
+		const int radius = 16;
+		cv::Mat a(256, 256, CV_8UC3, cv::Scalar{0}), b(256, 256, CV_8UC3, cv::Scalar{0});
+		for (int y=0; y<256; y++)
+			for (int x=0; x<256; x++)
+				for (int c=0; c<3; c++) {
+					a.ptr<uint8_t>(y)[x*3+c] = 100;
+					if (x < 128) b.ptr<uint8_t>(y)[x*3+c] = 200;
+				}
+		Blender feather(BlendMode::eFeather, radius);
+		cv::Mat got = feather.blend({a, b});
+		for (int y=0; y<256; y++)
+			for (int x=0; x<256; x++) {
+				int d = std::min(3 * std::max(128 - x, 0), 3 * radius);
+				double wb = (255 * d + 3 * radius - 1) / (3 * radius);
+				double want = (100 * 255 + 200 * wb) / (255 + wb);
+				for (int c=0; c<3; c++) REQUIRE(std::abs(got.ptr<uint8_t>(y)[x*3+c] - want) <= .501);
+			}
+	}
+
+	Blender blender;
+	REQUIRE(blender.blend({}).empty());
+	cv::Mat one(4, 4, CV_8UC3);
+	REQUIRE(blender.blend({one}).data == one.data);
+	REQUIRE_THROWS(blender.blend({one, cv::Mat(4, 4, CV_8UC1)}));
+}
+
+TEST_CASE( "SourceIndex", "[flatwriter]" ) {
+	fmt::print(" - Running SourceIndex test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	// A strip of similar footprints (like the GeoTIFFs of a survey), a few outliers, and one zero-size box.
+	std::mt19937_64 rng(0);
+	std::uniform_real_distribution<double> u(-.5, .5);
+	std::vector<SourceIndex::Box> boxes;
+	for (int i=0; i<2000; i++) {
+		double x = u(rng), y = u(rng) * .1, s = .01 + .002 * u(rng);
+		// Corners in either order.
+		if (i % 2) boxes.push_back({x, y, x+s, y+s});
+		else boxes.push_back({x+s, y+s, x, y});
+	}
+	boxes.push_back({-1, -1, 1, 1});
+	boxes.push_back({.3, .3, .3001, .9});
+	boxes.push_back({.2, .2, .2, .2});
+
+	SourceIndex index(boxes);
+	REQUIRE(index.size() == boxes.size());
+
+	std::vector<uint32_t> got;
+	for (int q=0; q<2000; q++) {
+		double x0 = u(rng) * 1.2, y0 = u(rng) * 1.2, s = std::abs(u(rng)) * (q % 10 == 0 ? .5 : .02);
+		double x1 = x0 + s, y1 = y0 + s;
+		if (q == 0) { x0 = y0 = x1 = y1 = .2; }
+		index.query(got, x0, y0, x1, y1);
+
+		std::vector<uint32_t> want;
+		for (uint32_t i=0; i<boxes.size(); i++) {
+			auto& b = boxes[i];
+			if (std::min(b[0],b[2]) <= x1 and x0 <= std::max(b[0],b[2]) and std::min(b[1],b[3]) <= y1 and y0 <= std::max(b[1],b[3]))
+				want.push_back(i);
+		}
+		REQUIRE(got == want);
+	}
+
+	SourceIndex empty(std::vector<SourceIndex::Box>{});
+	empty.query(got, 0, 0, 1, 1);
+	REQUIRE(got.empty());
+}
+
+TEST_CASE( "LocalitySchedule", "[flatwriter]" ) {
+	fmt::print(" - Running LocalitySchedule test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string fname = "test.it";
+
+	// Two sources split at x=16, nothing under y<8.
+	constexpr int lvl = 6;
+	const uint64_t tlbr[4] = { 3, 5, 29, 22 };
+	auto twoSources = [](const uint64_t t[4]) -> uint32_t {
+		if (t[3] <= 8) return LocalitySchedule::noSource;
+		return t[0] < 16 ? 1 : 0;
+	};
+	auto oneSource = [](const uint64_t*) { return 0u; };
+
+	using KeyOrder = FlatEnvironment::FileMeta::KeyOrder;
+	for (auto keyOrder : { KeyOrder::eRowMajor, KeyOrder::eMorton, KeyOrder::eHilbert }) {
+		for (bool single : { false, true }) {
+			const LocalitySchedule::PrimarySource& primary = single ? LocalitySchedule::PrimarySource(oneSource) : LocalitySchedule::PrimarySource(twoSources);
+			unlink(fname.c_str());
+
+			std::vector<uint64_t> order;
+			uint64_t numDirect, numSpilled;
+			{
+				FlatEnvironment env(fname, EnvOptions{});
+				if (keyOrder != KeyOrder::eRowMajor) env.setKeyOrder(keyOrder);
+				auto orderedKey = [&env](uint64_t k) { return env.orderedKey(k); };
+
+				LocalitySchedule schedule(lvl, tlbr, primary, orderedKey);
+				REQUIRE(schedule.numGroups() == 4 * 3);
+
+				env.beginLevel(lvl);
+				ScheduledLevelWriter writer(env, lvl, fname + ".spill");
+
+				std::set<uint64_t> seen;
+				std::vector<uint64_t> group, firsts, laterMins;
+				uint32_t lastSource = 0;
+				uint64_t laterMin;
+				while (schedule.next(group, laterMin)) {
+					REQUIRE(group.size() > 0);
+					BlockCoordinate first(group[0]);
+					uint64_t gt[4] = { first.x() & ~7ull, first.y() & ~7ull, (first.x() & ~7ull) + 8, (first.y() & ~7ull) + 8 };
+					uint64_t clipped[4] = { std::max(gt[0], tlbr[0]), std::max(gt[1], tlbr[1]), std::min(gt[2], tlbr[2]), std::min(gt[3], tlbr[3]) };
+					uint32_t source = primary(clipped);
+					REQUIRE(source >= lastSource);
+					// Within a source, groups go in key order.
+					if (source == lastSource and firsts.size()) REQUIRE(orderedKey(group[0]) > firsts.back());
+					lastSource = source;
+					firsts.push_back(orderedKey(group[0]));
+					laterMins.push_back(laterMin);
+
+					for (size_t i=0; i<group.size(); i++) {
+						BlockCoordinate bc(group[i]);
+						REQUIRE(bc.z() == lvl);
+						REQUIRE((bc.x() >> 3) == (first.x() >> 3));
+						REQUIRE((bc.y() >> 3) == (first.y() >> 3));
+						REQUIRE(bc.x() >= tlbr[0]);
+						REQUIRE(bc.x() < tlbr[2]);
+						REQUIRE(bc.y() >= tlbr[1]);
+						REQUIRE(bc.y() < tlbr[3]);
+						if (i > 0) REQUIRE(orderedKey(group[i]) > orderedKey(group[i-1]));
+						REQUIRE(seen.insert(group[i]).second);
+						order.push_back(group[i]);
+					}
+
+					// As the writer thread would see them. Skip some, like empty tiles.
+					writer.beginGroup(group.size(), laterMin);
+					for (uint64_t k : group) {
+						if (k % 5 == 0) writer.add(k, nullptr, 0);
+						else            writer.add(k, &k, sizeof(uint64_t));
+					}
+				}
+				REQUIRE(seen.size() == (tlbr[2]-tlbr[0]) * (tlbr[3]-tlbr[1]));
+				REQUIRE(schedule.groupsDone() == schedule.numGroups());
+				for (size_t i=0; i<firsts.size(); i++)
+					REQUIRE(laterMins[i] == (i+1 == firsts.size() ? ~0ull : *std::min_element(firsts.begin()+i+1, firsts.end())));
+
+				writer.finish();
+				env.endLevel(true);
+				numDirect = writer.numDirect();
+				numSpilled = writer.numSpilled();
+			}
+			REQUIRE(numDirect + numSpilled == (uint64_t)std::count_if(order.begin(), order.end(), [](uint64_t k) { return k % 5 != 0; }));
+			// With one source, the spatial orders need no spill at all, row major spills all but the top row of a band.
+			if (single and keyOrder != KeyOrder::eRowMajor) REQUIRE(numSpilled == 0);
+			if (keyOrder == KeyOrder::eRowMajor) REQUIRE(numSpilled > numDirect);
+
+			FlatEnvironment env(fname, EnvOptions::getReadonly());
+			for (uint64_t k : order) {
+				Value val = env.lookup(lvl, k);
+				if (k % 5 == 0) {
+					REQUIRE(val.value == nullptr);
+					continue;
+				}
+				REQUIRE(val.len == sizeof(uint64_t));
+				uint64_t got;
+				memcpy(&got, val.value, sizeof(uint64_t));
+				REQUIRE(got == k);
+			}
+		}
+	}
+
+	// Tiles added from several threads, in no order, then written sorted.
+	{
+		unlink(fname.c_str());
+		std::vector<uint64_t> keys;
+		for (uint64_t y=tlbr[1]; y<tlbr[3]; y++)
+			for (uint64_t x=tlbr[0]; x<tlbr[2]; x++) keys.push_back(BlockCoordinate{(uint64_t)lvl, y, x}.c);
+		std::reverse(keys.begin(), keys.end());
+
+		{
+			FlatEnvironment env(fname, EnvOptions{});
+			TileSpill spill(fname + ".spill");
+			std::atomic<size_t> next = 0;
+			std::vector<std::thread> threads;
+			for (int t=0; t<4; t++)
+				threads.emplace_back([&] {
+					for (size_t i; (i = next++) < keys.size(); ) spill.add(keys[i], &keys[i], sizeof(uint64_t));
+				});
+			for (auto& t : threads) t.join();
+
+			env.beginLevel(lvl);
+			// The lower half first (keys is reversed), the rest after.
+			const size_t mid = keys.size() / 2;
+			spill.writeLevelBelow(env, lvl, env.orderedKey(keys[mid]));
+			REQUIRE(spill.count(lvl) == mid + 1);
+			spill.writeLevel(env, lvl);
+			REQUIRE(spill.count(lvl) == 0);
+			env.endLevel(true);
+		}
+
+		FlatEnvironment env(fname, EnvOptions::getReadonly());
+		for (uint64_t k : keys) {
+			Value val = env.lookup(lvl, k);
+			REQUIRE(val.len == sizeof(uint64_t));
+			uint64_t got;
+			memcpy(&got, val.value, sizeof(uint64_t));
+			REQUIRE(got == k);
+		}
+	}
+}
+
+TEST_CASE( "MergeShards", "[flatwriter]" ) {
+	fmt::print(" - Running MergeShards test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	// The bands of rows cover the level once.
+	{
+		ConvertConfig cfg;
+		cfg.shardCount = 7;
+		uint64_t next = 10;
+		for (cfg.shardIndex=0; cfg.shardIndex<cfg.shardCount; cfg.shardIndex++) {
+			uint64_t tlbr[4] = { 3, 10, 20, 109 };
+			shardLevelTlbr(tlbr, cfg);
+			REQUIRE(tlbr[0] == 3);
+			REQUIRE(tlbr[2] == 20);
+			REQUIRE(tlbr[1] == next);
+			REQUIRE(tlbr[3] - tlbr[1] + 1 >= 100 / 7);
+			next = tlbr[3] + 1;
+		}
+		REQUIRE(next == 110);
+
+		uint64_t tlbr[4] = { 0, 0, 4, 2 };
+		cfg.shardIndex = 5;
+		REQUIRE_THROWS(shardLevelTlbr(tlbr, cfg));
+	}
+
+	// Two shards of level 10 (rows [0,30) and [30,60)), the first also with level 9 alone, and a third file that
+	// replaces a few tiles of both.
+	const std::vector<std::string> names = { "test.shard0.it", "test.shard1.it", "test.patch.it" };
+	const std::string oname = "test.merged.it";
+	for (auto& n : names) unlink(n.c_str());
+	unlink(oname.c_str());
+
+	auto value = [](uint64_t key, int file) {
+		std::vector<uint8_t> val(1 + (key + file) % 300);
+		for (size_t i=0; i<val.size(); i++) val[i] = (key * 7 + file + i) % 251;
+		return val;
+	};
+	auto write = [&](int file, uint64_t lvl, uint64_t y0, uint64_t y1, uint64_t step, bool finalLevel) {
+		FlatEnvironment e(names[file], EnvOptions{});
+		e.beginLevel(lvl);
+		for (uint64_t y=y0; y<y1; y+=step)
+			for (uint64_t x=0; x<60; x+=step) {
+				uint64_t key = BlockCoordinate{lvl,y,x}.c;
+				auto val = value(key, file);
+				e.writeKeyValue(key, val.data(), val.size());
+			}
+		e.endLevel(finalLevel);
+	};
+	{
+		FlatEnvironment e(names[0], EnvOptions{});
+		for (uint64_t lvl : { 10, 9 }) {
+			e.beginLevel(lvl);
+			for (uint64_t y=0; y<(lvl == 10 ? 30 : 15); y++)
+				for (uint64_t x=0; x<(lvl == 10 ? 60 : 30); x++) {
+					uint64_t key = BlockCoordinate{lvl,y,x}.c;
+					auto val = value(key, 0);
+					e.writeKeyValue(key, val.data(), val.size());
+				}
+			e.endLevel(lvl == 9);
+		}
+	}
+	write(1, 10, 30, 60, 1, true);
+	write(2, 10, 25, 35, 5, true);
+
+	auto stats = mergeFiles(names, oname);
+	REQUIRE(stats.levelsCopied == 1);
+	REQUIRE(stats.levelsMerged == 1);
+	REQUIRE(stats.duplicates == 2 * 12);
+	REQUIRE(stats.tiles == 60 * 60 + 15 * 30);
+	REQUIRE_THROWS(mergeFiles(names, oname));
+
+	FlatEnvironment m(oname, EnvOptions::getReadonly());
+	REQUIRE(m.getLevelSpec(10).nitemsUsed() == 60 * 60);
+	REQUIRE(m.occupancy(10).valid());
+	for (uint64_t y=0; y<60; y++)
+		for (uint64_t x=0; x<60; x++) {
+			uint64_t key = BlockCoordinate{10,y,x}.c;
+			int file = (y >= 25 and y < 35 and y % 5 == 0 and x % 5 == 0) ? 2 : y < 30 ? 0 : 1;
+			auto want = value(key, file);
+			Value got = m.lookup(10, key);
+			REQUIRE(got.len == want.size());
+			REQUIRE(memcmp(got.value, want.data(), want.size()) == 0);
+		}
+	for (uint64_t y=0; y<15; y++)
+		for (uint64_t x=0; x<30; x++) {
+			uint64_t key = BlockCoordinate{9,y,x}.c;
+			auto want = value(key, 0);
+			Value got = m.lookup(9, key);
+			REQUIRE(got.len == want.size());
+			REQUIRE(memcmp(got.value, want.data(), want.size()) == 0);
+		}
+
+	// Level 9 is one run. Level 10 is one run of the first shard, then on rows 25 and 30 each of the 12 patched tiles
+	// and the shard run that follows it.
+	REQUIRE(stats.copies == 1 + 1 + 2 * 2 * 12);
+
+	// The other resolve rules, on the same inputs (the patched tiles are the rows 25 and 30 of its 5x5 grid).
+	auto winner = [&](uint64_t y, uint64_t x, MergeResolve resolve) {
+		uint64_t key = BlockCoordinate{10,y,x}.c;
+		int other = y < 30 ? 0 : 1;
+		switch (resolve) {
+			case MergeResolve::eFirst: return other;
+			case MergeResolve::eLargest: return value(key, other).size() > value(key, 2).size() ? other : 2;
+			default: return 2;
+		}
+	};
+	for (auto resolve : { MergeResolve::eFirst, MergeResolve::eLargest }) {
+		unlink(oname.c_str());
+		REQUIRE(mergeFiles(names, oname, resolve).duplicates == 2 * 12);
+		FlatEnvironment r(oname, EnvOptions::getReadonly());
+		for (uint64_t y : { 25, 30 })
+			for (uint64_t x=0; x<60; x+=5) {
+				uint64_t key = BlockCoordinate{10,y,x}.c;
+				auto want = value(key, winner(y, x, resolve));
+				Value got = r.lookup(10, key);
+				REQUIRE(got.len == want.size());
+				REQUIRE(memcmp(got.value, want.data(), want.size()) == 0);
+			}
+	}
+	unlink(oname.c_str());
+	REQUIRE_THROWS(mergeFiles(names, oname, MergeResolve::eError));
+	REQUIRE(access(oname.c_str(), F_OK) != 0);
+	REQUIRE(mergeFiles({ names[0], names[1] }, oname, MergeResolve::eError).duplicates == 0);
+	REQUIRE_THROWS(parseMergeResolve("newest"));
+}
+
+TEST_CASE( "ExtractFile", "[flatwriter]" ) {
+	fmt::print(" - Running ExtractFile test.\n");
+	fmt::print(" ----------------------------------------------------------------------------\n");
+
+	const std::string iname = "test.extractIn.it", oname = "test.extractOut.it";
+	auto value = [](uint64_t key, bool shared) {
+		BlockCoordinate bc(key);
+		// With shared values, many tiles have the same value (like nodata tiles).
+		uint64_t v = shared ? (bc.x() + bc.y()) % 7 : key;
+		std::vector<uint8_t> val(1 + v % 200);
+		for (size_t i=0; i<val.size(); i++) val[i] = (v * 3 + i) % 251;
+		return val;
+	};
+	// Web Mercator meters of a position in tiles of level 10.
+	auto wm = [](double t) { return (t / (1 << 10)) * 2 * WebMercatorMapScale - WebMercatorMapScale; };
+
+	// A row major file with implicit value lengths, then a Morton ordered one with explicit lengths (dedupValues).
+	for (bool morton : { false, true }) {
+		unlink(iname.c_str());
+		unlink(oname.c_str());
+		{
+			EnvOptions opts;
+			opts.dedupValues = morton;
+			FlatEnvironment e(iname, opts);
+			if (morton) e.setKeyOrder(FlatEnvironment::FileMeta::KeyOrder::eMorton);
+			for (uint64_t lvl : { 9, 10 }) {
+				std::vector<uint64_t> keys;
+				for (uint64_t y=0; y<(lvl == 10 ? 40 : 20); y++)
+					for (uint64_t x=0; x<(lvl == 10 ? 40 : 20); x++) keys.push_back(BlockCoordinate{lvl,y,x}.c);
+				std::sort(keys.begin(), keys.end(), [&](uint64_t a, uint64_t b) { return e.orderedKey(a) < e.orderedKey(b); });
+				e.beginLevel(lvl);
+				for (uint64_t key : keys) {
+					auto val = value(key, morton);
+					e.writeKeyValue(key, val.data(), val.size());
+				}
+				e.endLevel(lvl == 10);
+			}
+		}
+
+		// Tiles [10,20) x [5,15) of level 10, so [5,10) x [2,8) of level 9.
+		double tlbr[4] = { wm(10.5), wm(5.5), wm(19.5), wm(14.5) };
+		auto stats = extractFile(iname, oname, tlbr);
+		REQUIRE(stats.levelsCopied == 2);
+		REQUIRE(stats.tiles == 10 * 10 + 5 * 6);
+		if (not morton) REQUIRE(stats.copies == 10 + 6);
+		REQUIRE_THROWS(extractFile(iname, oname, tlbr));
+
+		FlatEnvironment out(oname, EnvOptions::getReadonly());
+		REQUIRE(out.keyOrder() == (morton ? FlatEnvironment::FileMeta::KeyOrder::eMorton : FlatEnvironment::FileMeta::KeyOrder::eRowMajor));
+		REQUIRE(out.hasExplicitValueLengths() == morton);
+		for (uint64_t lvl : { 9, 10 }) {
+			REQUIRE(out.occupancy(lvl).valid());
+			uint64_t x0 = lvl == 10 ? 10 : 5, x1 = lvl == 10 ? 20 : 10, y0 = lvl == 10 ? 5 : 2, y1 = lvl == 10 ? 15 : 8;
+			REQUIRE(out.getLevelSpec(lvl).nitemsUsed() == (x1 - x0) * (y1 - y0));
+			for (uint64_t y=0; y<(lvl == 10 ? 40 : 20); y++)
+				for (uint64_t x=0; x<(lvl == 10 ? 40 : 20); x++) {
+					uint64_t key = BlockCoordinate{lvl,y,x}.c;
+					bool inside = x >= x0 and x < x1 and y >= y0 and y < y1;
+					REQUIRE(out.keyExists(lvl, key) == inside);
+					if (not inside) continue;
+					auto want = value(key, morton);
+					Value got = out.lookup(lvl, key);
+					REQUIRE(got.len == want.size());
+					REQUIRE(memcmp(got.value, want.data(), want.size()) == 0);
+				}
+		}
+		// Shared values stay shared: at most the seven distinct ones per level.
+		if (morton) REQUIRE(out.getLevelSpec(10).valsLength <= 7 * 200);
+
+		double away[4] = { wm(100.5), wm(100.5), wm(110.5), wm(110.5) };
+		unlink(oname.c_str());
+		REQUIRE_THROWS(extractFile(iname, oname, away));
+	}
+}
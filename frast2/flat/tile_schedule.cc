@@ -0,0 +1,107 @@
+#include "tile_schedule.h"
+#include "tile_spill.h"
+#include "frast2/coordinates.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace frast {
+
+	LocalitySchedule::LocalitySchedule(int lvl, const uint64_t tlbr_[4], const PrimarySource& primary, const OrderedKey& orderedKey)
+		: lvl(lvl), orderedKey(orderedKey) {
+		for (int i=0; i<4; i++) tlbr[i] = tlbr_[i];
+		if (tlbr[2] <= tlbr[0] or tlbr[3] <= tlbr[1]) return;
+
+		uint64_t gx0 = tlbr[0] >> groupLog2, gx1 = (tlbr[2] - 1) >> groupLog2;
+		uint64_t gy0 = tlbr[1] >> groupLog2, gy1 = (tlbr[3] - 1) >> groupLog2;
+		groups.reserve((gx1 - gx0 + 1) * (gy1 - gy0 + 1));
+		std::vector<uint64_t> keys;
+		for (uint64_t gy=gy0; gy<=gy1; gy++)
+			for (uint64_t gx=gx0; gx<=gx1; gx++) {
+				// Only the part of the group that is in range.
+				uint64_t t[4] = {
+					std::max(gx << groupLog2, tlbr[0]), std::max(gy << groupLog2, tlbr[1]),
+					std::min((gx+1) << groupLog2, tlbr[2]), std::min((gy+1) << groupLog2, tlbr[3]) };
+				groupKeys((uint32_t)gx, (uint32_t)gy, keys);
+				groups.push_back(Group { primary(t), (uint32_t)gy, (uint32_t)gx, orderedKey(keys.front()) });
+			}
+
+		std::sort(groups.begin(), groups.end(), [](const Group& a, const Group& b) {
+			if (a.source != b.source) return a.source < b.source;
+			return a.first < b.first;
+		});
+
+		laterMin.resize(groups.size());
+		uint64_t m = ~0ull;
+		for (size_t i=groups.size(); i-- > 0; ) {
+			laterMin[i] = m;
+			m = std::min(m, groups[i].first);
+		}
+	}
+
+	void LocalitySchedule::groupKeys(uint32_t gx, uint32_t gy, std::vector<uint64_t>& out) const {
+		out.clear();
+		for (uint32_t dy=0; dy<groupSize; dy++)
+			for (uint32_t dx=0; dx<groupSize; dx++) {
+				uint64_t x = ((uint64_t)gx << groupLog2) + dx;
+				uint64_t y = ((uint64_t)gy << groupLog2) + dy;
+				if (x >= tlbr[0] and x < tlbr[2] and y >= tlbr[1] and y < tlbr[3])
+					out.push_back(BlockCoordinate{(uint64_t)lvl, y, x}.c);
+			}
+
+		std::sort(out.begin(), out.end(), [this](uint64_t a, uint64_t b) {
+			return orderedKey(a) < orderedKey(b);
+		});
+	}
+
+	bool LocalitySchedule::next(std::vector<uint64_t>& out, uint64_t& laterMin_) {
+		out.clear();
+		if (cur >= groups.size()) return false;
+		const Group& g = groups[cur];
+		laterMin_ = laterMin[cur];
+		cur++;
+
+		groupKeys(g.gx, g.gy, out);
+		return true;
+	}
+
+	ScheduledLevelWriter::ScheduledLevelWriter(FlatEnvironment& env, int lvl, const std::string& spillPath)
+		: env(env), lvl(lvl), spill(std::make_unique<TileSpill>(spillPath)) {
+	}
+
+	ScheduledLevelWriter::~ScheduledLevelWriter() {
+	}
+
+	void ScheduledLevelWriter::beginGroup(size_t n, uint64_t laterMin) {
+		if (n > 0) pending.push_back(Pending { n, laterMin });
+	}
+
+	void ScheduledLevelWriter::add(uint64_t key, void* value, uint64_t len) {
+		assert(pending.size());
+		Pending& group = pending.front();
+
+		if (len > 0) {
+			uint64_t t = env.orderedKey(key);
+			if (t < group.laterMin) {
+				// Nothing still to come sorts before it: write what was spilled before it, then the tile itself.
+				spill->writeLevelBelow(env, lvl, t);
+				env.writeKeyValue(key, value, len);
+				nDirect++;
+			} else {
+				spill->add(key, value, len);
+				nSpilled++;
+			}
+		}
+
+		if (--group.left == 0) {
+			spill->writeLevelBelow(env, lvl, group.laterMin);
+			pending.pop_front();
+		}
+	}
+
+	void ScheduledLevelWriter::finish() {
+		spill->writeLevel(env, lvl);
+		pending.clear();
+	}
+
+}
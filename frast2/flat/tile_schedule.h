@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace frast {
+
+	class FlatEnvironment;
+	class TileSpill;
+
+	//
+	// Hands out the tiles of a level in an order that keeps consecutive tiles in the same source file, and in the same
+	// rows of it, so the GDAL block cache of whichever worker opened it gets reused (see ConvertConfig::localitySchedule).
+	//
+	// The level is cut into aligned groups of 8x8 tiles. Groups are sorted by primary source, the one that wins in the
+	// blend (the lowest id overlapping the group), then by the least ordered key (FlatEnvironment::orderedKey()) of their
+	// tiles. Within a group, tiles go in ordered key order. A writer gives each group to one worker
+	// (ThreadPool::enqueueTo()).
+	//
+	// With a single source the groups simply follow the level's key order. What is left out of key order is written by
+	// a ScheduledLevelWriter.
+	//
+	class LocalitySchedule {
+		public:
+			static constexpr int groupLog2 = 3;
+			static constexpr uint32_t groupSize = 1u << groupLog2;
+			static constexpr uint32_t noSource = ~0u;
+
+			// Returns the primary source of the tiles [x0, y0, x1, y1), or noSource if none overlaps them.
+			using PrimarySource = std::function<uint32_t(const uint64_t tileTlbr[4])>;
+			// Maps a key to its position in the level's key order, normally FlatEnvironment::orderedKey().
+			using OrderedKey = std::function<uint64_t(uint64_t key)>;
+
+			LocalitySchedule() = default;
+			// @tlbr is the range [x0, y0, x1, y1) of tiles on level @lvl. Every tile in it is handed out once.
+			LocalitySchedule(int lvl, const uint64_t tlbr[4], const PrimarySource& primary, const OrderedKey& orderedKey);
+
+			// Set @out to the keys of the next group's tiles, and @laterMin to the least ordered key of every group after
+			// it (~0 for the last one). Returns false (with @out empty) once all were handed out.
+			bool next(std::vector<uint64_t>& out, uint64_t& laterMin);
+
+			inline size_t numGroups() const { return groups.size(); }
+			inline size_t groupsDone() const { return cur; }
+
+		private:
+			struct Group {
+				uint32_t source;
+				uint32_t gy, gx;
+				uint64_t first;
+			};
+
+			void groupKeys(uint32_t gx, uint32_t gy, std::vector<uint64_t>& out) const;
+
+			int lvl = 0;
+			uint64_t tlbr[4] = {0,0,0,0};
+			OrderedKey orderedKey;
+			std::vector<Group> groups;
+			// laterMin[i] is the least first of groups[i+1..].
+			std::vector<uint64_t> laterMin;
+			size_t cur = 0;
+	};
+
+	//
+	// Writes the tiles of a LocalitySchedule to the level open in @env, as they come out of the workers (in the order
+	// they were handed out).
+	//
+	// A tile goes straight to the level if no tile still to come sorts before it, which beginGroup() can tell from
+	// LocalitySchedule::next()'s @laterMin. The others are spilled to a TileSpill and written from there as soon as
+	// the same holds for them, so the level is still written in key order. With a single source and a Morton or
+	// Hilbert key order nothing is spilled. With eRowMajor a group spans 8 rows, so the 7 below its first one are
+	// spilled until the last group of the band is done.
+	//
+	class ScheduledLevelWriter {
+		public:
+			ScheduledLevelWriter(FlatEnvironment& env, int lvl, const std::string& spillPath);
+			~ScheduledLevelWriter();
+
+			// Call as each group is handed out, with the number of tiles in it.
+			void beginGroup(size_t n, uint64_t laterMin);
+			// Call once for every tile of the groups, in order. An empty tile (@len 0) is not written.
+			void add(uint64_t key, void* value, uint64_t len);
+			// Write whatever is left. Call before ending the level.
+			void finish();
+
+			inline uint64_t numDirect() const { return nDirect; }
+			inline uint64_t numSpilled() const { return nSpilled; }
+
+		private:
+			struct Pending {
+				size_t left;
+				uint64_t laterMin;
+			};
+
+			FlatEnvironment& env;
+			int lvl;
+			std::unique_ptr<TileSpill> spill;
+			std::deque<Pending> pending;
+			uint64_t nDirect = 0, nSpilled = 0;
+	};
+
+}
@@ -0,0 +1,90 @@
+#include "tile_spill.h"
+#include "frast2/coordinates.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fmt/core.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace frast {
+
+	TileSpill::TileSpill(const std::string& path) {
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fd < 0) throw std::runtime_error(fmt::format("TileSpill: could not open '{}': {}", path, strerror(errno)));
+		unlink(path.c_str());
+	}
+
+	TileSpill::~TileSpill() {
+		if (fd >= 0) close(fd);
+	}
+
+	void TileSpill::add(uint64_t key, const void* value, uint64_t len) {
+		uint64_t offset;
+		{
+			std::lock_guard<std::mutex> lck(mtx);
+			offset = end;
+			end += len;
+		}
+
+		uint64_t done = 0;
+		while (done < len) {
+			ssize_t r = pwrite(fd, static_cast<const char*>(value) + done, len - done, offset + done);
+			if (r < 0 and errno == EINTR) continue;
+			if (r < 0) throw std::runtime_error(fmt::format("TileSpill: write failed: {}", strerror(errno)));
+			done += r;
+		}
+
+		int lvl = BlockCoordinate(key).z();
+		std::lock_guard<std::mutex> lck(mtx);
+		if ((int)entries.size() <= lvl) entries.resize(lvl+1);
+		entries[lvl].added.push_back(Entry { key, offset, len });
+	}
+
+	uint64_t TileSpill::count(int lvl) const {
+		std::lock_guard<std::mutex> lck(mtx);
+		return lvl < (int)entries.size() ? entries[lvl].added.size() + entries[lvl].heap.size() : 0;
+	}
+
+	void TileSpill::writeLevel(FlatEnvironment& env, int lvl) {
+		writeLevelBelow(env, lvl, ~0ull);
+		if (lvl < (int)entries.size()) std::vector<Entry>().swap(entries[lvl].heap);
+	}
+
+	void TileSpill::writeLevelBelow(FlatEnvironment& env, int lvl, uint64_t orderedBound) {
+		std::vector<Entry> added;
+		{
+			std::lock_guard<std::mutex> lck(mtx);
+			if (lvl >= (int)entries.size()) return;
+			added.swap(entries[lvl].added);
+		}
+		auto& heap = entries[lvl].heap;
+
+		auto later = [&env](const Entry& a, const Entry& b) { return env.orderedKey(a.key) > env.orderedKey(b.key); };
+		for (auto& e : added) {
+			heap.push_back(e);
+			std::push_heap(heap.begin(), heap.end(), later);
+		}
+
+		std::vector<uint8_t> buf;
+		while (heap.size() and env.orderedKey(heap.front().key) < orderedBound) {
+			std::pop_heap(heap.begin(), heap.end(), later);
+			Entry e = heap.back();
+			heap.pop_back();
+
+			buf.resize(e.len);
+			uint64_t done = 0;
+			while (done < e.len) {
+				ssize_t r = pread(fd, buf.data() + done, e.len - done, e.offset + done);
+				if (r < 0 and errno == EINTR) continue;
+				if (r <= 0) throw std::runtime_error(fmt::format("TileSpill: read failed: {}", strerror(errno)));
+				done += r;
+			}
+			env.writeKeyValue(e.key, buf.data(), e.len);
+		}
+	}
+
+}
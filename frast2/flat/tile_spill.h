@@ -0,0 +1,56 @@
+#pragma once
+
+#include "flat_env.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace frast {
+
+	//
+	// Encoded tiles that are finished out of key order, kept in a temporary file until they can be written as sorted
+	// levels (see PyramidBuilder, and ScheduledLevelWriter).
+	//
+	// The file is unlinked as soon as it is created, so nothing is left behind if the conversion dies.
+	// Only the (key, offset, length) of each tile is kept in memory.
+	//
+	class TileSpill {
+		public:
+			explicit TileSpill(const std::string& path);
+			~TileSpill();
+
+			TileSpill(const TileSpill&) = delete;
+			TileSpill& operator=(const TileSpill&) = delete;
+
+			// Thread safe. Copies the @len bytes of @value.
+			void add(uint64_t key, const void* value, uint64_t len);
+
+			// Number of tiles added on level @lvl (and not yet written).
+			uint64_t count(int lvl) const;
+
+			// Write the tiles of level @lvl into @env's open level (or delta run), in env.orderedKey() order, then
+			// forget them. Not thread safe.
+			void writeLevel(FlatEnvironment& env, int lvl);
+			// The same, but only the tiles whose env.orderedKey() is below @orderedBound: the rest stay for a later call.
+			// @env must be the same for every call.
+			void writeLevelBelow(FlatEnvironment& env, int lvl, uint64_t orderedBound);
+
+		private:
+			struct Entry {
+				uint64_t key, offset, len;
+			};
+			struct Level {
+				// Added since the last write, and a min-heap (by ordered key) of the rest.
+				std::vector<Entry> added, heap;
+			};
+
+			int fd = -1;
+			mutable std::mutex mtx;
+			uint64_t end = 0;
+			// Indexed by level.
+			std::vector<Level> entries;
+	};
+
+}
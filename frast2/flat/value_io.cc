@@ -0,0 +1,139 @@
+#include "value_io.h"
+
+#include <stdexcept>
+
+#ifdef FRAST_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace frast {
+
+	ValueIo::ValueIo(int fd_, ValueReadMode mode_, int queueDepth)
+		: fd(fd_), mode(mode_), queueDepth_(queueDepth) {
+
+		if (mode == ValueReadMode::eMmap) throw std::runtime_error("ValueIo needs ValueReadMode ePread or eUring");
+		if (queueDepth_ < 1) queueDepth_ = 1;
+
+		if (mode == ValueReadMode::eUring) {
+#ifdef FRAST_HAVE_LIBURING
+			auto r = new io_uring;
+			int err = io_uring_queue_init(queueDepth_, r, 0);
+			if (err < 0) {
+				delete r;
+				throw std::runtime_error(fmt::format("io_uring_queue_init failed: {}", strerror(-err)));
+			}
+			ring = r;
+
+			slots.resize(queueDepth_);
+			for (int i=queueDepth_-1; i>=0; i--) freeSlots.push_back(i);
+#else
+			throw std::runtime_error("ValueReadMode::eUring requested, but frast was built without liburing");
+#endif
+		}
+
+		ready.reserve(queueDepth_);
+	}
+
+	ValueIo::~ValueIo() {
+#ifdef FRAST_HAVE_LIBURING
+		if (ring) {
+			auto r = static_cast<io_uring*>(ring);
+
+			// The kernel may still write into the caller's buffers, so wait out anything in flight.
+			if (nUnsubmitted) io_uring_submit(r);
+			while (nInFlight > 0) {
+				struct io_uring_cqe* cqe;
+				if (io_uring_wait_cqe(r, &cqe) < 0) break;
+				io_uring_cqe_seen(r, cqe);
+				nInFlight--;
+			}
+
+			io_uring_queue_exit(r);
+			delete r;
+		}
+#endif
+	}
+
+	int64_t ValueIo::read(void* dst, uint64_t len, uint64_t offset) {
+		uint64_t got = 0;
+		while (got < len) {
+			ssize_t r = pread(fd, static_cast<char*>(dst) + got, len - got, offset + got);
+			if (r < 0 and errno == EINTR) continue;
+			if (r < 0) return -errno;
+			if (r == 0) return -EIO;
+			got += r;
+		}
+		return len;
+	}
+
+	bool ValueIo::submit(void* dst, uint64_t len, uint64_t offset, uint64_t userData) {
+		if (nInFlight >= queueDepth_) return true;
+
+#ifdef FRAST_HAVE_LIBURING
+		if (ring) {
+			auto r = static_cast<io_uring*>(ring);
+			struct io_uring_sqe* sqe = io_uring_get_sqe(r);
+			if (sqe == nullptr) return true;
+
+			int slot = freeSlots.back();
+			freeSlots.pop_back();
+			slots[slot] = Slot { dst, len, offset, userData };
+
+			io_uring_prep_read(sqe, fd, dst, len, offset);
+			io_uring_sqe_set_data64(sqe, slot);
+			nUnsubmitted++;
+			nInFlight++;
+			return false;
+		}
+#endif
+
+		ready.push_back(Completion { userData, read(dst, len, offset) });
+		nInFlight++;
+		return false;
+	}
+
+	int ValueIo::reap(Completion* out, int maxOut, bool wait) {
+		int n = 0;
+
+#ifdef FRAST_HAVE_LIBURING
+		if (ring) {
+			auto r = static_cast<io_uring*>(ring);
+			if (nUnsubmitted) {
+				io_uring_submit(r);
+				nUnsubmitted = 0;
+			}
+
+			while (n < maxOut and nInFlight > 0) {
+				struct io_uring_cqe* cqe;
+				int err = (wait and n == 0) ? io_uring_wait_cqe(r, &cqe) : io_uring_peek_cqe(r, &cqe);
+				if (err == -EAGAIN) break;
+				if (err < 0) throw std::runtime_error(fmt::format("io_uring_wait_cqe failed: {}", strerror(-err)));
+
+				int slot = static_cast<int>(io_uring_cqe_get_data64(cqe));
+				const Slot& s = slots[slot];
+				int64_t res = cqe->res;
+				io_uring_cqe_seen(r, cqe);
+
+				// Short reads are possible (e.g. on network filesystems): finish them synchronously.
+				if (res >= 0 and static_cast<uint64_t>(res) < s.len) {
+					int64_t rest = read(static_cast<char*>(s.dst) + res, s.len - res, s.offset + res);
+					res = rest < 0 ? rest : static_cast<int64_t>(s.len);
+				}
+
+				out[n++] = Completion { s.userData, res };
+				freeSlots.push_back(slot);
+				nInFlight--;
+			}
+			return n;
+		}
+#endif
+
+		while (n < maxOut and not ready.empty()) {
+			out[n++] = ready.back();
+			ready.pop_back();
+			nInFlight--;
+		}
+		return n;
+	}
+
+}
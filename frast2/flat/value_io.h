@@ -0,0 +1,72 @@
+#pragma once
+
+#include "frast2/detail/env.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace frast {
+
+	//
+	// Reads tile values from the file descriptor into caller-supplied buffers, with up to `queueDepth` reads in
+	// flight at once.
+	//
+	// With ValueReadMode::eUring, submitted reads are batched into one io_uring_submit() call the next time
+	// reap() is called, and complete asynchronously.
+	// With ValueReadMode::ePread, submit() does the read immediately and reap() only returns the completions,
+	// so that callers can be written once against this interface.
+	//
+	// Not thread-safe: use one ValueIo per thread (the FlatReader owns one).
+	//
+	class ValueIo {
+		public:
+			struct Completion {
+				uint64_t userData;
+				// Bytes read, or -errno.
+				int64_t result;
+			};
+
+			ValueIo(int fd, ValueReadMode mode, int queueDepth);
+			~ValueIo();
+
+			ValueIo(const ValueIo&) = delete;
+			ValueIo& operator=(const ValueIo&) = delete;
+
+			// Blocking read of exactly @len bytes (retrying short reads). Returns @len, or -errno.
+			int64_t read(void* dst, uint64_t len, uint64_t offset);
+
+			// Queue a read of @len bytes at @offset into @dst. @dst must stay valid until the completion is reaped.
+			// Returns true if the queue is full (reap some completions and try again).
+			bool submit(void* dst, uint64_t len, uint64_t offset, uint64_t userData);
+
+			// Move up to @maxOut finished reads to @out, returning how many.
+			// If @wait is set and any reads are in flight, blocks until at least one finishes.
+			int reap(Completion* out, int maxOut, bool wait);
+
+			inline int inFlight() const { return nInFlight; }
+			inline int queueDepth() const { return queueDepth_; }
+
+		private:
+			int fd;
+			ValueReadMode mode;
+			int queueDepth_;
+			int nInFlight = 0;
+
+			// ePread: completed, but not yet reaped.
+			std::vector<Completion> ready;
+
+#ifdef FRAST_HAVE_LIBURING
+			struct Slot {
+				void* dst;
+				uint64_t len, offset, userData;
+			};
+			std::vector<Slot> slots;
+			std::vector<int> freeSlots;
+			int nUnsubmitted = 0;
+
+			// struct io_uring, kept opaque so that users of this header need not have liburing.h
+			void* ring = nullptr;
+#endif
+	};
+
+}
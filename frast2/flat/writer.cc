@@ -1,15 +1,31 @@
 #include "writer.h"
 #include "reader.h"
 #include <algorithm>
+#include <chrono>
+#include <deque>
 
 #include <fmt/core.h>
 #include <fmt/color.h>
 
 namespace frast {
 
+void shardLevelTlbr(uint64_t levelTlbr[4], const ConvertConfig& cfg) {
+	if (cfg.shardCount <= 1) return;
+	assert(cfg.shardIndex >= 0 and cfg.shardIndex < cfg.shardCount);
+
+	uint64_t y0 = levelTlbr[1], rows = levelTlbr[3] - levelTlbr[1] + 1;
+	uint64_t a = y0 + rows * cfg.shardIndex / cfg.shardCount;
+	uint64_t b = y0 + rows * (cfg.shardIndex + 1) / cfg.shardCount;
+	if (a == b) throw std::runtime_error(fmt::format("shard {} of {} has no rows (the level has only {}): use fewer shards", cfg.shardIndex, cfg.shardCount, rows));
+
+	levelTlbr[1] = a;
+	levelTlbr[3] = b - 1;
+	fmt::print(" - shard {} of {}: rows [{} {}] of [{} {}]\n", cfg.shardIndex, cfg.shardCount, a, b-1, y0, y0+rows-1);
+}
+
 WriterMasterGdal::WriterMasterGdal(const std::string& outPath, const EnvOptions& opts, int threads)
 	: ThreadPool(threads),
-	  env(outPath, opts), envOpts(opts) {
+	  env(outPath, opts), envOpts(opts), reorder(writerWindowPerThread * threads) {
 
 
 }
@@ -23,12 +39,21 @@ void WriterMasterGdal::start(const ConvertConfig& cfg_) {
 	assert(cfg.srcPaths.size() > 0);
 	assert(cfg.srcPaths.size() == 1); // for now...
 
-	env.beginLevel(cfg.baseLevel);
+	// A delta run must be written in the file's key order, which the row major yieldNextKeys() only is for eRowMajor
+	// files (see `frastTool --action reorder`). The locality schedule writes in any key order (ScheduledLevelWriter).
+	if (cfg.delta and env.keyOrder() != FlatEnvironment::FileMeta::KeyOrder::eRowMajor and not cfg.localitySchedule) {
+		fmt::print(" - appending to a file not in row major key order: using the locality schedule\n");
+		cfg.localitySchedule = true;
+	}
+	if (cfg.delta) env.beginDelta(cfg.baseLevel);
+	else           env.beginLevel(cfg.baseLevel);
 
 	curLevel = cfg.baseLevel;
 	masterData = create_gdal_stuff(-1);
 
 	set_level_tlbr_from_main_thread(masterData);
+	// The dataset's own extent, whatever cfg.tlbr and sharding make of levelTlbr.
+	const uint64_t dsetTlbr[4] = {levelTlbr[0], levelTlbr[1], levelTlbr[2], levelTlbr[3]};
 	if (cfg_.tlbr[0] == 0 and cfg_.tlbr[2] == 0) {
 	} else {
 		uint32_t iwm[4];
@@ -41,6 +66,29 @@ void WriterMasterGdal::start(const ConvertConfig& cfg_) {
 		double nold = (old[3]-old[1])*(old[2]-old[0]);
 		fmt::print(" -                   {:.4f}% kept tiles\n", 100. * (nnew/nold));
 	}
+	shardLevelTlbr(levelTlbr, cfg);
+
+	if (cfg.localitySchedule) {
+		// yieldNextKeys() covers x in [levelTlbr[0], levelTlbr[2]) and y in [levelTlbr[1], levelTlbr[3]].
+		uint64_t tlbr[4] = { levelTlbr[0], levelTlbr[1], levelTlbr[2], levelTlbr[3]+1 };
+		// One source, so it only tells the groups it covers from those it does not (which go last, and are all empty).
+		// Otherwise the groups follow the key order, so each group reads the source blocks of 8 tile rows at once,
+		// through one handle, rather than one tile row at a time from every worker.
+		auto primary = [&dsetTlbr](const uint64_t t[4]) {
+			bool overlaps = t[0] < dsetTlbr[2] and t[2] > dsetTlbr[0] and t[1] <= dsetTlbr[3] and t[3] > dsetTlbr[1];
+			return overlaps ? 0u : LocalitySchedule::noSource;
+		};
+		schedule = LocalitySchedule(cfg.baseLevel, tlbr, primary, [this](uint64_t key) { return env.orderedKey(key); });
+		scheduled = std::make_unique<ScheduledLevelWriter>(env, cfg.baseLevel, env.path_ + ".spill");
+		fmt::print(" - locality schedule: {} groups of up to {} tiles\n", schedule.numGroups(), LocalitySchedule::groupSize * LocalitySchedule::groupSize);
+	}
+
+	if (cfg.fusedAddo and cfg.baseLevel > 0) {
+		assert(not cfg.delta);
+		// yieldNextKeys() covers x in [levelTlbr[0], levelTlbr[2]) and y in [levelTlbr[1], levelTlbr[3]].
+		uint64_t baseTlbr[4] = { levelTlbr[0], levelTlbr[1], levelTlbr[2], levelTlbr[3]+1 };
+		pyramid = std::make_unique<PyramidBuilder>(env.path_ + ".pyramid.spill", cfg.baseLevel, baseTlbr, isTerrain(), cfg.addoInterp, 0, env.codec());
+	}
 
 	writerThread = std::thread(&WriterMasterGdal::writerLoop, this);
 
@@ -51,10 +99,17 @@ WriterMasterGdal::~WriterMasterGdal() {
 	// Note: we have a different mtx and cv for the writerThread, so this may be UB...
 	// (but it appears to work)
 	stop();
-	writerCv.notify_all();
+	reorder.wake();
 	if (writerThread.joinable()) writerThread.join();
 
-	env.endLevel(true);
+	if (scheduled) {
+		scheduled->finish();
+		fmt::print(" - locality schedule: {} tiles written directly, {} spilled\n", scheduled->numDirect(), scheduled->numSpilled());
+	}
+	if (pyramid) pyramid->finish();
+	env.endLevel(not pyramid or pyramid->numTiles() == 0);
+	// The overviews go after the base level.
+	if (pyramid) pyramid->writeLevels(env);
 
 	destroy_master_data();
 
@@ -63,38 +118,48 @@ WriterMasterGdal::~WriterMasterGdal() {
 
 
 void WriterMasterGdal::writerLoop() {
-	bool haveMoreWork = true;
-
-	while (haveMoreWork and !doStop_) {
-
-		// Gather next batch of keys from tiff...
-		std::vector<uint64_t> currKeys = yieldNextKeys();
-		lastNumEnqueued = currKeys.size();
-		haveMoreWork = lastNumEnqueued > 0;
-		// fmt::print(fmt::fg(fmt::color::green), " - Enqueing {} items ready.\n", lastNumEnqueued);
-
-		// Enqueue them
-		for (auto key : currKeys) enqueue(key);
-
-		// Wait until workers complete. We need an exact match.
-		{
-			std::unique_lock<std::mutex> lck(writerMtx);
-			writerCv.wait(lck, [&] { return doStop_ or processedData.size() == currKeys.size(); });
-			// fmt::print(fmt::fg(fmt::color::green), " - All {} items ready.\n", processedData.size());
-
-			handleProcessedData(processedData);
+	bool haveMoreKeys = true;
+	std::deque<uint64_t> pendingKeys;
+	std::vector<ProcessedData> ready;
+	// With the locality schedule, each batch of keys is one group, for one worker.
+	int groupWorker = -1;
+
+	uint64_t nwritten = 0;
+	auto t0 = std::chrono::steady_clock::now();
+
+	while (!doStop_) {
+
+		// Keep the window full, so that workers never wait on the writer (or on each other).
+		while (not reorder.full()) {
+			if (pendingKeys.empty() and haveMoreKeys) {
+				// Gather next batch of keys from tiff...
+				std::vector<uint64_t> keys = yieldNextKeys();
+				haveMoreKeys = keys.size() > 0;
+				pendingKeys.insert(pendingKeys.end(), keys.begin(), keys.end());
+				groupWorker = (groupWorker + 1) % getThreadCount();
+			}
+			if (pendingKeys.empty()) break;
+
+			reorder.issue(pendingKeys.front());
+			if (scheduled) enqueueTo(groupWorker, pendingKeys.front());
+			else           enqueue(pendingKeys.front());
+			pendingKeys.pop_front();
 		}
+
+		// Write whatever is done, in key order.
+		if (not reorder.takeReady(ready, [this] { return doStop_; })) break;
+		nwritten += ready.size();
+		handleProcessedData(ready);
 	}
 
-	fmt::print(" - writerLoop exiting.\n");
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	fmt::print(" - writerLoop exiting ({} tiles in {:.1f}s, {:.1f} tiles/s).\n", nwritten, secs, nwritten / secs);
 	writerLoopExited = true;
 }
 
 
 void WriterMasterGdal::handleProcessedData(std::vector<ProcessedData>& processedData) {
-	// Write all of that data.
-	// TODO: do this on another thread than the one that queues data?
-	std::sort(processedData.begin(), processedData.end());
+	// Write all of that data. It is already in issue order (see ReorderBuffer): key order, unless scheduled.
 
 	for (auto& pd : processedData) {
 		if (pd.value == nullptr) assert(pd.valueLength == ProcessedData::INVALID_VALUE_LENGTH);
@@ -102,7 +167,10 @@ void WriterMasterGdal::handleProcessedData(std::vector<ProcessedData>& processed
 		if (pd.value != nullptr) assert(pd.valueLength != ProcessedData::INVALID_VALUE_LENGTH);
 		if (pd.valueLength == 0) assert(false && "0-length value not supported yet (but will be!)");
 
-		if (pd.value != nullptr) {
+		if (scheduled) {
+			// Every tile, so it can tell when a group is done.
+			scheduled->add(pd.key, pd.value, pd.value ? pd.valueLength : 0);
+		} else if (pd.value != nullptr) {
 			// fmt::print(" - write k {}, vl {}\n", pd.key, pd.valueLength);
 			env.writeKeyValue(pd.key, pd.value, pd.valueLength);
 		}
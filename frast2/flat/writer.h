@@ -1,8 +1,16 @@
 #pragma once
 
 #include "frast2/tpool/tpool.h"
+#include "frast2/tpool/reorder_buffer.h"
+#include "blend.h"
 #include "flat_env.h"
+#include "pyramid.h"
+#include "source_index.h"
+#include "tile_schedule.h"
+#include "tile_spill.h"
+#include "frast2/detail/data_structures.hpp"
 #include <atomic>
+#include <unordered_map>
 
 
 namespace frast {
@@ -20,8 +28,30 @@ struct ConvertConfig {
 	int channels=3;
 	int addoInterp=1; // opencv value: https://docs.opencv.org/3.4/da/d54/group__imgproc__transform.html
 	double tlbr[4]={0};
+	// Write the base level as a delta run on an existing file, instead of as a new level (see FlatEnvironment::beginDelta).
+	bool delta = false;
+	// Build the overviews from the base tiles while converting them (see PyramidBuilder), instead of with a
+	// separate WriterMasterAddo pass. Only for addoInterp bilinear or area.
+	bool fusedAddo = false;
+	// How many freshly made overview tiles WriterMasterAddo keeps decoded, to build the next level from (0 disables).
+	int addoCacheTiles = 2048;
+	// How many source datasets each WriterMasterGdalMany worker keeps open (least recently used are closed).
+	int sourceHandlesPerWorker = 64;
+	// Convert the base level in LocalitySchedule order (8x8 groups of tiles, grouped by source file), one group per
+	// worker, instead of one tile per worker in key order. Tiles that finish out of key order are spilled and written
+	// sorted (see ScheduledLevelWriter).
+	bool localitySchedule = false;
+	// How WriterMasterGdalMany combines the sources overlapping a tile.
+	BlendMode blendMode = BlendMode::eFirst;
+	// Convert only the shardIndex'th of shardCount bands of base level rows (see shardLevelTlbr()), into a partial
+	// file to be merged with the other shards' (see mergeFiles()).
+	int shardIndex = 0, shardCount = 1;
 };
 
+// Restrict the base level rows [levelTlbr[1], levelTlbr[3]] (inclusive) to the band of cfg.shardIndex.
+// The bands split the rows as evenly as possible. Throws if this one gets no rows.
+void shardLevelTlbr(uint64_t levelTlbr[4], const ConvertConfig& cfg);
+
 struct ProcessedData {
 	static constexpr uint64_t INVALID_VALUE_LENGTH = ~(0lu);
 	// NOTE: this pointer should have been allocated with malloc,
@@ -35,6 +65,9 @@ struct ProcessedData {
 	inline bool operator<(const ProcessedData& o) const { return key < o.key; }
 };
 
+// How many tiles the writer threads keep issued ahead of the last one written, per worker thread.
+static constexpr int writerWindowPerThread = 64;
+
 // Writer component that uses a single input GDAL file (probably a vrt)
 class WriterMasterGdal : public ThreadPool {
 	public:
@@ -56,14 +89,16 @@ class WriterMasterGdal : public ThreadPool {
 		ConvertConfig cfg;
 		EnvOptions envOpts;
 
-		std::vector<ProcessedData> processedData;
-		std::mutex writerMtx;
-		std::condition_variable writerCv;
+		// Finished tiles, held until all tiles before them are finished too.
+		ReorderBuffer<ProcessedData> reorder;
+		// Set if cfg.fusedAddo.
+		std::unique_ptr<PyramidBuilder> pyramid;
+		// Set if cfg.localitySchedule: tiles finish in schedule order, and those out of key order wait here.
+		std::unique_ptr<ScheduledLevelWriter> scheduled;
+		LocalitySchedule schedule;
 		std::thread writerThread;
 		void writerLoop();
 		std::atomic_bool writerLoopExited = false;
-
-		int lastNumEnqueued = 0;
 	private:
 		// A stateful generator called repeatedly in writerLoop()
 		std::vector<uint64_t> yieldNextKeys();
@@ -105,14 +140,16 @@ class WriterMasterGdalMany : public ThreadPool {
 		ConvertConfig cfg;
 		EnvOptions envOpts;
 
-		std::vector<ProcessedData> processedData;
-		std::mutex writerMtx;
-		std::condition_variable writerCv;
+		// Finished tiles, held until all tiles before them are finished too.
+		ReorderBuffer<ProcessedData> reorder;
+		// Set if cfg.fusedAddo.
+		std::unique_ptr<PyramidBuilder> pyramid;
+		// Set if cfg.localitySchedule: tiles finish in schedule order, and those out of key order wait here.
+		std::unique_ptr<ScheduledLevelWriter> scheduled;
+		LocalitySchedule schedule;
 		std::thread writerThread;
 		void writerLoop();
 		std::atomic_bool writerLoopExited = false;
-
-		int lastNumEnqueued = 0;
 	private:
 		// A stateful generator called repeatedly in writerLoop()
 		std::vector<uint64_t> yieldNextKeys();
@@ -120,9 +157,7 @@ class WriterMasterGdalMany : public ThreadPool {
 		void handleProcessedData(std::vector<ProcessedData>& processedData);
 
 		// Things that are private to writer_gdal.cc (the actual conversion code)
-		void* masterData = nullptr;
 		void* create_gdal_stuff(int workerId);
-		void destroy_master_data();
 		int curLevel=-1, curIndex=0;
 
 		// This data is set on the *main thread* in start(), then kept constant for the remainder of the lifetime.
@@ -130,7 +165,11 @@ class WriterMasterGdalMany : public ThreadPool {
 		// (Although it's only needed for yieldNextKeys() in the writer thread)
 		uint64_t levelTlbr[4];
 		uint32_t levelTlbrStored=-1;
-		void set_level_tlbr_from_main_thread(void* dset);
+		// Footprints of cfg.srcPaths (in unit web mercator), so workers only open the sources a tile overlaps.
+		SourceIndex sourceIndex;
+		void scan_sources_from_main_thread();
+
+		std::atomic<uint64_t> sourceOpens = 0;
 };
 
 class WriterMasterAddo : public ThreadPool {
@@ -153,25 +192,66 @@ class WriterMasterAddo : public ThreadPool {
 		ConvertConfig cfg;
 		EnvOptions envOpts;
 
-		std::vector<ProcessedData> processedData;
-		std::mutex writerMtx;
-		std::condition_variable writerCv;
+		// The overview levels are built as a DAG: the first one (cfg.baseLevel-1) from the base level in the file,
+		// and every tile below that as soon as its children are done, so that several levels are built at once.
+		// The first level's tiles are written in key order through `reorder`. The levels below it finish long before
+		// the writer gets to them, so their tiles go to `spill` (on disk, not in memory), and each level is written
+		// from there once all of its tiles are done.
+		struct AddoLevel {
+			struct Pending {
+				uint8_t nreported = 0, nexpected = 0;
+				// Encoded children, in the order of WriterMasterAddo::process(). Empty if the child has no tile.
+				std::vector<uint8_t> children[4];
+			};
+
+			// Keys of this level that may have tiles, [x0 y0 x1 y1).
+			uint64_t tlbr[4];
+			// Tiles of this level that still wait for some of their children.
+			std::mutex mtx;
+			std::unordered_map<uint64_t, Pending> pending;
+			// Below the first level, every key of tlbr is finished once (see finishTile()). Guarded by mtx.
+			uint64_t nfinished = 0;
+			std::condition_variable finishedCv;
+
+			inline uint64_t size() const { return (tlbr[2] - tlbr[0]) * (tlbr[3] - tlbr[1]); }
+		};
+		// Indexed by level (only lastLevel..firstLevel are set).
+		std::vector<std::unique_ptr<AddoLevel>> dag;
+		int firstLevel=-1, lastLevel=0;
+		// Finished tiles of the first level, held until all tiles before them are finished too.
+		ReorderBuffer<ProcessedData> reorder;
+		// Finished tiles of the levels below the first.
+		std::unique_ptr<TileSpill> spill;
+		bool curLevelBegun = false;
+
+		// Pixels of the tiles made below the first level, so that parents need not decode them again.
+		// Also avoids the loss of a lossy codec compounding at every level. On a miss, the encoded child is decoded.
+		std::unique_ptr<StripedLruCache<uint64_t, cv::Mat>> decodedTiles;
+		std::atomic<uint64_t> decodedHits = 0, decodedMisses = 0;
+
 		std::thread writerThread;
 		void writerLoop();
 		std::atomic_bool writerLoopExited = false;
-
-		int lastNumEnqueued = 0;
 	private:
 		// A stateful generator called repeatedly in writerLoop()
 		std::vector<uint64_t> yieldNextKeys();
 		// void getNumTilesForLevel(uint64_t& outW, uint64_t& outH, int lvl);
 		void handleProcessedData(std::vector<ProcessedData>& processedData);
 
+		// The tile @key is done (@value may be null). Hands it to the writer and reports it to its parent.
+		void finishTile(uint64_t key, void* value, uint64_t valueLength);
+		// Wait until every tile of level @lvl (below the first) is finished. Returns true if stopped first.
+		bool waitForLevel(int lvl);
+		// Copy the child @key's @value into its parent, and resolve the parent if that was its last child.
+		void reportToParent(uint64_t key, const void* value, uint64_t valueLength);
+		int expectedChildren(int lvl, uint64_t x, uint64_t y) const;
+
 		// Things that are private to writer_gdal.cc (the actual conversion code)
 		void* masterData = nullptr;
 		void* create_reader_stuff(int workerId);
 		void destroy_master_data();
-		int curLevel=-1, curIndex=0;
+		int curLevel=-1;
+		uint64_t curIndex=0;
 		std::string path_;
 
 		// This data is set on the *main thread* in start(), then kept constant for the remainder of the lifetime.
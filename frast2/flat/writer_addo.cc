@@ -1,11 +1,14 @@
 #include "writer.h"
 #include "reader.h"
 #include <algorithm>
+#include <chrono>
+#include <deque>
 
 #include <fmt/core.h>
 #include <fmt/color.h>
 
 #include "codec.h"
+#include "decimate.h"
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
@@ -15,7 +18,7 @@ namespace frast {
 WriterMasterAddo::WriterMasterAddo(const std::string& outPath, const EnvOptions& opts)
 	: ThreadPool(FRAST_WRITER_THREADS),
 	  path_(outPath),
-	  env(outPath, opts), envOpts(opts) {
+	  env(outPath, opts), envOpts(opts), reorder(writerWindowPerThread * FRAST_WRITER_THREADS) {
 
 
 }
@@ -55,6 +58,38 @@ void WriterMasterAddo::start(const ConvertConfig& cfg_) {
 	curLevel = cfg.baseLevel;
 	masterData = create_reader_stuff(-1);
 	set_main_tlbr_from_main_thread((FlatReader*)masterData);
+
+	// Levels are built down from cfg.baseLevel-1 until the whole range would fit in one tile.
+	// Each level's range is the parents of the one above it, so every key in it has at least one child in range.
+	firstLevel = cfg.baseLevel - 1;
+	lastLevel = firstLevel + 1;
+	dag.resize(cfg.baseLevel + 1);
+	if (mainLvl >= 0) {
+		for (int lvl=firstLevel; lvl>=0; lvl--) {
+			int64_t zoom = mainLvl - lvl;
+			assert(zoom > 0);
+			assert(zoom < 30);
+			if ((mainTlbr[2] >> zoom) == (mainTlbr[0] >> zoom) and (mainTlbr[3] >> zoom) == (mainTlbr[1] >> zoom)) {
+				fmt::print(fmt::fg(fmt::color::magenta), " - [start] Not building lvl {} and below, because floored coords were both zero.\n", lvl);
+				break;
+			}
+
+			dag[lvl] = std::make_unique<AddoLevel>();
+			uint64_t* t = dag[lvl]->tlbr;
+			for (int i=0; i<4; i++) t[i] = mainTlbr[i];
+			for (int z=0; z<zoom; z++) {
+				t[0] = t[0] >> 1;
+				t[1] = t[1] >> 1;
+				t[2] = (t[2] + 1) >> 1;
+				t[3] = (t[3] + 1) >> 1;
+			}
+			lastLevel = lvl;
+		}
+	}
+
+	if (lastLevel < firstLevel) spill = std::make_unique<TileSpill>(path_ + ".addo.spill");
+	if (cfg.addoCacheTiles > 0) decodedTiles = std::make_unique<StripedLruCache<uint64_t, cv::Mat>>(cfg.addoCacheTiles);
+
 	writerThread = std::thread(&WriterMasterAddo::writerLoop, this);
 
 	ThreadPool::start();
@@ -64,9 +99,20 @@ WriterMasterAddo::~WriterMasterAddo() {
 	// Note: we have a different mtx and cv for the writerThread, so this may be UB...
 	// (but it appears to work)
 	stop();
-	writerCv.notify_all();
+	reorder.wake();
+	for (auto& level : dag)
+		if (level) {
+			{ std::lock_guard<std::mutex> lck(level->mtx); }
+			level->finishedCv.notify_all();
+		}
 	if (writerThread.joinable()) writerThread.join();
 
+	// Tiles of the first level the writer never took (stopped early).
+	std::vector<ProcessedData> left;
+	reorder.drain(left);
+	for (auto& pd : left)
+		if (pd.value) free(pd.value);
+
 	destroy_master_data();
 
 }
@@ -74,71 +120,75 @@ WriterMasterAddo::~WriterMasterAddo() {
 
 
 void WriterMasterAddo::writerLoop() {
-	bool haveMoreWork = true;
-
-	curLevel = cfg.baseLevel - 1;
-
 	usleep(55'000);
 
-	while (curLevel >= 0 and !doStop_) {
+	std::deque<uint64_t> pendingKeys;
+	std::vector<ProcessedData> ready;
+
+	for (curLevel = firstLevel; curLevel >= lastLevel and !doStop_; curLevel--) {
 		uint64_t n_level = 0;
-		haveMoreWork = true;
-		bool began = false;
+		curLevelBegun = false;
 		curIndex = 0;
+		auto t0 = std::chrono::steady_clock::now();
+
+		if (curLevel == firstLevel) {
+			// Only the first level's tiles are enqueued here. The levels below are enqueued by reportToParent() as
+			// their children finish, so they are mostly done by the time the writer gets to them.
+			bool haveMoreKeys = true;
+			while (!doStop_) {
+
+				while (not reorder.full()) {
+					if (pendingKeys.empty() and haveMoreKeys) {
+						std::vector<uint64_t> keys = yieldNextKeys();
+						haveMoreKeys = keys.size() > 0;
+						pendingKeys.insert(pendingKeys.end(), keys.begin(), keys.end());
+					}
+					if (pendingKeys.empty()) break;
 
-		while (haveMoreWork and !doStop_) {
-
-			std::vector<uint64_t> currKeys = yieldNextKeys();
-			lastNumEnqueued = currKeys.size();
+					reorder.issue(pendingKeys.front());
+					enqueue(pendingKeys.front());
+					pendingKeys.pop_front();
+				}
 
-			// Begin level, if there are tiles.
-			if (n_level == 0 and lastNumEnqueued > 0) {
+				if (not reorder.takeReady(ready, [this] { return doStop_; })) break;
+				for (auto& pd : ready) n_level += not pd.invalid();
+				handleProcessedData(ready);
+			}
+		} else {
+			// Written sorted from the spill, once all of it is there.
+			if (waitForLevel(curLevel)) break;
+			n_level = spill->count(curLevel);
+			if (n_level > 0) {
 				fmt::print(fmt::fg(fmt::color::lime), " - Beginning level {}\n", curLevel);
 				env.beginLevel(curLevel);
-				began = true;
-			}
-
-			n_level += lastNumEnqueued;
-			haveMoreWork = lastNumEnqueued > 0;
-
-
-			// Enqueue them
-			for (auto key : currKeys) enqueue(key);
-
-			// Wait until workers complete. We need an exact match.
-			if (lastNumEnqueued>0) {
-				std::unique_lock<std::mutex> lck(writerMtx);
-				writerCv.wait(lck, [&] { return doStop_ or processedData.size() == currKeys.size(); });
-				fmt::print(fmt::fg(fmt::color::green), " - All {} items ready.\n", processedData.size());
-
-				handleProcessedData(processedData);
+				curLevelBegun = true;
+				spill->writeLevel(env, curLevel);
 			}
-
 		}
 
-		if (began) env.endLevel(false);
+		if (curLevelBegun) {
+			env.endLevel(false);
+			double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+			fmt::print(fmt::fg(fmt::color::green), " - Level {} done ({} tiles in {:.1f}s, {:.1f} tiles/s).\n", curLevel, n_level, secs, n_level / secs);
+		}
 
 		if (n_level == 0) {
 			if (!doStop_)
 				fmt::print(" - Stopping on level {} (no more items)\n", curLevel);
 			break;
 		}
-
-		curLevel--;
 	}
 
 
 
 
-	fmt::print(" - writerLoop exiting.\n");
+	fmt::print(" - writerLoop exiting (decoded tile cache: {} hits, {} misses).\n", decodedHits.load(), decodedMisses.load());
 	writerLoopExited = true;
 }
 
 
 void WriterMasterAddo::handleProcessedData(std::vector<ProcessedData>& processedData) {
-	// Write all of that data.
-	// TODO: do this on another thread than the one that queues data?
-	std::sort(processedData.begin(), processedData.end());
+	// Write all of that data (of the first level). It is already in key order (see ReorderBuffer).
 
 	// fmt::print(" - addo handle proc {}\n", processedData.size());
 
@@ -149,6 +199,12 @@ void WriterMasterAddo::handleProcessedData(std::vector<ProcessedData>& processed
 		if (pd.valueLength == 0) assert(false && "0-length value not supported yet (but will be!)");
 
 		if (pd.value != nullptr) {
+			// Begin level, if there are tiles.
+			if (not curLevelBegun) {
+				fmt::print(fmt::fg(fmt::color::lime), " - Beginning level {}\n", curLevel);
+				env.beginLevel(curLevel);
+				curLevelBegun = true;
+			}
 			// fmt::print(" - write k {}, vl {}\n", pd.key, pd.valueLength);
 			env.writeKeyValue(pd.key, pd.value, pd.valueLength);
 		} //else fmt::print(" - no write k {}, vl {}\n", pd.key, pd.valueLength);
@@ -187,64 +243,105 @@ void WriterMasterAddo::getNumTilesForLevel(uint64_t& w, uint64_t& h, int lvl) {
 std::vector<uint64_t> WriterMasterAddo::yieldNextKeys() {
 	std::vector<uint64_t> out;
 
-	// March Update: I cache the call to `reader->determineTlbr` saved to `mainTlbr`,
-	// because that is potentially slow.
-	// I still recompute lvlTlbr each time, because it's just integer ops.
-	uint32_t lvlTlbr[4];
+	const uint64_t* lvlTlbr = dag[curLevel]->tlbr;
+	uint64_t w = lvlTlbr[2] - lvlTlbr[0];
+	uint64_t h = lvlTlbr[3] - lvlTlbr[1];
 
-	int64_t zoom = mainLvl - curLevel;
-	assert(zoom > 0);
-	assert(zoom < 30);
+	// Only the first level's keys come from here (see writerLoop()).
+	// A parent whose four children are all missing would only produce an invalid value, so it is not enqueued (but
+	// still counts as done for its own parent). The occupancy of the base level tells, unless it has delta runs.
+	OccupancyView childOcc;
+	if (not env.haveDeltas(curLevel+1)) childOcc = env.occupancy(curLevel+1);
+	auto noChildren = [&](uint64_t x, uint64_t y) {
+		return childOcc.valid() and not childOcc.anyIn(2*x, 2*y, 2*x+2, 2*y+2);
+	};
+
+	for (int n=0; n<256; ) {
+		if (curIndex >= w * h) {
+			fmt::print(fmt::fg(fmt::color::magenta), " - [yieldNextKeys()] Reached end of lvl {}, yielding last {}.\n", curLevel, out.size());
+			break;
+		}
 
-	lvlTlbr[0] = mainTlbr[0] / (1 << zoom);
-	lvlTlbr[1] = mainTlbr[1] / (1 << zoom);
-	lvlTlbr[2] = (mainTlbr[2] + ((1l<<zoom)-1l)) / (1 << zoom);
-	lvlTlbr[3] = (mainTlbr[3] + ((1l<<zoom)-1l)) / (1 << zoom);
+		uint64_t yy = curIndex / w;
+		uint64_t xx = curIndex - (yy * w); // avoid %
+		uint64_t y = (yy) + lvlTlbr[1];
+		uint64_t x = (xx) + lvlTlbr[0];
+		curIndex++;
 
-	auto ex = (mainTlbr[2]) / (1 << zoom);
-	auto ey = (mainTlbr[3]) / (1 << zoom);
-	auto w0 = ex - lvlTlbr[0];
-	auto h0 = ey - lvlTlbr[1];
+		uint64_t key = BlockCoordinate{(uint64_t)curLevel,y,x}.c;
+		if (noChildren(x, y)) {
+			if (curLevel > lastLevel) reportToParent(key, nullptr, ProcessedData::INVALID_VALUE_LENGTH);
+			continue;
+		}
 
-	if (w0 == 0 and h0 == 0) {
-		fmt::print(fmt::fg(fmt::color::magenta), " - [yieldNextKeys()] Reached end of lvl {} because floored coords were both zero.\n", curLevel);
-		return out;
+		out.push_back(key);
+		n++;
 	}
+	return out;
+}
 
+int WriterMasterAddo::expectedChildren(int lvl, uint64_t x, uint64_t y) const {
+	const uint64_t* c = dag[lvl+1]->tlbr;
+	int nx = (2*x >= c[0] and 2*x < c[2]) + (2*x+1 >= c[0] and 2*x+1 < c[2]);
+	int ny = (2*y >= c[1] and 2*y < c[3]) + (2*y+1 >= c[1] and 2*y+1 < c[3]);
+	return nx * ny;
+}
 
-	// fmt::print(" - level {}, tlbr {} {} -> {} {} (w0h0 {} {})\n", curLevel, lvlTlbr[0], lvlTlbr[1], lvlTlbr[2], lvlTlbr[3], w0,h0);
-
-	uint64_t w = lvlTlbr[2] - lvlTlbr[0];
-	uint64_t h = lvlTlbr[3] - lvlTlbr[1];
+void WriterMasterAddo::reportToParent(uint64_t key, const void* value, uint64_t valueLength) {
+	BlockCoordinate bc(key);
+	AddoLevel& parent = *dag[bc.z()-1];
+	uint64_t pkey = BlockCoordinate{bc.z()-1, bc.y()>>1, bc.x()>>1}.c;
+	int quadrant = (int)(bc.y()&1) + 2*(int)(bc.x()&1);
 
-	if (w > 0 or h > 0) {
-		if (w == 0) lvlTlbr[2]++, w++;
-		if (h == 0) lvlTlbr[3]++, h++;
-	}
+	std::vector<uint8_t> bytes;
+	if (value) bytes.assign(static_cast<const uint8_t*>(value), static_cast<const uint8_t*>(value) + valueLength);
 
-	if (w == 0) {
-		fmt::print(fmt::fg(fmt::color::magenta), " - [yieldNextKeys()] Reached beyond top row of lvl {}, yielding last {}.\n", curLevel, out.size());
-		return out;
+	bool anyChild = false;
+	{
+		std::lock_guard<std::mutex> lck(parent.mtx);
+		auto& p = parent.pending[pkey];
+		if (p.nexpected == 0) p.nexpected = expectedChildren(bc.z()-1, bc.x()>>1, bc.y()>>1);
+		p.children[quadrant] = std::move(bytes);
+
+		if (++p.nreported < p.nexpected) return;
+		for (int i=0; i<4; i++) anyChild |= not p.children[i].empty();
+		// process() takes the children out of `pending` itself.
+		if (not anyChild) parent.pending.erase(pkey);
 	}
 
-	for (int n=0; n<256; n++) {
-
-		uint64_t yy = curIndex / w;
-		uint64_t xx = curIndex - (yy * w); // avoid %
-		uint64_t y = (yy) + lvlTlbr[1];
-		uint64_t x = (xx) + lvlTlbr[0];
+	if (anyChild) enqueue(pkey);
+	else finishTile(pkey, nullptr, ProcessedData::INVALID_VALUE_LENGTH);
+}
 
-		// if (y >= lvlTblr[1])
-		if (y > lvlTlbr[3]) {
-			fmt::print(fmt::fg(fmt::color::magenta), " - [yieldNextKeys()] Reached beyond top row of lvl {}, yielding last {}.\n", curLevel, out.size());
-			break;
-		}
+void WriterMasterAddo::finishTile(uint64_t key, void* value, uint64_t valueLength) {
+	const int lvl = BlockCoordinate(key).z();
+	// The parent gets a copy, because the writer frees the value once written (possibly before the parent runs).
+	if (lvl > lastLevel) reportToParent(key, value, valueLength);
 
-		curIndex++;
+	if (lvl == firstLevel) {
+		// Wakes the writer if it is waiting on this key.
+		reorder.complete(key, ProcessedData{key, value, valueLength});
+		return;
+	}
 
-		out.push_back(BlockCoordinate{(uint64_t)curLevel,y,x}.c);
+	if (value) {
+		spill->add(key, value, valueLength);
+		free(value);
 	}
-	return out;
+	AddoLevel& level = *dag[lvl];
+	bool done;
+	{
+		std::lock_guard<std::mutex> lck(level.mtx);
+		done = ++level.nfinished == level.size();
+	}
+	if (done) level.finishedCv.notify_all();
+}
+
+bool WriterMasterAddo::waitForLevel(int lvl) {
+	AddoLevel& level = *dag[lvl];
+	std::unique_lock<std::mutex> lck(level.mtx);
+	level.finishedCv.wait(lck, [&] { return level.nfinished == level.size() or doStop_; });
+	return level.nfinished != level.size();
 }
 
 
@@ -252,15 +349,48 @@ void WriterMasterAddo::process(int workerId, const Key& key) {
 	auto reader = static_cast<FlatReader*>(getWorkerData(workerId));
 
 	BlockCoordinate above(key);
+	const int lvl = above.z();
 	BlockCoordinate ca(above.z()+1, (above.y()<<1)+0, (above.x()<<1)+0);
 	BlockCoordinate cb(above.z()+1, (above.y()<<1)+1, (above.x()<<1)+0);
 	BlockCoordinate cc(above.z()+1, (above.y()<<1)+0, (above.x()<<1)+1);
 	BlockCoordinate cd(above.z()+1, (above.y()<<1)+1, (above.x()<<1)+1);
 
-	cv::Mat imga = reader->getTile(ca.c, cfg.channels);
-	cv::Mat imgb = reader->getTile(cb.c, cfg.channels);
-	cv::Mat imgc = reader->getTile(cc.c, cfg.channels);
-	cv::Mat imgd = reader->getTile(cd.c, cfg.channels);
+	uint64_t childKeys[4] = { ca.c, cb.c, cc.c, cd.c };
+	Value childVals[4];
+	AddoLevel::Pending children;
+	if (lvl == firstLevel) {
+		// The four children are two pairs of adjacent keys, so look them up together.
+		reader->env.lookupMany(above.z()+1, childKeys, childVals, 4);
+	} else {
+		// The children are not in the file yet, reportToParent() kept them.
+		AddoLevel& level = *dag[lvl];
+		{
+			std::lock_guard<std::mutex> lck(level.mtx);
+			auto it = level.pending.find(key);
+			assert(it != level.pending.end());
+			children = std::move(it->second);
+			level.pending.erase(it);
+		}
+		for (int i=0; i<4; i++)
+			if (children.children[i].size()) childVals[i] = Value { children.children[i].data(), children.children[i].size() };
+	}
+
+	cv::Mat imgs[4];
+	for (int i=0; i<4; i++) {
+		if (childVals[i].value == nullptr) continue;
+		if (decodedTiles and lvl != firstLevel) {
+			if (not decodedTiles->take(imgs[i], childKeys[i])) {
+				decodedHits++;
+				continue;
+			}
+			decodedMisses++;
+		}
+		imgs[i] = decodeValue(childVals[i], cfg.channels, isTerrain(), env.codec());
+	}
+	cv::Mat& imga = imgs[0];
+	cv::Mat& imgb = imgs[1];
+	cv::Mat& imgc = imgs[2];
+	cv::Mat& imgd = imgs[3];
 
 	void* value = nullptr;
 	uint64_t valueLength = 0;
@@ -292,107 +422,46 @@ void WriterMasterAddo::process(int workerId, const Key& key) {
 		valueLength = ProcessedData::INVALID_VALUE_LENGTH;
 		// fmt::print(" - Empty tile for {} {} {}\n", above.z(), above.y(), above.x());
 	} else {
-		if (imga.empty() or imgb.empty() or imgc.empty() or imgd.empty()) {
-			// Find the non empty image to use as a template -- the empty ones are like it, but filled zero
-			cv::Mat* tmpl = nullptr;
-			if (!imga.empty()) tmpl = &imga;
-			else if (!imgb.empty()) tmpl = &imgb;
-			else if (!imgc.empty()) tmpl = &imgc;
-			else if (!imgd.empty()) tmpl = &imgd;
-
-			if (imga.empty()) imga = cv::Mat::zeros(tmpl->rows, tmpl->cols, tmpl->type());
-			if (imgb.empty()) imgb = cv::Mat::zeros(tmpl->rows, tmpl->cols, tmpl->type());
-			if (imgc.empty()) imgc = cv::Mat::zeros(tmpl->rows, tmpl->cols, tmpl->type());
-			if (imgd.empty()) imgd = cv::Mat::zeros(tmpl->rows, tmpl->cols, tmpl->type());
-		}
-
-		// Make joined image.
-		int th = imga.rows;
-		int tw = imga.cols;
-		cv::Mat img(th*2, tw*2, imga.type());
-
-		imga.copyTo(img(cv::Rect{0,th,tw,th}));
-		imgb.copyTo(img(cv::Rect{0,0,tw,th}));
-		imgc.copyTo(img(cv::Rect{tw,th,tw,th}));
-		imgd.copyTo(img(cv::Rect{tw,0,tw,th}));
-
-		if (interp < 900) {
-			// Half-scale it
-			cv::resize(img,img, imga.size(), 0, 0, interp);
-
-			// Encode.
-			Value v = encodeValue(img, isTerrain());
-			value = v.value;
-			valueLength = v.len;
+		// Find the non empty image to use as a template -- the empty ones are like it, but filled zero
+		cv::Mat* tmpl = nullptr;
+		for (int i=0; i<4 and tmpl == nullptr; i++)
+			if (not imgs[i].empty()) tmpl = &imgs[i];
+
+		cv::Mat img;
+		if (canDecimate(*tmpl) and (interp == cv::INTER_LINEAR or interp == cv::INTER_AREA)) {
+			// Both are a 2x2 box at exactly 2:1, so read the children in place rather than joining them.
+			decimate2x(img, imgs, DecimateKernel::eBox);
+		} else if (canDecimate(*tmpl) and interp >= 900) {
+			decimate2x(img, imgs, DecimateKernel::eSinc);
 		} else {
+			for (int i=0; i<4; i++)
+				if (imgs[i].empty()) imgs[i] = cv::Mat::zeros(tmpl->rows, tmpl->cols, tmpl->type());
 
-			cv::Mat oimg = imga;
-
-			// import numpy as np, re
-			// p = np.stack(np.meshgrid(*(np.linspace(-1,1,6,True),)*2),-1)
-			// d = np.linalg.norm(p, axis=-1) *1.9  ; w=np.sinc(d) * np.sinc(d/1.3); w
-			// re.sub(' +',',',str(w.reshape(-1))).replace('\n','')
-			//
-			// Balanced. Looks pretty much like area, so I'd not recommend.
-			//
-			// float K[] = { 0.00317,-0.01347,0.00683,0.00683,-0.01347,0.00317,-0.01347,0.03257,-0.01271,-0.01271,0.03257,-0.01347,0.00683,-0.01271,0.43628,0.43628,-0.01271,0.00683,0.00683,-0.01271,0.43628,0.43628,-0.01271,0.00683, -0.01347,0.03257,-0.01271,-0.01271,0.03257,-0.01347,0.00317,-0.01347,0.00683,0.00683,-0.01347,0.00317 };
-
-			//
-			// A little too sharp IMO.
-			//
-			// d = np.linalg.norm(p, axis=-1) *1.6  ; w=np.sinc(d) * np.sinc(d/2.5); w
-			// float K[] = { 0.01068,-0.02128,-0.07728,-0.07728,-0.02128,0.01068,-0.02128,-0.12278,-0.00886,-0.00886,-0.12278,-0.02128,-0.07728,-0.00886,0.65868,0.65868,-0.00886,-0.07728,-0.07728,-0.00886,0.65868,0.65868,-0.00886,-0.07728,-0.02128,-0.12278,-0.00886,-0.00886,-0.12278,-0.02128,0.01068,-0.02128,-0.07728,-0.07728,-0.02128,0.01068 };
-
-			// Balanced. Looks sharper than bilinear/area, and is better for a while. But after too many downscale iterations,
-			// it gets noisy/aliased.
-			//
-			// d = np.linalg.norm(p, axis=-1) *1.8  ; w=np.sinc(d) * np.sinc(d/1.8); w
-			float K[] = { -0.02685111,-0.00632553,0.00166139,0.00166139,-0.00632553,-0.02685111,-0.00632553,-0.03568254,-0.0542254,-0.0542254,-0.03568254,-0.00632553,0.00166139,-0.0542254,0.54590778,0.54590778,-0.0542254,0.00166139,0.00166139,-0.0542254,0.54590778,0.54590778,-0.0542254,0.00166139,-0.00632553,-0.03568254,-0.0542254,-0.0542254,-0.03568254,-0.00632553,-0.02685111,-0.00632553,0.00166139,0.00166139,-0.00632553,-0.02685111};
-
-
-			static_assert(sizeof(K)/4 == 36);
-			int IW = 2*tw;
-			int IH = 2*th;
-			int OW = 1*tw;
-			int OH = 1*th;
-			for (int oy=0; oy<OH; oy++)
-			for (int ox=0; ox<OH; ox++) {
-				float rgba[4] = {0};
-				for (int dy=0; dy<6; dy++)
-				for (int dx=0; dx<6; dx++) {
-					int iy = oy*2 + dy - 2;
-					int ix = ox*2 + dx - 2;
-					if (iy >= 0 and ix >= 0 and iy < IH and ix < IW) {
-						rgba[0] += ((float)img.data[iy*IW*3+ix*3+0]) * K[dy*6+dx];
-						rgba[1] += ((float)img.data[iy*IW*3+ix*3+1]) * K[dy*6+dx];
-						rgba[2] += ((float)img.data[iy*IW*3+ix*3+2]) * K[dy*6+dx];
-						rgba[3] += K[dy*6+dx];
-					}
-					oimg.data[oy*OW*3+ox*3+0] = (uint8_t) std::min(std::max(0.f, (rgba[0] / rgba[3])), 255.f);
-					oimg.data[oy*OW*3+ox*3+1] = (uint8_t) std::min(std::max(0.f, (rgba[1] / rgba[3])), 255.f);
-					oimg.data[oy*OW*3+ox*3+2] = (uint8_t) std::min(std::max(0.f, (rgba[2] / rgba[3])), 255.f);
+			// Make joined image.
+			int th = imga.rows;
+			int tw = imga.cols;
+			img = cv::Mat(th*2, tw*2, imga.type());
 
-				}
-			}
+			imga.copyTo(img(cv::Rect{0,th,tw,th}));
+			imgb.copyTo(img(cv::Rect{0,0,tw,th}));
+			imgc.copyTo(img(cv::Rect{tw,th,tw,th}));
+			imgd.copyTo(img(cv::Rect{tw,0,tw,th}));
 
-			Value v = encodeValue(oimg, isTerrain());
-			value = v.value;
-			valueLength = v.len;
+			// Half-scale it
+			cv::resize(img,img, imga.size(), 0, 0, interp < 900 ? interp : cv::INTER_AREA);
 		}
-	}
-
 
+		// Must be in the cache before finishTile() can enqueue the parent.
+		if (decodedTiles and lvl > lastLevel) decodedTiles->set(key, img);
 
-	{
-		std::unique_lock<std::mutex> lck(writerMtx);
-		// processedData.push_back(ProcessedData{key, malloc(1), 1});
-		processedData.push_back(ProcessedData{key, value, valueLength});
-
-		// Don't wake master until workers push all data.
-		if (processedData.size() == lastNumEnqueued)
-			writerCv.notify_one();
+		// Encode.
+		Value v = encodeValue(img, isTerrain(), env.codec());
+		value = v.value;
+		valueLength = v.len;
 	}
 
+	finishTile(key, value, valueLength);
+
 }
 
 }
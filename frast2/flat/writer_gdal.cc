@@ -68,22 +68,17 @@ void WriterMasterGdal::process(int workerId, const Key& key) {
 
 	if (!img.empty() and !image_is_black(img)) {
 		// Encode.
-		// `encodeValue` malloc()s. But our `processedData` queue is not lossy,
+		// `encodeValue` malloc()s. But our `reorder` buffer is not lossy,
 		// and the main thread will call free. So there is no leaks possible.
-		Value v = encodeValue(img, isTerrain());
+		Value v = encodeValue(img, isTerrain(), env.codec());
 		val = v.value;
 		valueLength = v.len;
 	}
 
-	{
-		std::unique_lock<std::mutex> lck(writerMtx);
-		// processedData.push_back(ProcessedData{key, malloc(1), 1});
-		processedData.push_back(ProcessedData{key, val, valueLength});
+	if (pyramid) pyramid->addTile(key, val ? img : cv::Mat{});
 
-		// Don't wake master until workers push all data.
-		if (processedData.size() == lastNumEnqueued)
-			writerCv.notify_one();
-	}
+	// Wakes the writer if it is waiting on this key.
+	reorder.complete(key, ProcessedData{key, val, valueLength});
 
 }
 
@@ -100,6 +95,17 @@ void WriterMasterGdal::getNumTilesForLevel(uint64_t& w, uint64_t& h, int lvl) {
 std::vector<uint64_t> WriterMasterGdal::yieldNextKeys() {
 	std::vector<uint64_t> out;
 
+	if (scheduled) {
+		// One group at a time (see writerLoop()).
+		size_t every = std::max<size_t>(1, schedule.numGroups() / 100);
+		if (schedule.groupsDone() % every == 0 and schedule.groupsDone() < schedule.numGroups())
+			fmt::print(" - yielding group {} / {} ({:.1f}% done)\n",
+					schedule.groupsDone(), schedule.numGroups(), 100. * schedule.groupsDone() / schedule.numGroups());
+		uint64_t laterMin;
+		if (schedule.next(out, laterMin)) scheduled->beginGroup(out.size(), laterMin);
+		return out;
+	}
+
 	auto dset = static_cast<MyGdalDataset*>(masterData);
 	/*
 	if (levelTlbrStored != curLevel) {
@@ -6,12 +6,13 @@
 
 #include <Eigen/Geometry>
 #include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
 #include <numeric>
 
 #include <opencv2/core.hpp>
 
-#include "blend.hpp"
-
 // https://stackoverflow.com/questions/73748856/eigen3-with-libfmt-9-0
 #include <fmt/core.h>
 #include <fmt/ostream.h>
@@ -38,19 +39,15 @@ namespace {
 		return r[0] == 0 and r[1] == 0 and r[2] == 0;
 	}
 
-	bool dset_intersects(MyGdalDataset* dset, Eigen::AlignedBox2f& box) {
-		Eigen::AlignedBox2f dset_box{dset->tlbr_uwm.head<2>().cast<float>()};
-		dset_box.extend(dset->tlbr_uwm.tail<2>().cast<float>());
-		bool out = box.intersects(dset_box);
-		if(0)
-		fmt::print("check xsect ({} -> {}) vs ({} -> {}) => {}\n",
-				dset_box.min().transpose(),
-				dset_box.max().transpose(),
-				box.min().transpose(),
-				box.max().transpose(), out);
-		return out;
-	}
+	// A worker's open source datasets, by index into ConvertConfig::srcPaths.
+	struct WorkerSources {
+		LruCache<uint32_t, std::shared_ptr<MyGdalDataset>> open;
+		// Scratch for SourceIndex::query()
+		std::vector<uint32_t> hits;
+		Blender blender;
 
+		inline WorkerSources(int capacity, BlendMode mode) : open(std::max(1, capacity)), blender(mode) {}
+	};
 
 }
 
@@ -58,7 +55,7 @@ namespace frast {
 
 void WriterMasterGdalMany::process(int workerId, const Key& key) {
 
-	auto dsets = static_cast<std::vector<MyGdalDataset*>*>(getWorkerData(workerId));
+	auto& sources = *static_cast<WorkerSources*>(getWorkerData(workerId));
 	int tileSize=256;
 
 	BlockCoordinate bc(key);
@@ -75,44 +72,39 @@ void WriterMasterGdalMany::process(int workerId, const Key& key) {
 		(static_cast<double>(1+bc.y()) / (1lu<<bc.z()) * 2. - 1.)
 	};
 
-	Eigen::AlignedBox2f tlbrUwmBox {Vector2f{tlbr_uwm[0], tlbr_uwm[1]}};
-	tlbrUwmBox.extend(Vector2f{tlbr_uwm[2], tlbr_uwm[3]});
-
 	// fmt::print(" - worker {} proc tile {} {} {}\n", workerId, bc.z(), bc.y(), bc.x());
+	// The overlapping sources come in srcPaths order, which is the priority order of the first and last blend modes.
 	std::vector<cv::Mat> imgs;
-	for (auto dset : *dsets) {
-		if (dset_intersects(dset, tlbrUwmBox)) {
-			cv::Mat img = dset->getWmTile(tlbr_wm, tileSize, tileSize, 3);
-			imgs.push_back(img);
+	sourceIndex.query(sources.hits, tlbr_uwm[0], tlbr_uwm[1], tlbr_uwm[2], tlbr_uwm[3]);
+	for (uint32_t i : sources.hits) {
+		std::shared_ptr<MyGdalDataset> dset;
+		if (sources.open.get(dset, i)) {
+			dset = std::make_shared<MyGdalDataset>(cfg.srcPaths[i], envOpts.isTerrain);
+			sources.open.set(i, dset);
+			sourceOpens++;
 		}
+		cv::Mat img = dset->getWmTile(tlbr_wm, tileSize, tileSize, 3);
+		imgs.push_back(img);
 	}
 
-	// NOTE: Choose blend function here
-	//
-	// cv::Mat img = blend_imgs_avg(imgs);
-	cv::Mat img = blend_imgs_first(imgs);
+	cv::Mat img = sources.blender.blend(imgs);
 
 	void* val = nullptr;
 	auto valueLength = ProcessedData::INVALID_VALUE_LENGTH;
 
 	if (!img.empty() and !image_is_black(img)) {
 		// Encode.
-		// `encodeValue` malloc()s. But our `processedData` queue is not lossy,
+		// `encodeValue` malloc()s. But our `reorder` buffer is not lossy,
 		// and the main thread will call free. So there is no leaks possible.
-		Value v = encodeValue(img, isTerrain());
+		Value v = encodeValue(img, isTerrain(), env.codec());
 		val = v.value;
 		valueLength = v.len;
 	}
 
-	{
-		std::unique_lock<std::mutex> lck(writerMtx);
-		// processedData.push_back(ProcessedData{key, malloc(1), 1});
-		processedData.push_back(ProcessedData{key, val, valueLength});
+	if (pyramid) pyramid->addTile(key, val ? img : cv::Mat{});
 
-		// Don't wake master until workers push all data.
-		if (processedData.size() == lastNumEnqueued)
-			writerCv.notify_one();
-	}
+	// Wakes the writer if it is waiting on this key.
+	reorder.complete(key, ProcessedData{key, val, valueLength});
 
 }
 
@@ -127,7 +119,7 @@ void WriterMasterGdalMany::process(int workerId, const Key& key) {
 
 WriterMasterGdalMany::WriterMasterGdalMany(const std::string& outPath, const EnvOptions& opts, int threads)
 	: ThreadPool(threads),
-	  env(outPath, opts), envOpts(opts) {
+	  env(outPath, opts), envOpts(opts), reorder(writerWindowPerThread * threads) {
 
 	if (envOpts.isTerrain) {
 		throw std::runtime_error("the '*Many' version does not support terrain. You must build a vrt and input just that one file.");
@@ -144,12 +136,17 @@ void WriterMasterGdalMany::start(const ConvertConfig& cfg_) {
 	// Otherwise, you ought to use the not 'Many' version.
 	assert(cfg.srcPaths.size() > 1);
 
-	env.beginLevel(cfg.baseLevel);
+	// A delta run must be written in the file's key order, which the row major yieldNextKeys() only is for eRowMajor
+	// files (see `frastTool --action reorder`). The locality schedule writes in any key order (ScheduledLevelWriter).
+	if (cfg.delta and env.keyOrder() != FlatEnvironment::FileMeta::KeyOrder::eRowMajor and not cfg.localitySchedule) {
+		fmt::print(" - appending to a file not in row major key order: using the locality schedule\n");
+		cfg.localitySchedule = true;
+	}
+	if (cfg.delta) env.beginDelta(cfg.baseLevel);
+	else           env.beginLevel(cfg.baseLevel);
 
 	curLevel = cfg.baseLevel;
-	masterData = create_gdal_stuff(-1);
-
-	set_level_tlbr_from_main_thread(masterData);
+	scan_sources_from_main_thread();
 	if (cfg_.tlbr[0] == 0 and cfg_.tlbr[2] == 0) {
 	} else {
 		uint32_t iwm[4];
@@ -162,6 +159,28 @@ void WriterMasterGdalMany::start(const ConvertConfig& cfg_) {
 		double nold = (old[3]-old[1])*(old[2]-old[0]);
 		fmt::print(" -                   {:.4f}% kept tiles\n", 100. * (nnew/nold));
 	}
+	shardLevelTlbr(levelTlbr, cfg);
+
+	if (cfg.localitySchedule) {
+		// yieldNextKeys() covers x in [levelTlbr[0], levelTlbr[2]) and y in [levelTlbr[1], levelTlbr[3]].
+		uint64_t tlbr[4] = { levelTlbr[0], levelTlbr[1], levelTlbr[2], levelTlbr[3]+1 };
+		schedule = LocalitySchedule(cfg.baseLevel, tlbr, [this](const uint64_t t[4]) {
+			// Tiles to unit web mercator.
+			double s = 2. / (1lu << cfg.baseLevel);
+			std::vector<uint32_t> hits;
+			sourceIndex.query(hits, t[0]*s - 1., t[1]*s - 1., t[2]*s - 1., t[3]*s - 1.);
+			return hits.empty() ? LocalitySchedule::noSource : hits[0];
+		}, [this](uint64_t key) { return env.orderedKey(key); });
+		scheduled = std::make_unique<ScheduledLevelWriter>(env, cfg.baseLevel, env.path_ + ".spill");
+		fmt::print(" - locality schedule: {} groups of up to {} tiles\n", schedule.numGroups(), LocalitySchedule::groupSize * LocalitySchedule::groupSize);
+	}
+
+	if (cfg.fusedAddo and cfg.baseLevel > 0) {
+		assert(not cfg.delta);
+		// yieldNextKeys() covers x in [levelTlbr[0], levelTlbr[2]) and y in [levelTlbr[1], levelTlbr[3]].
+		uint64_t baseTlbr[4] = { levelTlbr[0], levelTlbr[1], levelTlbr[2], levelTlbr[3]+1 };
+		pyramid = std::make_unique<PyramidBuilder>(env.path_ + ".pyramid.spill", cfg.baseLevel, baseTlbr, isTerrain(), cfg.addoInterp, 0, env.codec());
+	}
 
 	writerThread = std::thread(&WriterMasterGdalMany::writerLoop, this);
 
@@ -172,47 +191,64 @@ WriterMasterGdalMany::~WriterMasterGdalMany() {
 	// Note: we have a different mtx and cv for the writerThread, so this may be UB...
 	// (but it appears to work)
 	stop();
-	writerCv.notify_all();
+	reorder.wake();
 	if (writerThread.joinable()) writerThread.join();
 
-	env.endLevel(true);
-
-	destroy_master_data();
+	if (scheduled) {
+		scheduled->finish();
+		fmt::print(" - locality schedule: {} tiles written directly, {} spilled\n", scheduled->numDirect(), scheduled->numSpilled());
+	}
+	if (pyramid) pyramid->finish();
+	env.endLevel(not pyramid or pyramid->numTiles() == 0);
+	// The overviews go after the base level.
+	if (pyramid) pyramid->writeLevels(env);
 
 }
 
 void WriterMasterGdalMany::writerLoop() {
-	bool haveMoreWork = true;
-
-	while (haveMoreWork and !doStop_) {
-
-		// Gather next batch of keys from tiff...
-		std::vector<uint64_t> currKeys = yieldNextKeys();
-		lastNumEnqueued = currKeys.size();
-		haveMoreWork = lastNumEnqueued > 0;
-		// fmt::print(fmt::fg(fmt::color::green), " - Enqueing {} items ready.\n", lastNumEnqueued);
-
-		// Enqueue them
-		for (auto key : currKeys) enqueue(key);
-
-		// Wait until workers complete. We need an exact match.
-		{
-			std::unique_lock<std::mutex> lck(writerMtx);
-			writerCv.wait(lck, [&] { return doStop_ or processedData.size() == currKeys.size(); });
-			// fmt::print(fmt::fg(fmt::color::green), " - All {} items ready.\n", processedData.size());
-
-			handleProcessedData(processedData);
+	bool haveMoreKeys = true;
+	std::deque<uint64_t> pendingKeys;
+	std::vector<ProcessedData> ready;
+	// With the locality schedule, each batch of keys is one group, for one worker.
+	int groupWorker = -1;
+
+	uint64_t nwritten = 0;
+	auto t0 = std::chrono::steady_clock::now();
+
+	while (!doStop_) {
+
+		// Keep the window full, so that workers never wait on the writer (or on each other).
+		while (not reorder.full()) {
+			if (pendingKeys.empty() and haveMoreKeys) {
+				// Gather next batch of keys from tiff...
+				std::vector<uint64_t> keys = yieldNextKeys();
+				haveMoreKeys = keys.size() > 0;
+				pendingKeys.insert(pendingKeys.end(), keys.begin(), keys.end());
+				groupWorker = (groupWorker + 1) % getThreadCount();
+			}
+			if (pendingKeys.empty()) break;
+
+			reorder.issue(pendingKeys.front());
+			if (scheduled) enqueueTo(groupWorker, pendingKeys.front());
+			else           enqueue(pendingKeys.front());
+			pendingKeys.pop_front();
 		}
+
+		// Write whatever is done, in key order.
+		if (not reorder.takeReady(ready, [this] { return doStop_; })) break;
+		nwritten += ready.size();
+		handleProcessedData(ready);
 	}
 
-	fmt::print(" - writerLoop exiting.\n");
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	fmt::print(" - writerLoop exiting ({} tiles in {:.1f}s, {:.1f} tiles/s).\n", nwritten, secs, nwritten / secs);
+	fmt::print(" - opened {} source datasets ({} sources, {} per worker at most).\n", sourceOpens.load(), sourceIndex.size(), cfg.sourceHandlesPerWorker);
 	writerLoopExited = true;
 }
 
+
 void WriterMasterGdalMany::handleProcessedData(std::vector<ProcessedData>& processedData) {
-	// Write all of that data.
-	// TODO: do this on another thread than the one that queues data?
-	std::sort(processedData.begin(), processedData.end());
+	// Write all of that data. It is already in issue order (see ReorderBuffer): key order, unless scheduled.
 
 	for (auto& pd : processedData) {
 		if (pd.value == nullptr) assert(pd.valueLength == ProcessedData::INVALID_VALUE_LENGTH);
@@ -220,7 +256,10 @@ void WriterMasterGdalMany::handleProcessedData(std::vector<ProcessedData>& proce
 		if (pd.value != nullptr) assert(pd.valueLength != ProcessedData::INVALID_VALUE_LENGTH);
 		if (pd.valueLength == 0) assert(false && "0-length value not supported yet (but will be!)");
 
-		if (pd.value != nullptr) {
+		if (scheduled) {
+			// Every tile, so it can tell when a group is done.
+			scheduled->add(pd.key, pd.value, pd.value ? pd.valueLength : 0);
+		} else if (pd.value != nullptr) {
 			// fmt::print(" - write k {}, vl {}\n", pd.key, pd.valueLength);
 			env.writeKeyValue(pd.key, pd.value, pd.valueLength);
 		}
@@ -248,18 +287,25 @@ void WriterMasterGdalMany::handleProcessedData(std::vector<ProcessedData>& proce
 
 
 
-void WriterMasterGdalMany::set_level_tlbr_from_main_thread(void* dsets) {
+void WriterMasterGdalMany::scan_sources_from_main_thread() {
+	// Open each source once, one at a time (there may be more than the open file limit), to get its footprint.
 	levelTlbr[0] = 9999999999;
 	levelTlbr[1] = 9999999999;
 	levelTlbr[2] = 0;
 	levelTlbr[3] = 0;
-	for (MyGdalDataset* dset : *((std::vector<MyGdalDataset*>*)dsets)) {
+	std::vector<SourceIndex::Box> footprints;
+	for (auto& path : cfg.srcPaths) {
+		MyGdalDataset dset(path, envOpts.isTerrain);
+		footprints.push_back({dset.tlbr_uwm[0], dset.tlbr_uwm[1], dset.tlbr_uwm[2], dset.tlbr_uwm[3]});
+
 		uint64_t tlbr_[4];
-		dset->getTlbrForLevel(tlbr_, curLevel);
+		dset.getTlbrForLevel(tlbr_, curLevel);
 		for (int i=0; i<2; i++) levelTlbr[i] = std::min(levelTlbr[i], tlbr_[i]);
 		for (int i=0; i<2; i++) levelTlbr[2+i] = std::max(levelTlbr[2+i], tlbr_[2+i]);
 	}
 	levelTlbrStored = curLevel;
+
+	sourceIndex = SourceIndex(footprints);
 }
 
 void* WriterMasterGdalMany::createWorkerData(int workerId) {
@@ -267,22 +313,12 @@ void* WriterMasterGdalMany::createWorkerData(int workerId) {
 	return create_gdal_stuff(workerId);
 }
 void WriterMasterGdalMany::destroyWorkerData(int workerId, void *ptr) {
-	auto dsets = static_cast<std::vector<MyGdalDataset*>*>(ptr);
-	delete dsets;	
-}
-
-void WriterMasterGdalMany::destroy_master_data() {
-	auto dsets = static_cast<std::vector<MyGdalDataset*>*>(masterData);
-	delete dsets;	
+	delete static_cast<WorkerSources*>(ptr);
 }
 
 void* WriterMasterGdalMany::create_gdal_stuff(int worker_id) {
-	// return new MyGdalDataset("/data/naip/mocoNaip/whole.wm.tif", envOpts.isTerrain);
-	std::vector<MyGdalDataset*>* out = new std::vector<MyGdalDataset*>();
-	for (auto path : cfg.srcPaths) {
-		out->push_back(new MyGdalDataset(path, envOpts.isTerrain));
-	}
-	return out;
+	// Sources are opened on first use (see process()), so workers only hold the ones near the tiles they make.
+	return new WorkerSources(cfg.sourceHandlesPerWorker, cfg.blendMode);
 }
 
 
@@ -300,6 +336,17 @@ void WriterMasterGdalMany::getNumTilesForLevel(uint64_t& w, uint64_t& h, int lvl
 std::vector<uint64_t> WriterMasterGdalMany::yieldNextKeys() {
 	std::vector<uint64_t> out;
 
+	if (scheduled) {
+		// One group at a time (see writerLoop()).
+		size_t every = std::max<size_t>(1, schedule.numGroups() / 100);
+		if (schedule.groupsDone() % every == 0 and schedule.groupsDone() < schedule.numGroups())
+			fmt::print(" - yielding group {} / {} ({:.1f}% done)\n",
+					schedule.groupsDone(), schedule.numGroups(), 100. * schedule.groupsDone() / schedule.numGroups());
+		uint64_t laterMin;
+		if (schedule.next(out, laterMin)) scheduled->beginGroup(out.size(), laterMin);
+		return out;
+	}
+
 	// auto dsets = static_cast<std::vector<MyGdalDataset*>*>(masterData);
 	assert(levelTlbrStored == curLevel);
 	uint64_t w = levelTlbr[2] - levelTlbr[0];
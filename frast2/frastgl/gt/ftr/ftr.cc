@@ -157,14 +157,14 @@ template<> void GtRenderer<FtTypes, FtTypes::Renderer>::render(RenderState& rs)
 
 
 FtDataLoader::~FtDataLoader() {
-	for (auto cd : colorDsets) delete cd;
+	if (colorDset) delete colorDset;
 	if (elevDset) delete elevDset;
 }
 
 void FtDataLoader::do_init() {
 	EnvOptions optColor = EnvOptions::getReadonly(false);
-	for (const auto& colorPath : renderer->cfg.colorDsetPaths)
-		colorDsets.push_back(new FlatReaderCached(colorPath, optColor));
+	if (renderer->cfg.colorDsetPaths.size())
+		colorDset = new FlatMultiReader(renderer->cfg.colorDsetPaths, optColor);
 
 	EnvOptions optElev = EnvOptions::getReadonly(true);
 	if (renderer->cfg.elevDsetPath.length() > 1)
@@ -217,41 +217,21 @@ FtDataLoader::FtDataLoader() {
 void FtDataLoader::loadColor(FtTile* tile, FtTypes::DecodedCpuTileData::MeshData& mesh) {
 	assert(renderer != nullptr);
 
-	uint64_t tlbr[4] = { tile->coord.x(), tile->coord.y(), tile->coord.x()+1lu, tile->coord.y()+1lu };
-
-	// TODO: Not the most efficient thing to loop through each...
-	for (int i=0; i<colorDsets.size(); i++) {
-		auto colorDset = this->colorDsets[i];
-
-		// FIXME: HERE
-		/*
-		if (colorDsets.size() == 1 or colorDset->tileExists(tile->coord, color_txns[i])) {
-			int n_missing = colorDset->fetchBlocks(colorBuf, tile->coord.z(), tlbr, color_txns[i]);
-			// fmt::print(" - [#loadColor()] fetched tiles from tlbr {} {} {} {} ({} missing)\n", tlbr[0],tlbr[1],tlbr[2],tlbr[3], n_missing);
-			// if (n_missing > 0) return true;
-			if (n_missing == 0) {
-				mesh.img_buffer_cpu.resize(colorBuf.size());
-				memcpy(mesh.img_buffer_cpu.data(), colorBuf.buffer, colorBuf.size());
-				return;
-			}
-		}
-		*/
-
-		if (colorDsets.size() == 1 or colorDset->tileExists(tile->coord)) {
-			// fmt::print(" - loading tile {} {} {}\n", tile->coord.z(), tile->coord.y(), tile->coord.x());
-			colorBuf = colorDset->getTile(tile->coord, 4);
-			// fmt::print(" - loading tile {} -> {}x{}x{}\n", tile->coord.c, colorBuf.rows, colorBuf.cols, colorBuf.channels());
-			auto size = colorBuf.total()*colorBuf.elemSize();
-			mesh.img_buffer_cpu.resize(size);
-			mesh.texSize[0] = colorBuf.rows;
-			mesh.texSize[1] = colorBuf.cols;
-			mesh.texSize[2] = colorBuf.channels();
-			memcpy(mesh.img_buffer_cpu.data(), colorBuf.data, size);
-			// cv::imshow("img", colorBuf); cv::waitKey(0);
-			return;
-		}
-
+	if (colorDset == nullptr) return;
+
+	// Decode straight into the upload buffer, as BGRA (the decoder fills the alpha).
+	// Only the file(s) covering this tile are probed, with one lookup each.
+	constexpr int ts = FlatReader::tileSize;
+	mesh.img_buffer_cpu.resize(ts*ts*4);
+	cv::Mat dst(ts, ts, CV_8UC4, mesh.img_buffer_cpu.data());
+	if (colorDset->getTileInto(dst, tile->coord, 4)) {
+		// Missing: no texture, as when no file has the tile.
+		mesh.img_buffer_cpu.clear();
+		return;
 	}
+	mesh.texSize[0] = ts;
+	mesh.texSize[1] = ts;
+	mesh.texSize[2] = 4;
 }
 
 
@@ -2,6 +2,7 @@
 
 #include "../gt.h"
 #include "frast2/flat/reader.h"
+#include "frast2/flat/multi_reader.h"
 
 namespace frast {
 
@@ -155,10 +156,9 @@ struct FtDataLoader : public GtDataLoader<FtTypes, FtDataLoader> {
 		Image colorBuf;
 		Image elevBuf;
 		*/
-		cv::Mat colorBuf;
 		cv::Mat elevBuf;
 
-		std::vector<FlatReaderCached*> colorDsets;
+		FlatMultiReader* colorDset = nullptr;
 		FlatReaderCached* elevDset  = nullptr;
 
 };
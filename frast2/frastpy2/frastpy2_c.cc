@@ -3,6 +3,7 @@
 #include <pybind11/stl.h>
 
 #include "frast2/flat/reader.h"
+#include "frast2/flat/multi_reader.h"
 
 #ifdef FRASTGL
 #include "gt_app_wrapper.h"
@@ -58,6 +59,17 @@ py::array create_py_image(cv::Mat& img) {
 	return result;
 }
 
+// A numpy array of @rows x @cols x @channels pixels and a cv::Mat header over it, so that readers decode (or warp)
+// straight into the array that is returned, instead of into a Mat that create_py_image() then copies.
+// Terrain is always one channel of uint16, whatever @channels says.
+std::pair<py::array, cv::Mat> alloc_py_image(int rows, int cols, int channels, bool isTerrain) {
+	const int cvType = isTerrain ? CV_16UC1 : CV_MAKETYPE(CV_8U, channels);
+	auto dtype = isTerrain ? py::dtype::of<uint16_t>() : py::dtype::of<uint8_t>();
+	py::array arr(dtype, std::vector<ssize_t>{ rows, cols, CV_MAT_CN(cvType) });
+	cv::Mat mat(rows, cols, cvType, arr.mutable_data());
+	return { arr, mat };
+}
+
 #ifdef FRASTGL
 py::array create_py_image(const Image& img) {
 
@@ -105,8 +117,14 @@ struct DatasetReaderIterator {
 
 		uint64_t key = reader->env.getKeys(lvl)[ii];
 		Value val = reader->env.getValueFromIdx(lvl, ii);
-		auto mat = decodeValue(val, channels, reader->isTerrain());
-		auto arr = create_py_image(mat);
+		constexpr int ts = FlatReader::tileSize;
+		auto img = alloc_py_image(ts, ts, channels, reader->isTerrain());
+		py::array arr = img.first;
+		if (decodeValueInto(img.second, val, channels, reader->isTerrain(), 1, reader->env.codec())) {
+			// Not a tileSize² tile.
+			auto mat = decodeValue(val, channels, reader->isTerrain(), reader->env.codec());
+			arr = create_py_image(mat);
+		}
 
 		ii++;
 		
@@ -242,11 +260,18 @@ PYBIND11_MODULE(frastpy2_c, m) {
 					throw std::runtime_error("tlbr must have stride 4 (be contiguous uint64_t), was: " +
 							std::to_string(tlbr_.strides(0)));
 
-				uint32_t* tlbr = const_cast<uint32_t*>(tlbr_.data());
-				cv::Mat mat = dset.getTlbr(lvl, tlbr, channels);
-				if (mat.empty()) return py::none();
+				// A level the file does not have (it holds 26 at most), in neither its base nor a delta run, is missing
+				// like a missing tile.
+				bool missing = lvl >= 26 or not dset.env.haveLevel(lvl);
+				for (int d=0; missing and d<dset.env.numDeltas(); d++) missing = dset.env.deltaLevel(d) != lvl;
+				if (missing) return py::none();
 
-				return create_py_image(mat);
+				uint32_t* tlbr = const_cast<uint32_t*>(tlbr_.data());
+				constexpr int ts = FlatReader::tileSize;
+				auto img = alloc_py_image(ts * (tlbr[3] - tlbr[1]), ts * (tlbr[2] - tlbr[0]), channels, dset.isTerrain());
+				if (img.second.empty()) return py::none();
+				dset.getTlbr(img.second, lvl, tlbr, channels);
+				return img.first;
 			})
 
 		.def("rasterIo", [](FlatReaderCached& dset, py::array_t<double> tlbrWm_, int outW, int outH, int channels) -> py::object {
@@ -258,7 +283,35 @@ PYBIND11_MODULE(frastpy2_c, m) {
 							std::to_string(tlbrWm_.strides(0)));
 
 				double* tlbrWm = const_cast<double*>(tlbrWm_.data());
-				cv::Mat mat = dset.rasterIo(tlbrWm, outW, outH, channels);
+				auto img = alloc_py_image(outH, outW, channels, dset.isTerrain());
+				if (dset.rasterIo(img.second, tlbrWm)) return py::none();
+				return img.first;
+			})
+		;
+
+	py::class_<FlatMultiReader>(m, "FlatMultiReader")
+		.def(py::init<const std::vector<std::string>&, const EnvOptions&, const std::vector<int>&>(),
+				py::arg("paths"), py::arg("opts"), py::arg("priorities") = std::vector<int>{})
+
+		.def("findSource", &FlatMultiReader::findSource)
+		.def("size", &FlatMultiReader::size)
+
+		.def("getTile", [](FlatMultiReader& dset, uint64_t tile, int channels) -> py::object {
+				constexpr int ts = FlatReader::tileSize;
+				auto img = alloc_py_image(ts, ts, channels, dset.isTerrain());
+				if (dset.getTileInto(img.second, tile, channels)) return py::none();
+				return img.first;
+			})
+
+		.def("rasterIo", [](FlatMultiReader& dset, py::array_t<double> tlbrWm_, int outW, int outH, int channels) -> py::object {
+
+				if (tlbrWm_.size() != 4) throw std::runtime_error("tlbr must be length 4.");
+				if (tlbrWm_.ndim() != 1) throw std::runtime_error("tlbr must have one dim.");
+				if (tlbrWm_.strides(0) != 8)
+					throw std::runtime_error("tlbr must have stride 8 (be contiguous uint64_t), was: " +
+							std::to_string(tlbrWm_.strides(0)));
+
+				cv::Mat mat = dset.rasterIo(tlbrWm_.data(), outW, outH, channels);
 				if (mat.empty()) return py::none();
 
 				return create_py_image(mat);
@@ -3,6 +3,8 @@
 #include <fmt/ostream.h>
 
 #include "frast2/flat/reader.h"
+#include "frast2/flat/compact.h"
+#include "frast2/flat/merge.h"
 
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -11,12 +13,16 @@
 #include "frast2/detail/argparse.hpp"
 
 #include <limits.h>
+#include <limits>
 #include <sstream>
+#include <algorithm>
 #include <fstream>
 #include "frast2/flat/gdal_stuff.hpp"
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <chrono>
+#include <cmath>
 
 using namespace frast;
 
@@ -28,6 +34,7 @@ template <typename T> struct fmt::formatter<Eigen::WithFormat<T>> : ostream_form
 #endif
 
 static void do_show_overlap_(ArgParser& parser);
+static void do_benchmark_codecs_(ArgParser& parser, FlatReaderCached& reader);
 
 
 int main(int argc, char** argv) {
@@ -43,7 +50,7 @@ int main(int argc, char** argv) {
 	fmt::print(" - opt={}\n", o);
 	fmt::print(" - action={}\n", action);
 	*/
-	auto action = parser.getChoice2("-a", "--action", "info", "showTiles", "showSample", "rasterIo", "dump", "takeTop", "showOverlap").value();
+	auto action = parser.getChoice2("-a", "--action", "info", "showTiles", "showSample", "rasterIo", "dump", "takeTop", "showOverlap", "reorder", "compact", "mergeDeltas", "addOccupancy", "merge", "extract", "benchmarkCodecs").value();
 
 
 	if (action == "showOverlap") {
@@ -51,8 +58,57 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+	if (action == "merge") {
+		// Union of several files (e.g. the shards of `frastFlatWriter --shards`), without decoding any tile.
+		auto inPaths = parser.get2OrDie<std::vector<std::string>>("-i", "--input");
+		std::string outPath = parser.get2OrDie<std::string>("-o", "--out");
+		std::string resolve = parser.getChoice("--resolve", "last", "first", "largest", "error").value_or("last");
+		auto stats = mergeFiles(inPaths, outPath, parseMergeResolve(resolve));
+		fmt::print(" - merged {} files into '{}': {} levels copied, {} merged\n", inPaths.size(), outPath, stats.levelsCopied, stats.levelsMerged);
+		fmt::print(" - {:L} tiles, {:L} value bytes in {:L} copies, {:L} duplicate keys (resolved by '{}')\n",
+				stats.tiles, stats.valueBytes, stats.copies, stats.duplicates, resolve);
+		return 0;
+	}
+
+	if (action == "extract") {
+		// The tiles of an area of interest (Web Mercator meters), on every level, without decoding any tile.
+		std::string inPath = parser.get2OrDie<std::string>("-i", "--input");
+		std::string outPath = parser.get2OrDie<std::string>("-o", "--out");
+		Tlbr tlbr = parser.get<Tlbr>("--tlbr").value();
+		double dwmTlbr[4] = {tlbr.tl[0], tlbr.tl[1], tlbr.br[0], tlbr.br[1]};
+		auto stats = extractFile(inPath, outPath, dwmTlbr);
+		fmt::print(" - extracted {:L} tiles on {} levels into '{}': {:L} value bytes in {:L} copies\n",
+				stats.tiles, stats.levelsCopied, outPath, stats.valueBytes, stats.copies);
+		return 0;
+	}
+
 	std::string path = parser.get2OrDie<std::string>("-i", "--input");
+
+	if (action == "compact") {
+		// Without `-o`, the input is replaced (atomically) by the compacted file.
+		std::string outPath = parser.get2<std::string>("-o", "--out", path).value();
+		auto stats = compactFile(path, outPath);
+		fmt::print(" - compacted '{}' -> '{}'\n", path, outPath);
+		fmt::print(" - size    {:>14L} -> {:>14L} bytes\n", stats.bytesIn, stats.bytesOut);
+		if (stats.extentsIn < 0 or stats.extentsOut < 0)
+			fmt::print(" - extents (FIEMAP not supported by this filesystem)\n");
+		else
+			fmt::print(" - extents {:>14L} -> {:>14L}\n", stats.extentsIn, stats.extentsOut);
+		return 0;
+	}
+
 	bool isTerrain = parser.get2<bool>("-t", "--terrain", 0).value();
+
+	if (action == "addOccupancy") {
+		// Files from before occupancy segments existed: append the missing ones in place.
+		EnvOptions wopts;
+		wopts.isTerrain = isTerrain;
+		FlatEnvironment env(path, wopts);
+		int n = env.addMissingOccupancy();
+		fmt::print(" - added {} occupancy segments to '{}'\n", n, path);
+		return 0;
+	}
+
 	EnvOptions opts;
 	opts.readonly = true;
 	opts.isTerrain = isTerrain;
@@ -83,6 +139,44 @@ int main(int argc, char** argv) {
 		fmt::print(" - deepest tile actual count: {}", reader.levelSize(lvl));
 		fmt::print(" - meter [ wm    ] ({:.1Lf}m x {:.1Lf}m) ({:.2Lf}km²)\n", w*tileToM, h*tileToM, (w*tileToKm)*(h*tileToKm));
 		fmt::print(" - meter [~actual] ({:.1Lf}m x {:.1Lf}m) ({:.2Lf}km²)\n", scaleFactorInv*w*tileToM, scaleFactorInv*h*tileToM, (w*scaleFactorInv*tileToKm)*(h*scaleFactorInv*tileToKm));
+		fmt::print(" - key order: {}\n", static_cast<int>(reader.env.keyOrder()));
+		fmt::print(" - codec: {}\n", getCodec(reader.env.codec(), reader.env.isTerrain()).name);
+		fmt::print(" - explicit value lengths (dedup): {}\n", reader.env.hasExplicitValueLengths());
+		for (int i=0; i<MAX_LVLS; i++)
+			if (reader.env.haveLevel(i) and not reader.env.occupancy(i).valid())
+				fmt::print(" - lvl {} has no occupancy segment (see `--action addOccupancy`)\n", i);
+		for (int d=0; d<reader.env.numDeltas(); d++)
+			fmt::print(" - delta run {}: lvl {}, {} tiles\n", d, reader.env.deltaLevel(d), reader.env.getDeltaSpec(d).nitemsUsed());
+	}
+
+	if ((action == "takeTop" or action == "reorder") and reader.env.numDeltas() > 0) {
+		fmt::print("input has {} delta runs: run `--action mergeDeltas` first\n", reader.env.numDeltas());
+		return 1;
+	}
+
+	if (action == "mergeDeltas") {
+		// Rewrite the file with every delta run folded into its level.
+		std::string outPath = parser.get2OrDie<std::string>("-o", "--out");
+
+		std::vector<int> levels;
+		for (int lvl=0; lvl<MAX_LVLS; lvl++) if (reader.env.haveLevel(lvl) or reader.env.haveDeltas(lvl)) levels.push_back(lvl);
+		// Keep the input's physical order of levels (levels that only have deltas go last).
+		auto physicalPos = [&reader](int lvl) {
+			return reader.env.haveLevel(lvl) ? reader.env.getLevelSpec(lvl).keysOffset : std::numeric_limits<uint64_t>::max();
+		};
+		std::stable_sort(levels.begin(), levels.end(), [&physicalPos](int a, int b) { return physicalPos(a) < physicalPos(b); });
+
+		EnvOptions newOpts;
+		newOpts.isTerrain = isTerrain;
+		newOpts.dedupValues = reader.env.hasExplicitValueLengths();
+		newOpts.codec = static_cast<uint8_t>(reader.env.codec());
+		FlatEnvironment newEnv(outPath, newOpts);
+		newEnv.setKeyOrder(reader.env.keyOrder());
+
+		for (int j=0; j<levels.size(); j++) {
+			fmt::print(" - merging level {}\n", levels[j]);
+			reader.env.mergeLevel(levels[j], newEnv, j == levels.size() - 1);
+		}
 	}
 
 	if (action == "takeTop") {
@@ -105,7 +199,11 @@ int main(int argc, char** argv) {
 		EnvOptions newOpts;
 		newOpts.readonly = false;
 		newOpts.isTerrain = false;
+		newOpts.codec = static_cast<uint8_t>(reader.env.codec());
 		FlatEnvironment newEnv(path + ".2", newOpts);
+		// The levels are copied verbatim, so they keep the input's order and k2vs format.
+		newEnv.setKeyOrder(reader.env.keyOrder());
+		newEnv.setValueLengths(reader.env.meta()->valueLengths);
 
 		for (int i=0; i<levels.size(); i++) {
 		int lvl = levels[i];
@@ -121,6 +219,46 @@ int main(int argc, char** argv) {
 		}
   }
 
+	if (action == "reorder") {
+		// Rewrite every level with its keys (and values) sorted along a space filling curve (or back to row-major).
+		std::string outPath = parser.get2OrDie<std::string>("-o", "--out");
+		auto orderName = parser.getChoice("--order", "rowMajor", "morton", "hilbert").value_or("hilbert");
+
+		auto order = FlatEnvironment::FileMeta::KeyOrder::eHilbert;
+		if (orderName == "rowMajor") order = FlatEnvironment::FileMeta::KeyOrder::eRowMajor;
+		if (orderName == "morton") order = FlatEnvironment::FileMeta::KeyOrder::eMorton;
+
+		std::vector<int> levels;
+		for (int lvl=0; lvl<MAX_LVLS; lvl++) if (reader.env.haveLevel(lvl)) levels.push_back(lvl);
+
+		EnvOptions newOpts;
+		newOpts.isTerrain = isTerrain;
+		newOpts.dedupValues = reader.env.hasExplicitValueLengths();
+		newOpts.codec = static_cast<uint8_t>(reader.env.codec());
+		FlatEnvironment newEnv(outPath, newOpts);
+		newEnv.setKeyOrder(order);
+
+		for (int j=0; j<levels.size(); j++) {
+			int lvl = levels[j];
+			uint64_t n = reader.env.getLevelSpec(lvl).nitemsUsed();
+			uint64_t* keys = reader.env.getKeys(lvl);
+			fmt::print(" - reordering level {} ({} tiles) to '{}'\n", lvl, n, orderName);
+
+			std::vector<uint64_t> idxs(n);
+			for (uint64_t i=0; i<n; i++) idxs[i] = i;
+			std::sort(idxs.begin(), idxs.end(), [&](uint64_t a, uint64_t b) {
+				return newEnv.orderedKey(keys[a]) < newEnv.orderedKey(keys[b]);
+			});
+
+			newEnv.beginLevel(lvl);
+			for (uint64_t i : idxs) {
+				Value val = reader.env.getValueFromIdx(lvl, i);
+				newEnv.writeKeyValue(keys[i], val.value, val.len);
+			}
+			newEnv.endLevel(j == levels.size() - 1);
+		}
+	}
+
 	if (action == "showTiles") {
 		int chosenLvl = parser.get2<int>("-l", "--level", -1).value();
 
@@ -152,7 +290,7 @@ int main(int argc, char** argv) {
 				Value val = reader.env.lookup(lvl, key);
 				fmt::print(" - item ({:>6d}/{:>6d}) key {} len {}\n", i,n, key, val.len);
 				if (val.value != nullptr) {
-					img = decodeValue(val, opts.isTerrain?1:3, opts.isTerrain);
+					img = decodeValue(val, opts.isTerrain?1:3, opts.isTerrain, reader.env.codec());
 				}
 
 			} else {
@@ -188,7 +326,7 @@ int main(int argc, char** argv) {
 				assert(nread == buf.size());
 
 				/*
-				img = decodeValue(loaded, opts.isTerrain?1:3, opts.isTerrain);
+				img = decodeValue(loaded, opts.isTerrain?1:3, opts.isTerrain, reader.env.codec());
 				*/
 			}
 
@@ -251,9 +389,17 @@ int main(int argc, char** argv) {
 		cv::waitKey(0);
 	}
 
+	if (action == "benchmarkCodecs") {
+		do_benchmark_codecs_(parser, reader);
+		return 0;
+	}
+
 	if (action == "dump") {
 		std::string outPath = parser.get2OrDie<std::string>("--out", "-o");
 		int chosenLvl = parser.get2<int>("-l", "--level", -1).value();
+		// Decode tiles at 1/scale of their size (a thumbnail of a larger area).
+		int scale = std::stoi(parser.getChoice("--scale", "1", "2", "4", "8").value_or("1"));
+		int ts = 256 / scale;
 
 		uint32_t tlbr[4];
 		auto lvl = reader.determineTlbrOnLevel(tlbr, chosenLvl);
@@ -271,13 +417,13 @@ int main(int argc, char** argv) {
 		fmt::print(" - Tlbr (lvl {}) [{} {} -> {} {}]\n", lvl, tlbr[0], tlbr[1], tlbr[2], tlbr[3]);
 		uint32_t ny = tlbr[3] - tlbr[1];
 		uint32_t nx = tlbr[2] - tlbr[0];
-		if (nx * ny >= 32*32) {
+		if (nx * ny >= 32*32 * scale*scale) {
 			fmt::print(" - Refusing to 'dump' too large image (ny={}, nx={})\n", ny,nx);
 			exit(1);
 		} else
 			fmt::print(" - 'dump' image (ny={}, nx={})\n", ny,nx);
 
-		cv::Mat out(ny*256, nx*256, CV_8UC3);
+		cv::Mat out(ny*ts, nx*ts, CV_8UC3);
 
 		auto &spec = reader.env.getLevelSpec(lvl);
 		fmt::print(" - Items {}\n", spec.nitemsUsed());
@@ -292,11 +438,11 @@ int main(int argc, char** argv) {
 			int iy = ((int)bc.y()) - ((int)tlbr[1]);
 			fmt::print(" - item ({:>6d}/{:>6d}) key {} len {}, local {} {}\n", i,n, key, val.len, iy,ix);
 
-			cv::Mat img = decodeValue(val, opts.isTerrain?1:3, opts.isTerrain);
+			cv::Mat img = decodeValueScaled(val, opts.isTerrain?1:3, opts.isTerrain, scale, reader.env.codec());
 			int th = img.rows;
 			int tw = img.cols;
 			if (ix >= 0 and iy >= 0 and ix < nx and iy < ny)
-				img.copyTo(out(cv::Rect{(int) (256*(ix)),(int) (256*(ny-1-iy)),tw,th}));
+				img.copyTo(out(cv::Rect{(int) (ts*(ix)),(int) (ts*(ny-1-iy)),tw,th}));
 			else
 				fmt::print(" - skip out of bounds tile.\n");
 		}
@@ -313,6 +459,92 @@ int main(int argc, char** argv) {
 
 
 
+// Re-encode a sample of the file's tiles with each codec of its raster kind, and time encoding and decoding them.
+// Throughput is in MB of decoded pixels per second, on one thread.
+static void do_benchmark_codecs_(ArgParser& parser, FlatReaderCached& reader) {
+	bool terrain = reader.env.isTerrain();
+	int channels = terrain ? 1 : 3;
+	int samples = parser.get<int>("--samples", 256).value();
+	auto only = parser.get<std::vector<std::string>>("--codecs");
+	// The deepest level by default.
+	int lvl = parser.get2<int>("-l", "--level", -1).value();
+	if (lvl < 0) for (lvl=MAX_LVLS-1; lvl>0 and not reader.env.haveLevel(lvl); lvl--) ;
+	if (not reader.env.haveLevel(lvl)) throw std::runtime_error(fmt::format("benchmarkCodecs: no level {}", lvl));
+
+	// Spread over the level (in file order).
+	std::vector<cv::Mat> imgs;
+	uint64_t n = reader.env.getLevelSpec(lvl).nitemsUsed();
+	uint64_t step = std::max<uint64_t>(1, n / std::max(samples, 1));
+	double rawBytes = 0, storedBytes = 0;
+	for (uint64_t i=0; i<n and imgs.size()<samples; i+=step) {
+		Value val = reader.env.getValueFromIdx(lvl, i);
+		cv::Mat img = decodeValue(val, channels, terrain, reader.env.codec());
+		if (img.empty()) continue;
+		imgs.push_back(img);
+		rawBytes += img.total() * img.elemSize();
+		storedBytes += val.len;
+	}
+	if (imgs.empty()) throw std::runtime_error("benchmarkCodecs: no tiles to sample");
+
+	fmt::print(" - {} tiles of lvl {}, stored with '{}' at {:.1f} bytes/tile ({:.2f}x)\n", imgs.size(), lvl,
+			getCodec(reader.env.codec(), terrain).name, storedBytes / imgs.size(), rawBytes / storedBytes);
+	fmt::print(" {:>14} {:>11} {:>7} {:>12} {:>12} {:>10}\n", "codec", "bytes/tile", "ratio", "encode MB/s", "decode MB/s", "error");
+
+	using Clock = std::chrono::steady_clock;
+	auto mbps = [rawBytes](Clock::duration d) { return rawBytes / 1e6 / std::chrono::duration<double>(d).count(); };
+
+	for (auto& codec : allCodecs()) {
+		if (codec.terrain != terrain) continue;
+		if (only and std::find(only->begin(), only->end(), codec.name) == only->end()) continue;
+		if (not codec.canEncode() or not codec.canDecode()) {
+			fmt::print(" {:>14} (not in this build)\n", codec.name);
+			continue;
+		}
+
+		std::vector<Value> vals;
+		vals.reserve(imgs.size());
+		double encodedBytes = 0;
+		auto t0 = Clock::now();
+		try {
+			for (auto& img : imgs) vals.push_back(encodeValue(img, terrain, codec.id));
+		} catch (std::exception& e) {
+			for (auto& v : vals) free(v.value);
+			fmt::print(" {:>14} (skipped: {})\n", codec.name, e.what());
+			continue;
+		}
+		auto t1 = Clock::now();
+		cv::Mat out;
+		for (auto& v : vals) decodeValue(out, v, channels, terrain, codec.id);
+		auto t2 = Clock::now();
+
+		// Compare outside of the timed loops: PSNR for color, the largest difference for terrain.
+		double sse = 0, elems = 0, maxDiff = 0;
+		for (size_t i=0; i<vals.size(); i++) {
+			encodedBytes += vals[i].len;
+			bool corrupt = decodeValue(out, vals[i], channels, terrain, codec.id)
+				or out.rows != imgs[i].rows or out.cols != imgs[i].cols;
+			free(vals[i].value);
+			if (corrupt) {
+				maxDiff = std::numeric_limits<double>::infinity();
+				continue;
+			}
+			for (int y=0; y<out.rows; y++)
+				for (int x=0; x<out.cols*channels; x++) {
+					double d = terrain ? (double)out.ptr<uint16_t>(y)[x] - imgs[i].ptr<uint16_t>(y)[x]
+					                   : (double)out.ptr<uint8_t>(y)[x] - imgs[i].ptr<uint8_t>(y)[x];
+					sse += d * d;
+					maxDiff = std::max(maxDiff, std::abs(d));
+				}
+			elems += out.total() * channels;
+		}
+		std::string error = maxDiff == 0 ? "exact" : std::isinf(maxDiff) ? "corrupt"
+			: terrain ? fmt::format("max {}", maxDiff) : fmt::format("{:.1f} dB", 10 * std::log10(255. * 255. / (sse / elems)));
+
+		fmt::print(" {:>14} {:>11.1f} {:>6.2f}x {:>12.1f} {:>12.1f} {:>10}\n", codec.name, encodedBytes / vals.size(),
+				rawBytes / encodedBytes, mbps(t1 - t0), mbps(t2 - t1), error);
+	}
+}
+
 static void do_show_overlap_(ArgParser& parser) {
 		using Corners = Eigen::Matrix<double,4,2>;
 
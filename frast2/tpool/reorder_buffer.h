@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+#include <mutex>
+
+namespace frast {
+
+//
+// Puts the results of a ThreadPool back into the order their keys were issued in.
+//
+// The producer thread issues keys (and enqueues them on the pool) at most `window` ahead of the oldest key it has not
+// yet taken back. Workers hand results to complete() in whatever order they finish. takeReady() waits only for the
+// oldest issued key, then returns it with every following key that is also done.
+// So the producer can consume in order as results arrive, and top the window up again, instead of waiting for the
+// slowest key of a whole batch while the rest of the pool idles.
+//
+template <class T>
+class ReorderBuffer {
+	public:
+		inline explicit ReorderBuffer(size_t window) : window_(window) {}
+
+		// Producer thread only.
+		inline bool full() const { return issued_.size() >= window_; }
+		inline bool empty() const { return issued_.empty(); }
+		inline size_t inFlight() const { return issued_.size(); }
+		inline void issue(uint64_t key) { issued_.push_back(key); }
+
+		// Worker threads.
+		inline void complete(uint64_t key, T&& t) {
+			bool wake;
+			{
+				std::lock_guard<std::mutex> lck(mtx_);
+				done_.emplace(key, std::move(t));
+				wake = key == awaited_;
+			}
+			if (wake) cv_.notify_one();
+		}
+
+		// Producer thread. Blocks until the oldest issued key is complete, then appends it and the consecutive complete
+		// keys after it to @out (in issue order).
+		// Returns false (appending nothing) if nothing is issued, or if @stop() became true while waiting.
+		template <class Stop>
+		inline bool takeReady(std::vector<T>& out, Stop&& stop) {
+			if (issued_.empty()) return false;
+
+			std::unique_lock<std::mutex> lck(mtx_);
+			awaited_ = issued_.front();
+			cv_.wait(lck, [&] { return done_.count(awaited_) > 0 or stop(); });
+			awaited_ = noKey;
+
+			bool any = false;
+			while (issued_.size()) {
+				auto it = done_.find(issued_.front());
+				if (it == done_.end()) break;
+				out.push_back(std::move(it->second));
+				done_.erase(it);
+				issued_.pop_front();
+				any = true;
+			}
+			return any;
+		}
+
+		// Once no worker completes keys anymore: take every result that is left, issued or not.
+		inline void drain(std::vector<T>& out) {
+			std::lock_guard<std::mutex> lck(mtx_);
+			for (auto& kv : done_) out.push_back(std::move(kv.second));
+			done_.clear();
+			issued_.clear();
+		}
+
+		// Wake a producer blocked in takeReady() so that it re-checks its stop condition.
+		inline void wake() {
+			{ std::lock_guard<std::mutex> lck(mtx_); }
+			cv_.notify_all();
+		}
+
+	private:
+		static constexpr uint64_t noKey = ~0ull;
+
+		size_t window_;
+		std::deque<uint64_t> issued_;
+
+		std::mutex mtx_;
+		std::condition_variable cv_;
+		std::unordered_map<uint64_t, T> done_;
+		uint64_t awaited_ = noKey;
+};
+
+}
@@ -5,8 +5,11 @@
 #include <unistd.h>
 #include <atomic>
 #include <unordered_set>
+#include <algorithm>
+#include <chrono>
 
 #include "tpool.h"
+#include "reorder_buffer.h"
 
 using namespace frast;
 
@@ -85,3 +88,141 @@ TEST_CASE( "tpool", "[tpool]" ) {
 
 
 }
+
+// Workers that take a variable time per key (like tiles that are empty, or need many source images),
+// used to compare a batch-and-wait writer loop with a ReorderBuffer one.
+class Slow_ThreadPool : public ThreadPool {
+	public:
+		static constexpr int THREADS = 4;
+
+		inline Slow_ThreadPool() : ThreadPool(THREADS), reorder(64 * THREADS) {}
+
+		inline virtual void process(int workerId, const Key& key) override {
+			usleep(key % 61 == 0 ? 4'000 : 150);
+			if (useReorder) reorder.complete(key, uint64_t{key});
+			else {
+				std::lock_guard<std::mutex> lck(batchMtx);
+				batchDone.push_back(key);
+				batchCv.notify_one();
+			}
+		}
+		inline virtual void* createWorkerData(int workerId) override { return nullptr; }
+		inline virtual void destroyWorkerData(int workerId, void *ptr) override { }
+
+		bool useReorder = false;
+		ReorderBuffer<uint64_t> reorder;
+
+		std::mutex batchMtx;
+		std::condition_variable batchCv;
+		std::vector<uint64_t> batchDone;
+
+		inline bool stopped() const { return doStop_; }
+};
+
+TEST_CASE( "reorderBuffer", "[tpool]" ) {
+	constexpr uint64_t N = 8192;
+	double tilesPerSecond[2];
+
+	for (int useReorder=0; useReorder<2; useReorder++) {
+		Slow_ThreadPool* tpool = new Slow_ThreadPool();
+		tpool->useReorder = useReorder;
+		tpool->start();
+
+		std::vector<uint64_t> written;
+		auto t0 = std::chrono::steady_clock::now();
+
+		if (not useReorder) {
+			// The old writer loop: enqueue 256, wait for all of them, sort, write.
+			for (uint64_t k=0; k<N; k+=256) {
+				for (uint64_t i=k; i<k+256; i++) tpool->enqueue(i);
+				std::unique_lock<std::mutex> lck(tpool->batchMtx);
+				tpool->batchCv.wait(lck, [&] { return tpool->batchDone.size() == 256; });
+				std::sort(tpool->batchDone.begin(), tpool->batchDone.end());
+				written.insert(written.end(), tpool->batchDone.begin(), tpool->batchDone.end());
+				tpool->batchDone.clear();
+			}
+		} else {
+			uint64_t next = 0;
+			std::vector<uint64_t> ready;
+			while (true) {
+				while (not tpool->reorder.full() and next < N) {
+					tpool->reorder.issue(next);
+					tpool->enqueue(next++);
+				}
+				ready.clear();
+				if (not tpool->reorder.takeReady(ready, [&] { return tpool->stopped(); })) break;
+				written.insert(written.end(), ready.begin(), ready.end());
+			}
+		}
+
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		tilesPerSecond[useReorder] = N / secs;
+
+		tpool->stop();
+		tpool->reorder.wake();
+		delete tpool;
+
+		REQUIRE(written.size() == N);
+		for (uint64_t i=0; i<N; i++) REQUIRE(written[i] == i);
+	}
+
+	fmt::print(" - batch barrier : {:>8.1f} keys/s\n", tilesPerSecond[0]);
+	fmt::print(" - reorder buffer: {:>8.1f} keys/s ({:.2f}x)\n", tilesPerSecond[1], tilesPerSecond[1] / tilesPerSecond[0]);
+}
+
+// Records which worker processed each key.
+class Affinity_ThreadPool : public ThreadPool {
+	public:
+		static constexpr int THREADS = 4;
+
+		inline Affinity_ThreadPool(int n) : ThreadPool(THREADS), processedBy(n) {
+			for (auto& p : processedBy) p = -1;
+		}
+
+		inline virtual void process(int workerId, const Key& key) override {
+			usleep(20);
+			int expected = -1;
+			if (not processedBy[key].compare_exchange_strong(expected, workerId)) n_duplicate++;
+			nprocessed++;
+		}
+		inline virtual void* createWorkerData(int workerId) override { return nullptr; }
+		inline virtual void destroyWorkerData(int workerId, void *ptr) override { }
+
+		std::vector<std::atomic_int> processedBy;
+		std::atomic_int n_duplicate = 0;
+		std::atomic_int nprocessed = 0;
+};
+
+TEST_CASE( "enqueueTo", "[tpool]" ) {
+	constexpr int N = 1 << 14;
+	constexpr int group = 64;
+	Affinity_ThreadPool* tpool = new Affinity_ThreadPool(N);
+
+	// All queued for one worker before any runs: the others must steal it.
+	for (int i=0; i<N/4; i++) tpool->enqueueTo(0, i);
+	tpool->start();
+
+	// Then groups round robin, mixed with shared work.
+	for (int i=N/4; i<N/2; i++) tpool->enqueueTo((i / group) % Affinity_ThreadPool::THREADS, i);
+	for (int i=N/2; i<N; i++) {
+		if (i % 3 == 0) tpool->enqueue(i);
+		else tpool->enqueueTo((i / group) % Affinity_ThreadPool::THREADS, i);
+	}
+
+	tpool->blockUntilFinishedPoll();
+	while (tpool->nprocessed.load() < N) usleep(1'000);
+	tpool->stop();
+
+	int onOwner = 0, targeted = 0;
+	for (int i=0; i<N; i++) {
+		REQUIRE(tpool->processedBy[i].load() >= 0);
+		if (i >= N/4 and (i < N/2 or i % 3 != 0)) {
+			targeted++;
+			onOwner += tpool->processedBy[i].load() == (i / group) % Affinity_ThreadPool::THREADS;
+		}
+	}
+	REQUIRE(tpool->n_duplicate.load() == 0);
+	fmt::print(" - {:.1f}% of targeted keys ran on their worker\n", 100. * onOwner / targeted);
+
+	delete tpool;
+}
@@ -8,6 +8,7 @@ namespace frast {
 ThreadPool::ThreadPool(int n) {
 	workerDatas.resize(n);
 	workerMetas.resize(n);
+	queuedWorkTo.resize(n);
 
 	// You should not construct a thread that calls a virtual method
 	// from a derived class until after base is fully constructed.
@@ -69,6 +70,47 @@ int ThreadPool::enqueue(const Key& k) {
 	return n;
 }
 
+int ThreadPool::enqueueTo(int worker, const Key& k) {
+	assert(worker >= 0 and worker < (int)queuedWorkTo.size());
+	size_t n = 0;
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		queuedWorkTo[worker].push_front(k);
+		nqueuedTo++;
+		n = queuedWorkTo[worker].size();
+	}
+
+	// The worker may be asleep, and notify_one() might wake another. Whoever wakes takes it, if it is still there.
+	if (n == 1) cv.notify_all();
+	return n;
+}
+
+bool ThreadPool::takeWork(int I, Key& key) {
+	auto& own = queuedWorkTo[I];
+	if (own.size()) {
+		key = own.back();
+		own.pop_back();
+		nqueuedTo--;
+		return true;
+	}
+	if (queuedWork.size()) {
+		key = queuedWork.back();
+		queuedWork.pop_back();
+		return true;
+	}
+	if (nqueuedTo) {
+		// Steal the newest key of the longest queue: the owner still works through its oldest ones.
+		size_t victim = 0;
+		for (size_t i=1; i<queuedWorkTo.size(); i++)
+			if (queuedWorkTo[i].size() > queuedWorkTo[victim].size()) victim = i;
+		key = queuedWorkTo[victim].front();
+		queuedWorkTo[victim].pop_front();
+		nqueuedTo--;
+		return true;
+	}
+	return false;
+}
+
 void ThreadPool::workerLoop(int I) {
 	// auto &meta = workerMetas[I];
 
@@ -83,7 +125,7 @@ void ThreadPool::workerLoop(int I) {
 
 		// Sleep until some work is available.
 		std::unique_lock<std::mutex> lck(mtx);
-		cv.wait(lck, [&] { return doStop_ or queuedWork.size(); });
+		cv.wait(lck, [&] { return doStop_ or queuedWork.size() or nqueuedTo; });
 
 		// Interestingly: this unlock, followed immediately by a lock() on the first do-while iter below,
 		//                actually helps performance (when process() is a no-op).
@@ -108,12 +150,9 @@ void ThreadPool::workerLoop(int I) {
 			// if (nproc > firstProc) fmt::print(" - check {}th loop: {}\n", nproc, queuedWork.size());
 
 			Key key;
-			haveKey = queuedWork.size() > 0;
 			haveStop = doStop_;
-			if (haveKey) {
-				key = queuedWork.back();
-				queuedWork.pop_back();
-			} else if (not haveStop) spurious += nproc==firstProc;
+			haveKey = takeWork(I, key);
+			if (not haveKey and not haveStop) spurious += nproc==firstProc;
 			lck.unlock();
 
 			if (haveStop) {
@@ -146,7 +185,7 @@ void ThreadPool::workerLoop(int I) {
 void ThreadPool::blockUntilFinishedPoll() {
 	while (true) {
 		mtx.lock();
-		auto size = queuedWork.size();
+		auto size = queuedWork.size() + nqueuedTo;
 		mtx.unlock();
 		if (size > 0) {
 			// fmt::print(" - [blockUntilFinished] remaining size {}\n", size);
@@ -40,6 +40,10 @@ class ThreadPool {
 		void start();
 		void stop();
 		int  enqueue(const Key& k);
+		// Like enqueue(), but for worker @worker, which takes these before any shared work. Other workers only take
+		// them (newest first) when they have nothing else to do, so keys that share state (an open file, a cache)
+		// mostly stay on one worker without leaving the rest idle.
+		int  enqueueTo(int worker, const Key& k);
 
 		void blockUntilFinishedPoll();
 
@@ -49,6 +53,9 @@ class ThreadPool {
 	private:
 
 		std::deque<Key> queuedWork;
+		// Per worker, see enqueueTo(). nqueuedTo is their total size.
+		std::vector<std::deque<Key>> queuedWorkTo;
+		size_t nqueuedTo = 0;
 
 		// std::vector<std::thread> threads;
 		// std::vector<std::condition_variable> cvs;
@@ -57,6 +64,8 @@ class ThreadPool {
 		std::vector<void*> workerDatas;
 
 		virtual void workerLoop(int i);
+		// With mtx held: pop the next key for worker @i. Returns false if there is none.
+		bool takeWork(int i, Key& key);
 
 		std::condition_variable cv;
 		std::mutex mtx;